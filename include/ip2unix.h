@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: LGPL-3.0-only */
+#ifndef IP2UNIX_H
+#define IP2UNIX_H
+
+/*
+ * Interface to link the socket handling of ip2unix directly into an
+ * application instead of using the preload library.
+ *
+ * The functions below have the same semantics as their counterparts without
+ * the "ip2unix_" prefix, except that IP sockets are handled according to the
+ * rules passed to ip2unix_load_rules(). File descriptors created by one of
+ * these functions must only be used via these functions as well, especially
+ * ip2unix_close(), so that their state is tracked correctly.
+ */
+
+#include <netdb.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Everything else in the library is hidden, see meson.build. */
+#pragma GCC visibility push(default)
+
+/*
+ * Load rules in the same format as the files passed via the -f option of the
+ * ip2unix command, so one rule per line, with empty lines and lines starting
+ * with '#' being ignored.
+ *
+ * This replaces all rules loaded previously, sockets that already have been
+ * handled according to the old rules are not affected. Until the first call
+ * no socket is handled at all.
+ *
+ * On success zero is returned, otherwise -1 with errno set to EINVAL and the
+ * reason written to stderr.
+ */
+int ip2unix_load_rules(const char *data, size_t len);
+
+int ip2unix_socket(int domain, int type, int protocol);
+int ip2unix_bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int ip2unix_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/* Only available if ip2unix has been built with systemd support. */
+int ip2unix_listen(int fd, int backlog);
+
+int ip2unix_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int ip2unix_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen,
+                    int flags);
+
+/* Host names used in "host=" rules resolve to their synthetic address. */
+int ip2unix_getaddrinfo(const char *node, const char *service,
+                        const struct addrinfo *hints, struct addrinfo **res);
+struct hostent *ip2unix_gethostbyname(const char *name);
+struct hostent *ip2unix_gethostbyname2(const char *name, int af);
+
+int ip2unix_getpeername(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int ip2unix_getsockname(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int ip2unix_setsockopt(int fd, int level, int optname, const void *optval,
+                       socklen_t optlen);
+
+ssize_t ip2unix_recvfrom(int fd, void *buf, size_t len, int flags,
+                         struct sockaddr *addr, socklen_t *addrlen);
+ssize_t ip2unix_recvmsg(int fd, struct msghdr *msg, int flags);
+ssize_t ip2unix_sendto(int fd, const void *buf, size_t len, int flags,
+                       const struct sockaddr *addr, socklen_t addrlen);
+ssize_t ip2unix_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+int ip2unix_dup(int oldfd);
+int ip2unix_dup2(int oldfd, int newfd);
+int ip2unix_dup3(int oldfd, int newfd, int flags);
+int ip2unix_close(int fd);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
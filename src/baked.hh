@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_BAKED_HH
+#define IP2UNIX_BAKED_HH
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+#include "rules.hh"
+#include "sockaddr.hh"
+
+/*
+ * Support code for preload libraries with rules baked in at compile time.
+ *
+ * The translation unit generated via "ip2unix --emit" defines the following
+ * within the Baked namespace before including preload.cc, which is then
+ * compiled with BAKED_RULES defined:
+ *
+ *   USES_UDP, USES_REJECT, USES_BLACKHOLE, USES_SOCKET_ACTIVATION,
+ *   USES_HOSTS:
+ *     Constant booleans, which are false if none of the rules could possibly
+ *     make use of the corresponding feature, so that the code handling it is
+ *     compiled out.
+ *
+ *   RULES:
+ *     A std::array of RuleData in the order the rules have been specified.
+ *
+ *   std::optional<size_t> match(const SockAddr&, SocketType, RuleDir):
+ *     Returns the index of the first rule in RULES that both matches and has
+ *     an action, using a switch on the port number and comparisons against
+ *     constant addresses instead of iterating through all the rules.
+ */
+namespace Baked {
+    struct RuleData {
+        std::optional<RuleDir> direction;
+        std::optional<SocketType> type;
+        const char *address;
+        const char *host;
+        std::optional<uint16_t> port;
+        std::optional<uint16_t> port_end;
+        bool socket_activation;
+        const char *fd_name;
+        const char *socket_path;
+        bool reject;
+        std::optional<int> reject_errno;
+        bool blackhole;
+        bool ignore;
+    };
+
+    static inline std::optional<std::string> to_string(const char *str)
+    {
+        if (str == nullptr)
+            return std::nullopt;
+        return std::string(str);
+    }
+
+    static inline Rule to_rule(const RuleData &data)
+    {
+        Rule rule;
+        rule.direction = data.direction;
+        rule.type = data.type;
+        rule.address = to_string(data.address);
+        rule.host = to_string(data.host);
+        rule.port = data.port;
+        rule.port_end = data.port_end;
+#ifdef SYSTEMD_SUPPORT
+        rule.socket_activation = data.socket_activation;
+        rule.fd_name = to_string(data.fd_name);
+#endif
+        rule.socket_path = to_string(data.socket_path);
+        rule.reject = data.reject;
+        rule.reject_errno = data.reject_errno;
+        rule.blackhole = data.blackhole;
+        rule.ignore = data.ignore;
+        return rule;
+    }
+}
+
+#endif
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_CLOCK_HH
+#define IP2UNIX_CLOCK_HH
+
+#include <cstdint>
+#include <ctime>
+
+/* The current time of the given clock in nanoseconds. */
+static inline uint64_t clock_ns(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000
+         + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+#endif
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include "execfilter.hh"
+#include "globpath.hh"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+/* The search path used by execvp() if PATH isn't set. */
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+ExecFilter::ExecFilter(const std::vector<std::string> &pats,
+                       const std::string &lib)
+    : patterns(pats)
+    , libpath(lib)
+{
+}
+
+/*
+ * Make the path absolute and drop empty and "." components, so that patterns
+ * don't need to account for things like "./foo" or "/usr//bin/foo". Symbolic
+ * links and ".." components are left as-is, since resolving them would
+ * require accessing the file system for every component.
+ */
+static std::string normalise_path(const std::string &path)
+{
+    std::string input = path;
+
+    if (input.empty() || input[0] != '/') {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof cwd) != nullptr)
+            input = std::string(cwd) + "/" + input;
+    }
+
+    std::string out;
+    size_t pos = 0;
+    while (pos <= input.size()) {
+        size_t end = input.find('/', pos);
+        if (end == std::string::npos)
+            end = input.size();
+        std::string component = input.substr(pos, end - pos);
+        if (!component.empty() && component != ".")
+            out += "/" + component;
+        pos = end + 1;
+    }
+
+    return out.empty() ? "/" : out;
+}
+
+std::string ExecFilter::find_program(const char *file, bool search_path)
+{
+    if (!search_path || strchr(file, '/') != nullptr || *file == '\0')
+        return normalise_path(file);
+
+    const char *path = getenv("PATH");
+    std::string dirs = path == nullptr ? DEFAULT_PATH : path;
+
+    size_t pos = 0;
+    while (pos <= dirs.size()) {
+        size_t end = dirs.find(':', pos);
+        if (end == std::string::npos)
+            end = dirs.size();
+        std::string dir = dirs.substr(pos, end - pos);
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + file;
+        if (access(candidate.c_str(), X_OK) == 0)
+            return normalise_path(candidate);
+        pos = end + 1;
+    }
+
+    /* The program doesn't exist, so the exec call is going to fail anyway. */
+    return normalise_path(file);
+}
+
+bool ExecFilter::matches(const std::string &path) const
+{
+    for (const std::string &pattern : this->patterns) {
+        if (globpath(pattern, path))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * The dynamic linker accepts both colons and spaces as separators, so we
+ * only remove our own library and keep everything else in place. The result
+ * is written to out, which needs to be as large as the value, and the end of
+ * it is returned.
+ */
+static char *strip_preload(const char *value, const std::string &libpath,
+                           char *out)
+{
+    char *start = out;
+    for (;;) {
+        size_t len = strcspn(value, ": ");
+        if (len > 0 && (len != libpath.size() ||
+                        strncmp(value, libpath.c_str(), len) != 0)) {
+            if (out != start)
+                *out++ = ':';
+            memcpy(out, value, len);
+            out += len;
+        }
+        if (value[len] == '\0')
+            return out;
+        value += len + 1;
+    }
+}
+
+void ExecFilter::env_size(char *const envp[], size_t *vars, size_t *bytes)
+{
+    *vars = 1;
+    *bytes = 0;
+
+    for (char *const *env = envp; env != nullptr && *env != nullptr; ++env) {
+        ++*vars;
+        if (strncmp(*env, "LD_PRELOAD=", 11) == 0)
+            *bytes += strlen(*env) + 1;
+    }
+}
+
+void ExecFilter::strip_env(char *const envp[], char **out, char *buf) const
+{
+    for (char *const *env = envp; env != nullptr && *env != nullptr; ++env) {
+        if (strncmp(*env, "__IP2UNIX_", 10) == 0)
+            continue;
+
+        if (strncmp(*env, "LD_PRELOAD=", 11) == 0) {
+            memcpy(buf, *env, 11);
+            char *end = strip_preload(*env + 11, this->libpath, buf + 11);
+            if (end != buf + 11) {
+                *end++ = '\0';
+                *out++ = buf;
+                buf = end;
+            }
+            continue;
+        }
+
+        *out++ = *env;
+    }
+
+    *out = nullptr;
+}
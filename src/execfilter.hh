@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_EXECFILTER_HH
+#define IP2UNIX_EXECFILTER_HH
+
+#include <string>
+#include <vector>
+
+/*
+ * Decides whether programs executed by a wrapped program should inherit the
+ * preload library, based on glob patterns matched against the absolute path
+ * of the program.
+ */
+struct ExecFilter
+{
+    ExecFilter(const std::vector<std::string>&, const std::string&);
+
+    /* Look up the given file in PATH if it doesn't contain a slash and
+     * return the absolute path of the program that would be executed.
+     */
+    static std::string find_program(const char*, bool);
+
+    bool matches(const std::string&) const;
+
+    /* Return the number of pointers, including the terminating null
+     * pointer, and the number of bytes needed by strip_env() for the given
+     * environment.
+     */
+    static void env_size(char *const[], size_t*, size_t*);
+
+    /* Copy the given environment without our entry in LD_PRELOAD and
+     * without any of the __IP2UNIX_* variables into the given array of
+     * pointers, using the given buffer for the shortened LD_PRELOAD. This
+     * doesn't allocate, so it can be used in a child created via vfork().
+     */
+    void strip_env(char *const[], char**, char*) const;
+
+    private:
+        std::vector<std::string> patterns;
+        std::string libpath;
+};
+
+#endif
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_HANDOVER_HH
+#define IP2UNIX_HANDOVER_HH
+
+#include <atomic>
+
+/*
+ * A lock-free list of per-thread items, which are only written by the thread
+ * currently owning them. When a thread exits, its item is handed over to the
+ * next new thread, so items are never freed and readers can walk the list at
+ * any time, even from a signal handler.
+ *
+ * The item type needs an "owned" flag and a "next" pointer, which are only
+ * used by the list.
+ */
+template <typename T>
+class HandoverList
+{
+    public:
+        /* Releases the item of a thread when it exits. */
+        struct Owner {
+            T *item = nullptr;
+
+            ~Owner() {
+                if (this->item != nullptr)
+                    this->item->owned.store(false);
+            }
+        };
+
+        T *first(void) const {
+            return this->head.load();
+        }
+
+        /* Take over an item released by an exited thread or add a new one. */
+        T *acquire(void) {
+            for (T *item = this->first(); item != nullptr; item = item->next) {
+                bool expected = false;
+                if (item->owned.compare_exchange_strong(expected, true))
+                    return item;
+            }
+
+            T *item = new T();
+            item->owned.store(true);
+            item->next = this->head.load();
+            while (!this->head.compare_exchange_weak(item->next, item));
+            return item;
+        }
+
+    private:
+        std::atomic<T*> head = nullptr;
+};
+
+#endif
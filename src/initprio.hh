@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_INITPRIO_HH
+#define IP2UNIX_INITPRIO_HH
+
+/* The order of static initialisation across translation units is unspecified,
+ * so global objects which are used during the optional early initialisation
+ * in preload.cc need to be constructed with a higher priority than the
+ * initialisation itself.
+ */
+#define INIT_PRIO_STATE 101
+#define INIT_PRIO_EARLY 102
+
+#define INIT_STATE __attribute__((init_priority(INIT_PRIO_STATE)))
+
+#endif
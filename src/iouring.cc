@@ -0,0 +1,590 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include <sched.h>
+
+#include <sys/mman.h>
+
+#include "iouring.hh"
+#include "logging.hh"
+
+/* The number of rings which can be checked for new completions without
+ * locking anything, see has_new_completions().
+ */
+#define WATCH_SLOTS 16
+
+IoUring::Pending::Pending()
+    : opcode(IORING_OP_NOP)
+    , fd(-1)
+    , wants_completion(false)
+    , result(std::nullopt)
+    , addr()
+    , msg()
+    , user_msg(nullptr)
+    , user_addr(nullptr)
+    , user_addrlen(nullptr)
+{
+}
+
+/*
+ * Our own view on the shared rings of an io_uring instance created by the
+ * application. We map the rings a second time, so we don't need to know
+ * anything about how the application (or liburing) keeps track of them and
+ * only rely on the kernel ABI instead.
+ */
+struct Ring
+{
+    using PendingRef = std::shared_ptr<IoUring::Pending>;
+
+    Ring(int, const io_uring_params*);
+    ~Ring();
+
+    bool is_mapped(void) const;
+
+    io_uring_sqe *get_sqe(unsigned int) const;
+    io_uring_sqe *get_queued_sqe(unsigned int) const;
+    io_uring_cqe *get_cqe(unsigned int) const;
+
+    unsigned int sq_first(void) const;
+    unsigned int sq_last(void) const;
+    unsigned int cq_head(void) const;
+    unsigned int cq_tail(void) const;
+
+    const int fd;
+    const unsigned int cq_entries;
+
+    /* The SQ position up to which entries have already been rewritten. */
+    unsigned int sq_seen;
+
+    /* The CQ tail up to which we've already looked at completions, which is
+     * read without locking by has_new_completions().
+     */
+    std::atomic<unsigned int> cq_seen;
+
+    /* Rewritten entries by their position in the SQ, whose storage needs to
+     * be kept until the kernel has consumed them.
+     */
+    std::deque<std::pair<unsigned int, IoUring::PendingPtr>> submitted;
+
+    /* Rewritten entries waiting for their completion by user_data, which the
+     * application doesn't need to keep unique, so entries with the same
+     * user_data are kept in submission order.
+     */
+    std::unordered_map<uint64_t, std::deque<PendingRef>> pending;
+    std::atomic<size_t> pending_count;
+
+    /* Completions by their position in the CQ, whose sockets have been
+     * registered but which still need to be rewritten, along with the
+     * result to report instead.
+     */
+    struct Completed {
+        unsigned int pos;
+        PendingRef pending;
+        std::optional<int> result;
+    };
+    std::deque<Completed> completed;
+
+    /* The index into the watched rings or -1 if there was no free slot. */
+    int watch_slot;
+
+    private:
+        Ring(const Ring&) = delete;
+        Ring &operator=(const Ring&) = delete;
+
+        size_t sq_size, cq_size, sqes_size;
+        void *sq_ptr, *cq_ptr, *sqes_ptr;
+
+        unsigned int sqe_shift, cqe_shift;
+        unsigned int sq_mask, cq_mask;
+        bool has_sq_array;
+
+        const unsigned int *sq_head, *sq_tail, *sq_array;
+        const unsigned int *cq_khead, *cq_ktail;
+        char *sqes, *cqes;
+};
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+template <typename T>
+static inline T *ring_ptr(void *base, uint32_t offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+Ring::Ring(int ringfd, const io_uring_params *p)
+    : fd(ringfd)
+    , cq_entries(p->cq_entries)
+    , sq_seen(0)
+    , cq_seen(0)
+    , submitted()
+    , pending()
+    , pending_count(0)
+    , completed()
+    , watch_slot(-1)
+    , sq_size(p->sq_off.array + p->sq_entries * sizeof(unsigned int))
+    , cq_size(p->cq_off.cqes + p->cq_entries * sizeof(io_uring_cqe))
+    , sqes_size(p->sq_entries * sizeof(io_uring_sqe))
+    , sq_ptr(nullptr)
+    , cq_ptr(nullptr)
+    , sqes_ptr(nullptr)
+    , sqe_shift(0)
+    , cqe_shift(0)
+    , sq_mask(0)
+    , cq_mask(0)
+    , has_sq_array(true)
+    , sq_head(nullptr)
+    , sq_tail(nullptr)
+    , sq_array(nullptr)
+    , cq_khead(nullptr)
+    , cq_ktail(nullptr)
+    , sqes(nullptr)
+    , cqes(nullptr)
+{
+    int old_errno = errno;
+
+    if (p->flags & IORING_SETUP_SQE128) {
+        this->sqe_shift = 1;
+        this->sqes_size <<= 1;
+    }
+
+    if (p->flags & IORING_SETUP_CQE32) {
+        this->cqe_shift = 1;
+        this->cq_size += p->cq_entries * sizeof(io_uring_cqe);
+    }
+
+#ifdef IORING_SETUP_NO_SQARRAY
+    if (p->flags & IORING_SETUP_NO_SQARRAY)
+        this->has_sq_array = false;
+#endif
+
+    this->sq_ptr = map_ring(fd, this->sq_size, IORING_OFF_SQ_RING);
+    this->cq_ptr = map_ring(fd, this->cq_size, IORING_OFF_CQ_RING);
+    this->sqes_ptr = map_ring(fd, this->sqes_size, IORING_OFF_SQES);
+
+    errno = old_errno;
+
+    if (!this->is_mapped())
+        return;
+
+    this->sq_head = ring_ptr<unsigned int>(this->sq_ptr, p->sq_off.head);
+    this->sq_tail = ring_ptr<unsigned int>(this->sq_ptr, p->sq_off.tail);
+    this->sq_mask = *ring_ptr<unsigned int>(this->sq_ptr,
+                                            p->sq_off.ring_mask);
+    this->sq_array = ring_ptr<unsigned int>(this->sq_ptr, p->sq_off.array);
+    this->sqes = static_cast<char*>(this->sqes_ptr);
+
+    this->cq_khead = ring_ptr<unsigned int>(this->cq_ptr, p->cq_off.head);
+    this->cq_ktail = ring_ptr<unsigned int>(this->cq_ptr, p->cq_off.tail);
+    this->cq_mask = *ring_ptr<unsigned int>(this->cq_ptr,
+                                            p->cq_off.ring_mask);
+    this->cqes = ring_ptr<char>(this->cq_ptr, p->cq_off.cqes);
+
+    this->sq_seen = this->sq_last();
+    this->cq_seen = this->cq_tail();
+}
+
+Ring::~Ring()
+{
+    int old_errno = errno;
+    if (this->sq_ptr != nullptr) munmap(this->sq_ptr, this->sq_size);
+    if (this->cq_ptr != nullptr) munmap(this->cq_ptr, this->cq_size);
+    if (this->sqes_ptr != nullptr) munmap(this->sqes_ptr, this->sqes_size);
+    errno = old_errno;
+}
+
+bool Ring::is_mapped(void) const
+{
+    return this->sq_ptr != nullptr && this->cq_ptr != nullptr
+        && this->sqes_ptr != nullptr;
+}
+
+io_uring_sqe *Ring::get_sqe(unsigned int pos) const
+{
+    unsigned int idx = pos & this->sq_mask;
+    if (this->has_sq_array)
+        idx = this->sq_array[idx];
+    size_t offset = static_cast<size_t>(idx) * sizeof(io_uring_sqe);
+    return reinterpret_cast<io_uring_sqe*>(this->sqes
+                                           + (offset << this->sqe_shift));
+}
+
+io_uring_sqe *Ring::get_queued_sqe(unsigned int pos) const
+{
+    size_t offset = (pos & this->sq_mask) * sizeof(io_uring_sqe);
+    return reinterpret_cast<io_uring_sqe*>(this->sqes
+                                           + (offset << this->sqe_shift));
+}
+
+io_uring_cqe *Ring::get_cqe(unsigned int pos) const
+{
+    size_t offset = (pos & this->cq_mask) * sizeof(io_uring_cqe);
+    return reinterpret_cast<io_uring_cqe*>(this->cqes
+                                           + (offset << this->cqe_shift));
+}
+
+/* The SQ head is written by the kernel, the tail by the application. */
+unsigned int Ring::sq_first(void) const
+{
+    return __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+}
+
+unsigned int Ring::sq_last(void) const
+{
+    return __atomic_load_n(this->sq_tail, __ATOMIC_ACQUIRE);
+}
+
+/* The CQ head is written by the application, the tail by the kernel. */
+unsigned int Ring::cq_head(void) const
+{
+    return __atomic_load_n(this->cq_khead, __ATOMIC_ACQUIRE);
+}
+
+unsigned int Ring::cq_tail(void) const
+{
+    return __atomic_load_n(this->cq_ktail, __ATOMIC_ACQUIRE);
+}
+
+static std::mutex rings_mutex;
+static std::unordered_map<int, std::unique_ptr<Ring>> rings;
+
+/* The number of entries waiting for their completion across all rings. */
+static std::atomic<size_t> pending_total(0);
+
+/*
+ * Every wrapper checks for new completions and close() checks whether the
+ * file descriptor is a ring, so rings are additionally kept in a fixed
+ * number of slots, which can be checked without locking. Readers announce
+ * themselves via fast_readers, so that a ring is only destroyed after it
+ * has been removed from its slot and no reader could still be looking at it.
+ * Rings without a free slot are counted in unwatched and always need the
+ * lock to be taken.
+ */
+static std::atomic<Ring*> watched[WATCH_SLOTS];
+static std::atomic<size_t> unwatched(0);
+static std::atomic<size_t> ring_count(0);
+static std::atomic<unsigned int> fast_readers(0);
+
+struct FastReader {
+    FastReader() { ++fast_readers; }
+    ~FastReader() { --fast_readers; }
+};
+
+/* Must be called while holding rings_mutex. */
+static void watch(Ring &ring)
+{
+    ++ring_count;
+    for (int i = 0; i < WATCH_SLOTS; ++i) {
+        Ring *expected = nullptr;
+        if (watched[i].compare_exchange_strong(expected, &ring)) {
+            ring.watch_slot = i;
+            return;
+        }
+    }
+    ++unwatched;
+}
+
+/* Must be called while holding rings_mutex, afterwards the ring can be
+ * destroyed.
+ */
+static void unwatch(Ring &ring)
+{
+    if (ring.watch_slot == -1) {
+        --unwatched;
+    } else {
+        watched[ring.watch_slot].store(nullptr);
+        while (fast_readers.load() != 0)
+            sched_yield();
+    }
+    --ring_count;
+    pending_total -= ring.pending_count;
+}
+
+/* Whether any of the rings might have completions of rewritten entries we
+ * haven't seen yet.
+ */
+static bool has_new_completions(void)
+{
+    if (pending_total.load(std::memory_order_relaxed) == 0)
+        return false;
+    if (unwatched.load(std::memory_order_relaxed) != 0)
+        return true;
+
+    FastReader reader;
+    for (std::atomic<Ring*> &slot : watched) {
+        Ring *ring = slot.load();
+        if (ring != nullptr &&
+            ring->pending_count.load(std::memory_order_relaxed) != 0 &&
+            ring->cq_tail() != ring->cq_seen.load(std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+/* Whether the file descriptor might belong to a ring. */
+static bool may_be_ring(int fd)
+{
+    if (ring_count.load(std::memory_order_relaxed) == 0)
+        return false;
+    if (unwatched.load(std::memory_order_relaxed) != 0)
+        return true;
+
+    FastReader reader;
+    for (std::atomic<Ring*> &slot : watched) {
+        Ring *ring = slot.load();
+        if (ring != nullptr && ring->fd == fd)
+            return true;
+    }
+    return false;
+}
+
+void IoUring::setup(int fd, const io_uring_params *params)
+{
+    if (params->flags & IORING_SETUP_SQPOLL) {
+        LOG(WARNING) << "The io_uring with fd " << fd << " uses a kernel"
+                     << " submission thread, so its sockets will not be"
+                     << " handled by ip2unix.";
+        return;
+    }
+
+#ifdef IORING_SETUP_NO_MMAP
+    if (params->flags & IORING_SETUP_NO_MMAP) {
+        LOG(WARNING) << "The io_uring with fd " << fd << " uses rings"
+                     << " allocated by the application, so its sockets will"
+                     << " not be handled by ip2unix.";
+        return;
+    }
+#endif
+
+    /* We free the storage of rewritten entries as soon as the kernel has
+     * consumed them, which is only safe if it copies everything it needs.
+     */
+    if (!(params->features & IORING_FEAT_SUBMIT_STABLE)) {
+        LOG(WARNING) << "The kernel doesn't support stable submissions for"
+                     << " the io_uring with fd " << fd << ", so its sockets"
+                     << " will not be handled by ip2unix.";
+        return;
+    }
+
+    std::unique_ptr<Ring> ring = std::make_unique<Ring>(fd, params);
+    if (!ring->is_mapped()) {
+        LOG(WARNING) << "Unable to map the rings of the io_uring with fd "
+                     << fd << ", its sockets will not be handled by ip2unix.";
+        return;
+    }
+
+    std::scoped_lock<std::mutex> lock(rings_mutex);
+
+    /* The previous ring with the same file descriptor has been closed
+     * without us noticing, eg. via a direct system call.
+     */
+    auto found = rings.find(fd);
+    if (found != rings.end()) {
+        unwatch(*found->second);
+        rings.erase(found);
+    }
+
+    watch(*ring);
+    rings[fd] = std::move(ring);
+    LOG(INFO) << "Registered io_uring with fd " << fd << '.';
+}
+
+/* Free the storage of rewritten entries the kernel has already consumed. */
+static void release_submitted(Ring &ring)
+{
+    unsigned int head = ring.sq_first();
+    while (!ring.submitted.empty() &&
+           static_cast<int>(head - ring.submitted.front().first) > 0)
+        ring.submitted.pop_front();
+}
+
+/* Whether the first position of the SQ comes before the second one. */
+static inline bool sq_before(unsigned int a, unsigned int b)
+{
+    return static_cast<int>(b - a) > 0;
+}
+
+/* Rewrite the entries between the given positions which we haven't seen
+ * yet, which must be called while holding rings_mutex.
+ */
+static void submit_range(Ring &ring, unsigned int first, unsigned int last,
+                         bool queued, IoUring::SqeHandler &handler)
+{
+    release_submitted(ring);
+
+    if (sq_before(first, ring.sq_seen) && !sq_before(last, ring.sq_seen))
+        first = ring.sq_seen;
+
+    for (unsigned int pos = first; pos != last; ++pos) {
+        io_uring_sqe *sqe = queued ? ring.get_queued_sqe(pos)
+                                   : ring.get_sqe(pos);
+        IoUring::PendingPtr pending = handler(sqe);
+        if (!pending)
+            continue;
+
+        LOG(DEBUG) << "Tracking rewritten io_uring entry with opcode "
+                   << static_cast<int>(pending->opcode) << " for fd "
+                   << pending->fd << '.';
+
+        if (pending->wants_completion) {
+            ring.pending[sqe->user_data].push_back(std::move(pending));
+            ++ring.pending_count;
+            ++pending_total;
+        } else {
+            ring.submitted.emplace_back(pos, std::move(pending));
+        }
+    }
+
+    if (sq_before(ring.sq_seen, last))
+        ring.sq_seen = last;
+}
+
+void IoUring::submit(int fd, unsigned int to_submit, SqeHandler handler)
+{
+    if (!may_be_ring(fd))
+        return;
+
+    std::scoped_lock<std::mutex> lock(rings_mutex);
+
+    auto found = rings.find(fd);
+    if (found == rings.end())
+        return;
+
+    Ring &ring = *found->second;
+    unsigned int head = ring.sq_first();
+    unsigned int count = std::min(to_submit, ring.sq_last() - head);
+    submit_range(ring, head, head + count, false, handler);
+}
+
+void IoUring::submit_queued(int fd, unsigned int first, unsigned int last,
+                            SqeHandler handler)
+{
+    if (first == last || !may_be_ring(fd))
+        return;
+
+    std::scoped_lock<std::mutex> lock(rings_mutex);
+
+    auto found = rings.find(fd);
+    if (found != rings.end())
+        submit_range(*found->second, first, last, true, handler);
+}
+
+/* Register the sockets of new completions and if requested, rewrite all of
+ * the completions the application hasn't reaped yet.
+ */
+static void process_completions(Ring &ring, IoUring::CqeHandler &handler,
+                                bool rewrite)
+{
+    release_submitted(ring);
+
+    unsigned int tail = ring.cq_tail();
+    unsigned int seen = ring.cq_seen.load(std::memory_order_relaxed);
+
+    /* Entries further behind than the size of the ring have already been
+     * overwritten by the kernel.
+     */
+    if (ring.pending_count > 0 && tail - seen > ring.cq_entries) {
+        LOG(WARNING) << "Missed " << tail - seen - ring.cq_entries
+                     << " completions on io_uring with fd " << ring.fd << '.';
+        seen = tail - ring.cq_entries;
+    }
+
+    for (; seen != tail && ring.pending_count > 0; ++seen) {
+        io_uring_cqe *cqe = ring.get_cqe(seen);
+
+        auto found = ring.pending.find(cqe->user_data);
+        if (found == ring.pending.end())
+            continue;
+
+        /* If the user_data is not unique, we can't tell which of the entries
+         * has completed, so we assume the oldest one.
+         */
+        Ring::PendingRef pending = found->second.front();
+        std::optional<int> result = handler(*pending, cqe,
+                                            IoUring::Stage::REGISTER);
+        ring.completed.push_back({seen, pending, result});
+
+        if (cqe->flags & IORING_CQE_F_MORE)
+            continue;
+
+        found->second.pop_front();
+        if (found->second.empty())
+            ring.pending.erase(found);
+        --ring.pending_count;
+        --pending_total;
+    }
+
+    ring.cq_seen.store(tail, std::memory_order_relaxed);
+
+    /* Completions the application has already reaped or which have been
+     * overwritten in the meantime must no longer be touched.
+     */
+    unsigned int head = ring.cq_head();
+    while (!ring.completed.empty() &&
+           (static_cast<int>(head - ring.completed.front().pos) > 0 ||
+            tail - ring.completed.front().pos > ring.cq_entries))
+        ring.completed.pop_front();
+
+    if (!rewrite)
+        return;
+
+    for (Ring::Completed &done : ring.completed) {
+        io_uring_cqe *cqe = ring.get_cqe(done.pos);
+        std::optional<int> result = handler(*done.pending, cqe,
+                                            IoUring::Stage::REWRITE);
+        if (!result)
+            result = done.result;
+        if (result && cqe->res != result.value())
+            cqe->res = result.value();
+    }
+    ring.completed.clear();
+}
+
+void IoUring::complete(int fd, CqeHandler handler, bool rewrite)
+{
+    if (!may_be_ring(fd))
+        return;
+
+    std::scoped_lock<std::mutex> lock(rings_mutex);
+
+    auto found = rings.find(fd);
+    if (found != rings.end())
+        process_completions(*found->second, handler, rewrite);
+}
+
+void IoUring::reap(CqeHandler handler)
+{
+    if (!has_new_completions())
+        return;
+
+    std::scoped_lock<std::mutex> lock(rings_mutex);
+
+    for (auto &[fd, ring] : rings) {
+        if (ring->pending_count > 0)
+            process_completions(*ring, handler, false);
+    }
+}
+
+void IoUring::forget(int fd)
+{
+    if (!may_be_ring(fd))
+        return;
+
+    std::scoped_lock<std::mutex> lock(rings_mutex);
+
+    auto found = rings.find(fd);
+    if (found == rings.end())
+        return;
+
+    unwatch(*found->second);
+    rings.erase(found);
+    LOG(INFO) << "Unregistered io_uring with fd " << fd << '.';
+}
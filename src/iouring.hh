@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_IOURING_HH
+#define IP2UNIX_IOURING_HH
+
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include "sockaddr.hh"
+
+/* Only defined by the headers of Linux 5.11 and newer. */
+#ifndef IORING_FEAT_EXT_ARG
+#define IORING_FEAT_EXT_ARG (1U << 8)
+#endif
+
+/* Only defined by the headers of Linux 6.11 and newer. */
+#ifndef IORING_NOP_INJECT_RESULT
+#define IORING_NOP_INJECT_RESULT (1U << 0)
+#endif
+
+namespace IoUring {
+    /* Bookkeeping for a submission queue entry we have rewritten and which
+     * needs either storage that outlives the submission (eg. the rewritten
+     * destination address) or post-processing once its completion arrives.
+     */
+    struct Pending {
+        Pending();
+
+        uint8_t opcode;
+        int fd;
+
+        /* Whether the completion needs to be post-processed, otherwise the
+         * record is only kept until the kernel has consumed the entry.
+         */
+        bool wants_completion;
+
+        /* The result of operations that we carry out ourselves while
+         * submitting a no-op to the kernel instead.
+         */
+        std::optional<int> result;
+
+        SockAddr addr;
+
+        /* A copy of the message header of the application. For receiving,
+         * it's only used if the buffer for the peer address is too small to
+         * hold the address of a Unix domain socket, otherwise msg.msg_name is
+         * nullptr and the kernel writes directly into the application's
+         * buffers.
+         */
+        msghdr msg;
+
+        /* Pointers to the buffers of the application. */
+        msghdr *user_msg;
+        sockaddr *user_addr;
+        socklen_t *user_addrlen;
+    };
+
+    using PendingPtr = std::unique_ptr<Pending>;
+
+    /* Returns a Pending record if the entry has been rewritten. */
+    using SqeHandler = std::function<PendingPtr(io_uring_sqe*)>;
+
+    /* Completions are post-processed in two stages. Sockets are registered
+     * as soon as we see the completion, since that only changes our own
+     * state. The result and the buffers of the application are only
+     * rewritten by the thread that waits for completions before they're
+     * handed to the application, because another thread could be reading
+     * them otherwise. Completions the application has already reaped on its
+     * own are not rewritten at all.
+     */
+    enum class Stage { REGISTER, REWRITE };
+
+    /* Returns the result to report instead of the one of the completion. */
+    using CqeHandler = std::function<std::optional<int>(Pending&,
+                                                        io_uring_cqe*, Stage)>;
+
+    /* The beginning of struct io_uring of liburing, whose layout is part of
+     * its ABI and is the same in all versions since 0.7, so we don't need
+     * the headers of liburing.
+     */
+    struct Liburing {
+        struct {
+            unsigned int *khead, *ktail, *kring_mask, *kring_entries;
+            unsigned int *kflags, *kdropped, *array;
+            io_uring_sqe *sqes;
+            /* Entries before the tail are queued but only handed to the
+             * kernel on the next submission.
+             */
+            unsigned int sqe_head, sqe_tail;
+            size_t ring_sz;
+            void *ring_ptr;
+            unsigned int pad[4];
+        } sq;
+        struct {
+            unsigned int *khead, *ktail, *kring_mask, *kring_entries;
+            unsigned int *kflags, *koverflow;
+            io_uring_cqe *cqes;
+            size_t ring_sz;
+            void *ring_ptr;
+            unsigned int pad[4];
+        } cq;
+        unsigned int flags;
+        int ring_fd;
+        unsigned int features;
+    };
+
+    /* Map the rings of a freshly created io_uring instance. */
+    void setup(int, const io_uring_params*);
+
+    /* Call the handler for every entry in the submission queue which is
+     * about to be submitted and hasn't been seen yet.
+     */
+    void submit(int, unsigned int, SqeHandler);
+
+    /* Same as submit(), but for the entries between the given positions of
+     * the submission queue, which liburing has queued without handing them
+     * to the kernel yet, so they're always at the same index of the array
+     * of entries.
+     */
+    void submit_queued(int, unsigned int, unsigned int, SqeHandler);
+
+    /* Call the handler for every completion of a rewritten entry. If the
+     * last argument is true, the calling thread is about to hand the
+     * completions to the application, so they're rewritten as well.
+     */
+    void complete(int, CqeHandler, bool);
+
+    /* Register sockets for all rings that have entries waiting for their
+     * completion, which are possibly reaped by the application without
+     * entering the kernel.
+     */
+    void reap(CqeHandler);
+
+    /* Stop tracking the given file descriptor if it is an io_uring. */
+    void forget(int);
+}
+
+#endif
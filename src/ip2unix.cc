@@ -1,20 +1,37 @@
 // SPDX-License-Identifier: LGPL-3.0-only
 #include <algorithm>
+#include <cinttypes>
 #include <climits>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <fstream>
 #include <getopt.h>
+#include <iterator>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <strings.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "rules.hh"
+#include "ruleimage.hh"
 #include "serial.hh"
+#include "stats.hh"
+#include "trace.hh"
+#include "rules/errno_list.hh"
 
 extern char **environ;
 
+/* MAX_ARG_STRLEN of the kernel, including the variable name. */
+#define MAX_ENV_STRLEN (32 * 4096 - sizeof("__IP2UNIX_RULES_4294967295="))
+
 extern "C" const char *__ip2unix__(void);
 
 static std::optional<std::string> get_preload_libpath(void)
@@ -29,7 +46,84 @@ static std::optional<std::string> get_preload_libpath(void)
     return std::string(info.dli_fname);
 }
 
-static bool run_preload(std::vector<Rule> &rules, char *argv[])
+/*
+ * Copy the rule image into a sealed memory file descriptor, which is inherited
+ * by the program so that the preload library can map it directly.
+ */
+static std::optional<int> create_image_fd(const std::string &image)
+{
+    int fd = memfd_create("ip2unix-rules", MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return std::nullopt;
+    }
+
+    const char *data = image.data();
+    size_t remaining = image.size();
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            close(fd);
+            return std::nullopt;
+        }
+        data += written;
+        remaining -= static_cast<size_t>(written);
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE
+                             | F_SEAL_SEAL) == -1) {
+        perror("fcntl(F_ADD_SEALS)");
+        close(fd);
+        return std::nullopt;
+    }
+
+    return fd;
+}
+
+/*
+ * Pass the serialised rules via __IP2UNIX_RULES, continued in
+ * __IP2UNIX_RULES_1, __IP2UNIX_RULES_2 and so on if they don't fit into a
+ * single variable. Rules that would take up more than half of the space the
+ * kernel allows for arguments and the environment are not passed at all, in
+ * which case false is returned.
+ */
+static bool set_rules_env(const std::string &serialised)
+{
+    long arg_max = sysconf(_SC_ARG_MAX);
+    bool fits = arg_max <= 0 || serialised.size() < MAX_ENV_STRLEN ||
+                serialised.size() <= static_cast<size_t>(arg_max) / 2;
+
+    size_t part = 1;
+    if (fits) {
+        setenv("__IP2UNIX_RULES", serialised.substr(0, MAX_ENV_STRLEN).c_str(),
+               1);
+        for (; part * MAX_ENV_STRLEN < serialised.size(); ++part) {
+            std::string name = "__IP2UNIX_RULES_" + std::to_string(part);
+            std::string data = serialised.substr(part * MAX_ENV_STRLEN,
+                                                 MAX_ENV_STRLEN);
+            setenv(name.c_str(), data.c_str(), 1);
+        }
+    } else {
+        unsetenv("__IP2UNIX_RULES");
+    }
+
+    /* Remove parts left over from an outer invocation of ip2unix. */
+    for (;; ++part) {
+        std::string name = "__IP2UNIX_RULES_" + std::to_string(part);
+        if (getenv(name.c_str()) == nullptr)
+            break;
+        unsetenv(name.c_str());
+    }
+
+    return fits;
+}
+
+static bool run_preload(std::vector<Rule> &rules,
+                        const std::optional<std::string> &image,
+                        char *argv[])
 {
     const char *libversion;
     char *preload;
@@ -54,7 +148,35 @@ static bool run_preload(std::vector<Rule> &rules, char *argv[])
         setenv("LD_PRELOAD", libpath.value().c_str(), 1);
     }
 
-    setenv("__IP2UNIX_RULES", serialise(rules).c_str(), 1);
+    std::optional<int> image_fd;
+    std::string serialised = serialise(rules);
+    if (image) {
+        image_fd = create_image_fd(*image);
+    } else if (serialised.size() >= MAX_ENV_STRLEN) {
+        /* The kernel limits the size of a single environment string, so pass
+         * large rule sets via a compiled rule image instead.
+         */
+        std::string compiled;
+        MaybeError err = RuleImage::compile(rules, &compiled);
+        if (err) {
+            fprintf(stderr, "Unable to compile rules: %s\n", err->c_str());
+            return false;
+        }
+        image_fd = create_image_fd(compiled);
+    }
+
+    if (image_fd)
+        setenv("__IP2UNIX_RULE_IMAGE", std::to_string(*image_fd).c_str(), 1);
+
+    /* Programs that are started after all file descriptors have been closed,
+     * eg. via close_range() or Python's subprocess module, no longer have the
+     * image, so the rules are always passed as text as well if they fit.
+     */
+    if (!set_rules_env(serialised)) {
+        fputs("ip2unix: Warning: The rules are too large to be passed via the"
+              " environment, so programs started after closing all file"
+              " descriptors won't be able to use them.\n", stderr);
+    }
 
     if (execvpe(argv[0], argv, environ) == -1) {
         std::string err = "execvpe(\"" + std::string(argv[0]) + "\")";
@@ -65,7 +187,7 @@ static bool run_preload(std::vector<Rule> &rules, char *argv[])
 }
 
 #define PROG "PROGRAM [ARGS...]"
-#define COMMON "[-v...] [-p]"
+#define COMMON "[-v...] [-p] [-E]"
 #define RULE_ARGS "{-r RULE | -f FILE} [-r RULE | -f FILE]..."
 #define RULE_DOC_URL "https://github.com/nixcloud/ip2unix/blob/v" VERSION \
                      "/README.adoc#rule-specification"
@@ -74,6 +196,12 @@ static void print_usage(char *prog, FILE *fp)
 {
     fprintf(fp, "Usage: %s " COMMON " " RULE_ARGS " " PROG "\n", prog);
     fprintf(fp, "       %s " COMMON " -c " RULE_ARGS "\n", prog);
+    fprintf(fp, "       %s --compile=IMAGE " RULE_ARGS "\n", prog);
+    fprintf(fp, "       %s --emit=SOURCE " RULE_ARGS "\n", prog);
+    fprintf(fp, "       %s --optimize[=HITS] " RULE_ARGS "\n", prog);
+    fprintf(fp, "       %s stat [--watch[=SECONDS]] [--prometheus] PID\n",
+            prog);
+    fprintf(fp, "       %s trace-decode FILE...\n", prog);
     fprintf(fp, "       %s -h\n", prog);
     fprintf(fp, "       %s --version\n", prog);
     fputs("\nTurn IP sockets into Unix domain sockets for PROGRAM\n", fp);
@@ -85,6 +213,47 @@ static void print_usage(char *prog, FILE *fp)
     fputs("  -c, --check       Validate rules and exit\n",                fp);
     fputs("  -p, --print       Print out the table of rules\n",           fp);
     fputs("  -f, --file=FILE   Read newline-separated rules from FILE\n", fp);
+    fputs("      --compile=IMAGE\n"
+          "                    Write rules as a compiled image and exit\n", fp);
+    fputs("      --emit=SOURCE\n"
+          "                    Write C++ source for a preload library with\n"
+          "                    built-in rules and exit\n", fp);
+    fputs("      --optimize[=HITS]\n"
+          "                    Print an equivalent but faster rule file\n"
+          "                    and exit, optionally ordered by HITS\n", fp);
+    fputs("      --record-hits=HITS\n"
+          "                    Append how often each rule has matched\n"
+          "                    to HITS when PROGRAM exits\n", fp);
+    fputs("      --report-missed=FILE\n"
+          "                    Append connections and bindings that\n"
+          "                    haven't been converted to FILE\n", fp);
+    fputs("      --report-metrics=FILE\n"
+          "                    Append call counts and latencies of\n"
+          "                    ip2unix to FILE\n", fp);
+    fputs("      --perf-counters\n"
+          "                    Also report CPU cycles, instructions and\n"
+          "                    cache misses per call in user space\n", fp);
+    fputs("      --stats       Publish statistics for \"ip2unix stat\"\n",
+          fp);
+    fputs("      --trace=FILE  Record recent calls of every thread and\n"
+          "                    write them to FILE on exit, crashes or\n"
+          "                    SIGNAL, see \"ip2unix trace-decode\"\n", fp);
+    fputs("      --trace-continuous\n"
+          "                    Write all recorded calls to the trace file\n"
+          "                    while PROGRAM is running\n", fp);
+    fputs("      --report-signal=SIGNAL\n"
+          "                    Also write reports when PROGRAM receives\n"
+          "                    SIGNAL instead of only on exit\n", fp);
+    fputs("      --log-control=FILE\n"
+          "                    Read the verbosity and which calls to log\n"
+          "                    from FILE, again on SIGNAL\n", fp);
+    fputs("  -E, --early-init  Initialise rules when PROGRAM is loaded\n", fp);
+    fputs("      --no-unmap-ipv4\n"
+          "                    Don't match IPv4-mapped IPv6 addresses\n"
+          "                    against rules for IPv4 addresses\n", fp);
+    fputs("      --exec-filter=PATTERN\n"
+          "                    Only load ip2unix into programs run by\n"
+          "                    PROGRAM if their path matches PATTERN\n", fp);
     fputs("  -r, --rule        A single rule\n",                          fp);
     fputs("  -v, --verbose     Increase level of verbosity\n",            fp);
 #ifdef WITH_MANPAGE
@@ -127,40 +296,430 @@ static void warn_deprecated_yaml_file(std::string &filename)
             filename.c_str());
 }
 
-static bool push_rule_args_from_file(std::string &filename,
-                                     std::vector<std::string> &rule_args)
+/*
+ * Read the given file if it's a compiled rule image. If it's not or if it
+ * can't be opened, the image argument is left untouched and true is returned
+ * as well, so that errors are reported when reading the file as rules.
+ */
+static bool read_rule_image(const std::string &filename,
+                            std::optional<std::string> &image)
 {
-    std::ifstream input(filename);
-    std::string line;
+    std::ifstream input(filename, std::ios::binary);
 
-    if (!input.is_open()) {
-        fprintf(stderr, "Error opening rule file '%s': %s\n",
+    char magic[sizeof RuleImage::MAGIC];
+    if (!input.read(magic, sizeof magic) ||
+        !RuleImage::is_image(magic, sizeof magic))
+        return true;
+
+    input.seekg(0);
+    std::string data{std::istreambuf_iterator<char>(input),
+                     std::istreambuf_iterator<char>()};
+
+    if (input.bad()) {
+        fprintf(stderr, "Error reading rule file '%s': %s\n",
                 filename.c_str(), strerror(errno));
         return false;
     }
 
-    while (std::getline(input, line)) {
-        // Remove all leading whitespace characters
-        auto to_erase = std::find_if(
-            line.begin(), line.end(), [](int c) { return !std::isspace(c); }
-        );
-        line.erase(line.begin(), to_erase);
+    MaybeError err = RuleImage::Image(data.data(), data.size()).validate();
+    if (err) {
+        fprintf(stderr, "Error in rule image '%s': %s\n",
+                filename.c_str(), err->c_str());
+        return false;
+    }
 
-        if (line.empty() || line[0] == '#')
-            continue;
+    image = data;
+    return true;
+}
+
+static bool write_rule_image(const std::string &filename,
+                             const std::vector<Rule> &rules)
+{
+    std::string image;
+    MaybeError err = RuleImage::compile(rules, &image);
+    if (err) {
+        fprintf(stderr, "Unable to compile rules: %s\n", err->c_str());
+        return false;
+    }
+
+    std::ofstream output(filename, std::ios::binary | std::ios::trunc);
+    if (!output.is_open()) {
+        fprintf(stderr, "Error opening rule image '%s': %s\n",
+                filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    output.write(image.data(), static_cast<std::streamsize>(image.size()));
+    output.close();
+
+    if (output.fail()) {
+        fprintf(stderr, "Error writing rule image '%s': %s\n",
+                filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
 
-        rule_args.push_back(line);
+static bool write_emitted_rules(const std::string &filename,
+                                const std::vector<Rule> &rules)
+{
+    std::ofstream output(filename, std::ios::trunc);
+    if (!output.is_open()) {
+        fprintf(stderr, "Error opening output file '%s': %s\n",
+                filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    emit_rules(rules, output);
+    output.close();
+
+    if (output.fail()) {
+        fprintf(stderr, "Error writing output file '%s': %s\n",
+                filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool print_optimized_rules(const std::vector<Rule> &rules,
+                                  const std::optional<std::string> &hits_from)
+{
+    std::vector<uint64_t> hits;
+
+    if (hits_from) {
+        std::optional<std::vector<uint64_t>> result =
+            read_rule_hits(*hits_from, rules.size());
+        if (!result)
+            return false;
+        hits = result.value();
+    }
+
+    std::optional<std::vector<Rule>> optimized =
+        optimize_rules(rules, hits, std::cerr);
+    if (!optimized)
+        return false;
+
+    std::cerr << "Optimised " << rules.size() << " rule(s) into "
+              << optimized->size() << " rule(s)." << std::endl;
+
+    for (const Rule &rule : *optimized)
+        std::cout << format_rule_arg(rule) << std::endl;
+
+    return true;
+}
+
+/*
+ * Read the whole rule file into a buffer that needs to stay alive as long as
+ * the rule arguments are used, since they only point into it.
+ */
+static bool push_rule_args_from_file(std::string &filename,
+                                     std::deque<std::string> &buffers,
+                                     std::vector<std::string_view> &rule_args)
+{
+    std::ifstream input(filename, std::ios::binary);
+
+    if (!input.is_open()) {
+        fprintf(stderr, "Error opening rule file '%s': %s\n",
+                filename.c_str(), strerror(errno));
+        return false;
     }
 
+    std::ostringstream data;
+    data << input.rdbuf();
+
     if (input.bad()) {
         fprintf(stderr, "Error reading rule file '%s': %s\n",
                 filename.c_str(), strerror(errno));
         return false;
     }
 
+    split_rule_args(buffers.emplace_back(data.str()), rule_args);
     return true;
 }
 
+/*
+ * Parse a signal given either by its number or by its name with or without
+ * the "SIG" prefix, like in kill(1).
+ */
+static std::optional<int> parse_signal(const char *arg)
+{
+    static const std::pair<const char*, int> signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM},
+        {"TERM", SIGTERM}, {"WINCH", SIGWINCH},
+    };
+
+    char *end;
+    long num = strtol(arg, &end, 10);
+    if (*arg != '\0' && *end == '\0')
+        return num > 0 && num < NSIG ? std::optional<int>(num) : std::nullopt;
+
+    if (strncasecmp(arg, "SIG", 3) == 0)
+        arg += 3;
+
+    for (const auto &[name, signum] : signals) {
+        if (strcasecmp(arg, name) == 0)
+            return signum;
+    }
+    return std::nullopt;
+}
+
+static const char *socket_type_name(uint8_t type)
+{
+    switch (static_cast<SocketType>(type)) {
+        case SocketType::TCP: return "tcp";
+        case SocketType::UDP: return "udp";
+        case SocketType::INVALID: break;
+    }
+    return "-";
+}
+
+/* The statistics come from another process, so don't rely on the string
+ * fields being terminated.
+ */
+template <size_t N>
+static std::string_view stats_field(const char (&field)[N])
+{
+    size_t len = strnlen(field, N);
+    return len == 0 ? "-" : std::string_view(field, len);
+}
+
+static void print_stats(FILE *fp, pid_t pid, const Stats::Data &data)
+{
+    char updated[32] = "never";
+    time_t when = static_cast<time_t>(data.updated);
+    struct tm tm;
+    if (data.updated != 0 && gmtime_r(&when, &tm) != nullptr)
+        strftime(updated, sizeof updated, "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    fprintf(fp, "Process %d, updated %s\n\n", pid, updated);
+    fprintf(fp, "Sockets: %u registered, %u converted\n\n",
+            data.socket_count, data.converted_count);
+
+    uint32_t entries = std::min(data.entry_count,
+                                static_cast<uint32_t>(Stats::MAX_SOCKETS));
+
+    if (entries > 0) {
+        fprintf(fp, "%-6s %-4s %-10s %-40s %s\n", "FD", "TYPE", "STATE",
+                "PATH", "PEER");
+        for (uint32_t i = 0; i < entries; ++i) {
+            const Stats::SocketEntry &entry = data.sockets[i];
+            const char *state = "registered";
+            if (entry.flags & Stats::BLACKHOLED)
+                state = "blackholed";
+            else if (entry.flags & Stats::CONVERTED)
+                state = "converted";
+            std::string_view path = stats_field(entry.path);
+            std::string_view peer = stats_field(entry.peer);
+            fprintf(fp, "%-6d %-4s %-10s %-40.*s %.*s\n", entry.fd,
+                    socket_type_name(entry.type), state,
+                    static_cast<int>(path.size()), path.data(),
+                    static_cast<int>(peer.size()), peer.data());
+        }
+        if (data.socket_count > entries)
+            fprintf(fp, "(%u more)\n", data.socket_count - entries);
+        fputc('\n', fp);
+    }
+
+    fprintf(fp, "%-16s %12s %12s\n", "WRAPPER", "CALLS", "MEAN (ns)");
+    for (size_t i = 0; i < WRAPPER_COUNT; ++i) {
+        uint64_t calls = data.metrics.calls[i];
+        if (calls == 0)
+            continue;
+        fprintf(fp, "%-16s %12" PRIu64 " %12" PRIu64 "\n", WRAPPER_NAMES[i],
+                calls, data.metrics.total_ns[i] / calls);
+    }
+
+    fprintf(fp, "\n%-16s %12s\n", "EVENT", "COUNT");
+    for (size_t i = 0; i < Metrics::COUNTER_COUNT; ++i)
+        fprintf(fp, "%-16s %12" PRIu64 "\n", Metrics::COUNTER_NAMES[i],
+                data.metrics.counters[i]);
+
+    fprintf(fp, "\n%-16s %12s\n", "RULE", "HITS");
+    uint32_t rules = std::min(data.rule_count,
+                              static_cast<uint32_t>(Stats::MAX_RULES));
+    for (uint32_t i = 0; i < rules; ++i) {
+        if (data.rule_hits[i] > 0)
+            fprintf(fp, "%-16u %12" PRIu64 "\n", i + 1, data.rule_hits[i]);
+    }
+}
+
+static void print_prometheus(FILE *fp, pid_t pid, const Stats::Data &data)
+{
+    fputs("# HELP ip2unix_calls_total Calls of intercepted functions.\n"
+          "# TYPE ip2unix_calls_total counter\n", fp);
+    for (size_t i = 0; i < WRAPPER_COUNT; ++i)
+        fprintf(fp, "ip2unix_calls_total{pid=\"%d\",wrapper=\"%s\"} %"
+                    PRIu64 "\n", pid, WRAPPER_NAMES[i],
+                data.metrics.calls[i]);
+
+    fputs("# HELP ip2unix_call_seconds_total Time spent within ip2unix.\n"
+          "# TYPE ip2unix_call_seconds_total counter\n", fp);
+    for (size_t i = 0; i < WRAPPER_COUNT; ++i)
+        fprintf(fp, "ip2unix_call_seconds_total{pid=\"%d\",wrapper=\"%s\"}"
+                    " %.9f\n", pid, WRAPPER_NAMES[i],
+                static_cast<double>(data.metrics.total_ns[i]) / 1e9);
+
+    fputs("# HELP ip2unix_events_total Sockets by what happened to them.\n"
+          "# TYPE ip2unix_events_total counter\n", fp);
+    for (size_t i = 0; i < Metrics::COUNTER_COUNT; ++i)
+        fprintf(fp, "ip2unix_events_total{pid=\"%d\",event=\"%s\"} %"
+                    PRIu64 "\n", pid, Metrics::COUNTER_NAMES[i],
+                data.metrics.counters[i]);
+
+    fputs("# HELP ip2unix_rule_hits_total How often rules have matched.\n"
+          "# TYPE ip2unix_rule_hits_total counter\n", fp);
+    uint32_t rules = std::min(data.rule_count,
+                              static_cast<uint32_t>(Stats::MAX_RULES));
+    for (uint32_t i = 0; i < rules; ++i)
+        fprintf(fp, "ip2unix_rule_hits_total{pid=\"%d\",rule=\"%u\"} %"
+                    PRIu64 "\n", pid, i + 1, data.rule_hits[i]);
+
+    fputs("# HELP ip2unix_sockets Currently registered sockets.\n"
+          "# TYPE ip2unix_sockets gauge\n", fp);
+    fprintf(fp, "ip2unix_sockets{pid=\"%d\",state=\"registered\"} %u\n",
+            pid, data.socket_count);
+    fprintf(fp, "ip2unix_sockets{pid=\"%d\",state=\"converted\"} %u\n",
+            pid, data.converted_count);
+}
+
+/*
+ * Show the statistics published by a process running with --stats, either
+ * once or continuously until the process exits.
+ */
+static int stat_main(char *self, int argc, char *argv[])
+{
+    int c;
+    std::optional<double> interval = std::nullopt;
+    bool prometheus = false;
+
+    static struct option lopts[] = {
+        {"help", no_argument, nullptr, 'h'},
+        {"watch", optional_argument, nullptr, 'w'},
+        {"prometheus", no_argument, nullptr, 'P'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    optind = 1;
+    while ((c = getopt_long(argc, argv, "+hw::", lopts, nullptr)) != -1) {
+        switch (c) {
+            case 'h':
+                printf("Usage: %s stat [--watch[=SECONDS]] [--prometheus]"
+                       " PID\n", self);
+                return EXIT_SUCCESS;
+
+            case 'w':
+                interval = optarg == nullptr ? 1.0 : atof(optarg);
+                if (*interval <= 0) {
+                    fprintf(stderr, "%s: Invalid interval '%s'.\n", self,
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'P':
+                prometheus = true;
+                break;
+
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    char *end;
+    long pid = optind + 1 == argc ? strtol(argv[optind], &end, 10) : 0;
+    if (pid <= 0 || *end != '\0') {
+        fprintf(stderr, "%s: Expected a single process ID.\n", self);
+        return EXIT_FAILURE;
+    }
+
+    for (bool first = true;; first = false) {
+        if (kill(static_cast<pid_t>(pid), 0) == -1 && errno == ESRCH) {
+            if (!first)
+                return EXIT_SUCCESS;
+            fprintf(stderr, "%s: Process %ld is not running.\n", self, pid);
+            return EXIT_FAILURE;
+        }
+
+        std::string error;
+        std::unique_ptr<Stats::Data> data =
+            Stats::read(static_cast<pid_t>(pid), &error);
+        if (!data) {
+            fprintf(stderr, "%s: %s\n", self, error.c_str());
+            return EXIT_FAILURE;
+        }
+
+        if (interval && !prometheus)
+            fputs("\033[H\033[2J", stdout);
+
+        if (prometheus)
+            print_prometheus(stdout, static_cast<pid_t>(pid), *data);
+        else
+            print_stats(stdout, static_cast<pid_t>(pid), *data);
+        fflush(stdout);
+
+        if (!interval)
+            return EXIT_SUCCESS;
+
+        usleep(static_cast<useconds_t>(*interval * 1e6));
+    }
+}
+
+static void print_trace_record(FILE *fp, const Trace::Record &record)
+{
+    const Trace::Event &event = record.event;
+
+    char when[32] = "";
+    time_t secs = static_cast<time_t>(record.when / 1000000000);
+    struct tm tm;
+    if (gmtime_r(&secs, &tm) != nullptr)
+        strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%S", &tm);
+
+    fprintf(fp, "%s.%09" PRIu64 "Z %d %d %s(", when, record.when % 1000000000,
+            record.pid, event.tid, WRAPPER_NAMES[event.wrapper]);
+    size_t argc = std::min(static_cast<size_t>(event.argc), Trace::MAX_ARGS);
+    for (size_t i = 0; i < argc; ++i) {
+        if (i > 0)
+            fputs(", ", fp);
+        if (event.pointers & (1 << i))
+            fprintf(fp, "%#" PRIx64, static_cast<uint64_t>(event.args[i]));
+        else
+            fprintf(fp, "%" PRId64, event.args[i]);
+    }
+    fprintf(fp, ") = %" PRId64, event.result);
+    if (event.error != 0)
+        fprintf(fp, " %s (%s)", errno2name(event.error).c_str(),
+                strerror(event.error));
+    fprintf(fp, " <%" PRIu64 " ns>\n", record.duration);
+}
+
+/* Print the calls recorded in trace files in chronological order. */
+static int trace_decode_main(char *self, int argc, char *argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "-h") == 0 ||
+        strcmp(argv[1], "--help") == 0) {
+        fprintf(argc < 2 ? stderr : stdout,
+                "Usage: %s trace-decode FILE...\n", self);
+        return argc < 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    std::vector<Trace::Record> records;
+    for (int i = 1; i < argc; ++i) {
+        std::string error;
+        if (!Trace::read(argv[i], records, &error)) {
+            fprintf(stderr, "%s: %s\n", self, error.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    Trace::sort(records);
+    for (const Trace::Record &record : records)
+        print_trace_record(stdout, record);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
@@ -168,8 +727,14 @@ int main(int argc, char *argv[])
 
     bool check_only = false;
     bool show_rules = false;
+    bool early_init = false;
     unsigned int verbosity = 0;
 
+    if (argc >= 2 && strcmp(argv[1], "stat") == 0)
+        return stat_main(self, argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "trace-decode") == 0)
+        return trace_decode_main(self, argc - 1, argv + 1);
+
     // TODO: Remove in version 3.0.
     bool show_warn_deprecated_rules_file_long_opt = false;
     bool show_warn_deprecated_yaml_data = false;
@@ -181,6 +746,21 @@ int main(int argc, char *argv[])
         {"print", no_argument, nullptr, 'p'},
         {"rule", required_argument, nullptr, 'r'},
         {"file", required_argument, nullptr, 'f'},
+        {"early-init", no_argument, nullptr, 'E'},
+        {"compile", required_argument, nullptr, 'C'},
+        {"emit", required_argument, nullptr, 'e'},
+        {"optimize", optional_argument, nullptr, 'O'},
+        {"record-hits", required_argument, nullptr, 'H'},
+        {"exec-filter", required_argument, nullptr, 'X'},
+        {"no-unmap-ipv4", no_argument, nullptr, 'M'},
+        {"report-missed", required_argument, nullptr, 'm'},
+        {"report-metrics", required_argument, nullptr, 'R'},
+        {"report-signal", required_argument, nullptr, 'S'},
+        {"perf-counters", no_argument, nullptr, 'Y'},
+        {"stats", no_argument, nullptr, 's'},
+        {"trace", required_argument, nullptr, 'T'},
+        {"trace-continuous", no_argument, nullptr, 'K'},
+        {"log-control", required_argument, nullptr, 'L'},
         {"verbose", no_argument, nullptr, 'v'},
 
         // TODO: Remove in version 3.0.
@@ -192,9 +772,25 @@ int main(int argc, char *argv[])
 
     std::optional<std::string> rulefile = std::nullopt;
     std::optional<std::string> ruledata = std::nullopt;
-    std::vector<std::string> rule_args;
+    std::deque<std::string> rule_buffers;
+    std::vector<std::string_view> rule_args;
+    std::optional<std::string> image = std::nullopt;
+    std::optional<std::string> compile_to = std::nullopt;
+    std::optional<std::string> emit_to = std::nullopt;
+    bool optimize = false;
+    std::optional<std::string> hits_from = std::nullopt;
+    std::optional<std::string> hits_to = std::nullopt;
+    std::optional<std::vector<std::string>> exec_filter = std::nullopt;
+    std::optional<std::string> missed_to = std::nullopt;
+    std::optional<std::string> metrics_to = std::nullopt;
+    std::optional<int> report_signal = std::nullopt;
+    bool perf_counters = false;
+    bool stats = false;
+    std::optional<std::string> trace_to = std::nullopt;
+    bool trace_continuous = false;
+    std::optional<std::string> log_control = std::nullopt;
 
-    while ((c = getopt_long(argc, argv, "+hcpr:f:F:v",
+    while ((c = getopt_long(argc, argv, "+hcpr:f:F:Ev",
                             lopts, nullptr)) != -1) {
         switch (c) {
             case 'h':
@@ -222,9 +818,24 @@ int main(int argc, char *argv[])
                 /* fallthrough */
             case 'f':
                 rulefile = std::string(optarg);
+                if (c == 'f') {
+                    std::optional<std::string> found = std::nullopt;
+                    if (!read_rule_image(*rulefile, found))
+                        return EXIT_FAILURE;
+                    if (found && image) {
+                        fprintf(stderr, "%s: Only one compiled rule image"
+                                        " can be used.\n", self);
+                        return EXIT_FAILURE;
+                    } else if (found) {
+                        image = found;
+                        rulefile = std::nullopt;
+                        break;
+                    }
+                }
                 if (is_yaml_rule_file(*rulefile))
                     warn_deprecated_yaml_file(*rulefile);
-                else if (push_rule_args_from_file(*rulefile, rule_args))
+                else if (push_rule_args_from_file(*rulefile, rule_buffers,
+                                                  rule_args))
                     // XXX: This is to make sure that when we use the new rule
                     //      file format we can use multiple -f options.
                     // TODO: Remove this in version 3.0 when dropping YAML
@@ -234,6 +845,77 @@ int main(int argc, char *argv[])
                     return EXIT_FAILURE;
                 break;
 
+            case 'E':
+                early_init = true;
+                break;
+
+            case 'C':
+                compile_to = std::string(optarg);
+                break;
+
+            case 'e':
+                emit_to = std::string(optarg);
+                break;
+
+            case 'O':
+                optimize = true;
+                if (optarg != nullptr)
+                    hits_from = std::string(optarg);
+                break;
+
+            case 'H':
+                hits_to = make_absolute(optarg);
+                break;
+
+            /* Set right away, because it also affects how the rules are
+             * parsed.
+             */
+            case 'M':
+                setenv("__IP2UNIX_NO_UNMAP_IPV4", "1", 1);
+                break;
+
+            case 'm':
+                missed_to = make_absolute(optarg);
+                break;
+
+            case 'R':
+                metrics_to = make_absolute(optarg);
+                break;
+
+            case 'S':
+                if (!(report_signal = parse_signal(optarg))) {
+                    fprintf(stderr, "%s: Invalid signal '%s'.\n", self,
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'Y':
+                perf_counters = true;
+                break;
+
+            case 's':
+                stats = true;
+                break;
+
+            case 'T':
+                trace_to = make_absolute(optarg);
+                break;
+
+            case 'K':
+                trace_continuous = true;
+                break;
+
+            case 'L':
+                log_control = make_absolute(optarg);
+                break;
+
+            case 'X':
+                if (!exec_filter)
+                    exec_filter.emplace();
+                exec_filter->push_back(optarg);
+                break;
+
             case 'F':
                 show_warn_deprecated_yaml_data = true;
                 ruledata = std::string(optarg);
@@ -263,6 +945,27 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (image && (!rule_args.empty() || rulefile || ruledata)) {
+        fprintf(stderr, "%s: Can't combine a compiled rule image with other"
+                        " rules.\n\n", self);
+        print_usage(self, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (trace_continuous && !trace_to) {
+        fprintf(stderr, "%s: The --trace-continuous option needs a trace"
+                        " file specified via --trace.\n\n", self);
+        print_usage(self, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (perf_counters && !metrics_to) {
+        fprintf(stderr, "%s: The --perf-counters option needs a metrics"
+                        " report specified via --report-metrics.\n\n", self);
+        print_usage(self, stderr);
+        return EXIT_FAILURE;
+    }
+
     if (rulefile && ruledata) {
         fprintf(stderr, "%s: Can't use a rule file path and inline rules"
                         " at the same time.\n\n", self);
@@ -272,15 +975,12 @@ int main(int argc, char *argv[])
 
     std::vector<Rule> rules;
 
-    if (!rule_args.empty()) {
-        size_t rulepos = 0;
-        for (auto arg : rule_args) {
-            auto result = parse_rule_arg(++rulepos, arg);
-            if (result)
-                rules.push_back(result.value());
-            else
-                return EXIT_FAILURE;
-        }
+    if (image) {
+        rules = RuleImage::Image(image->data(), image->size()).get_all();
+    } else if (!rule_args.empty()) {
+        auto result = parse_rule_args(rule_args);
+        if (!result) return EXIT_FAILURE;
+        rules = std::move(result.value());
     } else if (rulefile) {
         auto result = parse_rules(rulefile.value(), true);
         if (!result) return EXIT_FAILURE;
@@ -301,6 +1001,18 @@ int main(int argc, char *argv[])
     if (check_only)
         return EXIT_SUCCESS;
 
+    if (compile_to)
+        return write_rule_image(*compile_to, rules) ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+
+    if (emit_to)
+        return write_emitted_rules(*emit_to, rules) ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+
+    if (optimize)
+        return print_optimized_rules(rules, hits_from) ? EXIT_SUCCESS
+                                                       : EXIT_FAILURE;
+
     argc -= optind;
     argv += optind;
 
@@ -309,7 +1021,31 @@ int main(int argc, char *argv[])
             setenv("__IP2UNIX_VERBOSITY",
                    std::to_string(verbosity).c_str(), 1);
         }
-        run_preload(rules, argv);
+        if (early_init)
+            setenv("__IP2UNIX_EARLY_INIT", "1", 1);
+        if (hits_to)
+            setenv("__IP2UNIX_HITS_FILE", hits_to->c_str(), 1);
+        if (missed_to)
+            setenv("__IP2UNIX_MISSED_FILE", missed_to->c_str(), 1);
+        if (metrics_to)
+            setenv("__IP2UNIX_METRICS_FILE", metrics_to->c_str(), 1);
+        if (perf_counters)
+            setenv("__IP2UNIX_PERF_COUNTERS", "1", 1);
+        if (report_signal)
+            setenv("__IP2UNIX_REPORT_SIGNAL",
+                   std::to_string(*report_signal).c_str(), 1);
+        if (stats)
+            setenv("__IP2UNIX_STATS", "1", 1);
+        if (trace_to)
+            setenv("__IP2UNIX_TRACE_FILE", trace_to->c_str(), 1);
+        if (trace_continuous)
+            setenv("__IP2UNIX_TRACE_CONTINUOUS", "1", 1);
+        if (log_control)
+            setenv("__IP2UNIX_LOG_CONTROL", log_control->c_str(), 1);
+        if (exec_filter)
+            setenv("__IP2UNIX_EXEC_FILTER",
+                   serialise(*exec_filter).c_str(), 1);
+        run_preload(rules, image, argv);
     } else {
         fprintf(stderr, "%s: No program to execute specified.\n", self);
         print_usage(self, stderr);
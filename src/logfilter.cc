@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <strings.h>
+
+#include "logfilter.hh"
+#include "logging.hh"
+
+/* The maximum number of file descriptors, rules and ports in a filter. */
+#define MAX_ITEMS 16
+
+/* Sockets selected via rules or ports are tracked in a bitmap, so only file
+ * descriptors below this limit can be selected that way.
+ */
+#define MAX_SELECTED_FD 65536
+
+std::atomic<bool> LogFilter::active(false);
+
+/* The wrappers to log as a bitmask of WrapperId, where 0 means all. */
+static std::atomic<uint64_t> g_wrappers(0);
+
+/* Whether only calls on selected sockets are logged. */
+static std::atomic<bool> g_by_socket(false);
+
+struct ItemList {
+    std::atomic<size_t> count;
+    std::atomic<int64_t> items[MAX_ITEMS];
+};
+
+static ItemList g_fds;
+static ItemList g_rules;
+static ItemList g_ports;
+
+static std::atomic<uint64_t> g_selected[MAX_SELECTED_FD / 64];
+
+/* Only the outermost wrapper of a thread is considered. */
+static thread_local unsigned int t_depth = 0;
+static thread_local WrapperId t_wrapper;
+static thread_local bool t_match = true;
+
+static_assert(WRAPPER_COUNT <= 64, "Wrappers need to fit into a bitmask");
+
+static bool contains(const ItemList &list, int64_t value)
+{
+    size_t count = list.count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i) {
+        if (list.items[i].load(std::memory_order_relaxed) == value)
+            return true;
+    }
+    return false;
+}
+
+static void assign(ItemList &list, const std::vector<int64_t> &values)
+{
+    list.count.store(0, std::memory_order_release);
+    for (size_t i = 0; i < values.size(); ++i)
+        list.items[i].store(values[i], std::memory_order_relaxed);
+    list.count.store(values.size(), std::memory_order_release);
+}
+
+static inline bool wrapper_selected(WrapperId wid)
+{
+    uint64_t mask = g_wrappers.load(std::memory_order_relaxed);
+    return mask == 0 || (mask & (1ULL << static_cast<size_t>(wid))) != 0;
+}
+
+static bool socket_selected(int64_t fd)
+{
+    if (contains(g_fds, fd))
+        return true;
+    if (fd < 0 || fd >= MAX_SELECTED_FD)
+        return false;
+    uint64_t bits = g_selected[fd / 64].load(std::memory_order_relaxed);
+    return (bits & (1ULL << (fd % 64))) != 0;
+}
+
+/* The argument of a wrapper that is the file descriptor it operates on, if
+ * any. For socket() it's only known afterwards, see match_socket().
+ */
+static std::optional<size_t> fd_arg(WrapperId wid)
+{
+    switch (wid) {
+        case WrapperId::accept:
+        case WrapperId::accept4:
+        case WrapperId::bind:
+        case WrapperId::close:
+        case WrapperId::connect:
+        case WrapperId::dup:
+        case WrapperId::dup2:
+        case WrapperId::dup3:
+        case WrapperId::getpeername:
+        case WrapperId::getsockname:
+        case WrapperId::ioctl:
+        case WrapperId::listen:
+        case WrapperId::recvfrom:
+        case WrapperId::recvmsg:
+        case WrapperId::sendmsg:
+        case WrapperId::sendto:
+        case WrapperId::setsockopt:
+            return 0;
+        case WrapperId::epoll_ctl:
+            return 2;
+        case WrapperId::execl:
+        case WrapperId::execle:
+        case WrapperId::execlp:
+        case WrapperId::execv:
+        case WrapperId::execve:
+        case WrapperId::execvp:
+        case WrapperId::execvpe:
+        case WrapperId::getaddrinfo:
+        case WrapperId::gethostbyname:
+        case WrapperId::gethostbyname2:
+        case WrapperId::__io_uring_get_cqe:
+        case WrapperId::io_uring_peek_batch_cqe:
+        case WrapperId::io_uring_queue_init:
+        case WrapperId::io_uring_queue_init_params:
+        case WrapperId::io_uring_submit:
+        case WrapperId::io_uring_submit_and_wait:
+        case WrapperId::io_uring_submit_and_wait_timeout:
+        case WrapperId::io_uring_wait_cqes:
+        case WrapperId::pclose:
+        case WrapperId::popen:
+        case WrapperId::posix_spawn:
+        case WrapperId::posix_spawnp:
+        case WrapperId::socket:
+        case WrapperId::syscall:
+        case WrapperId::system:
+            break;
+    }
+    return std::nullopt;
+}
+
+void LogFilter::begin(WrapperId wid)
+{
+    if (t_depth++ > 0)
+        return;
+
+    t_wrapper = wid;
+    t_match = wrapper_selected(wid) &&
+              !g_by_socket.load(std::memory_order_relaxed);
+}
+
+void LogFilter::end(void)
+{
+    if (t_depth > 0)
+        --t_depth;
+}
+
+void LogFilter::set_args(const int64_t *values, size_t count)
+{
+    if (t_depth != 1 || !g_by_socket.load(std::memory_order_relaxed) ||
+        !wrapper_selected(t_wrapper))
+        return;
+
+    std::optional<size_t> arg = fd_arg(t_wrapper);
+    if (arg && *arg < count)
+        t_match = socket_selected(values[*arg]);
+}
+
+void LogFilter::match_socket(int fd, std::optional<size_t> rule,
+                             std::optional<uint16_t> port)
+{
+    if (!active.load(std::memory_order_relaxed) ||
+        !g_by_socket.load(std::memory_order_relaxed))
+        return;
+
+    bool selected = (rule && contains(g_rules, static_cast<int64_t>(*rule)))
+                 || (port && contains(g_ports, *port));
+    if (!selected)
+        return;
+
+    if (fd >= 0 && fd < MAX_SELECTED_FD) {
+        g_selected[fd / 64].fetch_or(1ULL << (fd % 64),
+                                     std::memory_order_relaxed);
+    }
+
+    if (t_depth > 0 && wrapper_selected(t_wrapper))
+        t_match = true;
+}
+
+void LogFilter::forget_fd(int fd)
+{
+    if (!active.load(std::memory_order_relaxed) || fd < 0 ||
+        fd >= MAX_SELECTED_FD)
+        return;
+
+    g_selected[fd / 64].fetch_and(~(1ULL << (fd % 64)),
+                                  std::memory_order_relaxed);
+}
+
+bool LogFilter::matches(void)
+{
+    return t_depth == 0 || t_match;
+}
+
+static std::optional<Verbosity> parse_verbosity(const char *value)
+{
+    static const char *const names[] = {
+        "fatal", "error", "warning", "info", "debug", "trace"
+    };
+
+    for (size_t i = 0; i < std::size(names); ++i) {
+        if (strcasecmp(value, names[i]) == 0 ||
+            (value[0] == static_cast<char>('0' + i) && value[1] == '\0'))
+            return static_cast<Verbosity>(i);
+    }
+
+    return std::nullopt;
+}
+
+static std::optional<WrapperId> parse_wrapper(const char *value)
+{
+    for (size_t i = 0; i < WRAPPER_COUNT; ++i) {
+        if (strcmp(value, WRAPPER_NAMES[i]) == 0)
+            return static_cast<WrapperId>(i);
+    }
+    return std::nullopt;
+}
+
+static std::optional<int64_t> parse_number(const char *value, int64_t max)
+{
+    char *end;
+    errno = 0;
+    long long num = strtoll(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || num < 0 || num > max)
+        return std::nullopt;
+    return num;
+}
+
+/* Remove comments and surrounding whitespace from a line of the file. */
+static char *strip(char *line)
+{
+    char *comment = strchr(line, '#');
+    if (comment != nullptr)
+        *comment = '\0';
+
+    while (*line == ' ' || *line == '\t')
+        ++line;
+
+    size_t len = strlen(line);
+    while (len > 0 && strchr(" \t\r\n", line[len - 1]) != nullptr)
+        line[--len] = '\0';
+
+    return line;
+}
+
+bool LogFilter::load(const char *path, std::string *error)
+{
+    FILE *fp = fopen(path, "re");
+    if (fp == nullptr) {
+        *error = std::string("Unable to open '") + path + "': "
+               + strerror(errno);
+        return false;
+    }
+
+    std::optional<Verbosity> verbosity = std::nullopt;
+    uint64_t wrappers = 0;
+    std::vector<int64_t> fds, rules, ports;
+
+    char buf[256];
+    for (size_t lineno = 1; fgets(buf, sizeof buf, fp) != nullptr; ++lineno) {
+        char *line = strip(buf);
+        if (*line == '\0')
+            continue;
+
+        char *value = strchr(line, '=');
+        if (value != nullptr)
+            *value++ = '\0';
+
+        std::optional<int64_t> num = std::nullopt;
+        std::vector<int64_t> *list = nullptr;
+        const char *invalid = nullptr;
+
+        if (value == nullptr) {
+            invalid = "expected KEY=VALUE";
+        } else if (strcmp(line, "verbosity") == 0) {
+            if (!(verbosity = parse_verbosity(value)))
+                invalid = "invalid verbosity";
+        } else if (strcmp(line, "wrapper") == 0) {
+            std::optional<WrapperId> wid = parse_wrapper(value);
+            if (wid)
+                wrappers |= 1ULL << static_cast<size_t>(*wid);
+            else
+                invalid = "unknown wrapper";
+        } else if (strcmp(line, "fd") == 0) {
+            num = parse_number(value, INT32_MAX);
+            list = &fds;
+        } else if (strcmp(line, "rule") == 0) {
+            num = parse_number(value, INT32_MAX);
+            list = &rules;
+        } else if (strcmp(line, "port") == 0) {
+            num = parse_number(value, UINT16_MAX);
+            list = &ports;
+        } else {
+            invalid = "unknown key";
+        }
+
+        if (list != nullptr) {
+            if (!num)
+                invalid = "invalid number";
+            else if (list->size() >= MAX_ITEMS)
+                invalid = "too many values";
+            else
+                list->push_back(*num);
+        }
+
+        if (invalid != nullptr) {
+            *error = std::string(path) + ':' + std::to_string(lineno) + ": "
+                   + invalid + " in '" + line + "'";
+            fclose(fp);
+            return false;
+        }
+    }
+
+    fclose(fp);
+
+    assign(g_fds, fds);
+    assign(g_rules, rules);
+    assign(g_ports, ports);
+    for (std::atomic<uint64_t> &bits : g_selected)
+        bits.store(0, std::memory_order_relaxed);
+
+    bool by_socket = !fds.empty() || !rules.empty() || !ports.empty();
+    g_wrappers.store(wrappers, std::memory_order_relaxed);
+    g_by_socket.store(by_socket, std::memory_order_relaxed);
+    LogFilter::active.store(by_socket || wrappers != 0);
+
+    if (verbosity)
+        current_verbosity.store(*verbosity);
+
+    return true;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_LOGFILTER_HH
+#define IP2UNIX_LOGFILTER_HH
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "trace.hh"
+#include "wrappers.hh"
+
+/*
+ * Restricts the informational, debug and trace messages logged during
+ * intercepted calls to certain wrappers and sockets, as configured via a log
+ * control file, which can also change the verbosity while the program is
+ * running. Messages logged outside of intercepted calls as well as errors and
+ * warnings are never filtered.
+ *
+ * Sockets are selected either by their file descriptor or by matching one of
+ * the given rules or ports during bind(), connect() and the like, in which
+ * case they're selected until they're closed.
+ */
+namespace LogFilter {
+    extern std::atomic<bool> active;
+
+    /* Read the control file and apply it, or return false along with an
+     * error message if it's invalid, in which case nothing is changed.
+     */
+    bool load(const char*, std::string*);
+
+    /* Start and finish an intercepted call, see Metrics::Scope. */
+    void begin(WrapperId);
+    void end(void);
+
+    void set_args(const int64_t*, size_t);
+
+    /* Select the socket if the rule it has matched or its port is part of
+     * the filter.
+     */
+    void match_socket(int, std::optional<size_t>, std::optional<uint16_t>);
+
+    /* Deselect a socket that has been closed or unregistered, which is
+     * cheap enough to be done for every closed descriptor.
+     */
+    void forget_fd(int);
+
+    /* Whether messages of the current call are logged. */
+    bool matches(void);
+
+    template <typename ... Args>
+    inline void args(const Args &...vals)
+    {
+        if (!active.load(std::memory_order_relaxed))
+            return;
+
+        const int64_t values[] = {Trace::to_arg(vals) ...};
+        set_args(values, sizeof...(Args));
+    }
+}
+
+#endif
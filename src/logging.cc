@@ -1,67 +1,516 @@
 // SPDX-License-Identifier: LGPL-3.0-only
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
 
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "clock.hh"
+#include "initprio.hh"
 #include "logging.hh"
 
-static std::optional<Verbosity> current_verbosity;
+std::atomic<Verbosity> current_verbosity(Verbosity::FATAL);
+
+/* Set before any wrapper is called, unless another library calls one during
+ * its own initialisation, in which case only fatal errors are logged.
+ */
+__attribute__((constructor(INIT_PRIO_STATE)))
+static void init_verbosity(void)
+{
+    const char *env = getenv("__IP2UNIX_VERBOSITY");
+    if (env != nullptr && *env >= '0' && *env <= '9') {
+        int level = std::min(atoi(env), static_cast<int>(Verbosity::TRACE));
+        current_verbosity.store(static_cast<Verbosity>(level));
+    }
+}
 
 #ifdef SYSTEMD_SUPPORT
+static std::atomic<bool> checked_systemd(false);
 static bool is_systemd;
 
 //                            FATAL, ERROR, WARNING, INFO, DEBUG, TRACE
 static const int sysdlvl[] = {2,     3,     4,       6,    7,     7};
 #endif
 
-Logger::Logger(Verbosity verbosity, const std::string_view &file, int line,
-               const char *fun, const char *label)
-    : logbuf(std::nullopt)
+/* Messages are formatted into one of these buffers per level of nesting, eg.
+ * if a function called for an argument of a message logs by itself.
+ */
+#define MAX_NESTING 2
+static thread_local char t_lines[MAX_NESTING][Logger::MAX_LINE];
+static thread_local unsigned int t_depth = 0;
+
+/* The number of queued messages, which needs to be a power of two. */
+#define QUEUE_SIZE 256
+
+/* The maximum number of messages written via a single writev(). */
+#define WRITE_BATCH 16
+
+/* A bounded queue for multiple producers, where every slot has a turn that
+ * is even while it's free and odd while it contains a message, and
+ * increases by one with every write and read of the slot. Only a single
+ * consumer can read at a time, which is ensured via g_draining.
+ */
+struct Slot {
+    std::atomic<uint64_t> turn;
+    size_t len;
+    char line[Logger::MAX_LINE];
+};
+
+static Slot g_queue[QUEUE_SIZE];
+static std::atomic<uint64_t> g_tail(0);
+static std::atomic<uint64_t> g_head(0);
+static std::atomic<bool> g_draining(false);
+static std::atomic<uint64_t> g_dropped(0);
+static uint64_t g_reported_drops = 0;
+
+/* Every call site may log a burst of LOG_BURST messages and LOG_RATE
+ * messages per second on average.
+ */
+#define LOG_BURST 20
+#define LOG_RATE 10
+#define LOG_INTERVAL_NS (1000000000 / LOG_RATE)
+
+/* The interval in seconds at which suppressed messages are reported. */
+#define REPORT_INTERVAL 5
+
+static std::atomic<LogSite*> g_sites(nullptr);
+
+enum class Writer { NONE, STARTING, RUNNING, STOPPED };
+
+static std::atomic<Writer> g_writer(Writer::NONE);
+static sem_t g_wakeup;
+
+/* The process owning the queue, which is not the case for a child created
+ * via vfork(), since it doesn't run the fork handlers.
+ */
+static pid_t g_pid = 0;
+
+static inline uint64_t turn_of(uint64_t pos)
+{
+    return pos / QUEUE_SIZE * 2;
+}
+
+static bool enqueue(const char *line, size_t len)
+{
+    uint64_t pos = g_tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        Slot &slot = g_queue[pos % QUEUE_SIZE];
+        uint64_t turn = turn_of(pos);
+        uint64_t current = slot.turn.load(std::memory_order_acquire);
+
+        if (current == turn) {
+            if (g_tail.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+                memcpy(slot.line, line, len);
+                slot.len = len;
+                slot.turn.store(turn + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (current < turn) {
+            /* The message of the previous round hasn't been written yet. */
+            return false;
+        } else {
+            pos = g_tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static void write_all(iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(STDERR_FILENO, iov, count);
+        if (written == -1 && errno == EINTR)
+            continue;
+        else if (written <= 0)
+            return;
+
+        size_t left = static_cast<size_t>(written);
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+}
+
+static size_t format_drops(char *buf, size_t size, uint64_t drops)
+{
+    int len;
+#ifdef SYSTEMD_SUPPORT
+    if (is_systemd) {
+        len = snprintf(buf, size, "<%d>ip2unix: Dropped %llu log messages.\n",
+                       sysdlvl[static_cast<int>(Verbosity::WARNING)],
+                       static_cast<unsigned long long>(drops));
+        return len < 0 ? 0 : static_cast<size_t>(len);
+    }
+#endif
+    len = snprintf(buf, size, "ip2unix WARNING: Dropped %llu log messages.\n",
+                   static_cast<unsigned long long>(drops));
+    return len < 0 ? 0 : static_cast<size_t>(len);
+}
+
+/* Write all of the queued messages, which needs g_draining to be held. */
+static void drain(void)
+{
+    iovec iov[WRITE_BATCH + 1];
+    char notice[128];
+
+    for (;;) {
+        uint64_t head = g_head.load(std::memory_order_relaxed);
+        uint64_t pos = head;
+        int count = 0;
+
+        uint64_t dropped = g_dropped.load(std::memory_order_relaxed);
+        if (dropped != g_reported_drops) {
+            iov[count++] = {notice, format_drops(notice, sizeof notice,
+                                                 dropped - g_reported_drops)};
+            g_reported_drops = dropped;
+        }
+
+        for (; count < WRITE_BATCH; ++pos) {
+            Slot &slot = g_queue[pos % QUEUE_SIZE];
+            if (slot.turn.load(std::memory_order_acquire) != turn_of(pos) + 1)
+                break;
+            iov[count++] = {slot.line, slot.len};
+        }
+
+        if (count == 0)
+            return;
+
+        write_all(iov, count);
+
+        for (; head < pos; ++head) {
+            g_queue[head % QUEUE_SIZE].turn.store(turn_of(head) + 2,
+                                                  std::memory_order_release);
+        }
+        g_head.store(pos, std::memory_order_relaxed);
+    }
+}
+
+static void lock_queue(void)
+{
+    while (g_draining.exchange(true, std::memory_order_acquire))
+        sched_yield();
+}
+
+static void unlock_queue(void)
+{
+    g_draining.store(false, std::memory_order_release);
+}
+
+void Logger::flush(void)
+{
+    if (g_pid != getpid())
+        return;
+
+    int old_errno = errno;
+    lock_queue();
+    drain();
+    unlock_queue();
+    errno = old_errno;
+}
+
+static void *writer_main(void*)
+{
+    uint64_t last_report = clock_ns(CLOCK_MONOTONIC_COARSE);
+
+    for (;;) {
+        /* Only wake up periodically once messages have been suppressed. */
+        if (g_sites.load() == nullptr) {
+            sem_wait(&g_wakeup);
+        } else {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPORT_INTERVAL;
+            sem_timedwait(&g_wakeup, &deadline);
+        }
+
+        uint64_t now = clock_ns(CLOCK_MONOTONIC_COARSE);
+        if (now - last_report >= REPORT_INTERVAL * 1000000000ULL) {
+            LogSite::report();
+            last_report = now;
+        }
+
+        Logger::flush();
+    }
+    return nullptr;
+}
+
+/* Messages logged after exit() are written synchronously. */
+static void stop_writer(void)
+{
+    g_writer.store(Writer::STOPPED);
+    LogSite::report();
+    Logger::flush();
+}
+
+/* The writer thread doesn't exist in the child, so start a new one once it
+ * logs and drop the messages of the parent, which writes them by itself.
+ */
+static void reset_after_fork(void)
+{
+    for (Slot &slot : g_queue)
+        slot.turn.store(0);
+    g_tail.store(0);
+    g_head.store(0);
+    g_draining.store(false);
+    g_dropped.store(0);
+    g_reported_drops = 0;
+    g_pid = getpid();
+    LogSite::reset();
+    if (g_writer.load() != Writer::STOPPED)
+        g_writer.store(Writer::NONE);
+}
+
+static bool start_writer(void)
 {
-    if (!current_verbosity) {
-        const char *env = getenv("__IP2UNIX_VERBOSITY");
-        if (env != nullptr && *env >= '0' && *env <= '9')
-            current_verbosity = static_cast<Verbosity>(atoi(env));
+    static bool registered = false;
+    if (!registered) {
+        pthread_atfork(nullptr, nullptr, reset_after_fork);
+        atexit(stop_writer);
+        registered = true;
+    }
+
+    g_pid = getpid();
+
+    if (sem_init(&g_wakeup, 0, 0) == -1)
+        return false;
+
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) != 0)
+        return false;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* The thread shouldn't receive any signals meant for the program. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t thread;
+    bool started = pthread_create(&thread, &attr, writer_main, nullptr) == 0;
+
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    pthread_attr_destroy(&attr);
+
+    if (started)
+        pthread_setname_np(thread, "ip2unix-log");
+    return started;
+}
+
+/* Return whether messages can be queued for the writer thread, starting it
+ * if it's not running yet.
+ */
+static bool have_writer(void)
+{
+    Writer state = g_writer.load(std::memory_order_acquire);
+    if (state == Writer::RUNNING)
+        return true;
+    if (state != Writer::NONE ||
+        !g_writer.compare_exchange_strong(state, Writer::STARTING))
+        return false;
+
+    bool started = start_writer();
+    g_writer.store(started ? Writer::RUNNING : Writer::STOPPED,
+                   std::memory_order_release);
+    return started;
+}
+
+static void submit(const char *line, size_t len, bool sync)
+{
+    if (!sync && have_writer()) {
+        if (enqueue(line, len))
+            sem_post(&g_wakeup);
         else
-            current_verbosity = Verbosity::FATAL;
+            g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    /* Write queued messages first, so that the order is retained. */
+    lock_queue();
+    drain();
+    iovec iov = {const_cast<char*>(line), len};
+    write_all(&iov, 1);
+    unlock_queue();
+}
+
+bool LogSite::allow(void)
+{
+    uint64_t now = clock_ns(CLOCK_MONOTONIC_COARSE);
+    uint64_t next_at = this->next_ns.load(std::memory_order_relaxed);
+
+    for (;;) {
+        uint64_t base = std::max(next_at, now);
+        if (base - now > (LOG_BURST - 1) * LOG_INTERVAL_NS)
+            break;
+        if (this->next_ns.compare_exchange_weak(next_at,
+                                                base + LOG_INTERVAL_NS,
+                                                std::memory_order_relaxed))
+            return true;
+    }
+
+    this->suppressed.fetch_add(1, std::memory_order_relaxed);
+
+    if (!this->listed.exchange(true)) {
+        LogSite *head = g_sites.load();
+        do {
+            this->next = head;
+        } while (!g_sites.compare_exchange_weak(head, this));
+
+        /* Let the writer thread know that it needs to report periodically. */
+        if (g_writer.load() == Writer::RUNNING)
+            sem_post(&g_wakeup);
+    }
+
+    return false;
+}
+
+void LogSite::report(void)
+{
+    for (LogSite *site = g_sites.load(); site != nullptr; site = site->next) {
+        uint64_t count = site->suppressed.exchange(0);
+        if (count == 0 || !Logger::enabled(site->level))
+            continue;
+        Logger(site->level, site->file, site->line, "", site->label)
+            << "Suppressed " << count << " more message(s) logged at "
+            << site->file << ':' << site->line << '.';
+    }
+}
 
+void LogSite::reset(void)
+{
+    for (LogSite *site = g_sites.load(); site != nullptr; site = site->next) {
+        site->next_ns.store(0);
+        site->suppressed.store(0);
+    }
+}
+
+Logger::Logger(Verbosity level, const std::string_view &file, int line,
+               const char *fun, const char *label)
+    : buf(nullptr)
+    , len(0)
+    , verbosity(level)
+{
 #ifdef SYSTEMD_SUPPORT
+    if (!checked_systemd.load(std::memory_order_acquire)) {
         int old_errno = errno;
         struct stat st;
         is_systemd = fstat(STDERR_FILENO, &st) == 0 && S_ISSOCK(st.st_mode);
+        checked_systemd.store(true, std::memory_order_release);
         errno = old_errno;
+    }
 #endif
+
+    Verbosity current = current_verbosity.load(std::memory_order_relaxed);
+
+    if (t_depth >= MAX_NESTING) {
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
     }
 
-    if (verbosity <= current_verbosity.value()) {
-        this->logbuf.emplace();
+    this->buf = t_lines[t_depth++];
+
 #ifdef SYSTEMD_SUPPORT
-        if (is_systemd) {
-            *this->logbuf << '<' << sysdlvl[static_cast<int>(verbosity)]
-                          << ">ip2unix:";
-            if (current_verbosity.value() >= Verbosity::DEBUG)
-                *this->logbuf << file << ':' << line << ':' << fun;
-            *this->logbuf << ' ';
-            return;
-        }
+    if (is_systemd) {
+        *this << '<' << sysdlvl[static_cast<int>(level)] << ">ip2unix:";
+        if (current >= Verbosity::DEBUG)
+            *this << file << ':' << line << ':' << fun;
+        *this << ' ';
+        return;
+    }
 #endif
 
-        *this->logbuf << "ip2unix";
-
-        if (current_verbosity.value() >= Verbosity::DEBUG) {
-            *this->logbuf << '[' << getpid() << "] ";
-            *this->logbuf << file << ':' << line << ':' << fun;
-        }
+    *this << "ip2unix";
 
-        *this->logbuf << ' ' << label << ": ";
+    if (current >= Verbosity::DEBUG) {
+        *this << '[' << getpid() << "] ";
+        *this << file << ':' << line << ':' << fun;
     }
+
+    *this << ' ' << label << ": ";
 }
 
 Logger::~Logger()
 {
-    if (this->logbuf) {
-        *this->logbuf << std::endl;
-        std::cerr << this->logbuf->str();
+    if (this->buf != nullptr) {
+        int old_errno = errno;
+        /* There is always room for the newline, see append(). */
+        this->buf[this->len++] = '\n';
+        submit(this->buf, this->len, this->verbosity <= Verbosity::ERROR);
+        --t_depth;
+        errno = old_errno;
     }
+
+    /* Fatal errors are usually followed by _exit(), so this is the last
+     * chance to write the recent calls leading up to it.
+     */
+    if (this->verbosity == Verbosity::FATAL)
+        Trace::dump();
+}
+
+void Logger::append(const char *str, size_t size)
+{
+    size_t avail = MAX_LINE - 1 - this->len;
+    if (size > avail)
+        size = avail;
+    memcpy(this->buf + this->len, str, size);
+    this->len += size;
+}
+
+void Logger::append_uint(uint64_t val)
+{
+    char digits[20];
+    size_t pos = sizeof digits;
+    do {
+        digits[--pos] = static_cast<char>('0' + val % 10);
+        val /= 10;
+    } while (val > 0);
+    this->append(digits + pos, sizeof digits - pos);
+}
+
+void Logger::append_int(int64_t val)
+{
+    if (val < 0) {
+        this->append('-');
+        this->append_uint(0 - static_cast<uint64_t>(val));
+    } else {
+        this->append_uint(static_cast<uint64_t>(val));
+    }
+}
+
+void Logger::append_hex(uintptr_t val)
+{
+    if (val == 0) {
+        this->append('0');
+        return;
+    }
+
+    char digits[2 + sizeof val * 2];
+    size_t pos = sizeof digits;
+    for (; val > 0; val >>= 4)
+        digits[--pos] = "0123456789abcdef"[val & 0xf];
+    digits[--pos] = 'x';
+    digits[--pos] = '0';
+    this->append(digits + pos, sizeof digits - pos);
+}
+
+void Logger::append_double(double val)
+{
+    char digits[32];
+    int size = snprintf(digits, sizeof digits, "%g", val);
+    if (size > 0)
+        this->append(digits, std::min(static_cast<size_t>(size),
+                                      sizeof digits - 1));
 }
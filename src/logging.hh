@@ -2,8 +2,15 @@
 #ifndef IP2UNIX_LOGGING_HH
 #define IP2UNIX_LOGGING_HH
 
-#include <optional>
-#include <sstream>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "logfilter.hh"
+#include "trace.hh"
 
 /* A small helper so that we always get the basename of the file at compile
  * time instead of determining it at runtime.
@@ -17,43 +24,205 @@ constexpr std::string_view just_filename(const char *path) {
         return tmp.substr(last_slash + 1);
 }
 
-#define LOG(level) Logger(Verbosity::level, just_filename(__FILE__), \
-                          __LINE__, __func__, #level)
-
-#define TRACE_CALL(fname, ...) \
-    (LOG(TRACE) << fname "(").join_comma(__VA_ARGS__) << ')'
-
 /* NOTE: If you change anything here, be sure to sync it with sysdlvl in
  * logging.cc.
  */
 enum class Verbosity { FATAL = 0, ERROR, WARNING, INFO, DEBUG, TRACE };
 
-class Logger
+/* The most verbose level that is compiled in, see the "log-level" build
+ * option. Messages of more verbose levels are removed at compile time along
+ * with the evaluation of their arguments.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL TRACE
+#endif
+
+/* The verbosity at runtime, which is read from the environment when the
+ * library is loaded and can be changed via the log control file, see
+ * logfilter.hh.
+ */
+extern std::atomic<Verbosity> current_verbosity;
+
+#define LOGGER(level) Logger(Verbosity::level, just_filename(__FILE__), \
+                             __LINE__, __func__, #level)
+
+/* The state of every call site of LOG(), which is initialised at compile
+ * time and limits the rate of its messages, see LogSite::allow().
+ */
+#define LOG_SITE(level) \
+    ([]() -> LogSite& { \
+        static LogSite site(just_filename(__FILE__), __LINE__, \
+                            Verbosity::level, #level); \
+        return site; \
+    }())
+
+/* The message is only built if the level is enabled and the rate limit of the
+ * call site hasn't been exceeded, while the conditional expression makes sure
+ * that LOG() can still be used like a statement. Fatal errors are never
+ * suppressed.
+ */
+#define LOG(level) \
+    !Logger::enabled(Verbosity::level) || \
+    (Verbosity::level != Verbosity::FATAL && !LOG_SITE(level).allow()) \
+        ? static_cast<void>(0) : LogVoidify() & LOGGER(level)
+
+/* Record the arguments of a wrapper in the binary trace, see trace.hh, and
+ * log them if the verbosity is TRACE.
+ */
+#define TRACE_CALL(fname, ...) \
+    do { \
+        Trace::args(__VA_ARGS__); \
+        LogFilter::args(__VA_ARGS__); \
+        if (Logger::enabled(Verbosity::TRACE)) \
+            (LOGGER(TRACE) << fname "(").join_comma(__VA_ARGS__) << ')'; \
+    } while (0)
+
+/*
+ * Every call site may log a burst of messages, after which its messages are
+ * suppressed until they fall below a fixed rate again. The number of
+ * suppressed messages is logged periodically by the writer thread and on
+ * exit.
+ */
+class LogSite
 {
-    std::optional<std::ostringstream> logbuf;
+    public:
+        constexpr LogSite(std::string_view f, int l, Verbosity v,
+                          const char *lbl)
+            : file(f), line(l), level(v), label(lbl), next_ns(0),
+              suppressed(0), listed(false), next(nullptr) {}
+
+        LogSite(const LogSite&) = delete;
+        LogSite &operator=(const LogSite&) = delete;
+
+        /* Return whether a message may be logged right now. */
+        bool allow(void);
 
+        /* Log the number of messages suppressed since the last time. */
+        static void report(void);
+
+        /* Forget suppressed messages of the parent after fork(). */
+        static void reset(void);
+
+    private:
+        std::string_view file;
+        int line;
+        Verbosity level;
+        const char *label;
+        /* The time on the monotonic clock when the site would be allowed to
+         * log the next message if it logged at exactly the average rate.
+         */
+        std::atomic<uint64_t> next_ns;
+        std::atomic<uint64_t> suppressed;
+        /* Sites are added to a list once they have suppressed a message. */
+        std::atomic<bool> listed;
+        LogSite *next;
+};
+
+/*
+ * Messages are formatted into a fixed per-thread buffer without allocating
+ * memory and passed to a background thread via a lock-free queue, so that
+ * intercepted calls never block on a slow reader of stderr. If the queue is
+ * full, messages are dropped and the number of dropped messages is logged
+ * later. Fatal errors and errors are written synchronously, since they're
+ * often followed by the termination of the process.
+ */
+class Logger
+{
     public:
+        /* Messages longer than this are truncated. */
+        static constexpr size_t MAX_LINE = 1024;
+
         Logger(Verbosity, const std::string_view&, int, const char*,
                const char*);
         ~Logger();
 
+        Logger(const Logger&) = delete;
+        Logger &operator=(const Logger&) = delete;
+
         template <typename T>
         Logger &operator<<(T const &val) {
-            if (this->logbuf)
-                this->logbuf.value() << val;
+            if (this->buf != nullptr)
+                this->append(val);
             return *this;
         }
 
         template <typename Arg0, typename ... Args>
         Logger &join_comma(Arg0 const &arg0, Args const &...rest) {
-            if (!this->logbuf) return *this;
-            *this->logbuf << arg0;
+            if (this->buf == nullptr) return *this;
+            *this << arg0;
             if constexpr (sizeof...(rest) > 0) {
-                *this->logbuf << ", ";
+                *this << ", ";
                 return this->join_comma(rest...);
             }
             return *this;
         }
+
+        /* Errors and warnings are never subject to the log filter. */
+        static inline bool enabled(Verbosity level) {
+            return level <= Verbosity::LOG_LEVEL &&
+                level <= current_verbosity.load(std::memory_order_relaxed) &&
+                (level <= Verbosity::WARNING ||
+                 !LogFilter::active.load(std::memory_order_relaxed) ||
+                 LogFilter::matches());
+        }
+
+        /* Write all queued messages, eg. before exec() or on exit. Does
+         * nothing in a child created via vfork(), whose queue still belongs
+         * to the parent.
+         */
+        static void flush(void);
+
+    private:
+        char *buf;
+        size_t len;
+        Verbosity verbosity;
+
+        void append(const char*, size_t);
+        void append_int(int64_t);
+        void append_uint(uint64_t);
+        void append_hex(uintptr_t);
+        void append_double(double);
+
+        void append(const char *str) {
+            if (str == nullptr)
+                this->append("(null)", 6);
+            else
+                this->append(str, strlen(str));
+        }
+
+        void append(const std::string &str) {
+            this->append(str.data(), str.size());
+        }
+
+        void append(const std::string_view &str) {
+            this->append(str.data(), str.size());
+        }
+
+        void append(char c) {
+            this->append(&c, 1);
+        }
+
+        template <typename T>
+        void append(const T &val) {
+            using Pointee = std::remove_cv_t<std::remove_pointer_t<T>>;
+            if constexpr (std::is_pointer_v<T> && std::is_same_v<Pointee, char>)
+                this->append(static_cast<const char*>(val));
+            else if constexpr (std::is_pointer_v<T>)
+                this->append_hex(reinterpret_cast<uintptr_t>(val));
+            else if constexpr (std::is_enum_v<T>)
+                this->append(static_cast<std::underlying_type_t<T>>(val));
+            else if constexpr (std::is_floating_point_v<T>)
+                this->append_double(val);
+            else if constexpr (std::is_signed_v<T>)
+                this->append_int(val);
+            else
+                this->append_uint(val);
+        }
+};
+
+/* Turns the message into a void expression for the conditional in LOG(). */
+struct LogVoidify {
+    void operator&(const Logger&) {}
 };
 
 #endif
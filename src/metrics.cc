@@ -0,0 +1,464 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <mutex>
+#include <unordered_set>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "clock.hh"
+#include "handover.hh"
+#include "initprio.hh"
+#include "logging.hh"
+#include "metrics.hh"
+#include "realcalls.hh"
+
+/*
+ * Latency histograms use log-linear buckets like HDR histograms, with 2^3
+ * linear sub-buckets for every power of two, so the relative error is at most
+ * 12.5%. Values of 2^32 nanoseconds or more end up in the last bucket.
+ */
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_BITS 32
+#define BUCKET_COUNT ((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+/* The hardware events counted if enable_perf() has been called. */
+static constexpr uint64_t PERF_EVENTS[] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static constexpr const char *PERF_EVENT_NAMES[] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+};
+
+static constexpr size_t PERF_EVENT_COUNT = std::size(PERF_EVENTS);
+
+std::atomic<bool> Metrics::enabled = false;
+
+static std::atomic<bool> g_perf_enabled = false;
+/* Whether any thread has been able to open a counter. */
+static std::atomic<bool> g_perf_available = false;
+static std::atomic<bool> g_perf_warned = false;
+
+/* The counters of all threads, which the application must not close or
+ * replace, since the descriptors are kept until the thread exits.
+ */
+static std::mutex g_perf_mutex;
+static std::unordered_set<int> g_perf_fds INIT_STATE;
+
+using Value = std::atomic<uint64_t>;
+
+/*
+ * A shard is only written by the thread currently owning it, so values are
+ * updated via a relaxed load and store rather than an atomic increment.
+ * Shards outlive their threads, so the totals are kept.
+ */
+struct Shard {
+    Value histograms[WRAPPER_COUNT][BUCKET_COUNT];
+    Value calls[WRAPPER_COUNT];
+    Value total_ns[WRAPPER_COUNT];
+    Value counters[Metrics::COUNTER_COUNT];
+    Value perf_calls[WRAPPER_COUNT][PERF_EVENT_COUNT];
+    Value perf_totals[WRAPPER_COUNT][PERF_EVENT_COUNT];
+    std::atomic<bool> owned;
+    Shard *next;
+};
+
+static HandoverList<Shard> g_shards;
+
+static inline void add(Value &val, uint64_t amount)
+{
+    val.store(val.load(std::memory_order_relaxed) + amount,
+              std::memory_order_relaxed);
+}
+
+static inline size_t bucket_for(uint64_t value)
+{
+    if (value < SUB_COUNT)
+        return value;
+    if (value >= (static_cast<uint64_t>(1) << MAX_BITS))
+        return BUCKET_COUNT - 1;
+
+    unsigned int exp = 63 - static_cast<unsigned int>(__builtin_clzll(value));
+    size_t sub = (value >> (exp - SUB_BITS)) & (SUB_COUNT - 1);
+    return (exp - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+/* The highest value that ends up in the given bucket. */
+static inline uint64_t bucket_max(size_t bucket)
+{
+    if (bucket < SUB_COUNT)
+        return bucket;
+
+    unsigned int exp = static_cast<unsigned int>(bucket / SUB_COUNT)
+                     + SUB_BITS - 1;
+    uint64_t sub = SUB_COUNT + bucket % SUB_COUNT;
+    return ((sub + 1) << (exp - SUB_BITS)) - 1;
+}
+
+/*
+ * The performance counters of a thread, which are opened on its first call
+ * and form a group led by the first event that could be opened, so that all
+ * of them are read via a single read() of the leader. Events that aren't
+ * supported by the PMU are left out.
+ */
+struct PerfGroup {
+    enum class State { CLOSED, OPEN, UNAVAILABLE };
+
+    State state = State::CLOSED;
+    size_t count = 0;
+    int fds[PERF_EVENT_COUNT] = {};
+    /* The index into PERF_EVENTS of every counter in the group. */
+    size_t events[PERF_EVENT_COUNT] = {};
+
+    void open(void);
+    bool read(uint64_t*);
+    void close(void);
+
+    ~PerfGroup() {
+        this->close();
+    }
+};
+
+static thread_local HandoverList<Shard>::Owner t_owner;
+static thread_local bool t_in_wrapper = false;
+static thread_local uint64_t t_excluded_ns = 0;
+static thread_local PerfGroup t_perf;
+static thread_local bool t_perf_started = false;
+static thread_local uint64_t t_perf_start[PERF_EVENT_COUNT];
+
+static inline Shard &get_shard(void)
+{
+    if (t_owner.item == nullptr)
+        t_owner.item = g_shards.acquire();
+    return *t_owner.item;
+}
+
+void Metrics::enable(void)
+{
+    Metrics::enabled.store(true, std::memory_order_relaxed);
+}
+
+void Metrics::enable_perf(void)
+{
+    g_perf_enabled.store(true, std::memory_order_relaxed);
+    Metrics::enable();
+}
+
+void PerfGroup::open(void)
+{
+    int leader = -1;
+    int error = 0;
+
+    for (size_t event = 0; event < PERF_EVENT_COUNT; ++event) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_EVENTS[event];
+        attr.read_format = PERF_FORMAT_GROUP;
+        /* Counting only user space works without privileges up to a
+         * perf_event_paranoid setting of 2, which is the default.
+         */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* If the group can't be scheduled on the PMU, it goes into an error
+         * state rather than being multiplexed, so counts are never scaled.
+         */
+        if (leader == -1)
+            attr.pinned = 1;
+
+        long fd = real::syscall(SYS_perf_event_open, &attr, 0, -1, leader,
+                                PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) {
+            error = errno;
+            continue;
+        }
+
+        if (leader == -1)
+            leader = static_cast<int>(fd);
+        {
+            std::scoped_lock<std::mutex> lock(g_perf_mutex);
+            g_perf_fds.insert(static_cast<int>(fd));
+        }
+        this->fds[this->count] = static_cast<int>(fd);
+        this->events[this->count++] = event;
+    }
+
+    if (this->count > 0) {
+        this->state = State::OPEN;
+        g_perf_available.store(true, std::memory_order_relaxed);
+    } else {
+        this->state = State::UNAVAILABLE;
+        if (!g_perf_warned.exchange(true)) {
+            LOG(WARNING) << "Unable to open performance counters: "
+                         << strerror(error);
+        }
+    }
+}
+
+/* Read the counters into the values indexed by PERF_EVENTS. */
+bool PerfGroup::read(uint64_t *values)
+{
+    uint64_t buf[1 + PERF_EVENT_COUNT];
+    ssize_t len = ::read(this->fds[0], buf, sizeof buf);
+    if (len != static_cast<ssize_t>((1 + this->count) * sizeof(uint64_t)))
+        return false;
+
+    for (size_t i = 0; i < this->count; ++i)
+        values[this->events[i]] = buf[1 + i];
+    return true;
+}
+
+void PerfGroup::close(void)
+{
+    std::scoped_lock<std::mutex> lock(g_perf_mutex);
+    for (size_t i = 0; i < this->count; ++i) {
+        g_perf_fds.erase(this->fds[i]);
+        real::close(this->fds[i]);
+    }
+    this->count = 0;
+    this->state = State::CLOSED;
+}
+
+bool Metrics::is_perf_fd(int fd)
+{
+    if (!g_perf_available.load(std::memory_order_relaxed))
+        return false;
+
+    std::scoped_lock<std::mutex> lock(g_perf_mutex);
+    return g_perf_fds.count(fd) > 0;
+}
+
+static inline void perf_begin(void)
+{
+    if (t_perf.state == PerfGroup::State::CLOSED)
+        t_perf.open();
+    t_perf_started = t_perf.state == PerfGroup::State::OPEN &&
+                     t_perf.read(t_perf_start);
+}
+
+static inline void perf_end(Shard &shard, size_t wrapper)
+{
+    uint64_t values[PERF_EVENT_COUNT] = {};
+    t_perf_started = false;
+    if (!t_perf.read(values))
+        return;
+
+    for (size_t i = 0; i < t_perf.count; ++i) {
+        size_t event = t_perf.events[i];
+        add(shard.perf_calls[wrapper][event], 1);
+        add(shard.perf_totals[wrapper][event],
+            values[event] - t_perf_start[event]);
+    }
+}
+
+void Metrics::count(Counter counter)
+{
+    if (!Metrics::enabled.load(std::memory_order_relaxed))
+        return;
+
+    add(get_shard().counters[static_cast<size_t>(counter)], 1);
+}
+
+void Metrics::Scope::begin(void)
+{
+    if (t_in_wrapper)
+        return;
+
+    t_in_wrapper = true;
+    t_excluded_ns = 0;
+    this->active = true;
+    this->start = clock_ns(CLOCK_MONOTONIC);
+
+    /* The counters are read last and first in end(), so that they cover as
+     * little of the measurement itself as possible.
+     */
+    if (g_perf_enabled.load(std::memory_order_relaxed))
+        perf_begin();
+}
+
+void Metrics::Scope::end(void)
+{
+    int old_errno = errno;
+    Shard &shard = get_shard();
+    size_t wrapper = static_cast<size_t>(this->id);
+
+    if (t_perf_started)
+        perf_end(shard, wrapper);
+
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - this->start;
+    elapsed = elapsed > t_excluded_ns ? elapsed - t_excluded_ns : 0;
+    add(shard.histograms[wrapper][bucket_for(elapsed)], 1);
+    add(shard.calls[wrapper], 1);
+    add(shard.total_ns[wrapper], elapsed);
+
+    t_in_wrapper = false;
+    errno = old_errno;
+}
+
+Metrics::RealCall::RealCall()
+    : active(t_in_wrapper)
+    , start(0)
+{
+    if (this->active)
+        this->start = clock_ns(CLOCK_MONOTONIC);
+}
+
+Metrics::RealCall::~RealCall()
+{
+    if (this->active)
+        t_excluded_ns += clock_ns(CLOCK_MONOTONIC) - this->start;
+}
+
+static uint64_t percentile(const uint64_t *buckets, uint64_t total, int pct)
+{
+    uint64_t rank = (total * static_cast<uint64_t>(pct) + 99) / 100;
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        seen += buckets[bucket];
+        if (seen >= rank)
+            return bucket_max(bucket);
+    }
+    return bucket_max(BUCKET_COUNT - 1);
+}
+
+static void write_perf(FILE *fp)
+{
+    if (!g_perf_available.load(std::memory_order_relaxed)) {
+        fputs("# No performance counters could be opened.\n", fp);
+        return;
+    }
+
+    fputs("# perf\tWRAPPER\tEVENT\tCALLS\tMEAN"
+          " (per call within ip2unix in user space)\n", fp);
+
+    for (size_t wrapper = 0; wrapper < WRAPPER_COUNT; ++wrapper) {
+        for (size_t event = 0; event < PERF_EVENT_COUNT; ++event) {
+            uint64_t calls = 0, total = 0;
+            for (Shard *shard = g_shards.first(); shard != nullptr;
+                 shard = shard->next) {
+                calls += shard->perf_calls[wrapper][event].load(
+                    std::memory_order_relaxed
+                );
+                total += shard->perf_totals[wrapper][event].load(
+                    std::memory_order_relaxed
+                );
+            }
+
+            if (calls == 0)
+                continue;
+
+            fprintf(fp, "perf\t%s\t%s\t%" PRIu64 "\t%" PRIu64 "\n",
+                    WRAPPER_NAMES[wrapper], PERF_EVENT_NAMES[event], calls,
+                    total / calls);
+        }
+    }
+}
+
+void Metrics::write(FILE *fp)
+{
+    uint64_t buckets[BUCKET_COUNT];
+
+    fprintf(fp, "# Metrics of ip2unix in process %d:\n", getpid());
+    fputs("# WRAPPER\tCALLS\tMEAN\tP50\tP90\tP99\tMAX"
+          " (nanoseconds spent within ip2unix)\n", fp);
+
+    for (size_t wrapper = 0; wrapper < WRAPPER_COUNT; ++wrapper) {
+        uint64_t calls = 0, total_ns = 0;
+        std::fill(std::begin(buckets), std::end(buckets), 0);
+
+        for (Shard *shard = g_shards.first(); shard != nullptr;
+             shard = shard->next) {
+            for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+                uint64_t val = shard->histograms[wrapper][bucket].load(
+                    std::memory_order_relaxed
+                );
+                buckets[bucket] += val;
+                calls += val;
+            }
+            total_ns += shard->total_ns[wrapper].load(
+                std::memory_order_relaxed
+            );
+        }
+
+        if (calls == 0)
+            continue;
+
+        size_t max_bucket = BUCKET_COUNT - 1;
+        while (max_bucket > 0 && buckets[max_bucket] == 0)
+            --max_bucket;
+
+        fprintf(fp, "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64
+                    "\t%" PRIu64 "\t%" PRIu64 "\n", WRAPPER_NAMES[wrapper],
+                calls, total_ns / calls, percentile(buckets, calls, 50),
+                percentile(buckets, calls, 90),
+                percentile(buckets, calls, 99), bucket_max(max_bucket));
+    }
+
+    if (g_perf_enabled.load(std::memory_order_relaxed))
+        write_perf(fp);
+
+    Totals totals;
+    Metrics::sum(&totals);
+    for (size_t counter = 0; counter < COUNTER_COUNT; ++counter)
+        fprintf(fp, "counter\t%s\t%" PRIu64 "\n", COUNTER_NAMES[counter],
+                totals.counters[counter]);
+}
+
+void Metrics::sum(Totals *totals)
+{
+    *totals = Totals();
+
+    for (Shard *shard = g_shards.first(); shard != nullptr;
+         shard = shard->next) {
+        for (size_t wrapper = 0; wrapper < WRAPPER_COUNT; ++wrapper) {
+            totals->calls[wrapper] += shard->calls[wrapper].load(
+                std::memory_order_relaxed
+            );
+            totals->total_ns[wrapper] += shard->total_ns[wrapper].load(
+                std::memory_order_relaxed
+            );
+        }
+        for (size_t counter = 0; counter < COUNTER_COUNT; ++counter)
+            totals->counters[counter] += shard->counters[counter].load(
+                std::memory_order_relaxed
+            );
+    }
+}
+
+void Metrics::reset(void)
+{
+    for (Shard *shard = g_shards.first(); shard != nullptr;
+         shard = shard->next) {
+        for (auto &histogram : shard->histograms) {
+            for (Value &val : histogram)
+                val.store(0, std::memory_order_relaxed);
+        }
+        for (Value &val : shard->calls)
+            val.store(0, std::memory_order_relaxed);
+        for (Value &val : shard->total_ns)
+            val.store(0, std::memory_order_relaxed);
+        for (Value &val : shard->counters)
+            val.store(0, std::memory_order_relaxed);
+        for (auto &events : shard->perf_calls) {
+            for (Value &val : events)
+                val.store(0, std::memory_order_relaxed);
+        }
+        for (auto &events : shard->perf_totals) {
+            for (Value &val : events)
+                val.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /* Inherited counters would still count the thread of the parent. */
+    t_perf.close();
+}
@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_METRICS_HH
+#define IP2UNIX_METRICS_HH
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+
+#include "logfilter.hh"
+#include "probes.hh"
+#include "trace.hh"
+#include "wrappers.hh"
+
+/*
+ * Counters and latency histograms of the preload library, which are sharded
+ * per thread so that recording doesn't need any locking or atomic
+ * read-modify-write operations. Nothing is recorded unless enable() has been
+ * called, so the only overhead otherwise is a single relaxed load per call.
+ */
+namespace Metrics {
+    enum class Counter {
+        CONVERSIONS,
+        REPLAY_FAILURES,
+        BLACKHOLES,
+        REJECTS,
+    };
+
+    inline constexpr const char *COUNTER_NAMES[] = {
+        "conversions",
+        "replay_failures",
+        "blackholes",
+        "rejects",
+    };
+
+    inline constexpr size_t COUNTER_COUNT = std::size(COUNTER_NAMES);
+
+    /* Sums of all shards without the latency distribution. */
+    struct Totals {
+        uint64_t calls[WRAPPER_COUNT];
+        uint64_t total_ns[WRAPPER_COUNT];
+        uint64_t counters[COUNTER_COUNT];
+    };
+
+    extern std::atomic<bool> enabled;
+
+    void enable(void);
+    void count(Counter);
+
+    /* Additionally count CPU cycles, instructions and cache misses in user
+     * space for every wrapper via per-thread performance counters of the
+     * kernel, see perf_event_open(2). Threads for which the counters can't
+     * be opened, eg. because there's no PMU, are only measured in time.
+     */
+    void enable_perf(void);
+
+    /* Whether the descriptor belongs to the performance counters of any
+     * thread, so the application must not close it.
+     */
+    bool is_perf_fd(int);
+
+    /* Write the sum of all shards in a tab-separated format. */
+    void write(FILE*);
+
+    void sum(Totals*);
+
+    /* Reset all shards, eg. in a child process after fork(). */
+    void reset(void);
+
+    /* Measures the time spent within a wrapper, excluding the time spent in
+     * real calls made while the scope is active, see RealCall below. Only
+     * the outermost scope of a thread is measured.
+     *
+     * This also fires the "wrapper_entry" and "wrapper_return" probes, with
+     * the wrapper's index in WRAPPER_NAMES and its name as arguments and the
+     * value passed to result() along with errno as additional arguments on
+     * return, and records the call in the binary trace if enabled, see
+     * trace.hh, and determines whether its messages pass the log filter, see
+     * logfilter.hh.
+     */
+    class Scope
+    {
+        public:
+            Scope(WrapperId wid)
+                : id(wid)
+                , active(false)
+                , tracing(false)
+                , filtering(false)
+                , start(0)
+                , retval(0)
+            {
+                PROBE(wrapper_entry, static_cast<int>(wid),
+                      WRAPPER_NAMES[static_cast<size_t>(wid)]);
+                if (enabled.load(std::memory_order_relaxed))
+                    this->begin();
+                if (Trace::enabled.load(std::memory_order_relaxed))
+                    this->tracing = Trace::begin(wid);
+                if (LogFilter::active.load(std::memory_order_relaxed)) {
+                    LogFilter::begin(wid);
+                    this->filtering = true;
+                }
+            }
+
+            ~Scope()
+            {
+                if (this->filtering)
+                    LogFilter::end();
+                if (this->tracing)
+                    Trace::end();
+                if (this->active)
+                    this->end();
+                PROBE(wrapper_return, static_cast<int>(this->id),
+                      WRAPPER_NAMES[static_cast<size_t>(this->id)],
+                      this->retval, errno);
+            }
+
+            /* Pass through the value returned by the wrapper, see
+             * METRICS_RESULT below.
+             */
+            template <typename T>
+            inline T result(T val)
+            {
+#ifdef USDT_PROBES
+                this->retval = Trace::to_arg(val);
+#endif
+                return val;
+            }
+
+        private:
+            Scope(const Scope&) = delete;
+            Scope &operator=(const Scope&) = delete;
+
+            void begin(void);
+            void end(void);
+
+            WrapperId id;
+            bool active;
+            bool tracing;
+            bool filtering;
+            uint64_t start;
+            int64_t retval;
+    };
+
+    /* Measures the time of a call to the C library or kernel. */
+    class RealCall
+    {
+        public:
+            RealCall();
+            ~RealCall();
+
+        private:
+            RealCall(const RealCall&) = delete;
+            RealCall &operator=(const RealCall&) = delete;
+
+            bool active;
+            uint64_t start;
+    };
+}
+
+#define METRICS_SCOPE(name) Metrics::Scope metrics_scope(WrapperId::name)
+#define METRICS_RESULT(val) metrics_scope.result(val)
+
+#endif
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <cinttypes>
+
+#include <unistd.h>
+
+#include "missed.hh"
+
+MissedTable::MissedTable(size_t max)
+    : max_entries(max)
+    , entries()
+    , untracked(0)
+{
+}
+
+void MissedTable::record(const SockAddr &addr, SocketType type, RuleDir dir,
+                         MissReason reason)
+{
+    Key key(addr.get_host().value_or(""), addr.get_port().value_or(0), type,
+            dir, reason);
+    time_t now = time(nullptr);
+
+    auto found = this->entries.find(key);
+    if (found != this->entries.end()) {
+        found->second.count++;
+        found->second.last_seen = now;
+    } else if (this->entries.size() < this->max_entries) {
+        this->entries.emplace(key, Entry{1, now, now});
+    } else {
+        this->untracked++;
+    }
+}
+
+static std::string format_time(time_t val)
+{
+    char buf[32];
+    struct tm tm;
+    if (gmtime_r(&val, &tm) == nullptr ||
+        strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%SZ", &tm) == 0)
+        return std::to_string(val);
+    return buf;
+}
+
+void MissedTable::write(FILE *fp) const
+{
+    fprintf(fp, "# Missed by ip2unix in process %d:\n", getpid());
+    fputs("# RULE\tREASON\tCOUNT\tFIRST\tLAST\n", fp);
+
+    for (const auto &[key, entry] : this->entries) {
+        const auto &[host, port, type, dir, reason] = key;
+
+        std::string rule = dir == RuleDir::INCOMING ? "in" : "out";
+        if (type == SocketType::TCP)
+            rule += ",tcp";
+        else if (type == SocketType::UDP)
+            rule += ",udp";
+        if (!host.empty())
+            rule += ",addr=" + host;
+        if (port != 0)
+            rule += ",port=" + std::to_string(port);
+
+        fprintf(fp, "%s\t%s\t%" PRIu64 "\t%s\t%s\n", rule.c_str(),
+                reason == MissReason::IGNORED ? "ignored" : "unmatched",
+                entry.count, format_time(entry.first_seen).c_str(),
+                format_time(entry.last_seen).c_str());
+    }
+
+    if (this->untracked > 0)
+        fprintf(fp, "# %" PRIu64 " more miss(es) not tracked, because the"
+                    " table is full.\n", this->untracked);
+}
+
+void MissedTable::clear(void)
+{
+    this->entries.clear();
+    this->untracked = 0;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_MISSED_HH
+#define IP2UNIX_MISSED_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <string>
+#include <tuple>
+
+#include "rules.hh"
+#include "sockaddr.hh"
+
+enum class MissReason { UNMATCHED, IGNORED };
+
+/*
+ * Keeps track of destinations and bindings that didn't get converted to Unix
+ * domain sockets, either because no rule matched or because they have been
+ * explicitly ignored. The number of tracked entries is bounded, so once the
+ * table is full, only the number of untracked misses is counted.
+ */
+class MissedTable
+{
+    public:
+        MissedTable(size_t);
+
+        void record(const SockAddr&, SocketType, RuleDir, MissReason);
+
+        /* Write the table in a format where every line starts with a rule
+         * matching the entry, so it's easy to complete the rule set.
+         */
+        void write(FILE*) const;
+
+        void clear(void);
+
+    private:
+        using Key = std::tuple<std::string, uint16_t, SocketType, RuleDir,
+                               MissReason>;
+
+        struct Entry {
+            uint64_t count;
+            time_t first_seen;
+            time_t last_seen;
+        };
+
+        size_t max_entries;
+        std::map<Key, Entry> entries;
+        uint64_t untracked;
+};
+
+#endif
@@ -1,35 +1,692 @@
 // SPDX-License-Identifier: LGPL-3.0-only
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <climits>
+#include <cstdarg>
+#include <ctime>
 #include <queue>
 #include <unordered_map>
 #include <variant>
 #include <memory>
 #include <mutex>
 
+#include <alloca.h>
 #include <arpa/inet.h>
+#include <dlfcn.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
-#ifndef WRAP_SYM
+/* The library for embedding is built with hidden visibility, so only the
+ * wrappers, which get an "ip2unix_" prefix there, are visible.
+ */
+#ifdef EMBEDDED
+#define WRAP_SYM(x) ip2unix_##x [[gnu::visibility("default")]]
+#elif !defined(WRAP_SYM)
 #define WRAP_SYM(x) x
 #endif
 
+#include "clock.hh"
+#include "initprio.hh"
 #include "rules.hh"
 #include "realcalls.hh"
 #include "socket.hh"
+#include "logfilter.hh"
 #include "logging.hh"
+#include "metrics.hh"
+#include "missed.hh"
 #include "serial.hh"
+#include "socketmask.hh"
+#include "stats.hh"
+#include "trace.hh"
+
+/* Whether rules are passed at runtime via environment variables. */
+#if !defined(EMBEDDED) && !defined(BAKED_RULES)
+#define RULES_FROM_ENV
+#include "ruleimage.hh"
+#endif
+
+/* Used to compile out handling of features not used by baked-in rules. */
+#ifdef BAKED_RULES
+#define RULES_USE(feature) (Baked::USES_##feature)
+#else
+#define RULES_USE(feature) true
+#endif
 
 #ifdef SYSTEMD_SUPPORT
 #include "systemd.hh"
 #endif
 
+#ifdef HAS_IO_URING
+#include <sys/syscall.h>
+#include "iouring.hh"
+#endif
+
+#ifdef HAS_IO_URING
+static void reap_uring(void);
+#else
+static inline void reap_uring(void) {}
+#endif
+
+#ifdef EMBEDDED
+#include "ip2unix.h"
+#else
+#include "execfilter.hh"
+#endif
+
 static std::mutex g_rules_mutex;
 
 static std::shared_ptr<const std::vector<Rule>> g_rules = nullptr;
 
+#ifdef RULES_FROM_ENV
+/* If the rules have been passed as a compiled image, they're used in place
+ * instead of g_rules, see init_rules().
+ */
+static std::optional<RuleImage::Image> g_image = std::nullopt;
+static int g_image_fd = -1;
+#endif
+
+/* Host names used by rules and the synthetic addresses they resolve to,
+ * which is only populated on the first lookup, see resolve_host().
+ */
+static std::optional<std::unordered_map<std::string, std::string>> g_hosts;
+
+/* The combinations of socket domain, type and direction the rules can match,
+ * which is SOCKET_MASK_UNKNOWN until the rules have been initialised. Since
+ * every bit is set in that case, every socket is considered as possibly
+ * matching until then.
+ */
+constexpr SocketMask::Mask SOCKET_MASK_UNKNOWN = UINT32_MAX;
+static std::atomic<SocketMask::Mask> g_socket_mask = SOCKET_MASK_UNKNOWN;
+
+#ifndef EMBEDDED
+/* How often each rule has matched if __IP2UNIX_HITS_FILE or
+ * __IP2UNIX_METRICS_FILE is set, see init_hits() and init_reports().
+ */
+static std::vector<uint64_t> g_hits;
+
+/* Connections and bindings that haven't been converted if
+ * __IP2UNIX_MISSED_FILE is set, see init_reports().
+ */
+static std::optional<MissedTable> g_missed = std::nullopt;
+
+/* Set by the handler for the signal in __IP2UNIX_REPORT_SIGNAL. */
+static std::atomic<bool> g_report_requested = false;
+
+/* The log control file, which is reloaded along with writing the reports,
+ * see load_log_control().
+ */
+static const char *g_log_control = nullptr;
+
+/* The segment statistics are published to if __IP2UNIX_STATS is set, along
+ * with whether it still needs to be created (eg. after fork()), the monotonic
+ * time in nanoseconds of the next update and whether a thread is currently
+ * publishing, see publish_stats().
+ */
+static std::atomic<Stats::Segment*> g_stats = nullptr;
+static std::atomic<bool> g_stats_pending = false;
+static std::atomic<uint64_t> g_stats_next = 0;
+static std::atomic<bool> g_stats_busy = false;
+#endif
+
 using RuleMatch = std::optional<std::pair<size_t, const Rule>>;
 
+static void set_rules(const std::vector<Rule> &rules)
+{
+#ifdef SYSTEMD_SUPPORT
+    for (const Rule &rule : rules) {
+        if (!RULES_USE(SOCKET_ACTIVATION) || !rule.socket_activation)
+            continue;
+
+        Systemd::init(rules);
+        break;
+    }
+#endif
+
+    g_rules = std::make_shared<std::vector<Rule>>(rules);
+    g_hosts = std::nullopt;
+    g_socket_mask.store(SocketMask::for_rules(rules),
+                        std::memory_order_relaxed);
+}
+
+static size_t rule_count(void);
+
+#ifndef EMBEDDED
+/* The maximum number of distinct entries in the missed traffic report. */
+#define MAX_MISSED_ENTRIES 4096
+
+static FILE *open_report(const char *var, const char *what)
+{
+    const char *path = getenv(var);
+    if (path == nullptr)
+        return nullptr;
+
+    FILE *fp = fopen(path, "ae");
+    if (fp == nullptr)
+        LOG(ERROR) << "Unable to open " << what << " \"" << path << "\".";
+    return fp;
+}
+
+static void write_reports(void)
+{
+    std::scoped_lock<std::mutex> lock(g_rules_mutex);
+    FILE *fp;
+
+    if (g_missed && (fp = open_report("__IP2UNIX_MISSED_FILE",
+                                      "missed traffic report")) != nullptr) {
+        g_missed->write(fp);
+        fclose(fp);
+    }
+
+    if (Metrics::enabled.load(std::memory_order_relaxed) &&
+        (fp = open_report("__IP2UNIX_METRICS_FILE",
+                          "metrics report")) != nullptr) {
+        Metrics::write(fp);
+        for (size_t pos = 0; pos < g_hits.size(); ++pos) {
+            if (g_hits[pos] > 0)
+                fprintf(fp, "rule\t%zu\t%" PRIu64 "\n", pos + 1, g_hits[pos]);
+        }
+        fclose(fp);
+    }
+}
+
+/* Unlike the reports, the trace can be written from within the handler. */
+static void request_report(int)
+{
+    g_report_requested.store(true, std::memory_order_relaxed);
+    Trace::dump();
+}
+
+/* The minimum time between updates of the published statistics. */
+#define STATS_INTERVAL_NS 100000000
+
+static void fill_socket_entry(Stats::SocketEntry &entry,
+                              const Socket::Summary &sock)
+{
+    entry.fd = sock.fd;
+    entry.type = static_cast<uint8_t>(sock.type);
+    entry.flags = 0;
+    if (sock.is_unix)
+        entry.flags |= Stats::CONVERTED;
+    if (sock.is_blackhole)
+        entry.flags |= Stats::BLACKHOLED;
+
+    snprintf(entry.path, sizeof entry.path, "%s",
+             sock.sockpath.value_or("").c_str());
+
+    std::optional<std::string> host;
+    std::optional<uint16_t> port;
+    if (sock.peer) {
+        host = sock.peer->get_host();
+        port = sock.peer->get_port();
+    }
+
+    if (!host || !port)
+        entry.peer[0] = '\0';
+    else if (sock.peer->ss_family == AF_INET6)
+        snprintf(entry.peer, sizeof entry.peer, "[%s]:%u", host->c_str(),
+                 *port);
+    else
+        snprintf(entry.peer, sizeof entry.peer, "%s:%u", host->c_str(),
+                 *port);
+}
+
+/*
+ * Publish the current statistics at most every STATS_INTERVAL_NS. Nothing in
+ * here ever waits for a lock, so if another thread is already publishing or
+ * the rules or sockets are locked, the update or the respective part of it is
+ * skipped.
+ */
+static void publish_stats(void)
+{
+    Stats::Segment *segment = g_stats.load(std::memory_order_acquire);
+    if (segment == nullptr && !g_stats_pending.load(std::memory_order_relaxed))
+        return;
+    if (segment != nullptr && segment->pid != getpid())
+        return;
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC_COARSE);
+    if (now < g_stats_next.load(std::memory_order_relaxed) ||
+        g_stats_busy.exchange(true, std::memory_order_acquire))
+        return;
+
+    g_stats_next.store(now + STATS_INTERVAL_NS, std::memory_order_relaxed);
+
+    /* The segment might have been removed in the meantime. */
+    segment = g_stats.load(std::memory_order_acquire);
+    if (segment == nullptr && !g_stats_pending.load(std::memory_order_relaxed)) {
+        g_stats_busy.store(false, std::memory_order_release);
+        return;
+    }
+
+    if (segment == nullptr) {
+        if ((segment = Stats::create(getpid())) == nullptr)
+            LOG(ERROR) << "Unable to create statistics segment in \""
+                       << Stats::runtime_dir() << "\": " << strerror(errno);
+        g_stats.store(segment, std::memory_order_release);
+        g_stats_pending.store(false, std::memory_order_relaxed);
+        if (segment == nullptr) {
+            g_stats_busy.store(false, std::memory_order_release);
+            return;
+        }
+    }
+
+    /* Only used by the thread holding g_stats_busy and too large for the
+     * stack of some threads.
+     */
+    static Stats::Data data;
+
+    data.updated = static_cast<uint64_t>(time(nullptr));
+    Metrics::sum(&data.metrics);
+
+    {
+        std::unique_lock<std::mutex> lock(g_rules_mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            data.rule_count = static_cast<uint32_t>(g_hits.size());
+            std::copy_n(g_hits.begin(),
+                        std::min(g_hits.size(), Stats::MAX_RULES),
+                        data.rule_hits);
+        }
+    }
+
+    uint32_t socket_count = 0, converted_count = 0, entry_count = 0;
+    bool visited = Socket::try_visit([&](const Socket::Summary &sock) {
+        ++socket_count;
+        if (sock.is_unix)
+            ++converted_count;
+        if (entry_count < Stats::MAX_SOCKETS)
+            fill_socket_entry(data.sockets[entry_count++], sock);
+    });
+
+    if (visited) {
+        data.socket_count = socket_count;
+        data.converted_count = converted_count;
+        data.entry_count = entry_count;
+    }
+
+    Stats::publish(segment, data);
+    g_stats_busy.store(false, std::memory_order_release);
+}
+
+/*
+ * Wait until no other thread is publishing, so that the segment can be
+ * unmapped. Publishing never waits for anything, so this doesn't take long.
+ */
+static void lock_stats(void)
+{
+    while (g_stats_busy.exchange(true, std::memory_order_acquire))
+        sched_yield();
+}
+
+static void remove_stats(void)
+{
+    lock_stats();
+    g_stats_pending.store(false);
+    Stats::Segment *segment = g_stats.exchange(nullptr);
+    if (segment != nullptr)
+        Stats::remove(segment);
+    g_stats_busy.store(false, std::memory_order_release);
+}
+
+/*
+ * The program executed next gets a segment of its own if it's run with ip2unix
+ * as well, so ours must not stay around with the same process ID. If exec()
+ * fails, the segment is created again by the next publish_stats(). The trace
+ * and queued log messages on the other hand would be lost, so they're written
+ * before.
+ *
+ * After vfork(), the child shares our memory without having run the fork
+ * handlers, so the segment, the trace and the log queue still belong to the
+ * parent in that case and are left alone.
+ */
+static void prepare_exec(void)
+{
+    Logger::flush();
+    Trace::dump();
+
+    Stats::Segment *segment = g_stats.load();
+    if (segment == nullptr || segment->pid != getpid())
+        return;
+
+    lock_stats();
+    if ((segment = g_stats.exchange(nullptr)) != nullptr) {
+        Stats::remove(segment);
+        g_stats_pending.store(true);
+    }
+    g_stats_busy.store(false, std::memory_order_release);
+}
+
+static void load_log_control(void)
+{
+    if (g_log_control == nullptr)
+        return;
+
+    std::string error;
+    if (!LogFilter::load(g_log_control, &error))
+        LOG(ERROR) << "Unable to load log control file: " << error;
+}
+
+/*
+ * Writing the reports from within the signal handler isn't safe, so they're
+ * written by the next intercepted call after the signal has been received.
+ * This must not be called with g_rules_mutex held.
+ */
+static inline void poll_reports(void)
+{
+    if (g_report_requested.load(std::memory_order_relaxed) &&
+        g_report_requested.exchange(false)) {
+        write_reports();
+        load_log_control();
+    }
+
+    publish_stats();
+}
+
+/* Everything of the parent is already reported by the parent itself. */
+static void reset_reports(void)
+{
+    if (g_missed)
+        g_missed->clear();
+
+    if (Metrics::enabled.load(std::memory_order_relaxed)) {
+        Metrics::reset();
+        std::fill(g_hits.begin(), g_hits.end(), 0);
+    }
+
+    /* The segment of the parent is still mapped, but it's not ours, so the
+     * child only gets one once it's actually using sockets.
+     */
+    Stats::Segment *segment = g_stats.exchange(nullptr);
+    if (segment != nullptr) {
+        munmap(segment, sizeof(Stats::Segment));
+        g_stats_busy.store(false);
+        g_stats_next.store(0);
+        g_stats_pending.store(true);
+    }
+
+    Trace::reset();
+}
+
+/* Needs to be called after the rules have been set. */
+static void init_reports(void)
+{
+    bool want_missed = getenv("__IP2UNIX_MISSED_FILE") != nullptr;
+    bool want_metrics = getenv("__IP2UNIX_METRICS_FILE") != nullptr;
+    bool want_stats = getenv("__IP2UNIX_STATS") != nullptr;
+    const char *trace_file = getenv("__IP2UNIX_TRACE_FILE");
+    g_log_control = getenv("__IP2UNIX_LOG_CONTROL");
+
+    if (!want_missed && !want_metrics && !want_stats &&
+        trace_file == nullptr && g_log_control == nullptr)
+        return;
+
+    load_log_control();
+
+    if (want_missed) {
+        g_missed.emplace(MAX_MISSED_ENTRIES);
+
+        /* Sockets are only seen by match_rule() if they are registered, even
+         * if none of the rules can possibly match them.
+         */
+        g_socket_mask.store(SocketMask::ALL, std::memory_order_relaxed);
+    }
+
+    if (want_metrics || want_stats) {
+        if (g_hits.empty())
+            g_hits.assign(rule_count(), 0);
+        Metrics::enable();
+    }
+
+    if (want_metrics && getenv("__IP2UNIX_PERF_COUNTERS") != nullptr)
+        Metrics::enable_perf();
+
+    if (want_stats) {
+        Stats::Segment *segment = Stats::create(getpid());
+        if (segment == nullptr) {
+            LOG(ERROR) << "Unable to create statistics segment in \""
+                       << Stats::runtime_dir() << "\": " << strerror(errno);
+        } else {
+            g_stats.store(segment);
+            atexit(remove_stats);
+        }
+    }
+
+    if (trace_file != nullptr) {
+        bool continuous = getenv("__IP2UNIX_TRACE_CONTINUOUS") != nullptr;
+        Trace::enable(trace_file, continuous);
+        atexit(Trace::dump);
+    }
+
+    atexit(write_reports);
+    pthread_atfork(nullptr, nullptr, reset_reports);
+
+    const char *signum = getenv("__IP2UNIX_REPORT_SIGNAL");
+    if (signum == nullptr)
+        return;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = request_report;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(atoi(signum), &sa, nullptr) == -1)
+        LOG(ERROR) << "Unable to install handler for report signal "
+                   << signum << ": " << strerror(errno);
+}
+#endif
+
+#ifdef EMBEDDED
+static void init_rules(void)
+{
+    /* Until rules are loaded via ip2unix_load_rules(), no socket is handled
+     * and every call is passed through as-is.
+     */
+    if (g_rules == nullptr)
+        g_rules = std::make_shared<std::vector<Rule>>();
+}
+
+extern "C" int ip2unix_load_rules(const char *data, size_t len)
+{
+    std::vector<std::string_view> rule_args;
+    std::vector<Rule> rules;
+
+    split_rule_args(std::string_view(data, len), rule_args);
+
+    size_t rulepos = 0;
+    for (std::string_view arg : rule_args) {
+        std::string error;
+        std::optional<Rule> rule = parse_rule_arg(++rulepos, arg, &error);
+        if (!rule) {
+            std::cerr << error;
+            errno = EINVAL;
+            return -1;
+        }
+        rules.push_back(rule.value());
+    }
+
+    std::optional<std::string> error = check_hosts(rules);
+    if (error) {
+        std::cerr << *error << std::endl;
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::scoped_lock<std::mutex> lock(g_rules_mutex);
+    set_rules(rules);
+    LOG(INFO) << "Loaded " << rules.size() << " rule(s).";
+    return 0;
+}
+#elif defined(BAKED_RULES)
+static void init_rules(void)
+{
+    if (g_rules != nullptr)
+        return;
+
+    std::vector<Rule> rules;
+    rules.reserve(Baked::RULES.size());
+    for (const Baked::RuleData &data : Baked::RULES)
+        rules.push_back(Baked::to_rule(data));
+
+    set_rules(rules);
+    init_reports();
+}
+#else
+/*
+ * Parsing YAML rule files requires yaml-cpp, which we don't want to load into
+ * every program, so the parser is only loaded on demand from a module that's
+ * installed alongside this library.
+ */
+static std::optional<std::vector<Rule>> load_rule_file(const char *file)
+{
+    Dl_info info;
+
+    if (dladdr(reinterpret_cast<void*>(load_rule_file), &info) == 0 ||
+        info.dli_fname == nullptr) {
+        LOG(FATAL) << "Unable to determine path of the ip2unix library.";
+        return std::nullopt;
+    }
+
+    std::string path(info.dli_fname);
+    std::string::size_type last_slash = path.rfind('/');
+    path.erase(last_slash == std::string::npos ? 0 : last_slash + 1);
+    path += "libip2unix-yaml.so";
+
+    void *module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (module == nullptr) {
+        LOG(FATAL) << "Unable to load YAML rule parser: " << dlerror();
+        return std::nullopt;
+    }
+
+    using ParseFun = bool(const char*, std::vector<Rule>*);
+    void *sym = dlsym(module, "ip2unix_parse_rule_file");
+    if (sym == nullptr) {
+        LOG(FATAL) << "Unable to find YAML rule parser: " << dlerror();
+        return std::nullopt;
+    }
+
+    std::vector<Rule> rules;
+    if (!reinterpret_cast<ParseFun*>(sym)(file, &rules))
+        return std::nullopt;
+
+    return rules;
+}
+
+/*
+ * Try to use the compiled rule image passed via the file descriptor in
+ * __IP2UNIX_RULE_IMAGE, which doesn't need any parsing at all. If the file
+ * descriptor has been closed by a parent process, the rules are decoded from
+ * __IP2UNIX_RULES instead, if available.
+ */
+static bool init_rule_image(const char *fdstr)
+{
+    char *end;
+    long fd = strtol(fdstr, &end, 10);
+    if (*fdstr == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX) {
+        LOG(ERROR) << "Invalid file descriptor \"" << fdstr << "\" in"
+                   << " __IP2UNIX_RULE_IMAGE.";
+        return false;
+    }
+
+    std::string err;
+    std::optional<RuleImage::Image> image =
+        RuleImage::map(static_cast<int>(fd), &err);
+    if (!image) {
+        if (getenv("__IP2UNIX_RULES") == nullptr)
+            LOG(ERROR) << "Unable to use rule image: " << err;
+        else
+            LOG(DEBUG) << "Unable to use rule image, using __IP2UNIX_RULES"
+                       << " instead: " << err;
+        return false;
+    }
+
+#ifdef SYSTEMD_SUPPORT
+    if (image->has_socket_activation())
+        Systemd::init(image->get_all());
+#endif
+
+    g_image = image;
+    g_image_fd = static_cast<int>(fd);
+    g_rules = std::make_shared<std::vector<Rule>>();
+    g_socket_mask.store(image->socket_mask(), std::memory_order_relaxed);
+    LOG(DEBUG) << "Using rule image with " << image->size() << " rule(s)"
+               << " from fd " << fd << '.';
+    return true;
+}
+
+static void write_hits(void)
+{
+    std::scoped_lock<std::mutex> lock(g_rules_mutex);
+    const char *path = getenv("__IP2UNIX_HITS_FILE");
+
+    if (g_hits.empty() || path == nullptr)
+        return;
+
+    FILE *fp = fopen(path, "ae");
+    if (fp == nullptr) {
+        LOG(ERROR) << "Unable to open hit count file \"" << path << "\".";
+        return;
+    }
+
+    fprintf(fp, "# %zu\n", g_hits.size());
+    for (size_t pos = 0; pos < g_hits.size(); ++pos) {
+        if (g_hits[pos] > 0)
+            fprintf(fp, "%zu %" PRIu64 "\n", pos + 1, g_hits[pos]);
+    }
+    fclose(fp);
+}
+
+/* Hits of the parent are already written by the parent itself. */
+static void reset_hits(void)
+{
+    std::fill(g_hits.begin(), g_hits.end(), 0);
+}
+
+static void init_hits(void)
+{
+    if (getenv("__IP2UNIX_HITS_FILE") == nullptr)
+        return;
+
+    g_hits.assign(rule_count(), 0);
+
+    /* Same as for the report of missed sockets, hits can only be recorded for
+     * sockets that have been registered in the first place.
+     */
+    g_socket_mask.store(SocketMask::ALL, std::memory_order_relaxed);
+
+    atexit(write_hits);
+    pthread_atfork(nullptr, nullptr, reset_hits);
+}
+
+/*
+ * Get the serialised rules from __IP2UNIX_RULES along with its continuations
+ * in __IP2UNIX_RULES_1, __IP2UNIX_RULES_2 and so on, which are used if the
+ * rules don't fit into a single environment variable.
+ */
+static std::optional<std::string> get_env_rules(void)
+{
+    const char *first = getenv("__IP2UNIX_RULES");
+    if (first == nullptr)
+        return std::nullopt;
+
+    std::string data(first);
+    for (size_t part = 1;; ++part) {
+        std::string name = "__IP2UNIX_RULES_" + std::to_string(part);
+        const char *next = getenv(name.c_str());
+        if (next == nullptr)
+            break;
+        data += next;
+    }
+
+    return data;
+}
+
 static void init_rules(void)
 {
     if (g_rules != nullptr)
@@ -37,10 +694,18 @@ static void init_rules(void)
 
     std::optional<std::vector<Rule>> rules;
     const char *rule_source;
+    std::optional<std::string> env_rules;
+
+    if ((rule_source = getenv("__IP2UNIX_RULE_IMAGE")) != nullptr &&
+        init_rule_image(rule_source)) {
+        init_hits();
+        init_reports();
+        return;
+    }
 
-    if ((rule_source = getenv("__IP2UNIX_RULES")) != nullptr) {
+    if ((env_rules = get_env_rules())) {
         rules.emplace();
-        MaybeError err = deserialise(std::string(rule_source), &*rules);
+        MaybeError err = deserialise(*env_rules, &*rules);
         if (err) {
             LOG(FATAL) << "Unable to decode __IP2UNIX_RULES: " << *err;
             _exit(EXIT_FAILURE);
@@ -49,7 +714,7 @@ static void init_rules(void)
         std::cerr << "The use of the IP2UNIX_RULE_FILE environment"
                      " variable is deprecated and will be removed in"
                      " ip2unix version 3.0." << std::endl;
-        rules = parse_rules(std::string(rule_source), true);
+        rules = load_rule_file(rule_source);
     } else {
         LOG(FATAL) << "Unable to find __IP2UNIX_RULES!";
         _exit(EXIT_FAILURE);
@@ -58,32 +723,178 @@ static void init_rules(void)
     if (!rules)
         _exit(EXIT_FAILURE);
 
-#ifdef SYSTEMD_SUPPORT
-    for (const Rule &rule : *rules) {
-        if (!rule.socket_activation)
-            continue;
+    set_rules(rules.value());
+    init_hits();
+    init_reports();
+}
+#endif
 
-        Systemd::init(*rules);
-        break;
+static size_t rule_count(void)
+{
+#ifdef RULES_FROM_ENV
+    if (g_image)
+        return g_image->size();
+#endif
+    return g_rules->size();
+}
+
+#ifndef BAKED_RULES
+static bool rule_matches(const Rule &rule, const SockAddr &addr,
+                         const Socket::Ptr sock, const RuleDir dir)
+{
+    if (rule.direction && rule.direction != dir)
+        return false;
+
+    if (rule.type && sock->type != rule.type)
+        return false;
+
+    if (rule.address && addr.get_host() != rule.address)
+        return false;
+
+    if (rule.port) {
+        std::optional<uint16_t> addrport = addr.get_port();
+        if (addrport && rule.port_end) {
+            if (rule.port.value() > addrport.value())
+                return false;
+            if (rule.port_end < addrport.value())
+                return false;
+        } else if (addrport != rule.port)
+            return false;
     }
+
+    return true;
+}
+
+/*
+ * Return the rule at the given position if it matches the socket address,
+ * type and direction. For compiled rule images, the rule is only
+ * materialised if it actually matches.
+ */
+static std::optional<Rule> get_matching_rule(size_t pos, const SockAddr &addr,
+                                             const Socket::Ptr sock,
+                                             const RuleDir dir)
+{
+#ifdef RULES_FROM_ENV
+    if (g_image) {
+        if (!g_image->matches(pos, addr, sock->type, dir))
+            return std::nullopt;
+        return g_image->get(pos);
+    }
+#endif
+
+    const Rule &rule = (*g_rules)[pos];
+    if (!rule_matches(rule, addr, sock, dir))
+        return std::nullopt;
+    return rule;
+}
+#endif
+
+/*
+ * Whether the given file descriptor must not be closed by the application,
+ * because we still need it ourselves.
+ */
+static bool is_protected_fd(int fd)
+{
+    if (Metrics::is_perf_fd(fd))
+        return true;
+
+    std::scoped_lock<std::mutex> lock(g_rules_mutex);
+    init_rules();
+
+#ifdef RULES_FROM_ENV
+    if (g_image && fd == g_image_fd)
+        return true;
 #endif
 
-    g_rules = std::make_shared<std::vector<Rule>>(rules.value());
+#ifdef SYSTEMD_SUPPORT
+    if (Systemd::has_fd(fd))
+        return true;
+#endif
+
+    return false;
+}
+
+#ifndef EMBEDDED
+/*
+ * If requested via __IP2UNIX_EARLY_INIT, do all the work that would otherwise
+ * happen lazily on the first intercepted call when the library is loaded, so
+ * that the first connection doesn't suffer from additional latency and
+ * configuration errors are reported before the program's main() is run.
+ */
+__attribute__((constructor(INIT_PRIO_EARLY)))
+static void early_init(void)
+{
+    const char *value = getenv("__IP2UNIX_EARLY_INIT");
+    if (value == nullptr || *value == '\0' || *value == '0')
+        return;
+
+    int old_errno = errno;
+
+    /* We run before the standard streams used for logging are guaranteed to
+     * be initialised, so make sure they are.
+     */
+    std::ios_base::Init ios_init;
+
+    real::resolve_all();
+
+    {
+        std::scoped_lock<std::mutex> lock(g_rules_mutex);
+        init_rules();
+        LOG(INFO) << "Initialised " << rule_count() << " rule(s) early.";
+    }
+
+    errno = old_errno;
 }
+#endif
 
 extern "C" const char *WRAP_SYM(__ip2unix__)(void)
 {
     return VERSION;
 }
 
+/*
+ * Whether any of the rules could match a socket with the given domain and
+ * type, so that sockets which can't match are never registered.
+ */
+static bool socket_may_match(int domain, int type)
+{
+    SocketMask::Mask mask = g_socket_mask.load(std::memory_order_relaxed);
+    if (mask == SOCKET_MASK_UNKNOWN) {
+        std::scoped_lock<std::mutex> lock(g_rules_mutex);
+        init_rules();
+        mask = g_socket_mask.load(std::memory_order_relaxed);
+    }
+    return SocketMask::may_match(mask, domain, get_sotype(type));
+}
+
 extern "C" int WRAP_SYM(socket)(int domain, int type, int protocol)
 {
+    METRICS_SCOPE(socket);
     TRACE_CALL("socket", domain, type, protocol);
 
     int fd = real::socket(domain, type, protocol);
-    if (fd != -1 && (domain == AF_INET || domain == AF_INET6))
-        Socket::create(fd, domain, type, protocol);
-    return fd;
+    if (fd == -1 || (domain != AF_INET && domain != AF_INET6))
+        return METRICS_RESULT(fd);
+
+#ifndef EMBEDDED
+    poll_reports();
+#endif
+
+    /* If none of the baked-in rules can match UDP sockets, there is no need
+     * to keep track of them.
+     */
+    int basetype = type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (!RULES_USE(UDP) && basetype != SOCK_STREAM)
+        return METRICS_RESULT(fd);
+
+    if (!socket_may_match(domain, type)) {
+        LOG(DEBUG) << "Not registering socket with fd " << fd << ", because"
+                   << " none of the rules can match it.";
+        return METRICS_RESULT(fd);
+    }
+
+    Socket::create(fd, domain, type, protocol);
+    return METRICS_RESULT(fd);
 }
 
 /*
@@ -93,46 +904,52 @@ extern "C" int WRAP_SYM(socket)(int domain, int type, int protocol)
 extern "C" int WRAP_SYM(setsockopt)(int sockfd, int level, int optname,
                                     const void *optval, socklen_t optlen)
 {
+    METRICS_SCOPE(setsockopt);
     TRACE_CALL("setsockopt", sockfd, level, optname, optval, optlen);
+    reap_uring();
 
-    return Socket::when<int>(sockfd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(sockfd, [&](Socket::Ptr sock) {
         if (sock->rewrite_peer_address)
             return sock->setsockopt(level, optname, optval, optlen);
         else
             return real::setsockopt(sockfd, level, optname, optval, optlen);
     }, [&]() {
         return real::setsockopt(sockfd, level, optname, optval, optlen);
-    });
+    }));
 }
 
 extern "C" int WRAP_SYM(ioctl)(int fd, unsigned long request, void *arg)
 {
+    METRICS_SCOPE(ioctl);
     TRACE_CALL("ioctl", fd, request, arg);
+    reap_uring();
 
-    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(fd, [&](Socket::Ptr sock) {
         if (sock->rewrite_peer_address)
             return sock->ioctl(request, arg);
         else
             return real::ioctl(fd, request, arg);
     }, [&]() {
         return real::ioctl(fd, request, arg);
-    });
+    }));
 }
 
 #ifdef HAS_EPOLL
 extern "C" int WRAP_SYM(epoll_ctl)(int epfd, int op, int fd,
                                    struct epoll_event *event)
 {
+    METRICS_SCOPE(epoll_ctl);
     TRACE_CALL("epoll", epfd, op, fd, event);
+    reap_uring();
 
-    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(fd, [&](Socket::Ptr sock) {
         if (sock->rewrite_peer_address)
             return sock->epoll_ctl(epfd, op, event);
         else
             return real::epoll_ctl(epfd, op, fd, event);
     }, [&]() {
         return real::epoll_ctl(epfd, op, fd, event);
-    });
+    }));
 }
 #endif
 
@@ -143,44 +960,93 @@ extern "C" int WRAP_SYM(epoll_ctl)(int epfd, int op, int fd,
  */
 extern "C" int WRAP_SYM(listen)(int sockfd, int backlog)
 {
+    METRICS_SCOPE(listen);
     TRACE_CALL("listen", sockfd, backlog);
-    return Socket::when<int>(sockfd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(sockfd, [&](Socket::Ptr sock) {
         return sock->listen(backlog);
     }, [&]() {
         return real::listen(sockfd, backlog);
-    });
+    }));
 }
 #endif
 
-static RuleMatch match_rule(const SockAddr &addr, const Socket::Ptr sock,
-                            const RuleDir dir)
+/*
+ * Whether IPv4-mapped and IPv4-compatible IPv6 addresses are matched against
+ * rules as the IPv4 address they contain, which can be disabled via
+ * __IP2UNIX_NO_UNMAP_IPV4.
+ */
+static bool unmap_ipv4_enabled(void)
 {
-    init_rules();
+    static const bool enabled = getenv("__IP2UNIX_NO_UNMAP_IPV4") == nullptr;
+    return enabled;
+}
 
-    size_t rulepos = 0;
-    for (auto &rule : *g_rules) {
-        if (rule.direction && rule.direction != dir)
-            continue;
+/* Record connections and bindings that aren't converted, if requested. */
+static inline RuleMatch missed([[maybe_unused]] const SockAddr &addr,
+                               [[maybe_unused]] const Socket::Ptr sock,
+                               [[maybe_unused]] const RuleDir dir,
+                               [[maybe_unused]] MissReason reason)
+{
+#ifndef EMBEDDED
+    if (g_missed)
+        g_missed->record(addr, sock->type, dir, reason);
+#endif
+    return std::nullopt;
+}
 
-        if (rule.type && sock->type != rule.type)
-            continue;
+static RuleMatch find_rule(const SockAddr &orig_addr, const Socket::Ptr sock,
+                           const RuleDir dir)
+{
+    init_rules();
 
-        if (rule.address && addr.get_host() != rule.address)
+    /* Only the address used for matching is changed, so everything the
+     * application gets to see (eg. via getpeername()) is still in the
+     * address family of its socket.
+     */
+    std::optional<SockAddr> unmapped = std::nullopt;
+    if (unmap_ipv4_enabled())
+        unmapped = orig_addr.unmap_ipv4();
+    const SockAddr &addr = unmapped ? *unmapped : orig_addr;
+
+#ifdef BAKED_RULES
+    std::optional<size_t> found = Baked::match(addr, sock->type, dir);
+    if (!found)
+        return missed(addr, sock, dir, MissReason::UNMATCHED);
+    if (!g_hits.empty())
+        ++g_hits[*found];
+    if ((*g_rules)[*found].ignore)
+        return missed(addr, sock, dir, MissReason::IGNORED);
+    return std::make_pair(*found, (*g_rules)[*found]);
+#else
+    /* The socket might have been registered before the rules were known, so
+     * avoid going through all of the rules if none of them can match. Hits
+     * are recorded for every matching rule though, including the ones that
+     * don't contribute to the socket mask.
+     */
+    bool count_hits = false;
+#ifndef EMBEDDED
+    count_hits = !g_hits.empty();
+#endif
+    SocketMask::Mask mask = g_socket_mask.load(std::memory_order_relaxed);
+    if (!count_hits && !SocketMask::may_match(mask, addr.ss_family,
+                                              sock->type, dir))
+        return missed(addr, sock, dir, MissReason::UNMATCHED);
+
+    size_t count = rule_count();
+    for (size_t rulepos = 0; rulepos < count; ++rulepos) {
+        std::optional<Rule> found = get_matching_rule(rulepos, addr, sock, dir);
+        if (!found)
             continue;
 
-        if (rule.port) {
-            std::optional<uint16_t> addrport = addr.get_port();
-            if (addrport && rule.port_end) {
-                if (rule.port.value() > addrport.value())
-                    continue;
-                if (rule.port_end < addrport.value())
-                    continue;
-            } else if (addrport != rule.port)
-                continue;
-        }
+#ifndef EMBEDDED
+        if (!g_hits.empty())
+            ++g_hits[rulepos];
+#endif
+
+        const Rule &rule = found.value();
 
         if (rule.ignore)
-            return std::nullopt;
+            return missed(addr, sock, dir, MissReason::IGNORED);
 
 #ifdef SYSTEMD_SUPPORT
         if (rule.socket_activation)
@@ -192,7 +1058,31 @@ static RuleMatch match_rule(const SockAddr &addr, const Socket::Ptr sock,
         return std::make_pair(rulepos, rule);
     }
 
-    return std::nullopt;
+    return missed(addr, sock, dir, MissReason::UNMATCHED);
+#endif
+}
+
+/*
+ * Find the rule for the given address and fire the "rule_match" probe with
+ * the direction (0 for incoming, 1 for outgoing), the socket type (0 for TCP,
+ * 1 for UDP), the address as a pointer to struct sockaddr and the index of the
+ * matching rule or -1 if the socket is not handled by any rule. The socket is
+ * also selected by the log filter if it matches, see logfilter.hh.
+ */
+static inline RuleMatch match_rule(const SockAddr &addr, const Socket::Ptr sock,
+                                   const RuleDir dir)
+{
+    RuleMatch result = find_rule(addr, sock, dir);
+    PROBE(rule_match, dir == RuleDir::OUTGOING ? 1 : 0,
+          static_cast<int>(sock->type), addr.cast(),
+          result ? static_cast<long>(result->first) : -1L);
+    if (LogFilter::active.load(std::memory_order_relaxed)) {
+        std::optional<size_t> rulenum = std::nullopt;
+        if (result)
+            rulenum = result->first + 1;
+        LogFilter::match_socket(sock->get_fd(), rulenum, addr.get_port());
+    }
+    return result;
 }
 
 /*
@@ -206,6 +1096,10 @@ static inline int bind_connect(SockFun &&sockfun, RealFun &&realfun,
     if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
         return std::invoke(realfun, fd, addr, addrlen);
 
+#ifndef EMBEDDED
+    poll_reports();
+#endif
+
     return Socket::when<int>(fd, [&](Socket::Ptr sock) {
         SockAddr inaddr(addr);
 
@@ -222,135 +1116,683 @@ static inline int bind_connect(SockFun &&sockfun, RealFun &&realfun,
 
         std::scoped_lock<std::mutex> lock(g_rules_mutex);
 
-        RuleMatch rule = match_rule(inaddr, sock, dir);
+        RuleMatch rule = match_rule(inaddr, sock, dir);
+
+        if (!rule) {
+            LOG(DEBUG) << "Socket " << fd << " doesn't match any rule or "
+                       << "is explicitly ignored, unregistering.";
+            sock->unregister();
+            return std::invoke(realfun, fd, addr, addrlen);
+        }
+
+        if (RULES_USE(REJECT) && rule->second.reject) {
+            Metrics::count(Metrics::Counter::REJECTS);
+            errno = rule->second.reject_errno.value_or(EACCES);
+            return -1;
+        }
+
+        if (RULES_USE(BLACKHOLE) && rule->second.blackhole) {
+            sock->blackhole();
+            return std::invoke(sockfun, sock, inaddr, "");
+        }
+
+#ifdef SYSTEMD_SUPPORT
+        if (RULES_USE(SOCKET_ACTIVATION) && rule->second.socket_activation) {
+            std::optional<Systemd::FdInfo> fdinfo =
+                Systemd::acquire_fdinfo_for_rulepos(rule->first);
+            if (fdinfo) {
+                return sock->activate(inaddr, fdinfo.value().first,
+                                      fdinfo.value().second);
+            } else {
+                LOG(WARNING) << "Systemd file descriptor queue empty, "
+                             << "blackholing socket with fd " << fd << '.';
+                sock->blackhole();
+                return std::invoke(sockfun, sock, inaddr, "");
+            }
+        }
+#endif
+
+        return std::invoke(sockfun, sock, inaddr, *rule->second.socket_path);
+    }, [&]() {
+        return std::invoke(realfun, fd, addr, addrlen);
+    });
+}
+
+extern "C" int WRAP_SYM(bind)(int fd, const struct sockaddr *addr,
+                              socklen_t addrlen)
+{
+    METRICS_SCOPE(bind);
+    TRACE_CALL("bind", fd, addr, addrlen);
+    return METRICS_RESULT(bind_connect(&Socket::bind, real::bind,
+                                       RuleDir::INCOMING, fd, addr, addrlen));
+}
+
+extern "C" int WRAP_SYM(connect)(int fd, const struct sockaddr *addr,
+                                 socklen_t addrlen)
+{
+    METRICS_SCOPE(connect);
+    TRACE_CALL("connect", fd, addr, addrlen);
+    return METRICS_RESULT(bind_connect(&Socket::connect, real::connect,
+                                       RuleDir::OUTGOING, fd, addr, addrlen));
+}
+
+static int handle_accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
+                         int flags)
+{
+#ifndef EMBEDDED
+    poll_reports();
+#endif
+
+    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
+        if (sock->rewrite_peer_address) {
+            int accfd = real::accept4(fd, nullptr, nullptr, flags);
+            if (accfd > 0)
+                return sock->accept(accfd, addr, addrlen);
+            else
+                return accfd;
+        } else {
+            return real::accept4(fd, addr, addrlen, flags);
+        }
+    }, [&]() {
+        return real::accept4(fd, addr, addrlen, flags);
+    });
+}
+
+extern "C" int WRAP_SYM(accept)(int fd, struct sockaddr *addr,
+                                socklen_t *addrlen)
+{
+    METRICS_SCOPE(accept);
+    TRACE_CALL("accept", fd, addr, addrlen);
+    return METRICS_RESULT(handle_accept(fd, addr, addrlen, 0));
+}
+
+extern "C" int WRAP_SYM(accept4)(int fd, struct sockaddr *addr,
+                                 socklen_t *addrlen, int flags)
+{
+    METRICS_SCOPE(accept4);
+    TRACE_CALL("accept4", fd, addr, addrlen, flags);
+    return METRICS_RESULT(handle_accept(fd, addr, addrlen, flags));
+}
+
+/*
+ * Look up the synthetic address for a host name used in rules, so that
+ * connections to it can be matched by address without querying a resolver.
+ */
+static std::optional<std::string> resolve_host(const char *name)
+{
+    if (!RULES_USE(HOSTS) || name == nullptr)
+        return std::nullopt;
+
+    std::scoped_lock<std::mutex> lock(g_rules_mutex);
+    init_rules();
+
+    if (!g_hosts) {
+#ifdef RULES_FROM_ENV
+        std::vector<Rule> rules = g_image ? g_image->get_all() : *g_rules;
+#else
+        const std::vector<Rule> &rules = *g_rules;
+#endif
+        g_hosts.emplace();
+        for (const Rule &rule : rules) {
+            if (rule.host)
+                g_hosts->emplace(*rule.host, *rule.address);
+        }
+    }
+
+    if (g_hosts->empty())
+        return std::nullopt;
+
+    std::string host(name);
+    if (!host.empty() && host.back() == '.')
+        host.pop_back();
+    for (char &c : host)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+    auto found = g_hosts->find(host);
+    if (found == g_hosts->end())
+        return std::nullopt;
+
+    LOG(DEBUG) << "Resolved host name " << name << " to " << found->second
+               << " without querying a resolver.";
+    return found->second;
+}
+
+extern "C" int WRAP_SYM(getaddrinfo)(const char *node, const char *service,
+                                     const struct addrinfo *hints,
+                                     struct addrinfo **res)
+{
+    METRICS_SCOPE(getaddrinfo);
+    TRACE_CALL("getaddrinfo", node == nullptr ? "NULL" : node,
+               service == nullptr ? "NULL" : service);
+
+    std::optional<std::string> addr = resolve_host(node);
+    if (!addr)
+        return METRICS_RESULT(real::getaddrinfo(node, service, hints, res));
+
+    /* The synthetic address isn't configured on any interface, so
+     * AI_ADDRCONFIG must not be used to filter it out.
+     */
+    struct addrinfo numeric;
+    memset(&numeric, 0, sizeof numeric);
+    if (hints != nullptr)
+        numeric = *hints;
+    numeric.ai_flags &= ~AI_ADDRCONFIG;
+    numeric.ai_flags |= AI_NUMERICHOST;
+
+    /* The synthetic address is an IPv4 address, so if only IPv6 addresses
+     * are requested, return its IPv4-mapped form.
+     */
+    if (numeric.ai_family == AF_INET6)
+        addr = "::ffff:" + *addr;
+
+    int ret = real::getaddrinfo(addr->c_str(), service, &numeric, res);
+    if (ret == 0 && (*res)->ai_canonname != nullptr) {
+        free((*res)->ai_canonname);
+        (*res)->ai_canonname = strdup(node);
+    }
+    return METRICS_RESULT(ret);
+}
+
+extern "C" struct hostent *WRAP_SYM(gethostbyname)(const char *name)
+{
+    METRICS_SCOPE(gethostbyname);
+    TRACE_CALL("gethostbyname", name == nullptr ? "NULL" : name);
+
+    std::optional<std::string> addr = resolve_host(name);
+    return METRICS_RESULT(real::gethostbyname(addr ? addr->c_str() : name));
+}
+
+extern "C" struct hostent *WRAP_SYM(gethostbyname2)(const char *name, int af)
+{
+    METRICS_SCOPE(gethostbyname2);
+    TRACE_CALL("gethostbyname2", name == nullptr ? "NULL" : name, af);
+
+    std::optional<std::string> addr = resolve_host(name);
+    if (addr && af == AF_INET6)
+        addr = "::ffff:" + *addr;
+    return METRICS_RESULT(real::gethostbyname2(addr ? addr->c_str() : name,
+                                               af));
+}
+
+#ifndef EMBEDDED
+/*
+ * If __IP2UNIX_EXEC_FILTER is set, programs executed by the wrapped program
+ * only inherit the preload library if their path matches one of the patterns
+ * in it. The variable is read when the library is loaded rather than on the
+ * first exec call, so that the ip2unix wrapper itself, which sets it right
+ * before executing the program, isn't affected.
+ */
+static std::optional<ExecFilter> g_exec_filter = std::nullopt;
+
+__attribute__((constructor(INIT_PRIO_EARLY)))
+static void init_exec_filter(void)
+{
+    const char *value = getenv("__IP2UNIX_EXEC_FILTER");
+    if (value == nullptr)
+        return;
+
+    std::ios_base::Init ios_init;
+
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void*>(init_exec_filter), &info) == 0 ||
+        info.dli_fname == nullptr) {
+        LOG(ERROR) << "Unable to determine path of preload library,"
+                   << " not filtering executed programs.";
+        return;
+    }
+
+    std::vector<std::string> patterns;
+    MaybeError err = deserialise(value, &patterns);
+    if (err) {
+        LOG(ERROR) << "Unable to decode __IP2UNIX_EXEC_FILTER: " << *err;
+        return;
+    }
+
+    g_exec_filter.emplace(patterns, info.dli_fname);
+}
+
+/*
+ * Call the given exec function either with the original environment or, if
+ * the program doesn't match the exec filter, with a copy of the environment
+ * that no longer loads the preload library and has no rules. The copy is
+ * kept on the stack, since the heap of a child created via vfork() still
+ * belongs to the parent.
+ */
+template <typename ExecFun>
+static inline auto exec_filtered(const char *file, bool search_path,
+                                 char *const envp[], ExecFun &&execfun)
+{
+    if (!g_exec_filter || file == nullptr)
+        return execfun(envp);
+
+    std::string path = ExecFilter::find_program(file, search_path);
+    if (g_exec_filter->matches(path)) {
+        LOG(DEBUG) << "Program " << path << " matches exec filter.";
+        return execfun(envp);
+    }
+
+    LOG(DEBUG) << "Executing " << path << " without ip2unix, because it"
+               << " doesn't match the exec filter.";
+
+    size_t vars, bytes;
+    ExecFilter::env_size(envp, &vars, &bytes);
+    char **newenvp = static_cast<char**>(alloca(vars * sizeof(char*)));
+    char *buf = static_cast<char*>(alloca(bytes));
+    g_exec_filter->strip_env(envp, newenvp, buf);
+    return execfun(newenvp);
+}
+
+/* Count the arguments of the execl*() family, including the terminating null
+ * pointer, so that the caller can collect them via collect_args() into an
+ * array on its stack.
+ */
+static size_t count_args(const char *arg, va_list ap)
+{
+    va_list aq;
+    va_copy(aq, ap);
+    size_t count = 1;
+    for (const char *cur = arg; cur != nullptr; cur = va_arg(aq, char*))
+        ++count;
+    va_end(aq);
+    return count;
+}
+
+static void collect_args(const char *arg, va_list &ap, char **args)
+{
+    for (char *cur = const_cast<char*>(arg); cur != nullptr;
+         cur = va_arg(ap, char*))
+        *args++ = cur;
+    *args = nullptr;
+}
+
+extern "C" int WRAP_SYM(execve)(const char *path, char *const argv[],
+                                char *const envp[])
+{
+    METRICS_SCOPE(execve);
+    TRACE_CALL("execve", path == nullptr ? "NULL" : path, argv, envp);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(path, false, envp,
+                                        [&](char *const env[]) {
+        return real::execve(path, argv, env);
+    }));
+}
+
+extern "C" int WRAP_SYM(execv)(const char *path, char *const argv[])
+{
+    METRICS_SCOPE(execv);
+    TRACE_CALL("execv", path == nullptr ? "NULL" : path, argv);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(path, false, environ,
+                                        [&](char *const env[]) {
+        return real::execve(path, argv, env);
+    }));
+}
+
+extern "C" int WRAP_SYM(execvp)(const char *file, char *const argv[])
+{
+    METRICS_SCOPE(execvp);
+    TRACE_CALL("execvp", file == nullptr ? "NULL" : file, argv);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(file, true, environ,
+                                        [&](char *const env[]) {
+        return real::execvpe(file, argv, env);
+    }));
+}
+
+extern "C" int WRAP_SYM(execvpe)(const char *file, char *const argv[],
+                                 char *const envp[])
+{
+    METRICS_SCOPE(execvpe);
+    TRACE_CALL("execvpe", file == nullptr ? "NULL" : file, argv, envp);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(file, true, envp,
+                                        [&](char *const env[]) {
+        return real::execvpe(file, argv, env);
+    }));
+}
+
+/* The C library implements the execl*() functions without going through the
+ * functions above, so we need to wrap them as well.
+ */
+extern "C" int WRAP_SYM(execl)(const char *path, const char *arg, ...)
+{
+    METRICS_SCOPE(execl);
+    va_list ap;
+    va_start(ap, arg);
+    size_t argc = count_args(arg, ap);
+    char **argv = static_cast<char**>(alloca(argc * sizeof(char*)));
+    collect_args(arg, ap, argv);
+    va_end(ap);
+
+    TRACE_CALL("execl", path == nullptr ? "NULL" : path, argc - 1);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(path, false, environ,
+                                        [&](char *const env[]) {
+        return real::execve(path, argv, env);
+    }));
+}
+
+extern "C" int WRAP_SYM(execlp)(const char *file, const char *arg, ...)
+{
+    METRICS_SCOPE(execlp);
+    va_list ap;
+    va_start(ap, arg);
+    size_t argc = count_args(arg, ap);
+    char **argv = static_cast<char**>(alloca(argc * sizeof(char*)));
+    collect_args(arg, ap, argv);
+    va_end(ap);
+
+    TRACE_CALL("execlp", file == nullptr ? "NULL" : file, argc - 1);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(file, true, environ,
+                                        [&](char *const env[]) {
+        return real::execvpe(file, argv, env);
+    }));
+}
+
+extern "C" int WRAP_SYM(execle)(const char *path, const char *arg, ...)
+{
+    METRICS_SCOPE(execle);
+    va_list ap;
+    va_start(ap, arg);
+    size_t argc = count_args(arg, ap);
+    char **argv = static_cast<char**>(alloca(argc * sizeof(char*)));
+    collect_args(arg, ap, argv);
+    char *const *envp = va_arg(ap, char *const*);
+    va_end(ap);
+
+    TRACE_CALL("execle", path == nullptr ? "NULL" : path, argc - 1,
+               envp);
+    prepare_exec();
+
+    return METRICS_RESULT(exec_filtered(path, false, envp,
+                                        [&](char *const env[]) {
+        return real::execve(path, argv, env);
+    }));
+}
 
-        if (!rule) {
-            LOG(DEBUG) << "Socket " << fd << " doesn't match any rule or "
-                       << "is explicitly ignored, unregistering.";
-            sock->unregister();
-            return std::invoke(realfun, fd, addr, addrlen);
-        }
+extern "C" int WRAP_SYM(posix_spawn)(pid_t *pid, const char *path,
+                                     const posix_spawn_file_actions_t *acts,
+                                     const posix_spawnattr_t *attrp,
+                                     char *const argv[], char *const envp[])
+{
+    METRICS_SCOPE(posix_spawn);
+    TRACE_CALL("posix_spawn", pid, path == nullptr ? "NULL" : path, acts,
+               attrp, argv, envp);
+
+    return METRICS_RESULT(exec_filtered(path, false, envp,
+                                        [&](char *const env[]) {
+        return real::posix_spawn(pid, path, acts, attrp, argv, env);
+    }));
+}
 
-        if (rule->second.reject) {
-            errno = rule->second.reject_errno.value_or(EACCES);
-            return -1;
-        }
+extern "C" int WRAP_SYM(posix_spawnp)(pid_t *pid, const char *file,
+                                      const posix_spawn_file_actions_t *acts,
+                                      const posix_spawnattr_t *attrp,
+                                      char *const argv[], char *const envp[])
+{
+    METRICS_SCOPE(posix_spawnp);
+    TRACE_CALL("posix_spawnp", pid, file == nullptr ? "NULL" : file, acts,
+               attrp, argv, envp);
+
+    return METRICS_RESULT(exec_filtered(file, true, envp,
+                                        [&](char *const env[]) {
+        return real::posix_spawnp(pid, file, acts, attrp, argv, env);
+    }));
+}
 
-        if (rule->second.blackhole) {
-            sock->blackhole();
-            return std::invoke(sockfun, sock, inaddr, "");
-        }
+/*
+ * The C library runs the shell for system() and popen() via its internal
+ * version of posix_spawn(), so the exec filter needs to be applied to the
+ * shell here instead.
+ */
+#define SHELL_PATH "/bin/sh"
 
-#ifdef SYSTEMD_SUPPORT
-        if (rule->second.socket_activation) {
-            std::optional<Systemd::FdInfo> fdinfo =
-                Systemd::acquire_fdinfo_for_rulepos(rule->first);
-            if (fdinfo) {
-                return sock->activate(inaddr, fdinfo.value().first,
-                                      fdinfo.value().second);
-            } else {
-                LOG(WARNING) << "Systemd file descriptor queue empty, "
-                             << "blackholing socket with fd " << fd << '.';
-                sock->blackhole();
-                return std::invoke(sockfun, sock, inaddr, "");
+/* Run the command via the shell like system() does, but with the given
+ * environment.
+ */
+static int system_env(const char *command, char *const envp[])
+{
+    struct sigaction ignore, intr, quit;
+    memset(&ignore, 0, sizeof ignore);
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &intr);
+    sigaction(SIGQUIT, &ignore, &quit);
+
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    sigemptyset(&mask);
+    if (intr.sa_handler != SIG_IGN)
+        sigaddset(&mask, SIGINT);
+    if (quit.sa_handler != SIG_IGN)
+        sigaddset(&mask, SIGQUIT);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &oldmask);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF
+                                  | POSIX_SPAWN_SETSIGMASK);
+
+    const char *argv[] = {"sh", "-c", "--", command, nullptr};
+    pid_t pid;
+    int status;
+    int ret = real::posix_spawn(&pid, SHELL_PATH, nullptr, &attr,
+                                const_cast<char *const*>(argv), envp);
+    posix_spawnattr_destroy(&attr);
+
+    if (ret == 0) {
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
             }
         }
-#endif
+    } else {
+        /* Same as if the shell couldn't execute the command. */
+        status = W_EXITCODE(127, 0);
+    }
 
-        return std::invoke(sockfun, sock, inaddr, *rule->second.socket_path);
-    }, [&]() {
-        return std::invoke(realfun, fd, addr, addrlen);
-    });
+    int old_errno = errno;
+    sigaction(SIGINT, &intr, nullptr);
+    sigaction(SIGQUIT, &quit, nullptr);
+    sigprocmask(SIG_SETMASK, &oldmask, nullptr);
+    errno = old_errno;
+    return status;
 }
 
-extern "C" int WRAP_SYM(bind)(int fd, const struct sockaddr *addr,
-                              socklen_t addrlen)
+extern "C" int WRAP_SYM(system)(const char *command)
 {
-    TRACE_CALL("bind", fd, addr, addrlen);
-    return bind_connect(&Socket::bind, real::bind, RuleDir::INCOMING,
-                        fd, addr, addrlen);
+    METRICS_SCOPE(system);
+    TRACE_CALL("system", command == nullptr ? "NULL" : command);
+
+    if (command == nullptr)
+        return METRICS_RESULT(real::system(command));
+
+    return METRICS_RESULT(exec_filtered(SHELL_PATH, false, environ,
+                                        [&](char *const env[]) {
+        if (env == environ)
+            return real::system(command);
+        return system_env(command, env);
+    }));
 }
 
-extern "C" int WRAP_SYM(connect)(int fd, const struct sockaddr *addr,
-                                 socklen_t addrlen)
-{
-    TRACE_CALL("connect", fd, addr, addrlen);
-    return bind_connect(&Socket::connect, real::connect, RuleDir::OUTGOING,
-                        fd, addr, addrlen);
-}
+/*
+ * The process IDs of the shells started by popen_env(), which are waited for
+ * by pclose(). The mutex is held while spawning, so that no other shell
+ * inherits the pipe of a stream.
+ */
+static std::mutex g_popen_mutex;
+static std::unordered_map<FILE*, pid_t> g_popen_pids;
 
-static int handle_accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
-                         int flags)
+/* Run the command via the shell like popen() does, but with the given
+ * environment.
+ */
+static FILE *popen_env(const char *command, const char *type,
+                       char *const envp[])
 {
-    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
-        if (sock->rewrite_peer_address) {
-            int accfd = real::accept4(fd, nullptr, nullptr, flags);
-            if (accfd > 0)
-                return sock->accept(accfd, addr, addrlen);
-            else
-                return accfd;
-        } else {
-            return real::accept4(fd, addr, addrlen, flags);
+    if ((type[0] != 'r' && type[0] != 'w') ||
+        (type[1] != '\0' && strcmp(type + 1, "e") != 0)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    bool reading = type[0] == 'r';
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        return nullptr;
+
+    int ours = pipefd[reading ? 0 : 1];
+    int theirs = pipefd[reading ? 1 : 0];
+    int target = reading ? STDOUT_FILENO : STDIN_FILENO;
+
+    /* Duplicating a descriptor onto itself wouldn't clear FD_CLOEXEC. */
+    if (theirs == target) {
+        int fd = fcntl(theirs, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        close(theirs);
+        if (fd == -1) {
+            close(ours);
+            return nullptr;
         }
-    }, [&]() {
-        return real::accept4(fd, addr, addrlen, flags);
-    });
+        theirs = fd;
+    }
+
+    std::scoped_lock<std::mutex> lock(g_popen_mutex);
+
+    posix_spawn_file_actions_t acts;
+    posix_spawn_file_actions_init(&acts);
+    for (const auto &[fp, pid] : g_popen_pids)
+        posix_spawn_file_actions_addclose(&acts, fileno(fp));
+    posix_spawn_file_actions_adddup2(&acts, theirs, target);
+
+    const char *argv[] = {"sh", "-c", "--", command, nullptr};
+    pid_t pid;
+    int ret = real::posix_spawn(&pid, SHELL_PATH, &acts, nullptr,
+                                const_cast<char *const*>(argv), envp);
+    posix_spawn_file_actions_destroy(&acts);
+    close(theirs);
+
+    if (ret != 0) {
+        close(ours);
+        errno = ret;
+        return nullptr;
+    }
+
+    if (type[1] != 'e')
+        fcntl(ours, F_SETFD, 0);
+
+    FILE *fp = fdopen(ours, reading ? "r" : "w");
+    if (fp == nullptr) {
+        int old_errno = errno;
+        close(ours);
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR);
+        errno = old_errno;
+        return nullptr;
+    }
+
+    g_popen_pids[fp] = pid;
+    return fp;
 }
 
-extern "C" int WRAP_SYM(accept)(int fd, struct sockaddr *addr,
-                                socklen_t *addrlen)
+extern "C" FILE *WRAP_SYM(popen)(const char *command, const char *type)
 {
-    TRACE_CALL("accept", fd, addr, addrlen);
-    return handle_accept(fd, addr, addrlen, 0);
+    METRICS_SCOPE(popen);
+    TRACE_CALL("popen", command == nullptr ? "NULL" : command,
+               type == nullptr ? "NULL" : type);
+
+    if (command == nullptr || type == nullptr)
+        return METRICS_RESULT(real::popen(command, type));
+
+    return METRICS_RESULT(exec_filtered(SHELL_PATH, false, environ,
+                                        [&](char *const env[]) {
+        if (env == environ)
+            return real::popen(command, type);
+        return popen_env(command, type, env);
+    }));
 }
 
-extern "C" int WRAP_SYM(accept4)(int fd, struct sockaddr *addr,
-                                 socklen_t *addrlen, int flags)
+extern "C" int WRAP_SYM(pclose)(FILE *stream)
 {
-    TRACE_CALL("accept4", fd, addr, addrlen, flags);
-    return handle_accept(fd, addr, addrlen, flags);
+    METRICS_SCOPE(pclose);
+    TRACE_CALL("pclose", stream);
+
+    pid_t pid;
+    {
+        std::scoped_lock<std::mutex> lock(g_popen_mutex);
+        auto found = g_popen_pids.find(stream);
+        if (found == g_popen_pids.end())
+            return METRICS_RESULT(real::pclose(stream));
+        pid = found->second;
+        g_popen_pids.erase(found);
+        fclose(stream);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            return METRICS_RESULT(-1);
+    }
+    return METRICS_RESULT(status);
 }
+#endif
 
 extern "C" int WRAP_SYM(getpeername)(int fd, struct sockaddr *addr,
                                      socklen_t *addrlen)
 {
+    METRICS_SCOPE(getpeername);
     TRACE_CALL("getpeername", fd, addr, addrlen);
+    reap_uring();
 
-    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(fd, [&](Socket::Ptr sock) {
         if (sock->rewrite_peer_address)
             return sock->getpeername(addr, addrlen);
         else
             return real::getpeername(fd, addr, addrlen);
     }, [&]() {
         return real::getpeername(fd, addr, addrlen);
-    });
+    }));
 }
 
 extern "C" int WRAP_SYM(getsockname)(int fd, struct sockaddr *addr,
                                      socklen_t *addrlen)
 {
+    METRICS_SCOPE(getsockname);
     TRACE_CALL("getsockname", fd, addr, addrlen);
+    reap_uring();
 
-    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(fd, [&](Socket::Ptr sock) {
         if (sock->rewrite_peer_address)
             return sock->getsockname(addr, addrlen);
         else
             return real::getsockname(fd, addr, addrlen);
     }, [&]() {
         return real::getsockname(fd, addr, addrlen);
-    });
+    }));
 }
 
 extern "C" ssize_t WRAP_SYM(recvfrom)(int fd, void *buf, size_t len, int flags,
                                       struct sockaddr *addr,
                                       socklen_t *addrlen)
 {
+    METRICS_SCOPE(recvfrom);
     TRACE_CALL("recvfrom", fd, buf, len, flags, addr, addrlen);
+    reap_uring();
 
     if (addr == nullptr)
-        return real::recvfrom(fd, buf, len, flags, addr, addrlen);
+        return METRICS_RESULT(real::recvfrom(fd, buf, len, flags, addr,
+                                             addrlen));
 
-    return Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
         if (!sock->rewrite_peer_address)
             return real::recvfrom(fd, buf, len, flags, addr, addrlen);
 
@@ -367,17 +1809,19 @@ extern "C" ssize_t WRAP_SYM(recvfrom)(int fd, void *buf, size_t len, int flags,
         }
     }, [&]() {
         return real::recvfrom(fd, buf, len, flags, addr, addrlen);
-    });
+    }));
 }
 
 extern "C" ssize_t WRAP_SYM(recvmsg)(int fd, struct msghdr *msg, int flags)
 {
+    METRICS_SCOPE(recvmsg);
     TRACE_CALL("recvmsg", fd, msg, flags);
+    reap_uring();
 
     if (msg->msg_name == nullptr)
-        return real::recvmsg(fd, msg, flags);
+        return METRICS_RESULT(real::recvmsg(fd, msg, flags));
 
-    return Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
         if (!sock->rewrite_peer_address)
             return real::recvmsg(fd, msg, flags);
 
@@ -404,19 +1848,22 @@ extern "C" ssize_t WRAP_SYM(recvmsg)(int fd, struct msghdr *msg, int flags)
         }
     }, [&]() {
         return real::recvmsg(fd, msg, flags);
-    });
+    }));
 }
 
 extern "C" ssize_t WRAP_SYM(sendto)(int fd, const void *buf, size_t len,
                                     int flags, const struct sockaddr *addr,
                                     socklen_t addrlen)
 {
+    METRICS_SCOPE(sendto);
     TRACE_CALL("sendto", fd, buf, len, flags, addr, addrlen);
+    reap_uring();
 
     if (addr == nullptr)
-        return real::sendto(fd, buf, len, flags, addr, addrlen);
+        return METRICS_RESULT(real::sendto(fd, buf, len, flags, addr,
+                                           addrlen));
 
-    return Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
         if (!sock->rewrite_peer_address)
             return real::sendto(fd, buf, len, flags, addr, addrlen);
 
@@ -432,7 +1879,8 @@ extern "C" ssize_t WRAP_SYM(sendto)(int fd, const void *buf, size_t len,
             if (!rule || !rule->second.socket_path)
                 return real::sendto(fd, buf, len, flags, addr, addrlen);
 
-            if (rule->second.reject) {
+            if (RULES_USE(REJECT) && rule->second.reject) {
+                Metrics::count(Metrics::Counter::REJECTS);
                 errno = rule->second.reject_errno.value_or(EACCES);
                 return static_cast<ssize_t>(-1);
             }
@@ -450,18 +1898,20 @@ extern "C" ssize_t WRAP_SYM(sendto)(int fd, const void *buf, size_t len,
         }
     }, [&]() {
         return real::sendto(fd, buf, len, flags, addr, addrlen);
-    });
+    }));
 }
 
 extern "C" ssize_t WRAP_SYM(sendmsg)(int fd, const struct msghdr *msg,
                                      int flags)
 {
+    METRICS_SCOPE(sendmsg);
     TRACE_CALL("sendmsg", fd, msg, flags);
+    reap_uring();
 
     if (msg->msg_name == nullptr)
-        return real::sendmsg(fd, msg, flags);
+        return METRICS_RESULT(real::sendmsg(fd, msg, flags));
 
-    return Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<ssize_t>(fd, [&](Socket::Ptr sock) {
         if (!sock->rewrite_peer_address)
             return real::sendmsg(fd, msg, flags);
 
@@ -477,7 +1927,8 @@ extern "C" ssize_t WRAP_SYM(sendmsg)(int fd, const struct msghdr *msg,
             if (!rule || !rule->second.socket_path)
                 return real::sendmsg(fd, msg, flags);
 
-            if (rule->second.reject) {
+            if (RULES_USE(REJECT) && rule->second.reject) {
+                Metrics::count(Metrics::Counter::REJECTS);
                 errno = rule->second.reject_errno.value_or(EACCES);
                 return static_cast<ssize_t>(-1);
             }
@@ -498,25 +1949,36 @@ extern "C" ssize_t WRAP_SYM(sendmsg)(int fd, const struct msghdr *msg,
         return real::sendmsg(fd, &newmsg, flags);
     }, [&]() {
         return real::sendmsg(fd, msg, flags);
-    });
+    }));
 }
 
 extern "C" int WRAP_SYM(dup)(int oldfd)
 {
+    METRICS_SCOPE(dup);
     TRACE_CALL("dup", oldfd);
+    reap_uring();
 
-    return Socket::when<int>(oldfd, [&](Socket::Ptr sock) {
+    return METRICS_RESULT(Socket::when<int>(oldfd, [&](Socket::Ptr sock) {
         return sock->dup();
     }, [&]() {
         return real::dup(oldfd);
-    });
+    }));
 }
 
 static int handle_dup3(int oldfd, int newfd, int flags)
 {
+    reap_uring();
+
     if (oldfd == newfd)
         return real::dup3(oldfd, newfd, flags);
 
+    if (Metrics::is_perf_fd(newfd)) {
+        LOG(DEBUG) << "Prevented fd " << newfd << " from being replaced,"
+                   << " because it's still in use by ip2unix.";
+        errno = EBUSY;
+        return -1;
+    }
+
     return Socket::when<int>(oldfd, [&](Socket::Ptr sock) {
         return sock->dup(newfd, flags);
     }, [&]() {
@@ -526,35 +1988,561 @@ static int handle_dup3(int oldfd, int newfd, int flags)
 
 extern "C" int WRAP_SYM(dup2)(int oldfd, int newfd)
 {
+    METRICS_SCOPE(dup2);
     TRACE_CALL("dup2", oldfd, newfd);
-    return handle_dup3(oldfd, newfd, 0);
+    return METRICS_RESULT(handle_dup3(oldfd, newfd, 0));
 }
 
 extern "C" int WRAP_SYM(dup3)(int oldfd, int newfd, int flags)
 {
+    METRICS_SCOPE(dup3);
     TRACE_CALL("dup3", oldfd, newfd, flags);
-    return handle_dup3(oldfd, newfd, flags);
+    return METRICS_RESULT(handle_dup3(oldfd, newfd, flags));
 }
 
 extern "C" int WRAP_SYM(close)(int fd)
 {
+    METRICS_SCOPE(close);
     TRACE_CALL("close", fd);
+    reap_uring();
 
-#ifdef SYSTEMD_SUPPORT
-    {
-        std::scoped_lock<std::mutex> lock(g_rules_mutex);
-        init_rules();
-        if (Systemd::has_fd(fd)) {
-            LOG(DEBUG) << "Prevented socket fd " << fd << " from being closed,"
-                       << " because it's a file descriptor passed by systemd.";
-            return 0;
-        }
-    }
+#ifndef EMBEDDED
+    poll_reports();
 #endif
 
-    return Socket::when<int>(fd, [&](Socket::Ptr sock) {
+#ifdef HAS_IO_URING
+    IoUring::forget(fd);
+#endif
+
+    if (is_protected_fd(fd)) {
+        LOG(DEBUG) << "Prevented fd " << fd << " from being closed,"
+                   << " because it's still in use by ip2unix.";
+        return METRICS_RESULT(0);
+    }
+
+    /* Sockets can be selected by the log filter without being registered,
+     * so the descriptor might be reused by an unrelated socket otherwise.
+     */
+    LogFilter::forget_fd(fd);
+
+    return METRICS_RESULT(Socket::when<int>(fd, [&](Socket::Ptr sock) {
         return sock->close();
     }, [&]() {
         return real::close(fd);
+    }));
+}
+
+#ifdef HAS_IO_URING
+/*
+ * Turn the given submission queue entry into a no-op and report the given
+ * result for its completion instead. This is used for operations we already
+ * did ourselves, like eg. closing a socket.
+ */
+static IoUring::PendingPtr uring_emulate(io_uring_sqe *sqe, int result)
+{
+    IoUring::PendingPtr pending = std::make_unique<IoUring::Pending>();
+    pending->opcode = sqe->opcode;
+    pending->fd = sqe->fd;
+    pending->result = result;
+
+    pending->wants_completion = true;
+
+    uint64_t user_data = sqe->user_data;
+    uint8_t flags = sqe->flags & (IOSQE_IO_DRAIN | IOSQE_IO_LINK
+                                | IOSQE_IO_HARDLINK);
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqe->flags = flags;
+    sqe->user_data = user_data;
+
+    /* Let the kernel post the result itself, so it's correct even if the
+     * application reaps the completion before we get to see it. Older kernels
+     * ignore the flag, so we still replace the result before handing the
+     * completion to the application if we get the chance.
+     */
+    sqe->rw_flags = IORING_NOP_INJECT_RESULT;
+    sqe->len = static_cast<uint32_t>(result);
+    return pending;
+}
+
+static IoUring::PendingPtr uring_connect(io_uring_sqe *sqe)
+{
+    const sockaddr *addr = reinterpret_cast<const sockaddr*>(sqe->addr);
+    if (addr == nullptr)
+        return nullptr;
+
+    if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
+        return nullptr;
+
+    return Socket::when<IoUring::PendingPtr>(sqe->fd, [&](Socket::Ptr sock)
+                                             -> IoUring::PendingPtr {
+        SockAddr inaddr(addr);
+
+        std::optional<SockAddr> dest = sock->connect_peermap_async(inaddr);
+        if (!dest) {
+            std::scoped_lock<std::mutex> lock(g_rules_mutex);
+
+            RuleMatch rule = match_rule(inaddr, sock, RuleDir::OUTGOING);
+
+            if (!rule) {
+                LOG(DEBUG) << "Socket " << sqe->fd << " doesn't match any"
+                           << " rule or is explicitly ignored, unregistering.";
+                sock->unregister();
+                return nullptr;
+            }
+
+            if (RULES_USE(REJECT) && rule->second.reject) {
+                Metrics::count(Metrics::Counter::REJECTS);
+                return uring_emulate(sqe, -rule->second.reject_errno
+                                                       .value_or(EACCES));
+            }
+
+            if (!rule->second.socket_path)
+                return nullptr;
+
+            dest = sock->connect_async(inaddr, *rule->second.socket_path);
+            if (!dest)
+                return uring_emulate(sqe, -EADDRNOTAVAIL);
+        }
+
+        IoUring::PendingPtr pending = std::make_unique<IoUring::Pending>();
+        pending->opcode = sqe->opcode;
+        pending->fd = sqe->fd;
+        pending->addr = dest.value();
+        sqe->addr = reinterpret_cast<uint64_t>(&pending->addr);
+        sqe->off = pending->addr.size();
+        return pending;
+    }, [&]() {
+        return nullptr;
+    });
+}
+
+static IoUring::PendingPtr uring_accept(io_uring_sqe *sqe)
+{
+    /* Direct descriptors are not visible to the rest of the application. */
+    if (sqe->file_index != 0)
+        return nullptr;
+
+    return Socket::when<IoUring::PendingPtr>(sqe->fd, [&](Socket::Ptr sock)
+                                             -> IoUring::PendingPtr {
+        if (!sock->rewrite_peer_address)
+            return nullptr;
+
+        /* The kernel writes the address of the Unix domain socket into the
+         * buffers of the application, which is rewritten on completion.
+         */
+        IoUring::PendingPtr pending = std::make_unique<IoUring::Pending>();
+        pending->opcode = sqe->opcode;
+        pending->fd = sqe->fd;
+        pending->wants_completion = true;
+        pending->user_addr = reinterpret_cast<sockaddr*>(sqe->addr);
+        pending->user_addrlen = reinterpret_cast<socklen_t*>(sqe->addr2);
+        return pending;
+    }, [&]() {
+        return nullptr;
+    });
+}
+
+static IoUring::PendingPtr uring_recvmsg(io_uring_sqe *sqe)
+{
+    msghdr *msg = reinterpret_cast<msghdr*>(sqe->addr);
+    if (msg == nullptr || msg->msg_name == nullptr)
+        return nullptr;
+
+#ifdef IORING_RECV_MULTISHOT
+    /* Multishot receives use a different layout for the peer address. */
+    if (sqe->ioprio & IORING_RECV_MULTISHOT)
+        return nullptr;
+#endif
+
+    return Socket::when<IoUring::PendingPtr>(sqe->fd, [&](Socket::Ptr sock)
+                                             -> IoUring::PendingPtr {
+        if (!sock->rewrite_peer_address)
+            return nullptr;
+
+        IoUring::PendingPtr pending = std::make_unique<IoUring::Pending>();
+        pending->opcode = sqe->opcode;
+        pending->fd = sqe->fd;
+        pending->wants_completion = true;
+        pending->user_msg = msg;
+
+        /* If the peer address of the Unix domain socket fits into the buffer
+         * of the application, the kernel writes it there and we rewrite it
+         * in place, so everything else of the message header is up to date
+         * even if the application reaps the completion on its own.
+         */
+        if (msg->msg_namelen >= sizeof(sockaddr_un))
+            return pending;
+
+        pending->addr.ss_family = AF_UNIX;
+        memcpy(&pending->msg, msg, sizeof(msghdr));
+        pending->msg.msg_name = &pending->addr;
+        pending->msg.msg_namelen = pending->addr.size();
+        sqe->addr = reinterpret_cast<uint64_t>(&pending->msg);
+        return pending;
+    }, [&]() {
+        return nullptr;
+    });
+}
+
+static IoUring::PendingPtr uring_sendmsg(io_uring_sqe *sqe)
+{
+    const msghdr *msg = reinterpret_cast<const msghdr*>(sqe->addr);
+    if (msg == nullptr || msg->msg_name == nullptr)
+        return nullptr;
+
+    return Socket::when<IoUring::PendingPtr>(sqe->fd, [&](Socket::Ptr sock)
+                                             -> IoUring::PendingPtr {
+        if (!sock->rewrite_peer_address)
+            return nullptr;
+
+        SockAddr addrcopy(reinterpret_cast<const sockaddr*>(msg->msg_name));
+
+        std::optional<SockAddr> newdest =
+            sock->rewrite_dest_peermap(addrcopy);
+        if (!newdest) {
+            std::scoped_lock<std::mutex> lock(g_rules_mutex);
+
+            RuleMatch rule = match_rule(addrcopy, sock, RuleDir::OUTGOING);
+
+            if (rule && RULES_USE(REJECT) && rule->second.reject) {
+                Metrics::count(Metrics::Counter::REJECTS);
+                return uring_emulate(sqe, -rule->second.reject_errno
+                                                       .value_or(EACCES));
+            }
+
+            if (!rule || !rule->second.socket_path)
+                return nullptr;
+
+            newdest = sock->rewrite_dest(addrcopy, *rule->second.socket_path);
+        }
+
+        IoUring::PendingPtr pending = std::make_unique<IoUring::Pending>();
+        pending->opcode = sqe->opcode;
+        pending->fd = sqe->fd;
+        memcpy(&pending->msg, msg, sizeof(msghdr));
+        if (newdest) {
+            pending->addr = newdest.value();
+            pending->msg.msg_name = &pending->addr;
+            pending->msg.msg_namelen = pending->addr.size();
+        } else {
+            pending->msg.msg_name = nullptr;
+            pending->msg.msg_namelen = 0;
+        }
+        sqe->addr = reinterpret_cast<uint64_t>(&pending->msg);
+        return pending;
+    }, [&]() {
+        return nullptr;
+    });
+}
+
+static IoUring::PendingPtr uring_close(io_uring_sqe *sqe)
+{
+    if (sqe->file_index != 0)
+        return nullptr;
+
+    if (is_protected_fd(sqe->fd)) {
+        LOG(DEBUG) << "Prevented fd " << sqe->fd << " from being closed"
+                   << " via io_uring, because it's still in use by ip2unix.";
+        return uring_emulate(sqe, 0);
+    }
+
+    return Socket::when<IoUring::PendingPtr>(sqe->fd, [&](Socket::Ptr sock) {
+        int ret = sock->close();
+        return uring_emulate(sqe, ret == 0 ? 0 : -errno);
+    }, [&]() {
+        return nullptr;
     });
 }
+
+/*
+ * Rewrite a submission queue entry in the same way as the wrappers above do
+ * for the corresponding synchronous calls.
+ */
+static IoUring::PendingPtr handle_uring_sqe(io_uring_sqe *sqe)
+{
+    if (sqe->flags & IOSQE_FIXED_FILE)
+        return nullptr;
+
+    switch (sqe->opcode) {
+        case IORING_OP_CONNECT:
+            return uring_connect(sqe);
+        case IORING_OP_ACCEPT:
+            return uring_accept(sqe);
+        case IORING_OP_RECVMSG:
+            return uring_recvmsg(sqe);
+        case IORING_OP_SENDMSG:
+            return uring_sendmsg(sqe);
+        case IORING_OP_CLOSE:
+            return uring_close(sqe);
+        default:
+            return nullptr;
+    }
+}
+
+/*
+ * Post-process the completion of a rewritten entry, so that accepted sockets
+ * get registered and peer addresses are rewritten just like in accept() and
+ * recvmsg(), see IoUring::Stage for when this happens.
+ */
+static std::optional<int> handle_uring_cqe(IoUring::Pending &pending,
+                                           io_uring_cqe *cqe,
+                                           IoUring::Stage stage)
+{
+    if (stage == IoUring::Stage::REWRITE && pending.result)
+        return pending.result;
+
+    if (cqe->res < 0)
+        return std::nullopt;
+
+    std::optional<int> result;
+
+    if (pending.opcode == IORING_OP_ACCEPT) {
+        if (stage == IoUring::Stage::REGISTER) {
+            Socket::when(pending.fd, [&](Socket::Ptr sock) {
+                if (sock->accept(cqe->res, nullptr, nullptr) == -1)
+                    result = -errno;
+            });
+        } else if (pending.user_addr != nullptr) {
+            Socket::when(cqe->res, [&](Socket::Ptr sock) {
+                sock->getpeername(pending.user_addr, pending.user_addrlen);
+            });
+        }
+    } else if (pending.opcode == IORING_OP_RECVMSG &&
+               stage == IoUring::Stage::REWRITE) {
+        msghdr *msg = pending.user_msg;
+        SockAddr real_addr;
+        if (pending.msg.msg_name == nullptr) {
+            memcpy(&real_addr, msg->msg_name,
+                   std::min(static_cast<size_t>(msg->msg_namelen),
+                            sizeof(sockaddr_storage)));
+        } else {
+            real_addr = pending.addr;
+            msg->msg_flags = pending.msg.msg_flags;
+            msg->msg_controllen = pending.msg.msg_controllen;
+        }
+        Socket::when(pending.fd, [&](Socket::Ptr sock) {
+            sockaddr *addr = reinterpret_cast<sockaddr*>(msg->msg_name);
+            if (!sock->rewrite_src(real_addr, addr, &msg->msg_namelen))
+                result = -EINVAL;
+        });
+    }
+
+    return result;
+}
+
+/*
+ * Completions might be reaped by the application without entering the
+ * kernel, so before looking up a file descriptor, we need to make sure that
+ * sockets accepted via io_uring in the meantime are registered.
+ */
+static void reap_uring(void)
+{
+    IoUring::reap(handle_uring_cqe);
+}
+
+/*
+ * Applications using io_uring either issue the io_uring_setup() and
+ * io_uring_enter() system calls on their own or via liburing, neither of
+ * which goes through any of the wrappers above. Since there are no C library
+ * wrappers for these system calls, we need to intercept syscall() instead,
+ * which is also used by liburing before version 2.2.
+ */
+extern "C" long WRAP_SYM(syscall)(long number, ...)
+{
+    METRICS_SCOPE(syscall);
+    long args[6];
+    va_list ap;
+
+    va_start(ap, number);
+    for (long &arg : args)
+        arg = va_arg(ap, long);
+    va_end(ap);
+
+    TRACE_CALL("syscall", number, args[0], args[1], args[2], args[3],
+               args[4], args[5]);
+
+    long ret;
+    int old_errno;
+    bool rewrite;
+
+    switch (number) {
+        case SYS_io_uring_setup:
+            ret = real::syscall(number, args[0], args[1], args[2], args[3],
+                                args[4], args[5]);
+            if (ret >= 0) {
+                old_errno = errno;
+                IoUring::setup(static_cast<int>(ret),
+                               reinterpret_cast<io_uring_params*>(args[1]));
+                errno = old_errno;
+            }
+            return METRICS_RESULT(ret);
+
+        case SYS_io_uring_enter:
+            /* Only the thread waiting for completions may rewrite them. */
+            rewrite = args[3] & IORING_ENTER_GETEVENTS;
+            IoUring::complete(static_cast<int>(args[0]), handle_uring_cqe,
+                              rewrite);
+            IoUring::submit(static_cast<int>(args[0]),
+                            static_cast<unsigned int>(args[1]),
+                            handle_uring_sqe);
+            ret = real::syscall(number, args[0], args[1], args[2], args[3],
+                                args[4], args[5]);
+            old_errno = errno;
+            IoUring::complete(static_cast<int>(args[0]), handle_uring_cqe,
+                              rewrite);
+            errno = old_errno;
+            return METRICS_RESULT(ret);
+
+        default:
+            return METRICS_RESULT(real::syscall(number, args[0], args[1],
+                                                args[2], args[3], args[4],
+                                                args[5]));
+    }
+}
+
+#ifndef EMBEDDED
+/*
+ * Since version 2.2, liburing issues the system calls directly, so we
+ * intercept its functions for setting up rings, submitting entries and
+ * waiting for completions instead. This only works if the application is
+ * linked against the shared library of liburing. Completions found by the
+ * inline functions of liburing without calling any of these are handled by
+ * reap_uring() like for any other application.
+ */
+static int uring_queue_init(unsigned entries, IoUring::Liburing *ring,
+                            io_uring_params *params)
+{
+    int ret = real::io_uring_queue_init_params(entries, ring, params);
+    if (ret == 0) {
+        int old_errno = errno;
+        IoUring::setup(ring->ring_fd, params);
+        errno = old_errno;
+    }
+    return ret;
+}
+
+/* Rewrite the entries liburing has queued and is about to submit. */
+static void uring_before_submit(IoUring::Liburing *ring, bool rewrite)
+{
+    IoUring::complete(ring->ring_fd, handle_uring_cqe, rewrite);
+    IoUring::submit_queued(ring->ring_fd, ring->sq.sqe_head,
+                           ring->sq.sqe_tail, handle_uring_sqe);
+}
+
+static void uring_after_call(IoUring::Liburing *ring, bool rewrite)
+{
+    int old_errno = errno;
+    IoUring::complete(ring->ring_fd, handle_uring_cqe, rewrite);
+    errno = old_errno;
+}
+
+extern "C" int WRAP_SYM(io_uring_queue_init)(unsigned entries,
+                                             IoUring::Liburing *ring,
+                                             unsigned flags)
+{
+    METRICS_SCOPE(io_uring_queue_init);
+    TRACE_CALL("io_uring_queue_init", entries, ring, flags);
+
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    params.flags = flags;
+    return METRICS_RESULT(uring_queue_init(entries, ring, &params));
+}
+
+extern "C" int WRAP_SYM(io_uring_queue_init_params)(unsigned entries,
+                                                    IoUring::Liburing *ring,
+                                                    io_uring_params *params)
+{
+    METRICS_SCOPE(io_uring_queue_init_params);
+    TRACE_CALL("io_uring_queue_init_params", entries, ring, params);
+    return METRICS_RESULT(uring_queue_init(entries, ring, params));
+}
+
+extern "C" int WRAP_SYM(io_uring_submit)(IoUring::Liburing *ring)
+{
+    METRICS_SCOPE(io_uring_submit);
+    TRACE_CALL("io_uring_submit", ring);
+    uring_before_submit(ring, false);
+    int ret = real::io_uring_submit(ring);
+    uring_after_call(ring, false);
+    return METRICS_RESULT(ret);
+}
+
+extern "C" int WRAP_SYM(io_uring_submit_and_wait)(IoUring::Liburing *ring,
+                                                  unsigned wait_nr)
+{
+    METRICS_SCOPE(io_uring_submit_and_wait);
+    TRACE_CALL("io_uring_submit_and_wait", ring, wait_nr);
+    uring_before_submit(ring, wait_nr > 0);
+    int ret = real::io_uring_submit_and_wait(ring, wait_nr);
+    uring_after_call(ring, wait_nr > 0);
+    return METRICS_RESULT(ret);
+}
+
+extern "C" int WRAP_SYM(io_uring_submit_and_wait_timeout)(
+    IoUring::Liburing *ring, io_uring_cqe **cqe_ptr, unsigned wait_nr,
+    __kernel_timespec *ts, sigset_t *sigmask
+)
+{
+    METRICS_SCOPE(io_uring_submit_and_wait_timeout);
+    TRACE_CALL("io_uring_submit_and_wait_timeout", ring, cqe_ptr, wait_nr,
+               ts, sigmask);
+    uring_before_submit(ring, true);
+    int ret = real::io_uring_submit_and_wait_timeout(ring, cqe_ptr, wait_nr,
+                                                     ts, sigmask);
+    uring_after_call(ring, true);
+    return METRICS_RESULT(ret);
+}
+
+/* Called by the inline functions of liburing that wait for completions. */
+extern "C" int WRAP_SYM(__io_uring_get_cqe)(IoUring::Liburing *ring,
+                                            io_uring_cqe **cqe_ptr,
+                                            unsigned submit, unsigned wait_nr,
+                                            sigset_t *sigmask)
+{
+    METRICS_SCOPE(__io_uring_get_cqe);
+    TRACE_CALL("__io_uring_get_cqe", ring, cqe_ptr, submit, wait_nr,
+               sigmask);
+    IoUring::complete(ring->ring_fd, handle_uring_cqe, true);
+    IoUring::submit(ring->ring_fd, submit, handle_uring_sqe);
+    int ret = real::__io_uring_get_cqe(ring, cqe_ptr, submit, wait_nr,
+                                       sigmask);
+    uring_after_call(ring, true);
+    return METRICS_RESULT(ret);
+}
+
+extern "C" int WRAP_SYM(io_uring_wait_cqes)(IoUring::Liburing *ring,
+                                            io_uring_cqe **cqe_ptr,
+                                            unsigned wait_nr,
+                                            __kernel_timespec *ts,
+                                            sigset_t *sigmask)
+{
+    METRICS_SCOPE(io_uring_wait_cqes);
+    TRACE_CALL("io_uring_wait_cqes", ring, cqe_ptr, wait_nr, ts, sigmask);
+
+    /* Without support for extended arguments, liburing submits an entry
+     * for the timeout along with all of the queued entries.
+     */
+    if (ts != nullptr && !(ring->features & IORING_FEAT_EXT_ARG))
+        uring_before_submit(ring, true);
+    else
+        IoUring::complete(ring->ring_fd, handle_uring_cqe, true);
+
+    int ret = real::io_uring_wait_cqes(ring, cqe_ptr, wait_nr, ts, sigmask);
+    uring_after_call(ring, true);
+    return METRICS_RESULT(ret);
+}
+
+extern "C" unsigned WRAP_SYM(io_uring_peek_batch_cqe)(IoUring::Liburing *ring,
+                                                      io_uring_cqe **cqes,
+                                                      unsigned count)
+{
+    METRICS_SCOPE(io_uring_peek_batch_cqe);
+    TRACE_CALL("io_uring_peek_batch_cqe", ring, cqes, count);
+    unsigned ret = real::io_uring_peek_batch_cqe(ring, cqes, count);
+    uring_after_call(ring, true);
+    return METRICS_RESULT(ret);
+}
+#endif
+#endif
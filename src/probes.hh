@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_PROBES_HH
+#define IP2UNIX_PROBES_HH
+
+/*
+ * Statically defined tracepoints for tools like bpftrace, perf or SystemTap,
+ * which are only compiled in with the "usdt-probes" build option. Every probe
+ * is a single nop instruction unless a tracer is attached to it.
+ *
+ * All probes are in the "ip2unix" provider and their names and arguments are
+ * documented in README.adoc, so they must not be changed. New arguments may
+ * only be appended.
+ */
+#ifdef USDT_PROBES
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(ip2unix, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do {} while (0)
+#endif
+
+#endif
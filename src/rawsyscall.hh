@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_RAWSYSCALL_HH
+#define IP2UNIX_RAWSYSCALL_HH
+
+#include <sys/syscall.h>
+
+/* Inline system call stubs, which return the raw result of the kernel, so
+ * errors are returned as negative errno values.
+ */
+#if defined(__x86_64__)
+inline long raw_syscall(long nr, long a1 = 0, long a2 = 0, long a3 = 0,
+                        long a4 = 0, long a5 = 0, long a6 = 0)
+{
+    long ret;
+    register long r10 __asm__("r10") = a4;
+    register long r8 __asm__("r8") = a5;
+    register long r9 __asm__("r9") = a6;
+    __asm__ __volatile__ ("syscall"
+                          : "=a" (ret)
+                          : "a" (nr), "D" (a1), "S" (a2), "d" (a3),
+                            "r" (r10), "r" (r8), "r" (r9)
+                          : "rcx", "r11", "memory");
+    return ret;
+}
+#elif defined(__aarch64__)
+inline long raw_syscall(long nr, long a1 = 0, long a2 = 0, long a3 = 0,
+                        long a4 = 0, long a5 = 0, long a6 = 0)
+{
+    register long x8 __asm__("x8") = nr;
+    register long x0 __asm__("x0") = a1;
+    register long x1 __asm__("x1") = a2;
+    register long x2 __asm__("x2") = a3;
+    register long x3 __asm__("x3") = a4;
+    register long x4 __asm__("x4") = a5;
+    register long x5 __asm__("x5") = a6;
+    __asm__ __volatile__ ("svc 0"
+                          : "+r" (x0)
+                          : "r" (x8), "r" (x1), "r" (x2), "r" (x3),
+                            "r" (x4), "r" (x5)
+                          : "memory");
+    return x0;
+}
+#else
+#error "Raw system calls are not supported on this architecture."
+#endif
+
+#endif
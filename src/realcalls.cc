@@ -1,10 +1,11 @@
 // SPDX-License-Identifier: LGPL-3.0-only
 #define IP2UNIX_REALCALL_EXTERN
 #include "realcalls.hh"
+#include "initprio.hh"
 
 std::mutex g_dlsym_mutex;
 
-DlsymHandle dlsym_handle;
+DlsymHandle dlsym_handle INIT_STATE;
 
 DlsymHandle::DlsymHandle() : handle(nullptr)
 {
@@ -30,3 +31,44 @@ DlsymHandle::~DlsymHandle()
     if (this->handle != RTLD_NEXT)
         dlclose(this->handle);
 }
+
+/* Only the dlsym() backend needs to resolve anything. */
+template <typename Fun>
+static inline auto resolve_fun(Fun &fun, int) -> decltype(fun.resolve(), void())
+{
+    fun.resolve();
+}
+
+template <typename Fun>
+static inline void resolve_fun(Fun&, long)
+{
+}
+
+template <typename ... Funs>
+static inline void resolve_funs(Funs &... funs)
+{
+    (resolve_fun(funs, 0), ...);
+}
+
+void real::resolve_all(void)
+{
+    resolve_funs(real::accept, real::accept4, real::bind, real::close,
+                 real::connect, real::dup, real::dup2, real::dup3,
+                 real::getaddrinfo, real::gethostbyname, real::gethostbyname2,
+                 real::getpeername, real::getsockname, real::ioctl,
+                 real::recvfrom, real::recvmsg, real::sendmsg, real::sendto,
+                 real::setsockopt, real::socket);
+#ifndef EMBEDDED
+    resolve_funs(real::execve, real::execvpe, real::posix_spawn,
+                 real::posix_spawnp);
+#endif
+#ifdef HAS_EPOLL
+    resolve_funs(real::epoll_ctl);
+#endif
+#ifdef SYSTEMD_SUPPORT
+    resolve_funs(real::listen);
+#endif
+#ifdef HAS_IO_URING
+    resolve_funs(real::syscall);
+#endif
+}
@@ -2,18 +2,41 @@
 #ifndef IP2UNIX_REALCALLS_HH
 #define IP2UNIX_REALCALLS_HH
 
+#include <atomic>
+#include <cstdio>
 #include <cstring>
 #include <mutex>
+#include <type_traits>
+#include <utility>
 
 #include <unistd.h>
 #include <dlfcn.h>
 
 #include "logging.hh"
+#include "metrics.hh"
+#include "trace.hh"
+
+#ifdef RAW_SYSCALLS
+#include "rawsyscall.hh"
+#endif
+
+#include <netdb.h>
+#include <spawn.h>
+
+#ifdef EMBEDDED
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#endif
 
 #if HAS_EPOLL
 #include <sys/epoll.h>
 #endif
 
+#ifdef HAS_IO_URING
+#include <csignal>
+#include "iouring.hh"
+#endif
+
 /* Let's declare all of the wrappers as extern, so that we can define them by
  * simply overriding IP2UNIX_REALCALL_EXTERN before the #include directive.
  */
@@ -48,24 +71,44 @@ namespace real {
     template <typename Self, typename FunType>
     struct DlsymFunBase
     {
-        FunType *fptr = nullptr;
+        std::atomic<FunType*> fptr = nullptr;
 
-        template <typename ... Args>
-        auto operator()(Args ... args) -> decltype(fptr(args ...))
+        /* The handle the symbol is looked up in, see DLSYM_NEXT_FUN. */
+        static void *handle(void)
+        {
+            return dlsym_handle.get();
+        }
+
+        /* Resolve the symbol only once, so that after the first call the only
+         * overhead is a single atomic load.
+         */
+        FunType *resolve(void)
         {
-            g_dlsym_mutex.lock();
-            if (this->fptr == nullptr) {
-                void *result = dlsym(dlsym_handle.get(), Self::fname);
-                if (result == nullptr) {
+            FunType *result = this->fptr.load(std::memory_order_acquire);
+            if (result != nullptr)
+                return result;
+
+            std::scoped_lock<std::mutex> lock(g_dlsym_mutex);
+            if ((result = this->fptr.load()) == nullptr) {
+                void *sym = dlsym(Self::handle(), Self::fname);
+                if (sym == nullptr) {
                     LOG(FATAL) << "Loading of symbol '" << Self::fname
                                << "' failed: " << strerror(errno);
-                    g_dlsym_mutex.unlock();
                     _exit(EXIT_FAILURE);
                 }
-                this->fptr = reinterpret_cast<decltype(fptr)>(result);
+                result = reinterpret_cast<FunType*>(sym);
+                this->fptr.store(result, std::memory_order_release);
             }
-            g_dlsym_mutex.unlock();
-            return this->fptr(args ...);
+            return result;
+        }
+
+        template <typename ... Args>
+        auto operator()(Args ... args)
+            -> decltype(std::declval<FunType&>()(args ...))
+        {
+            FunType *fun = this->resolve();
+            Metrics::RealCall timer;
+            return Trace::result(fun(args ...));
         }
     };
 
@@ -75,6 +118,27 @@ namespace real {
     template <typename Self, typename Ret, typename... FunArgs>
     using DlsymFunVaArgs = DlsymFunBase<Self, Ret(FunArgs..., ...)>;
 
+#ifdef EMBEDDED
+    /* If we're linked into the application, our wrappers are prefixed with
+     * "ip2unix_" and thus do not shadow the functions of the C library, so
+     * we can call them directly without going through dlsym().
+     */
+    template <auto fun>
+    struct DirectFun
+    {
+        template <typename ... Args>
+        auto operator()(Args ... args) -> decltype(fun(args ...))
+        {
+            Metrics::RealCall timer;
+            return Trace::result(fun(args ...));
+        }
+    };
+
+#define DLSYM_FUN(name, ...) IP2UNIX_REALCALL_EXTERN \
+    struct name##_fun_t : public DirectFun<&::name> {} name
+
+#define DLSYM_FUN_VA_ARGS DLSYM_FUN
+#else
 #define DLSYM_FUN(name, ...) IP2UNIX_REALCALL_EXTERN \
     struct name##_fun_t : public DlsymFun<name##_fun_t, __VA_ARGS__> { \
         static constexpr const char *fname = #name; \
@@ -85,31 +149,124 @@ namespace real {
         static constexpr const char *fname = #name; \
     } name
 
+/* For functions of libraries other than the C library. */
+#define DLSYM_NEXT_FUN(name, ...) IP2UNIX_REALCALL_EXTERN \
+    struct name##_fun_t : public DlsymFun<name##_fun_t, __VA_ARGS__> { \
+        static constexpr const char *fname = #name; \
+        static void *handle(void) { return RTLD_NEXT; } \
+    } name
+#endif
+
+#ifdef RAW_SYSCALLS
+    template <typename T>
+    inline long to_sysarg(T arg)
+    {
+        if constexpr (std::is_pointer<T>::value)
+            return reinterpret_cast<long>(arg);
+        else
+            return static_cast<long>(arg);
+    }
+
+    /* Issue system calls directly instead of going through the C library,
+     * which saves the indirection via the dynamic linker as well as the
+     * cancellation handling of the C library wrappers.
+     */
+    template <long nr, typename Ret, typename... FunArgs>
+    struct SyscallFun
+    {
+        Ret operator()(FunArgs ... args)
+        {
+            Metrics::RealCall timer;
+            long ret = raw_syscall(nr, to_sysarg(args)...);
+            if (ret < 0 && ret > -4096) {
+                errno = static_cast<int>(-ret);
+                ret = -1;
+            }
+            return static_cast<Ret>(Trace::result(ret));
+        }
+    };
+
+#define SYSCALL_FUN(name, ...) IP2UNIX_REALCALL_EXTERN \
+    struct name##_fun_t : public SyscallFun<SYS_##name, __VA_ARGS__> {} name
+#else
+#define SYSCALL_FUN DLSYM_FUN
+#endif
+
+#if defined(RAW_SYSCALLS) && defined(SYS_accept)
+    SYSCALL_FUN(accept, int, int, struct sockaddr*, socklen_t*);
+#else
     DLSYM_FUN(accept, int, int, struct sockaddr*, socklen_t*);
-    DLSYM_FUN(accept4, int, int, struct sockaddr*, socklen_t*, int);
-    DLSYM_FUN(bind, int, int, const struct sockaddr*, socklen_t);
-    DLSYM_FUN(close, int, int);
-    DLSYM_FUN(connect, int, int, const struct sockaddr*, socklen_t);
-    DLSYM_FUN(dup, int, int);
+#endif
+    SYSCALL_FUN(accept4, int, int, struct sockaddr*, socklen_t*, int);
+    SYSCALL_FUN(bind, int, int, const struct sockaddr*, socklen_t);
+    SYSCALL_FUN(close, int, int);
+    SYSCALL_FUN(connect, int, int, const struct sockaddr*, socklen_t);
+    SYSCALL_FUN(dup, int, int);
+#if defined(RAW_SYSCALLS) && defined(SYS_dup2)
+    SYSCALL_FUN(dup2, int, int, int);
+#else
     DLSYM_FUN(dup2, int, int, int);
-    DLSYM_FUN(dup3, int, int, int, int);
-    DLSYM_FUN(getpeername, int, int, struct sockaddr*, socklen_t*);
-    DLSYM_FUN(getsockname, int, int, struct sockaddr*, socklen_t*);
+#endif
+    SYSCALL_FUN(dup3, int, int, int, int);
+#ifndef EMBEDDED
+    DLSYM_FUN(execve, int, const char*, char *const[], char *const[]);
+    DLSYM_FUN(execvpe, int, const char*, char *const[], char *const[]);
+#endif
+    DLSYM_FUN(getaddrinfo, int, const char*, const char*,
+              const struct addrinfo*, struct addrinfo**);
+    DLSYM_FUN(gethostbyname, struct hostent*, const char*);
+    DLSYM_FUN(gethostbyname2, struct hostent*, const char*, int);
+    SYSCALL_FUN(getpeername, int, int, struct sockaddr*, socklen_t*);
+    SYSCALL_FUN(getsockname, int, int, struct sockaddr*, socklen_t*);
     DLSYM_FUN(ioctl, int, int, unsigned long, const void*);
+#if defined(HAS_IO_URING) && !defined(EMBEDDED)
+    DLSYM_NEXT_FUN(__io_uring_get_cqe, int, IoUring::Liburing*,
+                   io_uring_cqe**, unsigned, unsigned, sigset_t*);
+    DLSYM_NEXT_FUN(io_uring_peek_batch_cqe, unsigned, IoUring::Liburing*,
+                   io_uring_cqe**, unsigned);
+    DLSYM_NEXT_FUN(io_uring_queue_init, int, unsigned, IoUring::Liburing*,
+                   unsigned);
+    DLSYM_NEXT_FUN(io_uring_queue_init_params, int, unsigned,
+                   IoUring::Liburing*, io_uring_params*);
+    DLSYM_NEXT_FUN(io_uring_submit, int, IoUring::Liburing*);
+    DLSYM_NEXT_FUN(io_uring_submit_and_wait, int, IoUring::Liburing*,
+                   unsigned);
+    DLSYM_NEXT_FUN(io_uring_submit_and_wait_timeout, int, IoUring::Liburing*,
+                   io_uring_cqe**, unsigned, __kernel_timespec*, sigset_t*);
+    DLSYM_NEXT_FUN(io_uring_wait_cqes, int, IoUring::Liburing*,
+                   io_uring_cqe**, unsigned, __kernel_timespec*, sigset_t*);
+#endif
 #ifdef HAS_EPOLL
     DLSYM_FUN(epoll_ctl, int, int, int, int, struct epoll_event*);
 #endif
 #ifdef SYSTEMD_SUPPORT
-    DLSYM_FUN(listen, int, int, int);
-#endif
-    DLSYM_FUN(recvfrom, ssize_t, int, void*, size_t, int, struct sockaddr*,
-              socklen_t*);
-    DLSYM_FUN(recvmsg, ssize_t, int, struct msghdr*, int);
-    DLSYM_FUN(sendmsg, ssize_t, int, const struct msghdr*, int);
-    DLSYM_FUN(sendto, ssize_t, int, const void*, size_t, int,
-              const struct sockaddr*, socklen_t);
-    DLSYM_FUN(setsockopt, int, int, int, int, const void*, socklen_t);
-    DLSYM_FUN(socket, int, int, int, int);
+    SYSCALL_FUN(listen, int, int, int);
+#endif
+#ifndef EMBEDDED
+    DLSYM_FUN(pclose, int, FILE*);
+    DLSYM_FUN(popen, FILE*, const char*, const char*);
+    DLSYM_FUN(posix_spawn, int, pid_t*, const char*,
+              const posix_spawn_file_actions_t*, const posix_spawnattr_t*,
+              char *const[], char *const[]);
+    DLSYM_FUN(posix_spawnp, int, pid_t*, const char*,
+              const posix_spawn_file_actions_t*, const posix_spawnattr_t*,
+              char *const[], char *const[]);
+#endif
+    SYSCALL_FUN(recvfrom, ssize_t, int, void*, size_t, int, struct sockaddr*,
+                socklen_t*);
+    SYSCALL_FUN(recvmsg, ssize_t, int, struct msghdr*, int);
+    SYSCALL_FUN(sendmsg, ssize_t, int, const struct msghdr*, int);
+    SYSCALL_FUN(sendto, ssize_t, int, const void*, size_t, int,
+                const struct sockaddr*, socklen_t);
+    SYSCALL_FUN(setsockopt, int, int, int, int, const void*, socklen_t);
+    SYSCALL_FUN(socket, int, int, int, int);
+    DLSYM_FUN_VA_ARGS(syscall, long, long);
+#ifndef EMBEDDED
+    DLSYM_FUN(system, int, const char*);
+#endif
+
+    /* Resolve all symbols that are looked up via dlsym() at once. */
+    void resolve_all(void);
 }
 
 #endif
@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <cstring>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ruleimage.hh"
+
+using namespace RuleImage;
+
+/* Accumulates the string table, storing every distinct string only once. */
+class StringTable
+{
+    std::string table;
+    std::unordered_map<std::string, uint32_t> offsets;
+
+    public:
+        StringTable() : table(), offsets() {}
+
+        StrRef add(const std::optional<std::string> &str)
+        {
+            if (!str)
+                return {StrRef::NONE, 0};
+
+            uint32_t length = static_cast<uint32_t>(str->size());
+
+            auto found = this->offsets.find(*str);
+            if (found != this->offsets.end())
+                return {found->second, length};
+
+            uint32_t offset = static_cast<uint32_t>(this->table.size());
+            this->table += *str;
+            this->offsets[*str] = offset;
+            return {offset, length};
+        }
+
+        inline const std::string &get(void) const {
+            return this->table;
+        }
+};
+
+template <typename T>
+static inline void append(std::string *out, const T &val)
+{
+    out->append(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+static MaybeError compile_rule(const Rule &rule, StringTable &strings,
+                               CompiledRule *out)
+{
+    memset(out, 0, sizeof(CompiledRule));
+
+    if (rule.direction) {
+        out->flags |= RULE_HAS_DIRECTION;
+        if (rule.direction == RuleDir::INCOMING)
+            out->flags |= RULE_INCOMING;
+    }
+
+    if (rule.type) {
+        out->flags |= RULE_HAS_TYPE;
+        out->type = static_cast<uint8_t>(rule.type.value());
+    }
+
+    out->family = AF_UNSPEC;
+    if (rule.address) {
+        const char *addr = rule.address->c_str();
+        if (inet_pton(AF_INET, addr, out->address) == 1)
+            out->family = AF_INET;
+        else if (inet_pton(AF_INET6, addr, out->address) == 1)
+            out->family = AF_INET6;
+        else
+            return "Address \"" + rule.address.value() + "\""
+                   " is not a valid IPv4 or IPv6 address.";
+    }
+
+    if (rule.port) {
+        out->flags |= RULE_HAS_PORT;
+        out->port = rule.port.value();
+    }
+
+    if (rule.port_end) {
+        out->flags |= RULE_HAS_PORT_END;
+        out->port_end = rule.port_end.value();
+    }
+
+#ifdef SYSTEMD_SUPPORT
+    if (rule.socket_activation)
+        out->flags |= RULE_SOCKET_ACTIVATION;
+    out->fd_name = strings.add(rule.fd_name);
+#else
+    out->fd_name = strings.add(std::nullopt);
+#endif
+
+    if (rule.reject)
+        out->flags |= RULE_REJECT;
+
+    if (rule.reject_errno) {
+        out->flags |= RULE_HAS_REJECT_ERRNO;
+        out->reject_errno = rule.reject_errno.value();
+    }
+
+    if (rule.blackhole)
+        out->flags |= RULE_BLACKHOLE;
+
+    if (rule.ignore)
+        out->flags |= RULE_IGNORE;
+
+    out->address_str = strings.add(rule.address);
+    out->host = strings.add(rule.host);
+    out->socket_path = strings.add(rule.socket_path);
+    return std::nullopt;
+}
+
+MaybeError RuleImage::compile(const std::vector<Rule> &rules, std::string *out)
+{
+    StringTable strings;
+    std::vector<CompiledRule> compiled(rules.size());
+    uint32_t flags = 0;
+
+    for (size_t i = 0; i < rules.size(); ++i) {
+        MaybeError err = compile_rule(rules[i], strings, &compiled[i]);
+        if (err)
+            return "Rule #" + std::to_string(i + 1) + ": " + *err;
+        if (compiled[i].flags & RULE_SOCKET_ACTIVATION)
+            flags |= IMAGE_SOCKET_ACTIVATION;
+    }
+
+    size_t rules_size = compiled.size() * sizeof(CompiledRule);
+    size_t total = sizeof(Header) + rules_size + strings.get().size();
+    if (total > UINT32_MAX)
+        return std::string("Rules are too large for a rule image.");
+
+    Header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.byte_order = BYTE_ORDER_MARK;
+    header.version = FORMAT_VERSION;
+    header.flags = flags;
+    header.socket_mask = SocketMask::for_rules(rules);
+    header.rule_count = static_cast<uint32_t>(compiled.size());
+    header.rules_offset = sizeof(Header);
+    header.strings_offset = static_cast<uint32_t>(sizeof(Header)
+                                                  + rules_size);
+    header.strings_size = static_cast<uint32_t>(strings.get().size());
+    header.total_size = static_cast<uint32_t>(total);
+
+    out->clear();
+    out->reserve(total);
+    append(out, header);
+    for (const CompiledRule &rule : compiled)
+        append(out, rule);
+    *out += strings.get();
+    return std::nullopt;
+}
+
+bool RuleImage::is_image(const void *data, size_t size)
+{
+    return size >= sizeof MAGIC && memcmp(data, MAGIC, sizeof MAGIC) == 0;
+}
+
+Image::Image(const void *imgdata, size_t size)
+    : data(static_cast<const char*>(imgdata))
+    , data_size(size)
+{
+}
+
+const Header *Image::header(void) const
+{
+    return reinterpret_cast<const Header*>(this->data);
+}
+
+const CompiledRule *Image::rule_at(size_t pos) const
+{
+    return reinterpret_cast<const CompiledRule*>(
+        this->data + this->header()->rules_offset
+    ) + pos;
+}
+
+bool Image::valid_strref(const StrRef &ref) const
+{
+    if (ref.offset == StrRef::NONE)
+        return true;
+
+    uint64_t end = static_cast<uint64_t>(ref.offset) + ref.length;
+    return end <= this->header()->strings_size;
+}
+
+MaybeError Image::validate(void) const
+{
+    if (!is_image(this->data, this->data_size))
+        return std::string("Invalid magic bytes for rule image.");
+
+    if (this->data_size < sizeof(Header))
+        return std::string("Rule image header is truncated.");
+
+    const Header *hdr = this->header();
+
+    if (hdr->byte_order != BYTE_ORDER_MARK)
+        return std::string("Rule image has been created on a machine with"
+                           " a different byte order.");
+
+    if (hdr->version != FORMAT_VERSION)
+        return "Unsupported rule image version "
+             + std::to_string(hdr->version) + ", expected version "
+             + std::to_string(FORMAT_VERSION) + '.';
+
+    if (hdr->total_size > this->data_size)
+        return std::string("Rule image is truncated.");
+
+    uint64_t rules_end = hdr->rules_offset
+                       + static_cast<uint64_t>(hdr->rule_count)
+                       * sizeof(CompiledRule);
+
+    if (hdr->rules_offset < sizeof(Header)
+        || hdr->rules_offset % alignof(CompiledRule) != 0
+        || rules_end > hdr->strings_offset)
+        return std::string("Invalid offset for rules in rule image.");
+
+    uint64_t strings_end = static_cast<uint64_t>(hdr->strings_offset)
+                         + hdr->strings_size;
+    if (strings_end > hdr->total_size)
+        return std::string("Invalid string table in rule image.");
+
+    for (size_t i = 0; i < hdr->rule_count; ++i) {
+        const CompiledRule *rule = this->rule_at(i);
+        if (!this->valid_strref(rule->address_str)
+            || !this->valid_strref(rule->host)
+            || !this->valid_strref(rule->socket_path)
+            || !this->valid_strref(rule->fd_name))
+            return "Invalid string reference in rule #"
+                 + std::to_string(i + 1) + " of rule image.";
+
+        if (rule->family != AF_UNSPEC && rule->family != AF_INET
+            && rule->family != AF_INET6)
+            return "Invalid address family in rule #"
+                 + std::to_string(i + 1) + " of rule image.";
+    }
+
+    return std::nullopt;
+}
+
+size_t Image::size(void) const
+{
+    return this->header()->rule_count;
+}
+
+bool Image::has_socket_activation(void) const
+{
+    return this->header()->flags & IMAGE_SOCKET_ACTIVATION;
+}
+
+SocketMask::Mask Image::socket_mask(void) const
+{
+    return this->header()->socket_mask;
+}
+
+bool Image::matches(size_t pos, const SockAddr &addr, SocketType type,
+                    RuleDir dir) const
+{
+    const CompiledRule *rule = this->rule_at(pos);
+
+    if (rule->flags & RULE_HAS_DIRECTION) {
+        bool incoming = rule->flags & RULE_INCOMING;
+        if (incoming != (dir == RuleDir::INCOMING))
+            return false;
+    }
+
+    if (rule->flags & RULE_HAS_TYPE && static_cast<uint8_t>(type) != rule->type)
+        return false;
+
+    if (rule->family != AF_UNSPEC
+        && !addr.host_equals(rule->family, rule->address))
+        return false;
+
+    if (rule->flags & RULE_HAS_PORT) {
+        std::optional<uint16_t> addrport = addr.get_port();
+        if (addrport && rule->flags & RULE_HAS_PORT_END) {
+            if (rule->port > addrport.value())
+                return false;
+            if (rule->port_end < addrport.value())
+                return false;
+        } else if (addrport != rule->port) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::optional<std::string> Image::get_string(const StrRef &ref) const
+{
+    if (ref.offset == StrRef::NONE)
+        return std::nullopt;
+
+    const char *strings = this->data + this->header()->strings_offset;
+    return std::string(strings + ref.offset, ref.length);
+}
+
+Rule Image::get(size_t pos) const
+{
+    const CompiledRule *compiled = this->rule_at(pos);
+    uint16_t flags = compiled->flags;
+    Rule rule;
+
+    if (flags & RULE_HAS_DIRECTION)
+        rule.direction = flags & RULE_INCOMING ? RuleDir::INCOMING
+                                               : RuleDir::OUTGOING;
+
+    if (flags & RULE_HAS_TYPE)
+        rule.type = static_cast<SocketType>(compiled->type);
+
+    rule.address = this->get_string(compiled->address_str);
+    rule.host = this->get_string(compiled->host);
+
+    if (flags & RULE_HAS_PORT)
+        rule.port = compiled->port;
+
+    if (flags & RULE_HAS_PORT_END)
+        rule.port_end = compiled->port_end;
+
+#ifdef SYSTEMD_SUPPORT
+    rule.socket_activation = flags & RULE_SOCKET_ACTIVATION;
+    rule.fd_name = this->get_string(compiled->fd_name);
+#endif
+
+    rule.socket_path = this->get_string(compiled->socket_path);
+    rule.reject = flags & RULE_REJECT;
+
+    if (flags & RULE_HAS_REJECT_ERRNO)
+        rule.reject_errno = compiled->reject_errno;
+
+    rule.blackhole = flags & RULE_BLACKHOLE;
+    rule.ignore = flags & RULE_IGNORE;
+    return rule;
+}
+
+std::vector<Rule> Image::get_all(void) const
+{
+    std::vector<Rule> rules;
+    rules.reserve(this->size());
+    for (size_t i = 0; i < this->size(); ++i)
+        rules.push_back(this->get(i));
+    return rules;
+}
+
+std::optional<Image> RuleImage::map(int fd, std::string *err)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        *err = std::string("Unable to stat rule image: ") + strerror(errno);
+        return std::nullopt;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(Header)) {
+        *err = "Rule image is truncated.";
+        return std::nullopt;
+    }
+
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+        *err = std::string("Unable to map rule image: ") + strerror(errno);
+        return std::nullopt;
+    }
+
+    Image image(ptr, size);
+    MaybeError validation_err = image.validate();
+    if (validation_err) {
+        munmap(ptr, size);
+        *err = *validation_err;
+        return std::nullopt;
+    }
+
+    return image;
+}
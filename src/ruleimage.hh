@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_RULEIMAGE_HH
+#define IP2UNIX_RULEIMAGE_HH
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "rules.hh"
+#include "serial.hh"
+#include "sockaddr.hh"
+#include "socketmask.hh"
+
+/*
+ * A compiled representation of rules which can be mapped into memory and used
+ * in place without any parsing. All references within the image are offsets
+ * relative to its start, so the image is position-independent.
+ *
+ * The image is only meant to be exchanged between the ip2unix command and the
+ * preload library of the same build on the same machine, so all values are
+ * stored in host byte order.
+ */
+namespace RuleImage {
+    /* Bump this whenever the layout of any of the structures below changes. */
+    constexpr uint32_t FORMAT_VERSION = 3;
+
+    constexpr char MAGIC[8] = {'I', 'P', '2', 'U', 'R', 'I', 'M', 'G'};
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    /* Flags for the whole image. */
+    constexpr uint32_t IMAGE_SOCKET_ACTIVATION = 1 << 0;
+
+    struct Header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t version;
+        uint32_t flags;
+        /* See socketmask.hh. */
+        uint32_t socket_mask;
+        uint32_t rule_count;
+        uint32_t rules_offset;
+        uint32_t strings_offset;
+        uint32_t strings_size;
+        uint32_t total_size;
+    };
+
+    /* A string within the string table, which is interned so that equal
+     * strings (eg. socket paths used by several rules) are only stored once.
+     */
+    struct StrRef {
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    /* Flags for a single rule. */
+    constexpr uint16_t RULE_HAS_DIRECTION     = 1 << 0;
+    constexpr uint16_t RULE_INCOMING          = 1 << 1;
+    constexpr uint16_t RULE_HAS_TYPE          = 1 << 2;
+    constexpr uint16_t RULE_HAS_PORT          = 1 << 3;
+    constexpr uint16_t RULE_HAS_PORT_END      = 1 << 4;
+    constexpr uint16_t RULE_SOCKET_ACTIVATION = 1 << 5;
+    constexpr uint16_t RULE_REJECT            = 1 << 6;
+    constexpr uint16_t RULE_HAS_REJECT_ERRNO  = 1 << 7;
+    constexpr uint16_t RULE_BLACKHOLE         = 1 << 8;
+    constexpr uint16_t RULE_IGNORE            = 1 << 9;
+
+    struct CompiledRule {
+        uint16_t flags;
+        uint8_t type;
+
+        /* Either AF_INET or AF_INET6 if the rule has an address, otherwise
+         * AF_UNSPEC. The address is stored in network byte order, just like
+         * in in_addr or in6_addr.
+         */
+        uint8_t family;
+        uint8_t address[16];
+
+        uint16_t port;
+        uint16_t port_end;
+        int32_t reject_errno;
+
+        /* The address as written in the original rule. */
+        StrRef address_str;
+        StrRef host;
+        StrRef socket_path;
+        StrRef fd_name;
+    };
+
+    /* Compile the given rules into an image written to the output string. */
+    MaybeError compile(const std::vector<Rule>&, std::string*);
+
+    /* Whether the given data starts with the magic bytes of an image. */
+    bool is_image(const void*, size_t);
+
+    class Image
+    {
+        public:
+            /* Create a view on an image, which is not copied. */
+            Image(const void*, size_t);
+            Image(const Image&) = default;
+            Image &operator=(const Image&) = default;
+
+            /* Check whether the image is complete and consistent, which needs
+             * to be done before using any of the functions below.
+             */
+            MaybeError validate(void) const;
+
+            size_t size(void) const;
+            bool has_socket_activation(void) const;
+            SocketMask::Mask socket_mask(void) const;
+
+            /* Whether the rule at the given position matches the socket
+             * address, type and direction without materialising the rule.
+             */
+            bool matches(size_t, const SockAddr&, SocketType, RuleDir) const;
+
+            Rule get(size_t) const;
+            std::vector<Rule> get_all(void) const;
+
+        private:
+            const Header *header(void) const;
+            const CompiledRule *rule_at(size_t) const;
+            std::optional<std::string> get_string(const StrRef&) const;
+            bool valid_strref(const StrRef&) const;
+
+            const char *data;
+            size_t data_size;
+    };
+
+    /* Map an image from a file descriptor (eg. a memfd) read-only. */
+    std::optional<Image> map(int, std::string*);
+}
+
+#endif
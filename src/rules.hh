@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <optional>
+#include <string_view>
 #include <vector>
 
 #include <netinet/in.h>
@@ -16,6 +17,8 @@ struct Rule {
     std::optional<RuleDir> direction = std::nullopt;
     std::optional<SocketType> type = std::nullopt;
     std::optional<std::string> address = std::nullopt;
+    /* If set, the address is a synthetic one the host name resolves to. */
+    std::optional<std::string> host = std::nullopt;
     std::optional<uint16_t> port = std::nullopt;
     std::optional<uint16_t> port_end = std::nullopt;
 
@@ -36,6 +39,18 @@ struct Rule {
 bool is_yaml_rule_file(std::string);
 std::optional<std::vector<Rule>> parse_rules(std::string, bool);
 std::optional<Rule> parse_rule_arg(size_t, const std::string&);
+std::optional<Rule> parse_rule_arg(size_t, std::string_view, std::string*);
+std::optional<std::vector<Rule>>
+    parse_rule_args(const std::vector<std::string_view>&);
+void split_rule_args(std::string_view, std::vector<std::string_view>&);
 void print_rules(std::vector<Rule>&, std::ostream&);
+std::string format_rule_arg(const Rule&);
+std::string make_absolute(std::string_view);
+std::optional<std::string> check_hosts(const std::vector<Rule>&);
+std::optional<std::vector<uint64_t>> read_rule_hits(const std::string&, size_t);
+std::optional<std::vector<Rule>>
+    optimize_rules(const std::vector<Rule>&, const std::vector<uint64_t>&,
+                   std::ostream&);
+void emit_rules(const std::vector<Rule>&, std::ostream&);
 
 #endif
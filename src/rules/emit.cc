@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <cstdio>
+#include <map>
+
+#include <arpa/inet.h>
+
+#include "../rules.hh"
+
+/*
+ * Generates the translation unit for a preload library with baked-in rules,
+ * see baked.hh for the interface the generated code needs to provide.
+ */
+
+static std::string cxx_string(const std::optional<std::string> &str)
+{
+    if (!str)
+        return "nullptr";
+
+    std::string out = "\"";
+    for (const char &c : *str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20 || c > 0x7e) {
+            char buf[5];
+            snprintf(buf, sizeof buf, "\\%03o", static_cast<unsigned char>(c));
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+template <typename T>
+static std::string cxx_optional(const std::optional<T> &val)
+{
+    return val ? std::to_string(*val) : "std::nullopt";
+}
+
+static std::string cxx_direction(const std::optional<RuleDir> &dir)
+{
+    if (!dir)
+        return "std::nullopt";
+    return *dir == RuleDir::INCOMING ? "RuleDir::INCOMING"
+                                     : "RuleDir::OUTGOING";
+}
+
+static std::string cxx_type(const std::optional<SocketType> &type)
+{
+    if (!type)
+        return "std::nullopt";
+
+    switch (*type) {
+        case SocketType::TCP:
+            return "SocketType::TCP";
+        case SocketType::UDP:
+            return "SocketType::UDP";
+        case SocketType::INVALID:
+            break;
+    }
+    return "SocketType::INVALID";
+}
+
+static const char *cxx_bool(bool val)
+{
+    return val ? "true" : "false";
+}
+
+/* Whether match_rule() would return the rule at all if it matches. */
+static bool has_action(const Rule &rule)
+{
+#ifdef SYSTEMD_SUPPORT
+    if (rule.socket_activation)
+        return true;
+#endif
+    return rule.socket_path || rule.reject || rule.blackhole || rule.ignore;
+}
+
+/*
+ * Generate the conditions for matching direction, type and address of the
+ * rule, which is empty if the rule matches everything.
+ */
+static std::string match_conditions(const Rule &rule, size_t pos)
+{
+    std::vector<std::string> conds;
+
+    if (rule.direction)
+        conds.push_back("dir == " + cxx_direction(rule.direction));
+
+    if (rule.type)
+        conds.push_back("type == " + cxx_type(rule.type));
+
+    if (rule.address) {
+        unsigned char buf[sizeof(in6_addr)];
+        if (inet_pton(AF_INET, rule.address->c_str(), buf) == 1)
+            conds.push_back("addr.host_equals(AF_INET, ADDR_"
+                            + std::to_string(pos) + ".data())");
+        else
+            conds.push_back("addr.host_equals(AF_INET6, ADDR_"
+                            + std::to_string(pos) + ".data())");
+    }
+
+    std::string out;
+    for (const std::string &cond : conds)
+        out += (out.empty() ? "" : " && ") + cond;
+    return out;
+}
+
+static void emit_address(std::ostream &out, const Rule &rule, size_t pos)
+{
+    unsigned char buf[sizeof(in6_addr)];
+    size_t len;
+
+    if (inet_pton(AF_INET, rule.address->c_str(), buf) == 1)
+        len = sizeof(in_addr);
+    else if (inet_pton(AF_INET6, rule.address->c_str(), buf) == 1)
+        len = sizeof(in6_addr);
+    else
+        return;
+
+    out << "    constexpr std::array<uint8_t, " << len << "> ADDR_" << pos
+        << " = {";
+    for (size_t i = 0; i < len; ++i)
+        out << (i == 0 ? "" : ", ") << static_cast<unsigned>(buf[i]);
+    out << "};" << std::endl;
+}
+
+/*
+ * Emit the checks for the given rules in order. Exact ports are already
+ * handled by the switch statement, so the port only needs to be checked for
+ * port ranges outside of it. Returns false if one of the rules matches
+ * unconditionally, so that code after it would be unreachable.
+ */
+static bool emit_checks(std::ostream &out, const std::vector<Rule> &rules,
+                        const std::vector<size_t> &positions,
+                        const std::string &indent, bool check_range)
+{
+    for (size_t pos : positions) {
+        const Rule &rule = rules[pos];
+        std::string conds = match_conditions(rule, pos);
+
+        if (check_range && rule.port && rule.port_end) {
+            std::string range = "port && *port >= "
+                              + std::to_string(*rule.port)
+                              + " && *port <= "
+                              + std::to_string(*rule.port_end);
+            conds = conds.empty() ? range : range + " && " + conds;
+        }
+
+        if (conds.empty()) {
+            out << indent << "return " << pos << ';' << std::endl;
+            return false;
+        }
+
+        out << indent << "if (" << conds << ')' << std::endl
+            << indent << "    return " << pos << ';' << std::endl;
+    }
+    return true;
+}
+
+void emit_rules(const std::vector<Rule> &rules, std::ostream &out)
+{
+    bool uses_udp = false, uses_reject = false, uses_blackhole = false;
+    bool uses_socket_activation = false, uses_hosts = false;
+
+    for (const Rule &rule : rules) {
+        if (!has_action(rule))
+            continue;
+        if (rule.type != SocketType::TCP && !rule.ignore)
+            uses_udp = true;
+        uses_reject |= rule.reject;
+        uses_blackhole |= rule.blackhole;
+        uses_hosts |= rule.host.has_value();
+#ifdef SYSTEMD_SUPPORT
+        uses_socket_activation |= rule.socket_activation;
+#endif
+    }
+
+    out << "// Generated by ip2unix " VERSION " via --emit, do not edit."
+        << std::endl << "#include \"baked.hh\"" << std::endl << std::endl
+        << "namespace Baked {" << std::endl
+        << "    constexpr bool USES_UDP = " << cxx_bool(uses_udp) << ';'
+        << std::endl
+        << "    constexpr bool USES_REJECT = " << cxx_bool(uses_reject) << ';'
+        << std::endl
+        << "    constexpr bool USES_BLACKHOLE = " << cxx_bool(uses_blackhole)
+        << ';' << std::endl
+        << "    constexpr bool USES_SOCKET_ACTIVATION = "
+        << cxx_bool(uses_socket_activation) << ';' << std::endl
+        << "    constexpr bool USES_HOSTS = " << cxx_bool(uses_hosts) << ';'
+        << std::endl << std::endl;
+
+    out << "    constexpr std::array<RuleData, " << rules.size() << "> RULES"
+        << " = {{" << std::endl;
+    for (const Rule &rule : rules) {
+#ifdef SYSTEMD_SUPPORT
+        bool socket_activation = rule.socket_activation;
+        std::optional<std::string> fd_name = rule.fd_name;
+#else
+        bool socket_activation = false;
+        std::optional<std::string> fd_name = std::nullopt;
+#endif
+        out << "        {" << cxx_direction(rule.direction) << ", "
+            << cxx_type(rule.type) << ", " << cxx_string(rule.address) << ", "
+            << cxx_string(rule.host) << ", "
+            << cxx_optional(rule.port) << ", " << cxx_optional(rule.port_end)
+            << ", " << cxx_bool(socket_activation) << ", "
+            << cxx_string(fd_name) << ", " << cxx_string(rule.socket_path)
+            << ", " << cxx_bool(rule.reject) << ", "
+            << cxx_optional(rule.reject_errno) << ", "
+            << cxx_bool(rule.blackhole) << ", " << cxx_bool(rule.ignore)
+            << "}," << std::endl;
+    }
+    out << "    }};" << std::endl << std::endl;
+
+    /* Rules without an action are skipped by match_rule() anyway, so we can
+     * leave them out entirely.
+     */
+    std::vector<size_t> effective;
+    for (size_t pos = 0; pos < rules.size(); ++pos) {
+        if (!has_action(rules[pos]))
+            continue;
+        effective.push_back(pos);
+        if (rules[pos].address)
+            emit_address(out, rules[pos], pos);
+    }
+
+    /* For every port number used by a rule without a port range, the rules
+     * that can match this port in the order they were specified.
+     */
+    std::map<uint16_t, std::vector<size_t>> by_port;
+    for (size_t pos : effective) {
+        if (rules[pos].port && !rules[pos].port_end)
+            by_port[*rules[pos].port];
+    }
+
+    std::vector<size_t> other_ports;
+    for (size_t pos : effective) {
+        const Rule &rule = rules[pos];
+        for (auto &item : by_port) {
+            if (!rule.port || (rule.port_end ? item.first >= *rule.port &&
+                                               item.first <= *rule.port_end
+                                             : item.first == *rule.port))
+                item.second.push_back(pos);
+        }
+        if (!rule.port || rule.port_end)
+            other_ports.push_back(pos);
+    }
+
+    out << std::endl
+        << "    static inline std::optional<size_t>" << std::endl
+        << "        match([[maybe_unused]] const SockAddr &addr,"
+        << std::endl
+        << "              [[maybe_unused]] SocketType type,"
+        << std::endl
+        << "              [[maybe_unused]] RuleDir dir)"
+        << std::endl << "    {" << std::endl
+        << "        [[maybe_unused]] std::optional<uint16_t> port ="
+        << " addr.get_port();" << std::endl;
+
+    if (!by_port.empty()) {
+        out << "        if (port) {" << std::endl
+            << "            switch (*port) {" << std::endl;
+        for (const auto &item : by_port) {
+            out << "                case " << item.first << ':' << std::endl;
+            if (emit_checks(out, rules, item.second, "                    ",
+                            false))
+                out << "                    return std::nullopt;"
+                    << std::endl;
+        }
+        out << "                default:" << std::endl
+            << "                    break;" << std::endl
+            << "            }" << std::endl
+            << "        }" << std::endl;
+    }
+
+    if (emit_checks(out, rules, other_ports, "        ", true))
+        out << "        return std::nullopt;" << std::endl;
+
+    out << "    }" << std::endl << '}' << std::endl << std::endl
+        << "#include \"preload.cc\"" << std::endl;
+}
@@ -0,0 +1,485 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <arpa/inet.h>
+
+#include "../rules.hh"
+
+/*
+ * Rewrites a list of rules into one that's cheaper to match against but
+ * behaves exactly the same, since match_rule() returns the first rule that
+ * matches, so both the order and the number of rules matter.
+ *
+ * Every transformation is only done if it can't change which action is taken
+ * for any socket address, type and direction. Rules using socket activation
+ * are never removed, merged or moved past each other, because the systemd
+ * file descriptors are assigned based on the rule positions.
+ */
+
+using PortRange = std::pair<uint16_t, uint16_t>;
+
+struct OptRule {
+    Rule rule;
+    /* Positions (starting at 1) of the original rules this one is made of. */
+    std::vector<size_t> origins;
+    uint64_t hits;
+};
+
+static unsigned dir_mask(const Rule &rule)
+{
+    if (!rule.direction)
+        return 3;
+    return *rule.direction == RuleDir::INCOMING ? 1 : 2;
+}
+
+static unsigned type_mask(const Rule &rule)
+{
+    if (!rule.type)
+        return 7;
+
+    switch (*rule.type) {
+        case SocketType::TCP:
+            return 1;
+        case SocketType::UDP:
+            return 2;
+        case SocketType::INVALID:
+            break;
+    }
+    return 4;
+}
+
+/* Returns std::nullopt if the rule matches any port (or none at all). */
+static std::optional<PortRange> port_range(const Rule &rule)
+{
+    if (!rule.port)
+        return std::nullopt;
+    return PortRange(*rule.port, rule.port_end.value_or(*rule.port));
+}
+
+/* The binary representation of an address, so that different spellings of
+ * the same address are considered to be overlapping.
+ */
+static std::string address_key(const std::string &addr)
+{
+    unsigned char buf[sizeof(in6_addr)];
+
+    if (inet_pton(AF_INET, addr.c_str(), buf) == 1)
+        return std::string("4") + std::string(reinterpret_cast<char*>(buf),
+                                              sizeof(in_addr));
+    if (inet_pton(AF_INET6, addr.c_str(), buf) == 1)
+        return std::string("6") + std::string(reinterpret_cast<char*>(buf),
+                                              sizeof(in6_addr));
+    return addr;
+}
+
+static bool uses_socket_activation([[maybe_unused]] const Rule &rule)
+{
+#ifdef SYSTEMD_SUPPORT
+    return rule.socket_activation;
+#else
+    return false;
+#endif
+}
+
+/* Whether every socket matched by "b" is also matched by "a" when ignoring
+ * the port.
+ */
+static bool covers_except_port(const Rule &a, const Rule &b)
+{
+    if ((dir_mask(a) & dir_mask(b)) != dir_mask(b))
+        return false;
+    if ((type_mask(a) & type_mask(b)) != type_mask(b))
+        return false;
+    return !a.address || (b.address && *a.address == *b.address);
+}
+
+static bool covers(const Rule &a, const Rule &b)
+{
+    if (!covers_except_port(a, b))
+        return false;
+
+    std::optional<PortRange> pa = port_range(a), pb = port_range(b);
+    return !pa || (pb && pa->first <= pb->first && pb->second <= pa->second);
+}
+
+/* Whether there is at least one socket that could be matched by both. */
+static bool overlaps(const Rule &a, const Rule &b)
+{
+    if (!(dir_mask(a) & dir_mask(b)) || !(type_mask(a) & type_mask(b)))
+        return false;
+
+    if (a.address && b.address &&
+        address_key(*a.address) != address_key(*b.address))
+        return false;
+
+    std::optional<PortRange> pa = port_range(a), pb = port_range(b);
+    return !pa || !pb || (pa->first <= pb->second && pb->first <= pa->second);
+}
+
+/* Whether it makes no difference which of the two rules has matched. */
+static bool same_action(const Rule &a, const Rule &b)
+{
+    if (uses_socket_activation(a) || uses_socket_activation(b))
+        return false;
+
+    return a.socket_path == b.socket_path && a.reject == b.reject
+        && a.reject_errno == b.reject_errno && a.blackhole == b.blackhole
+        && a.ignore == b.ignore;
+}
+
+static std::string rule_list(const std::vector<size_t> &positions)
+{
+    std::string out;
+    for (size_t pos : positions)
+        out += (out.empty() ? "#" : ", #") + std::to_string(pos);
+    return out;
+}
+
+/*
+ * Find the rules before the given one that together match everything the
+ * rule itself would match, so that it can never match. Apart from the port,
+ * a single rule needs to cover it, but port ranges may be split up between
+ * several rules.
+ */
+static std::optional<std::vector<size_t>>
+    find_shadowing(const std::vector<OptRule> &rules, size_t pos)
+{
+    const Rule &rule = rules[pos].rule;
+    std::optional<PortRange> range = port_range(rule);
+    std::vector<std::pair<PortRange, size_t>> parts;
+
+    for (size_t i = 0; i < pos; ++i) {
+        if (!covers_except_port(rules[i].rule, rule))
+            continue;
+
+        std::optional<PortRange> other = port_range(rules[i].rule);
+        if (!other)
+            return std::vector<size_t>{rules[i].origins.front()};
+        if (range && other->second >= range->first &&
+            other->first <= range->second)
+            parts.emplace_back(*other, rules[i].origins.front());
+    }
+
+    if (!range)
+        return std::nullopt;
+
+    std::sort(parts.begin(), parts.end());
+
+    std::set<size_t> by;
+    uint32_t next = range->first;
+    for (const auto &part : parts) {
+        if (part.first.first > next)
+            break;
+        if (part.first.second + 1U > next) {
+            next = part.first.second + 1U;
+            by.insert(part.second);
+        }
+        if (next > range->second)
+            return std::vector<size_t>(by.begin(), by.end());
+    }
+
+    return std::nullopt;
+}
+
+/*
+ * A rule is redundant if a later rule with the same action matches everything
+ * it does and the rules in between either don't overlap with it or have the
+ * same action as well.
+ */
+static std::optional<size_t> find_covering(const std::vector<OptRule> &rules,
+                                           size_t pos)
+{
+    const Rule &rule = rules[pos].rule;
+
+    for (size_t i = pos + 1; i < rules.size(); ++i) {
+        const Rule &other = rules[i].rule;
+        if (!overlaps(rule, other))
+            continue;
+        if (!same_action(rule, other))
+            return std::nullopt;
+        if (covers(other, rule))
+            return i;
+    }
+
+    return std::nullopt;
+}
+
+/*
+ * Check whether the rule at "later" can be merged into the one at "pos" by
+ * extending its port range, which is the case if both only differ in their
+ * port ranges, the ranges are adjacent or overlapping, and no rule in between
+ * with a different action could match the ports added to the earlier rule.
+ */
+static bool can_merge(const std::vector<OptRule> &rules, size_t pos,
+                      size_t later)
+{
+    const Rule &a = rules[pos].rule, &b = rules[later].rule;
+
+    if (!same_action(a, b) || dir_mask(a) != dir_mask(b) ||
+        type_mask(a) != type_mask(b) || a.address != b.address ||
+        a.host != b.host)
+        return false;
+
+    std::optional<PortRange> pa = port_range(a), pb = port_range(b);
+    if (!pa || !pb || pb->first > pa->second + 1U ||
+        pa->first > pb->second + 1U)
+        return false;
+
+    for (size_t i = pos + 1; i < later; ++i) {
+        if (overlaps(rules[i].rule, b) && !same_action(rules[i].rule, b))
+            return false;
+    }
+
+    return true;
+}
+
+static void merge_into(OptRule &target, const OptRule &other)
+{
+    PortRange pa = *port_range(target.rule), pb = *port_range(other.rule);
+    uint16_t first = std::min(pa.first, pb.first);
+    uint16_t last = std::max(pa.second, pb.second);
+
+    target.rule.port = first;
+    if (first == last)
+        target.rule.port_end = std::nullopt;
+    else
+        target.rule.port_end = last;
+
+    target.origins.insert(target.origins.end(), other.origins.begin(),
+                          other.origins.end());
+    target.hits += other.hits;
+}
+
+/*
+ * Returns a string identifying the action of the first rule matching the
+ * given socket, which for rules using socket activation includes the number
+ * of the rule among all socket activation rules.
+ */
+static std::string match_action(const std::vector<Rule> &rules, RuleDir dir,
+                                SocketType type,
+                                const std::optional<std::string> &addr,
+                                const std::optional<uint16_t> &port)
+{
+    size_t activation_pos = 0;
+
+    for (const Rule &rule : rules) {
+        bool matches = true;
+
+        if (rule.direction && rule.direction != dir)
+            matches = false;
+        else if (rule.type && rule.type != type)
+            matches = false;
+        else if (rule.address && rule.address != addr)
+            matches = false;
+        else if (rule.port)
+            matches = port && *port >= *rule.port
+                   && *port <= rule.port_end.value_or(*rule.port);
+
+        if (uses_socket_activation(rule)) {
+            if (matches)
+                return "systemd " + std::to_string(activation_pos);
+            ++activation_pos;
+        }
+
+        if (!matches)
+            continue;
+
+        if (rule.ignore)
+            return "ignore";
+        if (rule.blackhole)
+            return "blackhole";
+        if (rule.reject)
+            return "reject " + std::to_string(rule.reject_errno.value_or(-1));
+        return "path " + rule.socket_path.value_or("");
+    }
+
+    return "none";
+}
+
+/*
+ * Check whether two lists of rules take the same action for every possible
+ * socket. This only needs to check one representative for every distinct
+ * combination of rule boundaries, because within these the outcome of
+ * matching can't change.
+ */
+static bool is_equivalent(const std::vector<Rule> &a,
+                          const std::vector<Rule> &b)
+{
+    std::set<std::optional<std::string>> addrs = {std::nullopt};
+    std::set<std::optional<uint16_t>> ports = {std::nullopt, 0};
+
+    for (const std::vector<Rule> *rules : {&a, &b}) {
+        for (const Rule &rule : *rules) {
+            if (rule.address)
+                addrs.insert(rule.address);
+
+            std::optional<PortRange> range = port_range(rule);
+            if (!range)
+                continue;
+            ports.insert(range->first);
+            if (range->second < 65535)
+                ports.insert(static_cast<uint16_t>(range->second + 1));
+        }
+    }
+
+    for (RuleDir dir : {RuleDir::INCOMING, RuleDir::OUTGOING}) {
+        for (SocketType type : {SocketType::TCP, SocketType::UDP,
+                                SocketType::INVALID}) {
+            for (const std::optional<std::string> &addr : addrs) {
+                for (const std::optional<uint16_t> &port : ports) {
+                    if (match_action(a, dir, type, addr, port) !=
+                        match_action(b, dir, type, addr, port))
+                        return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+std::optional<std::vector<uint64_t>> read_rule_hits(const std::string &file,
+                                                    size_t count)
+{
+    std::ifstream input(file);
+
+    if (!input.is_open()) {
+        std::cerr << "Error opening hit count file '" << file << "'."
+                  << std::endl;
+        return std::nullopt;
+    }
+
+    std::vector<uint64_t> hits(count, 0);
+    std::string line;
+    size_t lineno = 0;
+
+    while (std::getline(input, line)) {
+        std::istringstream fields(line);
+        std::string first;
+        ++lineno;
+
+        if (!(fields >> first))
+            continue;
+
+        if (first == "#") {
+            size_t rules;
+            if (fields >> rules && rules != count) {
+                std::cerr << "Hit counts in '" << file << "' have been"
+                          << " recorded for " << rules << " rule(s), but "
+                          << count << " rule(s) were given." << std::endl;
+                return std::nullopt;
+            }
+            continue;
+        }
+
+        size_t pos;
+        uint64_t value;
+        std::istringstream posfield(first);
+        if (!(posfield >> pos) || !(fields >> value) || pos == 0 ||
+            pos > count) {
+            std::cerr << "Invalid hit count in '" << file << "' on line "
+                      << lineno << '.' << std::endl;
+            return std::nullopt;
+        }
+        hits[pos - 1] += value;
+    }
+
+    return hits;
+}
+
+std::optional<std::vector<Rule>>
+    optimize_rules(const std::vector<Rule> &input,
+                   const std::vector<uint64_t> &hits, std::ostream &log)
+{
+    std::vector<OptRule> rules;
+    for (size_t i = 0; i < input.size(); ++i)
+        rules.push_back({input[i], {i + 1}, i < hits.size() ? hits[i] : 0});
+
+    for (size_t i = 0; i < rules.size();) {
+        std::optional<std::vector<size_t>> by = find_shadowing(rules, i);
+        if (!by) {
+            ++i;
+            continue;
+        }
+
+        log << "Rule #" << rules[i].origins.front() << " is shadowed by rule"
+            << (by->size() > 1 ? "s " : " ") << rule_list(*by);
+        if (uses_socket_activation(rules[i].rule)) {
+            log << " but uses socket activation, keeping it." << std::endl;
+            ++i;
+            continue;
+        }
+        log << ", removing it." << std::endl;
+        rules.erase(rules.begin() + static_cast<ptrdiff_t>(i));
+    }
+
+    for (size_t i = 0; i < rules.size();) {
+        std::optional<size_t> by = find_covering(rules, i);
+        if (!by) {
+            ++i;
+            continue;
+        }
+
+        log << "Rule #" << rules[i].origins.front() << " is redundant to"
+            << " rule #" << rules[*by].origins.front() << ", removing it."
+            << std::endl;
+        rules[*by].hits += rules[i].hits;
+        rules.erase(rules.begin() + static_cast<ptrdiff_t>(i));
+    }
+
+    for (size_t i = 0; i < rules.size(); ++i) {
+        for (size_t j = i + 1; j < rules.size();) {
+            if (!can_merge(rules, i, j)) {
+                ++j;
+                continue;
+            }
+
+            log << "Merging port range of rule #" << rules[j].origins.front()
+                << " into rule #" << rules[i].origins.front() << '.'
+                << std::endl;
+            merge_into(rules[i], rules[j]);
+            rules.erase(rules.begin() + static_cast<ptrdiff_t>(j));
+            /* The extended range might now be adjacent to rules we've
+             * already skipped.
+             */
+            j = i + 1;
+        }
+    }
+
+    /* Move rules with more hits in front of rules with fewer hits as long as
+     * they can't match the same sockets, so that their relative order doesn't
+     * matter.
+     */
+    size_t moved = 0;
+    for (size_t i = 1; i < rules.size(); ++i) {
+        for (size_t j = i; j > 0; --j) {
+            const OptRule &prev = rules[j - 1], &cur = rules[j];
+            if (prev.hits >= cur.hits || overlaps(prev.rule, cur.rule))
+                break;
+            if (uses_socket_activation(prev.rule) &&
+                uses_socket_activation(cur.rule))
+                break;
+            std::swap(rules[j - 1], rules[j]);
+            if (j == i)
+                ++moved;
+        }
+    }
+    if (moved > 0)
+        log << "Moved " << moved << " rule(s) ahead of rules with fewer"
+            << " hits." << std::endl;
+
+    std::vector<Rule> result;
+    for (const OptRule &rule : rules)
+        result.push_back(rule.rule);
+
+    if (!is_equivalent(input, result)) {
+        log << "Optimised rules don't match the same sockets as the original"
+            << " rules, this is a bug." << std::endl;
+        return std::nullopt;
+    }
+
+    return result;
+}
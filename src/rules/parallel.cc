@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "../rules.hh"
+
+/* Below this number of rules per thread, spawning threads isn't worth it. */
+#define MIN_RULES_PER_JOB 4096
+
+/*
+ * A contiguous range of rule arguments parsed by a single thread, which stops
+ * at the first invalid rule and remembers its error message.
+ */
+struct ParseJob {
+    size_t start;
+    size_t end;
+    std::optional<size_t> failed = std::nullopt;
+    std::string error = "";
+};
+
+static void run_job(const std::vector<std::string_view> &args,
+                    std::vector<Rule> &rules, ParseJob &job,
+                    std::atomic<size_t> &first_failed)
+{
+    for (size_t i = job.start; i < job.end; ++i) {
+        /* An earlier rule is already invalid and only the first error is
+         * reported, so there is no need to parse any further.
+         */
+        if (first_failed.load(std::memory_order_relaxed) < i)
+            return;
+
+        std::optional<Rule> rule = parse_rule_arg(i + 1, args[i], &job.error);
+        if (!rule) {
+            job.failed = i;
+            size_t current = first_failed.load(std::memory_order_relaxed);
+            while (i < current && !first_failed.compare_exchange_weak(
+                current, i, std::memory_order_relaxed
+            ));
+            return;
+        }
+        rules[i] = std::move(*rule);
+    }
+}
+
+/*
+ * Parse a list of rule arguments, splitting the work across multiple threads
+ * for large rule sets. The output (including error messages) is the same as
+ * parsing every rule in order via parse_rule_arg(), since only the error of
+ * the first invalid rule is printed.
+ */
+std::optional<std::vector<Rule>>
+    parse_rule_args(const std::vector<std::string_view> &args)
+{
+    size_t jobcount = std::max(std::thread::hardware_concurrency(), 1U);
+    jobcount = std::min(jobcount, args.size() / MIN_RULES_PER_JOB);
+    jobcount = std::max(jobcount, static_cast<size_t>(1));
+
+    std::vector<Rule> rules(args.size());
+    std::vector<ParseJob> jobs;
+    size_t chunk = (args.size() + jobcount - 1) / jobcount;
+    for (size_t start = 0; start < args.size(); start += chunk)
+        jobs.push_back({start, std::min(start + chunk, args.size())});
+
+    std::atomic<size_t> first_failed(args.size());
+
+    if (jobs.size() == 1) {
+        run_job(args, rules, jobs.front(), first_failed);
+    } else {
+        std::vector<std::thread> threads;
+        for (ParseJob &job : jobs) {
+            threads.emplace_back(run_job, std::cref(args), std::ref(rules),
+                                 std::ref(job), std::ref(first_failed));
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    for (const ParseJob &job : jobs) {
+        if (job.failed) {
+            std::cerr << job.error;
+            return std::nullopt;
+        }
+    }
+
+    std::optional<std::string> error = check_hosts(rules);
+    if (error) {
+        std::cerr << *error << std::endl;
+        return std::nullopt;
+    }
+
+    return rules;
+}
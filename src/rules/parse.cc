@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: LGPL-3.0-only
 #include <algorithm>
+#include <charconv>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <memory>
@@ -9,33 +11,69 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
-#include <yaml-cpp/yaml.h>
-
 #include "../rules.hh"
+#include "parse.hh"
 
 #include "errno_list.hh"
 
-static const std::string describe_nodetype(const YAML::Node &node)
+/*
+ * Host names are resolved to an address within 198.18.0.0/15, which is
+ * reserved for benchmarking and thus shouldn't be used by anything else. The
+ * address is derived from a hash of the host name, so that it doesn't depend
+ * on any other rules.
+ */
+static std::string host_address(std::string_view host)
 {
-    switch (node.Type()) {
-        case YAML::NodeType::Undefined: return "undefined";
-        case YAML::NodeType::Null:      return "null";
-        case YAML::NodeType::Scalar:    return "a scalar";
-        case YAML::NodeType::Sequence:  return "a sequence";
-        case YAML::NodeType::Map:       return "a map";
+    uint32_t hash = 2166136261U;
+    for (const char &c : host) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619U;
     }
-    return "an unknown type";
+
+    uint32_t offset = hash % 131070 + 1;
+    return "198." + std::to_string(18 + (offset >> 16)) + '.'
+         + std::to_string((offset >> 8) & 0xff) + '.'
+         + std::to_string(offset & 0xff);
+}
+
+/* Host names are case-insensitive and may be fully qualified. */
+static std::string normalise_host(std::string_view host)
+{
+    std::string out(host);
+    if (!out.empty() && out.back() == '.')
+        out.pop_back();
+    for (char &c : out)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return out;
 }
 
-static std::optional<std::string> validate_rule(Rule &rule)
+std::optional<std::string> validate_rule(Rule &rule)
 {
+    if (rule.host) {
+        if (rule.host.value().empty())
+            return "Host name has to be non-empty.";
+        if (rule.address != host_address(rule.host.value()))
+            return "Can't use both an address and a host name in the same"
+                   " rule.";
+    }
+
     if (rule.address) {
+        in6_addr addr6;
         char buf[INET6_ADDRSTRLEN];
         const char *addr = rule.address.value().c_str();
-        if (
-            !inet_pton(AF_INET, addr, buf) &&
-            !inet_pton(AF_INET6, addr, buf)
-        ) {
+        if (inet_pton(AF_INET6, addr, &addr6)) {
+            /* Sockets using IPv4-mapped or IPv4-compatible addresses are
+             * matched as the IPv4 address they contain unless
+             * __IP2UNIX_NO_UNMAP_IPV4 is set, so rules need to use the same
+             * form to match them.
+             */
+            bool unmap = getenv("__IP2UNIX_NO_UNMAP_IPV4") == nullptr;
+            if (unmap && (IN6_IS_ADDR_V4MAPPED(&addr6) ||
+                          IN6_IS_ADDR_V4COMPAT(&addr6))) {
+                inet_ntop(AF_INET, addr6.s6_addr + 12, buf, sizeof buf);
+                rule.address = std::string(buf);
+            }
+        } else if (!inet_pton(AF_INET, addr, buf)) {
             return "Address \"" + rule.address.value() + "\""
                    " is not a valid IPv4 or IPv6 address.";
         }
@@ -104,353 +142,317 @@ static std::optional<std::string> validate_rule(Rule &rule)
 }
 
 /* Convert a string into a port number, checking whether it satisfies bounds of
- * an uint16_t. First we convert to string, check whether everything is just
- * digits and whether the length is short enough for a 16 bit unsigned int and
- * then convert to uint32_t and check the upper bound.
+ * an uint16_t. Leading zeros are skipped, so that after that we only need to
+ * check whether everything is just digits and whether the length is short
+ * enough for a 16 bit unsigned int before checking the upper bound.
  */
-static std::optional<uint16_t> string2port(const std::string &str)
+std::optional<uint16_t> string2port(std::string_view str)
 {
-    std::string value(str);
-    value.erase(0, str.find_first_not_of('0'));
+    size_t start = str.find_first_not_of('0');
 
-    if (str.size() > 0 && value.empty())
-        return 0;
+    if (start == std::string_view::npos)
+        return str.empty() ? std::nullopt : std::optional<uint16_t>(0);
 
-    if (value.empty())
+    std::string_view value = str.substr(start);
+    if (value.length() > 5)
         return std::nullopt;
 
-    if (std::all_of(value.begin(), value.end(), isdigit)) {
-        uint32_t intval = std::stoul(value);
-        if (value.length() <= 6 && intval <= 65535)
-            return static_cast<uint16_t>(intval);
-        else
+    uint32_t intval = 0;
+    for (const char &c : value) {
+        if (c < '0' || c > '9')
             return std::nullopt;
+        intval = intval * 10 + static_cast<uint32_t>(c - '0');
     }
 
-    return std::nullopt;
+    if (intval > 65535)
+        return std::nullopt;
+
+    return static_cast<uint16_t>(intval);
 }
 
-static std::optional<int> parse_errno(const std::string &str)
+std::optional<int> parse_errno(std::string_view str)
 {
     if (str.empty())
         return std::nullopt;
 
-    if (std::all_of(str.begin(), str.end(), isdigit))
-        return std::stoi(str);
+    int value;
+    const char *end = str.data() + str.size();
+    std::from_chars_result result = std::from_chars(str.data(), end, value);
+    if (result.ptr == end && result.ec == std::errc() && str[0] != '-')
+        return value;
 
-    return name2errno(str);
+    return name2errno(std::string(str));
 }
 
-#define RULE_ERROR(msg) \
-    std::cerr << file << ":rule #" << pos + 1 << ": " << msg << std::endl
-
-#define RULE_CONVERT(target, key, type, tname) \
-    try { \
-        target = value.as<type>(); \
-    } catch (const YAML::BadConversion &e) { \
-        RULE_ERROR("The \"" key "\" option needs to be a " tname "."); \
-        return std::nullopt; \
-    }
-
-static std::optional<Rule> parse_rule(const std::string &file, int pos,
-                                      const YAML::Node &doc)
+static std::string format_arg_error(size_t rulepos, std::string_view arg,
+                                    size_t pos, size_t len,
+                                    const std::string &msg)
 {
-    Rule rule;
-
-    for (const auto &foo : doc) {
-        std::string key = foo.first.as<std::string>();
-        YAML::Node value = foo.second;
-        if (key == "direction") {
-            std::string val;
-            RULE_CONVERT(val, "direction", std::string, "string");
-            if (val == "outgoing") {
-                rule.direction = RuleDir::OUTGOING;
-            } else if (val == "incoming") {
-                rule.direction = RuleDir::INCOMING;
-            } else {
-                RULE_ERROR("Invalid direction \"" << val << "\".");
-                return std::nullopt;
-            }
-        } else if (key == "type") {
-            std::string val;
-            RULE_CONVERT(val, "type", std::string, "string");
-            if (val == "tcp") {
-                rule.type = SocketType::TCP;
-            } else if (val == "udp") {
-                rule.type = SocketType::UDP;
-            } else {
-                RULE_ERROR("Invalid type \"" << val << "\".");
-                return std::nullopt;
-            }
-        } else if (key == "address") {
-            RULE_CONVERT(rule.address, "address", std::string, "string");
-        } else if (key == "port") {
-            std::string val;
-            RULE_CONVERT(val, "port", std::string, "16 bit unsigned int");
-            std::optional<uint16_t> port = string2port(val);
-            if (port) {
-                rule.port = port.value();
-            } else {
-                RULE_ERROR("Port number is not a 16 bit unsigned int.");
-                return std::nullopt;
-            }
-        } else if (key == "portEnd") {
-            std::string val;
-            RULE_CONVERT(val, "portEnd", std::string, "16 bit unsigned int");
-            std::optional<uint16_t> portend = string2port(val);
-            if (portend) {
-                rule.port_end = portend.value();
-            } else {
-                RULE_ERROR("Port range end number is not a "
-                           "16 bit unsigned int.");
-                return std::nullopt;
-            }
-#ifdef SYSTEMD_SUPPORT
-        } else if (key == "socketActivation") {
-            RULE_CONVERT(rule.socket_activation, "socketActivation", bool,
-                         "bool");
-        } else if (key == "fdName") {
-            RULE_CONVERT(rule.fd_name, "fdName", std::string, "string");
-#endif
-        } else if (key == "reject") {
-            RULE_CONVERT(rule.reject, "reject", bool, "bool");
-        } else if (key == "rejectError") {
-            std::string val;
-            RULE_CONVERT(val, "rejectError", std::string, "string");
-            std::optional<int> rej_errno = parse_errno(val);
-            if (rej_errno) {
-                rule.reject_errno = rej_errno;
-            } else {
-                RULE_ERROR("Invalid reject error code \"" << val << "\".");
-                return std::nullopt;
-            }
-        } else if (key == "blackhole") {
-            RULE_CONVERT(rule.blackhole, "blackhole", bool, "bool");
-        } else if (key == "ignore") {
-            RULE_CONVERT(rule.ignore, "ignore", bool, "bool");
-        } else if (key == "socketPath") {
-            RULE_CONVERT(rule.socket_path, "socketPath", std::string,
-                         "string");
-        } else {
-            RULE_ERROR("Invalid key \"" << key << "\".");
-            return std::nullopt;
-        }
-    }
-
-    std::optional<std::string> errmsg = validate_rule(rule);
-    if (errmsg) {
-        RULE_ERROR(errmsg.value());
-        return std::nullopt;
-    }
-
-    return rule;
-}
+    std::string pos_str = std::to_string(rulepos);
+    std::string out = "In rule #" + pos_str + ": ";
+    out += arg;
+    out += "\n         " + std::string(pos_str.size(), ' ') + "  ";
 
-bool is_yaml_rule_file(std::string filename)
-{
-    YAML::Node doc;
-
-    try {
-        doc = YAML::LoadFile(filename);
-    } catch (const YAML::ParserException &e) {
-        return false;
-    } catch (const YAML::BadFile &e) {
-        // If the file can't be opened, let's assume it's YAML for now, since
-        // we're going to eventually throw an error anyway.
-        return true;
-    }
+    if (pos == 0 && len == 0)
+        return out + msg + '\n';
 
-    return doc.IsSequence();
+    return out + std::string(pos, ' ')
+         + std::string(std::max(len, static_cast<size_t>(1)), '^')
+         + ' ' + msg + '\n';
 }
 
-std::optional<std::vector<Rule>>
-    parse_rules(std::string content, bool content_is_filename)
+std::string make_absolute(std::string_view path)
 {
-    YAML::Node doc;
-    std::string file = content_is_filename ? content : "<unknown>";
-
-    try {
-        if (content_is_filename)
-            doc = YAML::LoadFile(file);
-        else
-            doc = YAML::Load(content);
-    } catch (const YAML::ParserException &e) {
-        std::cerr << file << ": " << e.msg << std::endl;
-        return std::nullopt;
-    } catch (const YAML::BadFile &e) {
-        std::cerr << "Unable to open file \"" << file << "\"." << std::endl;
-        return std::nullopt;
-    }
-
-    if (!doc.IsSequence()) {
-        std::cerr << file << ": Root node needs to be a sequence but it's "
-                  << describe_nodetype(doc) << " instead." << std::endl;
-        return std::nullopt;
-    }
-
-    std::vector<Rule> result;
-
-    int pos = 0;
-    for (const YAML::Node &node : doc) {
-        std::optional<Rule> rule = parse_rule(file, pos++, node);
-        if (!rule) return std::nullopt;
-        result.push_back(rule.value());
-    }
-
+    if (path.empty() || path[0] == '/')
+        return std::string(path);
+
+    /* Only determine the working directory once, since this might be called
+     * for a lot of rules.
+     */
+    static const std::string cwd = []() {
+        char *dir = get_current_dir_name();
+        std::string result(dir == nullptr ? "" : dir);
+        free(dir);
+        return result;
+    }();
+
+    std::string result;
+    result.reserve(cwd.size() + 1 + path.size());
+    result += cwd;
+    result += '/';
+    result += path;
     return result;
 }
 
-static void print_arg_error(size_t rulepos, const std::string &arg, size_t pos,
-                            size_t len, const std::string &msg)
+/*
+ * Find the end of a value, which is either the next comma that's not escaped
+ * via a backslash or the end of the argument.
+ */
+static size_t find_value_end(std::string_view arg, size_t pos, bool *escaped)
 {
-    std::string pos_str = std::to_string(rulepos);
-    std::string pos_spc = std::string(pos_str.size(), ' ');
-
-    std::cerr << "In rule #" << pos_str << ": " << arg << std::endl
-              << "         " << pos_spc << "  ";
-
-    if (pos == 0 && len == 0)
-        std::cerr << msg << std::endl;
-    else
-        std::cerr << std::string(pos, ' ')
-                  << std::string(std::max(len, static_cast<size_t>(1)), '^')
-                  << ' ' << msg << std::endl;
+    while ((pos = arg.find_first_of(",\\", pos)) != std::string_view::npos) {
+        if (arg[pos] == ',')
+            return pos;
+        if (pos + 1 < arg.size() && (arg[pos + 1] == ',' ||
+                                     arg[pos + 1] == '\\')) {
+            *escaped = true;
+            pos += 2;
+        } else {
+            pos += 1;
+        }
+    }
+    return arg.size();
 }
 
-std::string make_absolute(const std::string &path)
+static std::string unescape_value(std::string_view value)
 {
-    if (path.empty() || path[0] == '/')
-        return path;
-
-    return std::string(get_current_dir_name()) + '/' + path;
+    std::string out;
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '\\' && i + 1 < value.size() &&
+            (value[i + 1] == ',' || value[i + 1] == '\\'))
+            ++i;
+        out += value[i];
+    }
+    return out;
 }
 
-std::optional<Rule> parse_rule_arg(size_t rulepos, const std::string &arg)
+std::optional<Rule> parse_rule_arg(size_t rulepos, std::string_view arg,
+                                   std::string *error)
 {
-    std::string buf = "";
-    std::optional<std::string> key = std::nullopt;
-
     Rule rule;
+    size_t start = 0;
+    bool has_address = false;
+
+    for (;;) {
+        size_t end = arg.find_first_of(",=", start);
+
+        if (end != std::string_view::npos && arg[end] == '=') {
+            /* Handle key=value options. */
+            std::string_view key = arg.substr(start, end - start);
+            size_t valpos = end + 1;
+            bool escaped = false;
+            end = find_value_end(arg, valpos, &escaped);
+
+            std::string unescaped;
+            std::string_view buf = arg.substr(valpos, end - valpos);
+            if (escaped) {
+                unescaped = unescape_value(buf);
+                buf = unescaped;
+            }
 
-    size_t errpos = 0, valpos = 0;
-    size_t errlen = 0;
-
-    for (size_t i = 0, arglen = arg.length(); i <= arglen; ++i) {
-        if (key) {
-            if (i == arglen || arg[i] == ',') {
-                /* Handle key=value options. */
-                if (key.value() == "path") {
-                    rule.socket_path = make_absolute(buf);
+            if (key == "path") {
+                rule.socket_path = make_absolute(buf);
 #ifdef SYSTEMD_SUPPORT
-                } else if (key.value() == "systemd") {
-                    rule.socket_activation = true;
-                    rule.fd_name = buf;
+            } else if (key == "systemd") {
+                rule.socket_activation = true;
+                rule.fd_name = std::string(buf);
 #endif
-                } else if (key.value() == "reject") {
-                    rule.reject = true;
-                    std::optional<int> rej_errno = parse_errno(buf);
-                    if (rej_errno) {
-                        rule.reject_errno = rej_errno.value();
+            } else if (key == "reject") {
+                rule.reject = true;
+                std::optional<int> rej_errno = parse_errno(buf);
+                if (rej_errno) {
+                    rule.reject_errno = rej_errno.value();
+                } else {
+                    *error = format_arg_error(rulepos, arg, valpos,
+                                              end - valpos,
+                                              "invalid reject error code");
+                    return std::nullopt;
+                }
+            } else if (key == "addr" || key == "address") {
+                rule.address = std::string(buf);
+                has_address = true;
+            } else if (key == "host") {
+                rule.host = normalise_host(buf);
+            } else if (key == "port") {
+                /* Handle port ranges, like "1000-2000". */
+                size_t rangesep = buf.find('-');
+                std::string_view portbuf;
+                if (rangesep == std::string_view::npos || rangesep == 0) {
+                    portbuf = buf;
+                } else {
+                    portbuf = buf.substr(0, rangesep);
+                    std::optional<uint16_t> portend =
+                        string2port(buf.substr(rangesep + 1));
+                    if (portend) {
+                        rule.port_end = portend.value();
                     } else {
-                        print_arg_error(rulepos, arg, valpos, i - valpos,
-                                        "invalid reject error code");
+                        *error = format_arg_error(rulepos, arg,
+                                                  valpos + rangesep + 1,
+                                                  end - valpos - rangesep - 1,
+                                                  "invalid end port in range");
                         return std::nullopt;
                     }
-                } else if (key.value() == "addr" || key.value() == "address") {
-                    rule.address = buf;
-                } else if (key.value() == "port") {
-                    /* Handle port ranges, like "1000-2000". */
-                    std::size_t rangesep = buf.find('-');
-                    std::string portbuf;
-                    if (rangesep == std::string::npos || rangesep == 0) {
-                        portbuf = buf;
-                    } else {
-                        portbuf = buf.substr(0, rangesep);
-                        std::optional<uint16_t> portend =
-                            string2port(buf.substr(rangesep + 1));
-                        if (portend) {
-                            rule.port_end = portend.value();
-                        } else {
-                            print_arg_error(rulepos, arg,
-                                            valpos + rangesep + 1,
-                                            i - valpos - rangesep - 1,
-                                            "invalid end port in range");
-                            return std::nullopt;
-                        }
-                    }
+                }
 
-                    std::optional<uint16_t> port = string2port(portbuf);
-                    if (port) {
-                        rule.port = port.value();
-                    } else {
-                        print_arg_error(rulepos, arg, valpos, i - valpos,
-                                        "invalid port");
-                        return std::nullopt;
-                    }
+                std::optional<uint16_t> port = string2port(portbuf);
+                if (port) {
+                    rule.port = port.value();
                 } else {
-                    print_arg_error(rulepos, arg, errpos, errlen,
-                                    "unknown key");
+                    *error = format_arg_error(rulepos, arg, valpos,
+                                              end - valpos, "invalid port");
                     return std::nullopt;
                 }
-                key = std::nullopt;
-                errpos = i + 1;
-                errlen = 0;
-                buf.assign("");
-                continue;
-            } else if (arg[i] == '\\' && i < arglen && (arg[i + 1] == ',' ||
-                                                        arg[i + 1] == '\\')) {
-                buf += arg[++i];
-                continue;
+            } else {
+                *error = format_arg_error(rulepos, arg, start, key.size(),
+                                          "unknown key");
+                return std::nullopt;
             }
-        } else if (i == arglen || arg[i] == ',') {
+        } else {
             /* Handle bareword toggle flags. */
-            if (buf == "tcp") {
+            if (end == std::string_view::npos)
+                end = arg.size();
+
+            std::string_view flag = arg.substr(start, end - start);
+
+            if (flag == "tcp") {
                 rule.type = SocketType::TCP;
-            } else if (buf == "udp") {
+            } else if (flag == "udp") {
                 rule.type = SocketType::UDP;
-            } else if (buf == "in") {
+            } else if (flag == "in") {
                 rule.direction = RuleDir::INCOMING;
-            } else if (buf == "out") {
+            } else if (flag == "out") {
                 rule.direction = RuleDir::OUTGOING;
 #ifdef SYSTEMD_SUPPORT
-            } else if (buf == "systemd") {
+            } else if (flag == "systemd") {
                 rule.socket_activation = true;
 #endif
-            } else if (buf == "reject") {
+            } else if (flag == "reject") {
                 rule.reject = true;
-            } else if (buf == "blackhole") {
+            } else if (flag == "blackhole") {
                 rule.blackhole = true;
-            } else if (buf == "ignore") {
+            } else if (flag == "ignore") {
                 rule.ignore = true;
             } else {
-                print_arg_error(rulepos, arg, errpos, errlen, "unknown flag");
+                *error = format_arg_error(rulepos, arg, start, flag.size(),
+                                          "unknown flag");
                 return std::nullopt;
             }
-            errpos = i + 1;
-            errlen = 0;
-            buf.assign("");
-            continue;
-        } else if (arg[i] == '=') {
-            key = buf;
-            valpos = i + 1;
-            buf.assign("");
-            continue;
-        } else {
-            errlen += 1;
         }
 
-        buf += arg[i];
+        if (end >= arg.size())
+            break;
+        start = end + 1;
     }
 
+    /* Only derive the address after all options are known, so that an
+     * explicitly given address is rejected regardless of its position.
+     */
+    if (rule.host && !has_address)
+        rule.address = host_address(rule.host.value());
+
     std::optional<std::string> errmsg = validate_rule(rule);
     if (errmsg) {
-        print_arg_error(rulepos, arg, 0, 0, errmsg.value());
+        *error = format_arg_error(rulepos, arg, 0, 0, errmsg.value());
         return std::nullopt;
     }
 
     return rule;
 }
 
+std::optional<Rule> parse_rule_arg(size_t rulepos, const std::string &arg)
+{
+    std::string error;
+    std::optional<Rule> rule = parse_rule_arg(rulepos, arg, &error);
+    if (!rule)
+        std::cerr << error;
+    return rule;
+}
+
+/*
+ * Check whether two different host names would resolve to the same address,
+ * which is unlikely but would cause their rules to match each other.
+ */
+std::optional<std::string> check_hosts(const std::vector<Rule> &rules)
+{
+    std::unordered_map<std::string, std::string> hosts;
+
+    for (const Rule &rule : rules) {
+        if (!rule.host)
+            continue;
+
+        auto found = hosts.emplace(rule.address.value(), rule.host.value());
+        if (found.second || found.first->second == rule.host.value())
+            continue;
+
+        return "Host names \"" + found.first->second + "\" and \""
+             + rule.host.value() + "\" both resolve to "
+             + rule.address.value() + ", please use a different name for"
+             " one of them.";
+    }
+
+    return std::nullopt;
+}
+
+/*
+ * Split the contents of a rule file into newline-separated rule arguments,
+ * skipping empty lines and comments. The arguments are views into the given
+ * data, so it needs to outlive them.
+ */
+void split_rule_args(std::string_view data,
+                     std::vector<std::string_view> &rule_args)
+{
+    while (!data.empty()) {
+        size_t eol = data.find('\n');
+        std::string_view line = data.substr(0, eol);
+        data.remove_prefix(eol == std::string_view::npos ? data.size()
+                                                         : eol + 1);
+
+        // Remove all leading whitespace characters
+        size_t i = 0;
+        while (i < line.size() && std::isspace(
+            static_cast<unsigned char>(line[i])
+        ))
+            ++i;
+        line.remove_prefix(i);
+
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        rule_args.push_back(line);
+    }
+}
+
 void print_rules(std::vector<Rule> &rules, std::ostream &out)
 {
     int pos = 0;
@@ -482,6 +484,9 @@ void print_rules(std::vector<Rule> &rules, std::ostream &out)
             << "  IP Type: " << typestr << std::endl
             << "  Address: " << rule.address.value_or("<any>") << std::endl;
 
+        if (rule.host)
+            out << "  Host: " << rule.host.value() << std::endl;
+
         if (rule.port_end) {
             out << "  Ports: " << portstr << " - "
                 << std::to_string(rule.port_end.value())
@@ -520,3 +525,80 @@ void print_rules(std::vector<Rule> &rules, std::ostream &out)
 #endif
     }
 }
+
+static std::string escape_value(const std::string &value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (const char &c : value) {
+        if (c == ',' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+/*
+ * Turn a rule back into a rule argument as accepted by parse_rule_arg(), so
+ * that rules can be written in the format used for rule files.
+ */
+std::string format_rule_arg(const Rule &rule)
+{
+    std::vector<std::string> parts;
+
+    if (rule.direction == RuleDir::INCOMING)
+        parts.push_back("in");
+    else if (rule.direction == RuleDir::OUTGOING)
+        parts.push_back("out");
+
+    if (rule.type == SocketType::TCP)
+        parts.push_back("tcp");
+    else if (rule.type == SocketType::UDP)
+        parts.push_back("udp");
+
+    if (rule.host)
+        parts.push_back("host=" + escape_value(rule.host.value()));
+    else if (rule.address)
+        parts.push_back("addr=" + escape_value(rule.address.value()));
+
+    if (rule.port) {
+        std::string portstr = "port=" + std::to_string(rule.port.value());
+        if (rule.port_end)
+            portstr += '-' + std::to_string(rule.port_end.value());
+        parts.push_back(portstr);
+    }
+
+#ifdef SYSTEMD_SUPPORT
+    if (rule.socket_activation) {
+        if (rule.fd_name)
+            parts.push_back("systemd=" + escape_value(rule.fd_name.value()));
+        else
+            parts.push_back("systemd");
+    }
+#endif
+
+    if (rule.reject) {
+        if (!rule.reject_errno)
+            parts.push_back("reject");
+        else if (name2errno(errno2name(rule.reject_errno.value()))
+                 == rule.reject_errno)
+            parts.push_back("reject=" + errno2name(rule.reject_errno.value()));
+        else
+            parts.push_back("reject="
+                            + std::to_string(rule.reject_errno.value()));
+    }
+
+    if (rule.blackhole)
+        parts.push_back("blackhole");
+
+    if (rule.ignore)
+        parts.push_back("ignore");
+
+    if (rule.socket_path)
+        parts.push_back("path=" + escape_value(rule.socket_path.value()));
+
+    std::string out;
+    for (const std::string &part : parts)
+        out += (out.empty() ? "" : ",") + part;
+    return out;
+}
@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_RULES_PARSE_HH
+#define IP2UNIX_RULES_PARSE_HH
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "../rules.hh"
+
+/* Helpers shared by the parsers for rule arguments and YAML rule files. */
+std::optional<std::string> validate_rule(Rule&);
+std::optional<uint16_t> string2port(std::string_view);
+std::optional<int> parse_errno(std::string_view);
+
+#endif
@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <iostream>
+
+#include <yaml-cpp/yaml.h>
+
+#include "../rules.hh"
+#include "parse.hh"
+
+static const std::string describe_nodetype(const YAML::Node &node)
+{
+    switch (node.Type()) {
+        case YAML::NodeType::Undefined: return "undefined";
+        case YAML::NodeType::Null:      return "null";
+        case YAML::NodeType::Scalar:    return "a scalar";
+        case YAML::NodeType::Sequence:  return "a sequence";
+        case YAML::NodeType::Map:       return "a map";
+    }
+    return "an unknown type";
+}
+
+#define RULE_ERROR(msg) \
+    std::cerr << file << ":rule #" << pos + 1 << ": " << msg << std::endl
+
+#define RULE_CONVERT(target, key, type, tname) \
+    try { \
+        target = value.as<type>(); \
+    } catch (const YAML::BadConversion &e) { \
+        RULE_ERROR("The \"" key "\" option needs to be a " tname "."); \
+        return std::nullopt; \
+    }
+
+static std::optional<Rule> parse_rule(const std::string &file, int pos,
+                                      const YAML::Node &doc)
+{
+    Rule rule;
+
+    for (const auto &foo : doc) {
+        std::string key = foo.first.as<std::string>();
+        YAML::Node value = foo.second;
+        if (key == "direction") {
+            std::string val;
+            RULE_CONVERT(val, "direction", std::string, "string");
+            if (val == "outgoing") {
+                rule.direction = RuleDir::OUTGOING;
+            } else if (val == "incoming") {
+                rule.direction = RuleDir::INCOMING;
+            } else {
+                RULE_ERROR("Invalid direction \"" << val << "\".");
+                return std::nullopt;
+            }
+        } else if (key == "type") {
+            std::string val;
+            RULE_CONVERT(val, "type", std::string, "string");
+            if (val == "tcp") {
+                rule.type = SocketType::TCP;
+            } else if (val == "udp") {
+                rule.type = SocketType::UDP;
+            } else {
+                RULE_ERROR("Invalid type \"" << val << "\".");
+                return std::nullopt;
+            }
+        } else if (key == "address") {
+            RULE_CONVERT(rule.address, "address", std::string, "string");
+        } else if (key == "port") {
+            std::string val;
+            RULE_CONVERT(val, "port", std::string, "16 bit unsigned int");
+            std::optional<uint16_t> port = string2port(val);
+            if (port) {
+                rule.port = port.value();
+            } else {
+                RULE_ERROR("Port number is not a 16 bit unsigned int.");
+                return std::nullopt;
+            }
+        } else if (key == "portEnd") {
+            std::string val;
+            RULE_CONVERT(val, "portEnd", std::string, "16 bit unsigned int");
+            std::optional<uint16_t> portend = string2port(val);
+            if (portend) {
+                rule.port_end = portend.value();
+            } else {
+                RULE_ERROR("Port range end number is not a "
+                           "16 bit unsigned int.");
+                return std::nullopt;
+            }
+#ifdef SYSTEMD_SUPPORT
+        } else if (key == "socketActivation") {
+            RULE_CONVERT(rule.socket_activation, "socketActivation", bool,
+                         "bool");
+        } else if (key == "fdName") {
+            RULE_CONVERT(rule.fd_name, "fdName", std::string, "string");
+#endif
+        } else if (key == "reject") {
+            RULE_CONVERT(rule.reject, "reject", bool, "bool");
+        } else if (key == "rejectError") {
+            std::string val;
+            RULE_CONVERT(val, "rejectError", std::string, "string");
+            std::optional<int> rej_errno = parse_errno(val);
+            if (rej_errno) {
+                rule.reject_errno = rej_errno;
+            } else {
+                RULE_ERROR("Invalid reject error code \"" << val << "\".");
+                return std::nullopt;
+            }
+        } else if (key == "blackhole") {
+            RULE_CONVERT(rule.blackhole, "blackhole", bool, "bool");
+        } else if (key == "ignore") {
+            RULE_CONVERT(rule.ignore, "ignore", bool, "bool");
+        } else if (key == "socketPath") {
+            RULE_CONVERT(rule.socket_path, "socketPath", std::string,
+                         "string");
+        } else {
+            RULE_ERROR("Invalid key \"" << key << "\".");
+            return std::nullopt;
+        }
+    }
+
+    std::optional<std::string> errmsg = validate_rule(rule);
+    if (errmsg) {
+        RULE_ERROR(errmsg.value());
+        return std::nullopt;
+    }
+
+    return rule;
+}
+
+bool is_yaml_rule_file(std::string filename)
+{
+    YAML::Node doc;
+
+    try {
+        doc = YAML::LoadFile(filename);
+    } catch (const YAML::ParserException &e) {
+        return false;
+    } catch (const YAML::BadFile &e) {
+        // If the file can't be opened, let's assume it's YAML for now, since
+        // we're going to eventually throw an error anyway.
+        return true;
+    }
+
+    return doc.IsSequence();
+}
+
+std::optional<std::vector<Rule>>
+    parse_rules(std::string content, bool content_is_filename)
+{
+    YAML::Node doc;
+    std::string file = content_is_filename ? content : "<unknown>";
+
+    try {
+        if (content_is_filename)
+            doc = YAML::LoadFile(file);
+        else
+            doc = YAML::Load(content);
+    } catch (const YAML::ParserException &e) {
+        std::cerr << file << ": " << e.msg << std::endl;
+        return std::nullopt;
+    } catch (const YAML::BadFile &e) {
+        std::cerr << "Unable to open file \"" << file << "\"." << std::endl;
+        return std::nullopt;
+    }
+
+    if (!doc.IsSequence()) {
+        std::cerr << file << ": Root node needs to be a sequence but it's "
+                  << describe_nodetype(doc) << " instead." << std::endl;
+        return std::nullopt;
+    }
+
+    std::vector<Rule> result;
+
+    int pos = 0;
+    for (const YAML::Node &node : doc) {
+        std::optional<Rule> rule = parse_rule(file, pos++, node);
+        if (!rule) return std::nullopt;
+        result.push_back(rule.value());
+    }
+
+    return result;
+}
+
+/*
+ * Entry point for the preload library, which only loads this module if rules
+ * are passed via the deprecated IP2UNIX_RULE_FILE environment variable, so
+ * that not every program needs to load yaml-cpp.
+ */
+extern "C" bool ip2unix_parse_rule_file(const char *file,
+                                        std::vector<Rule> *rules)
+{
+    std::optional<std::vector<Rule>> result = parse_rules(file, true);
+    if (!result)
+        return false;
+    *rules = result.value();
+    return true;
+}
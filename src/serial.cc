@@ -1,47 +1,73 @@
 // SPDX-License-Identifier: LGPL-3.0-only
 #include "serial.hh"
 
-void serialise(const std::string &str, std::ostream &out)
+std::string invalid_char(int c, const char *where)
 {
-    for (const char &c : str) {
-        switch (c) {
-            case '&':
-            case '!':
-            case '\\':
-                out.put('\\');
-                out.put(c);
-                break;
-            case '\0':
-                out << "\\@";
-                break;
-            default:
-                out.put(c);
-                break;
+    if (c == EOF)
+        return std::string("Unexpected end of input ") + where + '.';
+    return std::string("Invalid character '") + static_cast<char>(c)
+         + "' " + where + '.';
+}
+
+void serialise(const std::string &str, Encoder &out)
+{
+    std::string_view rest(str);
+    size_t special;
+
+    /* Copy everything up to the next character that needs to be escaped in
+     * one go instead of doing it character by character.
+     */
+    while ((special = rest.find_first_of(std::string_view("&!\\\0", 4)))
+           != std::string_view::npos) {
+        out.write(rest.substr(0, special));
+        if (rest[special] == '\0') {
+            out.write("\\@");
+        } else {
+            out.put('\\');
+            out.put(rest[special]);
         }
+        rest.remove_prefix(special + 1);
     }
+
+    out.write(rest);
     out.put('&');
 }
 
-MaybeError deserialise(std::istream &in, std::string *out)
+MaybeError deserialise(Decoder &in, std::string *out)
 {
-    char c;
+    std::string_view rest = in.rest();
+    size_t end = rest.find_first_of("&\\");
+
+    /* Fast path for the common case, where the string has no escapes. */
+    if (end != std::string_view::npos && rest[end] == '&') {
+        out->append(rest.substr(0, end));
+        in.skip(end + 1);
+        return std::nullopt;
+    }
+
+    int c;
     while ((c = in.get()) != '&') {
-        if (c == '\\')
-            *out += (c = in.get()) == '@' ? '\0' : c;
-        else
-            *out += c;
+        if (c == EOF)
+            return invalid_char(c, "in string");
+        if (c == '\\') {
+            if ((c = in.get()) == EOF)
+                return invalid_char(c, "after escape character");
+            *out += c == '@' ? '\0' : static_cast<char>(c);
+        } else {
+            *out += static_cast<char>(c);
+        }
     }
     return std::nullopt;
 }
 
-void serialise(const bool &val, std::ostream &out)
+void serialise(const bool &val, Encoder &out)
 {
     out.put(val ? 't' : 'f');
 }
 
-MaybeError deserialise(std::istream &in, bool *out)
+MaybeError deserialise(Decoder &in, bool *out)
 {
-    char c;
+    int c;
     switch (c = in.get()) {
         case 't':
             *out = true;
@@ -50,12 +76,12 @@ MaybeError deserialise(std::istream &in, bool *out)
             *out = false;
             break;
         default:
-            return std::string("Invalid character '") + c + "' for boolean.";
+            return invalid_char(c, "for boolean");
     }
     return std::nullopt;
 }
 
-void serialise(const RuleDir &dir, std::ostream &out)
+void serialise(const RuleDir &dir, Encoder &out)
 {
     switch (dir) {
         case RuleDir::OUTGOING:
@@ -67,9 +93,9 @@ void serialise(const RuleDir &dir, std::ostream &out)
     }
 }
 
-MaybeError deserialise(std::istream &in, RuleDir *out)
+MaybeError deserialise(Decoder &in, RuleDir *out)
 {
-    char c;
+    int c;
     switch (c = in.get()) {
         case 'o':
             *out = RuleDir::OUTGOING;
@@ -78,12 +104,12 @@ MaybeError deserialise(std::istream &in, RuleDir *out)
             *out = RuleDir::INCOMING;
             break;
         default:
-            return std::string("Invalid character '") + c + "' in RuleDir.";
+            return invalid_char(c, "in RuleDir");
     }
     return std::nullopt;
 }
 
-void serialise(const SocketType &stype, std::ostream &out)
+void serialise(const SocketType &stype, Encoder &out)
 {
     switch (stype) {
         case SocketType::TCP:
@@ -98,9 +124,9 @@ void serialise(const SocketType &stype, std::ostream &out)
     }
 }
 
-MaybeError deserialise(std::istream &in, SocketType *out)
+MaybeError deserialise(Decoder &in, SocketType *out)
 {
-    char c;
+    int c;
     switch (c = in.get()) {
         case 't':
             *out = SocketType::TCP;
@@ -112,16 +138,17 @@ MaybeError deserialise(std::istream &in, SocketType *out)
             *out = SocketType::INVALID;
             break;
         default:
-            return std::string("Invalid character '") + c + "' in SocketType.";
+            return invalid_char(c, "in SocketType");
     }
     return std::nullopt;
 }
 
-void serialise(const Rule &rule, std::ostream &out)
+void serialise(const Rule &rule, Encoder &out)
 {
     serialise(rule.direction, out);
     serialise(rule.type, out);
     serialise(rule.address, out);
+    serialise(rule.host, out);
     serialise(rule.port, out);
     serialise(rule.port_end, out);
     serialise(rule.socket_path, out);
@@ -138,12 +165,13 @@ void serialise(const Rule &rule, std::ostream &out)
 #define DESERIALISE_OR_ERR(what) \
     if ((err = deserialise(in, &out->what))) return err
 
-MaybeError deserialise(std::istream &in, Rule *out)
+MaybeError deserialise(Decoder &in, Rule *out)
 {
     MaybeError err;
     DESERIALISE_OR_ERR(direction);
     DESERIALISE_OR_ERR(type);
     DESERIALISE_OR_ERR(address);
+    DESERIALISE_OR_ERR(host);
     DESERIALISE_OR_ERR(port);
     DESERIALISE_OR_ERR(port_end);
     DESERIALISE_OR_ERR(socket_path);
@@ -2,48 +2,116 @@
 #ifndef IP2UNIX_SERIAL_HH
 #define IP2UNIX_SERIAL_HH
 
+#include <charconv>
+#include <cstdio>
 #include <deque>
-#include <sstream>
+#include <string_view>
 #include <unordered_map>
 
 #include "rules.hh"
 
 using MaybeError = std::optional<std::string>;
 
-void serialise(const std::string&, std::ostream&);
-MaybeError deserialise(std::istream&, std::string*);
+/*
+ * Appends the serialised representation to a string, so that serialising a
+ * whole structure only needs to grow a single buffer.
+ */
+class Encoder
+{
+    public:
+        explicit Encoder(std::string &buf) : out(buf) {}
+
+        inline void put(char c) {
+            this->out.push_back(c);
+        }
+
+        inline void write(std::string_view str) {
+            this->out.append(str);
+        }
+
+    private:
+        std::string &out;
+};
+
+/*
+ * Reads from a view of the serialised data without copying it, similar to
+ * std::istream::get() and std::istream::peek(), returning EOF at the end.
+ */
+class Decoder
+{
+    public:
+        explicit Decoder(std::string_view buf) : data(buf), pos(0) {}
+
+        inline int get(void) {
+            if (this->pos >= this->data.size())
+                return EOF;
+            return static_cast<unsigned char>(this->data[this->pos++]);
+        }
+
+        inline int peek(void) const {
+            if (this->pos >= this->data.size())
+                return EOF;
+            return static_cast<unsigned char>(this->data[this->pos]);
+        }
+
+        inline std::string_view rest(void) const {
+            return this->data.substr(this->pos);
+        }
+
+        inline void skip(size_t len) {
+            this->pos += len;
+        }
+
+    private:
+        std::string_view data;
+        size_t pos;
+};
 
-void serialise(const bool&, std::ostream&);
-MaybeError deserialise(std::istream&, bool*);
+/* Error message for an unexpected character (or EOF) read from a Decoder. */
+std::string invalid_char(int, const char*);
 
-void serialise(const RuleDir&, std::ostream&);
-MaybeError deserialise(std::istream&, RuleDir*);
+void serialise(const std::string&, Encoder&);
+MaybeError deserialise(Decoder&, std::string*);
 
-void serialise(const SocketType&, std::ostream&);
-MaybeError deserialise(std::istream&, SocketType*);
+void serialise(const bool&, Encoder&);
+MaybeError deserialise(Decoder&, bool*);
 
-void serialise(const Rule&, std::ostream&);
-MaybeError deserialise(std::istream&, Rule*);
+void serialise(const RuleDir&, Encoder&);
+MaybeError deserialise(Decoder&, RuleDir*);
+
+void serialise(const SocketType&, Encoder&);
+MaybeError deserialise(Decoder&, SocketType*);
+
+void serialise(const Rule&, Encoder&);
+MaybeError deserialise(Decoder&, Rule*);
 
 template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
-inline void serialise(const T &val, std::ostream &out)
+inline void serialise(const T &val, Encoder &out)
 {
-    out << val;
+    char buf[24];
+    std::to_chars_result result = std::to_chars(buf, buf + sizeof buf, val);
+    out.write(std::string_view(buf, static_cast<size_t>(result.ptr - buf)));
     out.put('&');
 }
 
 template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
-MaybeError deserialise(std::istream &in, T *out)
+MaybeError deserialise(Decoder &in, T *out)
 {
-    char c;
-    in >> *out;
+    std::string_view rest = in.rest();
+    std::from_chars_result result =
+        std::from_chars(rest.data(), rest.data() + rest.size(), *out);
+    if (result.ec != std::errc())
+        return std::string("Invalid integer value.");
+    in.skip(static_cast<size_t>(result.ptr - rest.data()));
+
+    int c;
     if ((c = in.get()) != '&')
-        return std::string("Invalid character '") + c + "' after integer.";
+        return invalid_char(c, "after integer");
     return std::nullopt;
 }
 
 template <typename T>
-void serialise(const std::optional<T> &val, std::ostream &out)
+void serialise(const std::optional<T> &val, Encoder &out)
 {
     if (val)
         serialise(*val, out);
@@ -52,24 +120,22 @@ void serialise(const std::optional<T> &val, std::ostream &out)
 }
 
 template <typename T>
-MaybeError deserialise(std::istream &in, std::optional<T> *out)
+MaybeError deserialise(Decoder &in, std::optional<T> *out)
 {
-    if (in.get() == '!') {
+    if (in.peek() == '!') {
+        in.skip(1);
         *out = std::nullopt;
         return std::nullopt;
     }
 
-    in.unget();
-    T outval;
     MaybeError err;
-    if ((err = deserialise(in, &outval)))
+    if ((err = deserialise(in, &out->emplace())))
         return err;
-    out->emplace(outval);
     return std::nullopt;
 }
 
 template <typename A, typename B>
-void serialise(const std::pair<A, B> &val, std::ostream &out)
+void serialise(const std::pair<A, B> &val, Encoder &out)
 {
     serialise(val.first, out);
     out.put('#');
@@ -78,72 +144,66 @@ void serialise(const std::pair<A, B> &val, std::ostream &out)
 }
 
 template <typename A, typename B>
-MaybeError deserialise(std::istream &in, std::pair<A, B> *out)
+MaybeError deserialise(Decoder &in, std::pair<A, B> *out)
 {
-    char c;
+    int c;
     MaybeError err;
 
     if ((err = deserialise(in, &out->first)))
         return err;
 
     if ((c = in.get()) != '#')
-        return std::string("Invalid character '")
-             + c + "' after first pair value.";
+        return invalid_char(c, "after first pair value");
 
     if ((err = deserialise(in, &out->second)))
         return err;
 
     if ((c = in.get()) != '$')
-        return std::string("Invalid character '")
-             + c + "' after second pair value.";
+        return invalid_char(c, "after second pair value");
 
     return std::nullopt;
 }
 
 template <typename T>
-void serialise(const std::deque<T> &val, std::ostream &out)
+void serialise(const std::deque<T> &val, Encoder &out)
 {
     for (const T &item : val)
         serialise(item, out);
 }
 
 template <typename T>
-MaybeError deserialise(std::istream &in, std::deque<T> *out)
+MaybeError deserialise(Decoder &in, std::deque<T> *out)
 {
     while (in.peek() != EOF) {
-        T outval;
         MaybeError err;
-        if ((err = deserialise(in, &outval)))
+        if ((err = deserialise(in, &out->emplace_back())))
             return err;
-        out->push_back(outval);
     }
     return std::nullopt;
 }
 
 template <typename T>
-void serialise(const std::vector<T> &val, std::ostream &out)
+void serialise(const std::vector<T> &val, Encoder &out)
 {
     for (const T &item : val)
         serialise(item, out);
 }
 
 template <typename T>
-MaybeError deserialise(std::istream &in, std::vector<T> *out)
+MaybeError deserialise(Decoder &in, std::vector<T> *out)
 {
     while (in.peek() != EOF) {
-        T outval;
         MaybeError err;
-        if ((err = deserialise(in, &outval)))
+        if ((err = deserialise(in, &out->emplace_back())))
             return err;
-        out->push_back(outval);
     }
     return std::nullopt;
 }
 
 template <typename K, typename V>
-void serialise(const std::unordered_map<K, V> &val, std::ostream &out)
+void serialise(const std::unordered_map<K, V> &val, Encoder &out)
 {
-    for (const std::pair<K, V> &item : val) {
+    for (const auto &item : val) {
         serialise(item.first, out);
         out.put('=');
         serialise(item.second, out);
@@ -152,9 +212,9 @@ void serialise(const std::unordered_map<K, V> &val, std::ostream &out)
 }
 
 template <typename K, typename V>
-MaybeError deserialise(std::istream &in, std::unordered_map<K, V> *out)
+MaybeError deserialise(Decoder &in, std::unordered_map<K, V> *out)
 {
-    char c;
+    int c;
     while (in.peek() != EOF) {
         MaybeError err;
 
@@ -163,16 +223,14 @@ MaybeError deserialise(std::istream &in, std::unordered_map<K, V> *out)
             return err;
 
         if ((c = in.get()) != '=')
-            return std::string("Invalid character '") + c + "' after map key.";
+            return invalid_char(c, "after map key");
 
         V outval;
         if ((err = deserialise(in, &outval)))
             return err;
 
-        if ((c = in.get()) != ';') {
-            return std::string("Invalid character '") + c
-                 + "' after map record.";
-        }
+        if ((c = in.get()) != ';')
+            return invalid_char(c, "after map record");
 
         (*out)[outkey] = outval;
     }
@@ -184,16 +242,16 @@ MaybeError deserialise(std::istream &in, std::unordered_map<K, V> *out)
 template <typename T>
 std::string serialise(const T &val)
 {
-    std::ostringstream out;
+    std::string buf;
+    Encoder out(buf);
     serialise(val, out);
-    return out.str();
+    return buf;
 }
 
 template <typename T>
-MaybeError deserialise(const std::string &val, T *out)
+MaybeError deserialise(std::string_view val, T *out)
 {
-    std::istringstream in;
-    in.str(val);
+    Decoder in(val);
     MaybeError err;
     if ((err = deserialise(in, out)))
         return err;
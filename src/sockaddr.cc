@@ -107,6 +107,19 @@ bool SockAddr::set_host(const SockAddr &other)
     }
 }
 
+bool SockAddr::host_equals(sa_family_t family, const void *addr) const
+{
+    if (this->ss_family != family)
+        return false;
+
+    if (family == AF_INET)
+        return memcmp(&this->cast4()->sin_addr, addr, sizeof(in_addr)) == 0;
+    else if (family == AF_INET6)
+        return memcmp(&this->cast6()->sin6_addr, addr, sizeof(in6_addr)) == 0;
+
+    return false;
+}
+
 bool SockAddr::set_host(const ucred &peercred)
 {
     if (this->ss_family == AF_INET) {
@@ -194,6 +207,22 @@ bool SockAddr::is_loopback(void) const
     }
 }
 
+std::optional<SockAddr> SockAddr::unmap_ipv4(void) const
+{
+    if (this->ss_family != AF_INET6)
+        return std::nullopt;
+
+    const in6_addr *addr6 = &this->cast6()->sin6_addr;
+    if (!IN6_IS_ADDR_V4MAPPED(addr6) && !IN6_IS_ADDR_V4COMPAT(addr6))
+        return std::nullopt;
+
+    SockAddr out;
+    out.ss_family = AF_INET;
+    memcpy(&out.cast4()->sin_addr, addr6->s6_addr + 12, sizeof(in_addr));
+    out.cast4()->sin_port = this->cast6()->sin6_port;
+    return out;
+}
+
 void SockAddr::apply_addr(struct sockaddr *addr, socklen_t *addrlen) const
 {
     if (addr == nullptr || addrlen == nullptr)
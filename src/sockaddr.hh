@@ -23,6 +23,9 @@ struct SockAddr : public sockaddr_storage
     bool set_host(const ucred&);
     bool set_host(const SockAddr&);
 
+    /* Compare the host part against a raw in_addr or in6_addr. */
+    bool host_equals(sa_family_t, const void*) const;
+
     bool set_random_host(void);
 
     std::optional<std::string> get_sockpath(void) const;
@@ -32,6 +35,11 @@ struct SockAddr : public sockaddr_storage
 
     bool is_loopback(void) const;
 
+    /* If this is an IPv4-mapped or IPv4-compatible IPv6 address, return the
+     * corresponding IPv4 address with the same port.
+     */
+    std::optional<SockAddr> unmap_ipv4(void) const;
+
     void apply_addr(struct sockaddr*, socklen_t*) const;
     socklen_t size() const;
 
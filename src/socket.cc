@@ -6,7 +6,10 @@
 
 #include "socket.hh"
 #include "realcalls.hh"
+#include "logfilter.hh"
 #include "logging.hh"
+#include "metrics.hh"
+#include "probes.hh"
 
 std::optional<Socket::Ptr> Socket::find(int fd)
 {
@@ -35,16 +38,19 @@ Socket::Ptr Socket::create(int fd, int domain, int type, int protocol)
     return Socket::registry[fd];
 }
 
-static inline SocketType get_sotype(const int type)
+bool Socket::try_visit(const std::function<void(const Summary&)> &f)
 {
-    switch (type & (SOCK_STREAM | SOCK_DGRAM)) {
-        case SOCK_STREAM:
-            return SocketType::TCP;
-        case SOCK_DGRAM:
-            return SocketType::UDP;
-        default:
-            return SocketType::INVALID;
+    std::unique_lock<std::mutex> lock(Socket::registry_mutex,
+                                      std::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+
+    for (const auto &[fd, sock] : Socket::registry) {
+        f(Summary{fd, sock->type, sock->is_unix, sock->is_blackhole,
+                  sock->sockpath, sock->connection ? sock->connection
+                                                   : sock->binding});
     }
+    return true;
 }
 
 std::mutex Socket::registry_mutex;
@@ -62,6 +68,7 @@ Socket::Socket(int sfd, int sdomain, int stype, int sproto)
     , binding()
     , connection()
     , unlink_sockpath()
+    , sockpath()
     , sockopts()
     , ports()
     , peermap()
@@ -95,6 +102,7 @@ void Socket::blackhole(void)
     if (this->is_blackhole)
         return;
     LOG(INFO) << "Socket with fd " << this->fd << " blackholed.";
+    Metrics::count(Metrics::Counter::BLACKHOLES);
     this->is_blackhole = true;
 }
 
@@ -227,9 +235,13 @@ bool Socket::make_unix(int oldfd)
         LOG(INFO) << "Created new Unix socket with fd " << newfd << '.';
     }
 
-    if (!this->sockopts.replay(this->fd, newfd)) {
+    bool replayed = this->sockopts.replay(this->fd, newfd);
+    PROBE(sockopt_replay, this->fd, newfd, replayed ? 1 : 0);
+
+    if (!replayed) {
         LOG(ERROR) << "Unable to replay socket options from fd " << this->fd
                    << " to fd " << newfd << '.';
+        Metrics::count(Metrics::Counter::REPLAY_FAILURES);
         real::close(newfd);
         errno = old_errno;
         return false;
@@ -246,9 +258,11 @@ bool Socket::make_unix(int oldfd)
 
     real::close(newfd);
 
+    PROBE(socket_convert, this->fd, newfd, static_cast<int>(this->type));
     LOG(INFO) << "Replaced socket fd " << this->fd << " by socket with fd "
               << newfd << '.';
 
+    Metrics::count(Metrics::Counter::CONVERSIONS);
     errno = old_errno;
     this->is_unix = true;
     return true;
@@ -356,6 +370,7 @@ int Socket::bind(const SockAddr &addr, const std::string &path)
         if (ret == 0) {
             Socket::sockpath_registry.insert(newpath);
             this->unlink_sockpath = newpath;
+            this->sockpath = newpath;
         }
     }
 
@@ -417,6 +432,8 @@ int Socket::connect(const SockAddr &addr, const std::string &path)
     if (ret != 0)
         return ret;
 
+    this->sockpath = new_sockpath;
+
     if (!this->binding) {
         if (!this->create_binding(addr)) {
             errno = EADDRNOTAVAIL;
@@ -429,6 +446,59 @@ int Socket::connect(const SockAddr &addr, const std::string &path)
     return ret;
 }
 
+#ifdef HAS_IO_URING
+/*
+ * The following two functions are the counterparts of connect_peermap() and
+ * connect() for connections that are carried out asynchronously by the kernel
+ * (eg. via io_uring), so instead of connecting, they return the address that
+ * needs to be passed to the kernel. Since we don't know about the outcome, we
+ * assume that the connection will succeed.
+ */
+std::optional<SockAddr> Socket::connect_peermap_async(const SockAddr &addr)
+{
+    if (this->type != SocketType::UDP)
+        return std::nullopt;
+
+    std::optional<SockAddr> dest = this->rewrite_dest_peermap(addr);
+    if (dest)
+        this->connection = addr;
+    return dest;
+}
+
+std::optional<SockAddr> Socket::connect_async(const SockAddr &addr,
+                                              const std::string &path)
+{
+    if (this->type == SocketType::UDP && !this->binding) {
+        std::optional<SockAddr> dest = this->rewrite_dest(addr, path);
+        if (dest)
+            this->connection = addr;
+        return dest;
+    }
+
+    std::optional<SockAddr> dest =
+        SockAddr::unix(this->format_sockpath(path, addr));
+    if (!dest)
+        return std::nullopt;
+
+    std::optional<uint16_t> remote_port = addr.get_port();
+    if (!remote_port)
+        return std::nullopt;
+
+    if (!this->make_unix())
+        return std::nullopt;
+
+    if (!this->binding) {
+        if (!this->create_binding(addr))
+            return std::nullopt;
+        this->ports.reserve(remote_port.value());
+    }
+
+    this->connection = addr;
+    this->sockpath = dest->get_sockpath();
+    return dest;
+}
+#endif
+
 int Socket::accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
     if (!this->binding) {
@@ -479,7 +549,9 @@ int Socket::accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     sock->ports.reserve(local_port.value());
     sock->binding = local_addr;
     sock->connection = peer;
+    sock->sockpath = this->sockpath;
     sock->is_unix = true;
+    PROBE(accept_peer, this->fd, sockfd, peer.cast());
     peer.apply_addr(addr, addrlen);
     Socket::registry[sockfd] = sock->getptr();
     LOG(INFO) << "Accepted socket fd " << sockfd
@@ -542,6 +614,7 @@ bool Socket::rewrite_src(const SockAddr &real_addr, struct sockaddr *addr,
 
     this->peermap[peer] = path.value();
     this->revpeermap[path.value()] = peer;
+    PROBE(udp_peer, this->fd, path->c_str(), peer.cast());
 
     peer.apply_addr(addr, addrlen);
     return true;
@@ -655,6 +728,7 @@ int Socket::close(void)
 
     Socket::registry.erase(this->fd);
     LOG(INFO) << "Socket fd " << this->fd << " unregistered.";
+    LogFilter::forget_fd(this->fd);
     return ret;
 }
 
@@ -662,4 +736,5 @@ void Socket::unregister(void)
 {
     LOG(DEBUG) << "Unregistering socket fd " << this->fd << '.';
     Socket::registry.erase(this->fd);
+    LogFilter::forget_fd(this->fd);
 }
@@ -45,9 +45,26 @@ struct Socket : std::enable_shared_from_this<Socket>
         if (sock) f(sock.value());
     }
 
+    /* What's published about a registered socket, see try_visit(). */
+    struct Summary {
+        int fd;
+        SocketType type;
+        bool is_unix;
+        bool is_blackhole;
+        std::optional<std::string> sockpath;
+        std::optional<SockAddr> peer;
+    };
+
+    /* Call the function for every registered socket, unless the registry is
+     * locked by someone else, in which case false is returned immediately.
+     */
+    static bool try_visit(const std::function<void(const Summary&)>&);
+
     /* Construct the socket and register it in Socket::registry. */
     static std::shared_ptr<Socket> create(int, int, int, int);
 
+    int get_fd(void) const { return this->fd; }
+
     void blackhole(void);
 
     int setsockopt(int, int, const void*, socklen_t);
@@ -63,6 +80,10 @@ struct Socket : std::enable_shared_from_this<Socket>
     int bind(const SockAddr&, const std::string&);
     std::optional<int> connect_peermap(const SockAddr&);
     int connect(const SockAddr&, const std::string&);
+#ifdef HAS_IO_URING
+    std::optional<SockAddr> connect_peermap_async(const SockAddr&);
+    std::optional<SockAddr> connect_async(const SockAddr&, const std::string&);
+#endif
 
     int accept(int, sockaddr*, socklen_t*);
     int getsockname(sockaddr*, socklen_t*);
@@ -88,6 +109,9 @@ struct Socket : std::enable_shared_from_this<Socket>
         std::optional<SockAddr> connection;
         std::optional<std::string> unlink_sockpath;
 
+        /* The path of the Unix domain socket bound or connected to. */
+        std::optional<std::string> sockpath;
+
         SockOpts sockopts;
         DynPorts ports;
 
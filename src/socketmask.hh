@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_SOCKETMASK_HH
+#define IP2UNIX_SOCKETMASK_HH
+
+#include <cstdint>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "rules.hh"
+
+/*
+ * A summary of the combinations of socket domain, socket type and direction
+ * that any of the rules could possibly match, so that sockets which can never
+ * match a rule don't need to be tracked at all.
+ *
+ * Every combination is a single bit, so the summary of a whole rule set is
+ * just the bitwise OR of the summaries of its rules.
+ */
+namespace SocketMask {
+    using Mask = uint32_t;
+
+    constexpr Mask NONE = 0;
+    constexpr Mask ALL = (1 << 12) - 1;
+
+    static inline Mask bit(int domain, SocketType type, RuleDir dir)
+    {
+        unsigned int pos = domain == AF_INET6 ? 1 : 0;
+        pos = pos * 3 + static_cast<unsigned int>(type);
+        pos = pos * 2 + (dir == RuleDir::INCOMING ? 0 : 1);
+        return static_cast<Mask>(1) << pos;
+    }
+
+    static inline Mask for_rule(const Rule &rule)
+    {
+        bool has_action = rule.socket_path || rule.reject || rule.blackhole;
+#ifdef SYSTEMD_SUPPORT
+        has_action |= rule.socket_activation;
+#endif
+        /* Rules without an action and rules that only exclude sockets from
+         * being handled by later rules never cause a socket to be handled.
+         */
+        if (!has_action || rule.ignore)
+            return NONE;
+
+        /* IPv4 addresses can also be matched by IPv6 sockets via
+         * IPv4-mapped addresses, so only IPv6 addresses restrict the domain.
+         */
+        std::vector<int> domains = {AF_INET, AF_INET6};
+        if (rule.address) {
+            unsigned char buf[sizeof(struct in6_addr)];
+            if (inet_pton(AF_INET, rule.address->c_str(), buf) != 1)
+                domains = {AF_INET6};
+        }
+
+        Mask mask = NONE;
+        for (int domain : domains) {
+            for (SocketType type : {SocketType::TCP, SocketType::UDP,
+                                    SocketType::INVALID}) {
+                if (rule.type && rule.type != type)
+                    continue;
+                for (RuleDir dir : {RuleDir::INCOMING, RuleDir::OUTGOING}) {
+                    if (rule.direction && rule.direction != dir)
+                        continue;
+                    mask |= bit(domain, type, dir);
+                }
+            }
+        }
+        return mask;
+    }
+
+    static inline Mask for_rules(const std::vector<Rule> &rules)
+    {
+        Mask mask = NONE;
+        for (const Rule &rule : rules) {
+            mask |= for_rule(rule);
+            if (mask == ALL)
+                break;
+        }
+        return mask;
+    }
+
+    /* Whether a socket could match in any direction. */
+    static inline bool may_match(Mask mask, int domain, SocketType type)
+    {
+        return mask & (bit(domain, type, RuleDir::INCOMING)
+                       | bit(domain, type, RuleDir::OUTGOING));
+    }
+
+    static inline bool may_match(Mask mask, int domain, SocketType type,
+                                 RuleDir dir)
+    {
+        return mask & bit(domain, type, dir);
+    }
+}
+
+#endif
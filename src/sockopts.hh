@@ -2,6 +2,7 @@
 #ifndef IP2UNIX_SOCKOPT_HH
 #define IP2UNIX_SOCKOPT_HH
 
+#include <optional>
 #include <queue>
 #include <variant>
 
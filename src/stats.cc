@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.hh"
+
+/* How often a reader retries if the data is updated while it's copying. */
+#define MAX_READ_ATTEMPTS 1000
+
+std::string Stats::runtime_dir(void)
+{
+    const char *xdg = getenv("XDG_RUNTIME_DIR");
+    if (xdg != nullptr && *xdg == '/')
+        return std::string(xdg) + "/ip2unix";
+    return "/tmp/ip2unix-" + std::to_string(getuid());
+}
+
+std::string Stats::segment_path(pid_t pid)
+{
+    return Stats::runtime_dir() + '/' + std::to_string(pid) + ".stats";
+}
+
+/*
+ * Make sure that the runtime directory is not a symlink and can't be written
+ * to by other users, which is otherwise possible for the fallback in /tmp if
+ * another user has created it first.
+ */
+static bool check_runtime_dir(const std::string &dir)
+{
+    struct stat st;
+    if (lstat(dir.c_str(), &st) == -1)
+        return false;
+
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 0777) != 0700) {
+        errno = EPERM;
+        return false;
+    }
+
+    return true;
+}
+
+/* The file is opened via stdio, because close() would be intercepted by the
+ * preload library, which the ip2unix command is linked against as well.
+ */
+Stats::Segment *Stats::create(pid_t pid)
+{
+    std::string dir = Stats::runtime_dir();
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        return nullptr;
+    if (!check_runtime_dir(dir))
+        return nullptr;
+
+    std::string path = Stats::segment_path(pid);
+    unlink(path.c_str());
+
+    FILE *fp = fopen(path.c_str(), "w+xe");
+    if (fp == nullptr)
+        return nullptr;
+
+    void *addr = MAP_FAILED;
+    if (fchmod(fileno(fp), 0600) == 0 &&
+        ftruncate(fileno(fp), sizeof(Segment)) == 0)
+        addr = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fileno(fp), 0);
+    fclose(fp);
+
+    if (addr == MAP_FAILED) {
+        unlink(path.c_str());
+        return nullptr;
+    }
+
+    Segment *segment = static_cast<Segment*>(addr);
+    segment->version = Stats::FORMAT_VERSION;
+    segment->wrapper_count = WRAPPER_COUNT;
+    segment->pid = pid;
+    memcpy(segment->magic, Stats::MAGIC, sizeof Stats::MAGIC);
+    return segment;
+}
+
+void Stats::remove(Segment *segment)
+{
+    unlink(Stats::segment_path(segment->pid).c_str());
+    munmap(segment, sizeof(Segment));
+}
+
+void Stats::publish(Segment *segment, const Data &data)
+{
+    uint32_t seq = segment->seq.load(std::memory_order_relaxed);
+    segment->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&segment->data, &data, sizeof(Data));
+    segment->seq.store(seq + 2, std::memory_order_release);
+}
+
+std::unique_ptr<Stats::Data> Stats::read(pid_t pid, std::string *error)
+{
+    std::string dir = Stats::runtime_dir();
+    if (!check_runtime_dir(dir)) {
+        *error = "Unable to use '" + dir + "': " + strerror(errno);
+        return nullptr;
+    }
+
+    std::string path = Stats::segment_path(pid);
+
+    FILE *fp = fopen(path.c_str(), "re");
+    if (fp == nullptr) {
+        *error = "Unable to open '" + path + "': " + strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fileno(fp), &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(Segment))
+        addr = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED,
+                    fileno(fp), 0);
+    fclose(fp);
+
+    if (addr == MAP_FAILED) {
+        *error = "Invalid statistics in '" + path + "'.";
+        return nullptr;
+    }
+
+    const Segment *segment = static_cast<const Segment*>(addr);
+    if (memcmp(segment->magic, Stats::MAGIC, sizeof Stats::MAGIC) != 0 ||
+        segment->version != Stats::FORMAT_VERSION ||
+        segment->wrapper_count != WRAPPER_COUNT) {
+        munmap(addr, sizeof(Segment));
+        *error = "Statistics in '" + path + "' have an incompatible format.";
+        return nullptr;
+    }
+
+    std::unique_ptr<Data> data = std::make_unique<Data>();
+    for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; ++attempt) {
+        uint32_t before = segment->seq.load(std::memory_order_acquire);
+        if (before % 2 != 0) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(data.get(), &segment->data, sizeof(Data));
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (segment->seq.load(std::memory_order_relaxed) == before) {
+            munmap(addr, sizeof(Segment));
+            return data;
+        }
+    }
+
+    munmap(addr, sizeof(Segment));
+    *error = "Statistics in '" + path + "' are updated too frequently.";
+    return nullptr;
+}
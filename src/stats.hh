@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_STATS_HH
+#define IP2UNIX_STATS_HH
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+#include "metrics.hh"
+
+/*
+ * Statistics published by the preload library in a file that is shared with
+ * "ip2unix stat", so that they can be read without attaching to the process.
+ *
+ * The data is protected by a sequence lock: The publisher makes the sequence
+ * number odd while it's updating the data and even again afterwards, so a
+ * reader simply retries until it got a copy with the same even sequence
+ * number before and after copying. Neither side ever waits for the other.
+ */
+namespace Stats {
+    inline constexpr char MAGIC[8] = {'I', 'P', '2', 'U', 'S', 'T', 'A', 'T'};
+    inline constexpr uint32_t FORMAT_VERSION = 1;
+
+    /* Rules and sockets beyond these limits are counted but not listed. */
+    inline constexpr size_t MAX_RULES = 256;
+    inline constexpr size_t MAX_SOCKETS = 256;
+
+    enum SocketFlags : uint8_t {
+        CONVERTED = 1 << 0,
+        BLACKHOLED = 1 << 1,
+    };
+
+    struct SocketEntry {
+        int32_t fd;
+        uint8_t type;
+        uint8_t flags;
+        /* The path of the Unix domain socket if it has been bound or
+         * connected to one.
+         */
+        char path[108];
+        /* The IP address and port the program sees as its peer or, if not
+         * connected, as its own address.
+         */
+        char peer[64];
+    };
+
+    struct Data {
+        /* Seconds since the epoch of the last update. */
+        uint64_t updated;
+        Metrics::Totals metrics;
+        uint32_t rule_count;
+        uint64_t rule_hits[MAX_RULES];
+        uint32_t socket_count;
+        uint32_t converted_count;
+        uint32_t entry_count;
+        SocketEntry sockets[MAX_SOCKETS];
+    };
+
+    struct Segment {
+        char magic[sizeof MAGIC];
+        uint32_t version;
+        uint32_t wrapper_count;
+        int32_t pid;
+        std::atomic<uint32_t> seq;
+        Data data;
+    };
+
+    /* The per-user directory containing the segments of all processes. */
+    std::string runtime_dir(void);
+
+    std::string segment_path(pid_t);
+
+    /* Create and map the segment for the given process, which is unlinked
+     * again by remove().
+     */
+    Segment *create(pid_t);
+    void remove(Segment*);
+
+    /* Copy the data to the segment, which must only be done by one thread at
+     * a time.
+     */
+    void publish(Segment*, const Data&);
+
+    /* Get a consistent copy of the data published by the given process, or
+     * nullptr along with an error message if there is none.
+     */
+    std::unique_ptr<Data> read(pid_t, std::string*);
+}
+
+#endif
@@ -6,6 +6,7 @@
 
 #include <fcntl.h>
 
+#include "initprio.hh"
 #include "rules.hh"
 #include "systemd.hh"
 #include "logging.hh"
@@ -14,9 +15,9 @@
 
 #define SD_LISTEN_FDS_START 3
 
-static std::unordered_map<size_t, Systemd::FdInfo> fdmap;
-static std::deque<Systemd::FdInfo> fds;
-static std::unordered_set<int> all_fds;
+static std::unordered_map<size_t, Systemd::FdInfo> fdmap INIT_STATE;
+static std::deque<Systemd::FdInfo> fds INIT_STATE;
+static std::unordered_set<int> all_fds INIT_STATE;
 
 /* Fetch a colon-separated environment variable and split it into a vector. */
 static std::vector<std::string> get_env_vector(const char *name)
@@ -127,13 +128,13 @@ static bool init_from_env(void)
     if (fds_raw == nullptr || fdmap_raw == nullptr)
         return false;
 
-    if ((err = deserialise(std::string(fds_raw), &fds))) {
+    if ((err = deserialise(fds_raw, &fds))) {
         LOG(FATAL) << "Unable to deserialise __IP2UNIX_SYSTEMD_FDS: "
                    << *err;
         std::abort();
     }
 
-    if ((err = deserialise(std::string(fdmap_raw), &fdmap))) {
+    if ((err = deserialise(fdmap_raw, &fdmap))) {
         LOG(FATAL) << "Unable to deserialise __IP2UNIX_SYSTEMD_FDMAP: "
                    << *err;
         std::abort();
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <tuple>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "clock.hh"
+#include "handover.hh"
+#include "trace.hh"
+
+/* The number of events kept per thread, which must be a power of two. */
+#define RING_SIZE 1024
+
+/* The maximum number of events written in a single chunk, which is also how
+ * often events are written in continuous mode.
+ */
+#define BATCH_SIZE 32
+
+std::atomic<bool> Trace::enabled = false;
+
+/*
+ * A ring is only written by the thread currently owning it, which publishes
+ * an event by incrementing the head after writing it. Readers check the head
+ * again after copying events and drop all of the events that might have been
+ * overwritten in the meantime.
+ */
+struct Ring {
+    Trace::Event events[RING_SIZE];
+    std::atomic<uint64_t> head;
+    /* Events before this one have already been written in continuous mode. */
+    std::atomic<uint64_t> written;
+    std::atomic<bool> owned;
+    Ring *next;
+};
+
+static HandoverList<Ring> g_rings;
+
+static std::string g_path;
+static bool g_continuous = false;
+
+/* The process the rings belong to, which differs from the current one in a
+ * child after vfork(), where the fork handlers haven't been run.
+ */
+static pid_t g_pid = 0;
+static uint64_t g_base_ticks = 0;
+static uint64_t g_base_ns = 0;
+
+/* The file descriptor of the trace file along with its device and inode, so
+ * that it's reopened if the program has closed it and reused the descriptor
+ * for something else.
+ */
+static int g_fd = -1;
+static dev_t g_dev = 0;
+static ino_t g_ino = 0;
+
+/* Held while writing to the file, which is never waited for. */
+static std::atomic<bool> g_writing = false;
+
+static thread_local HandoverList<Ring>::Owner t_owner;
+static thread_local bool t_tracing = false;
+static thread_local bool t_have_args = false;
+static thread_local int t_saved_errno = 0;
+static thread_local int t_result_errno = 0;
+static thread_local pid_t t_tid = 0;
+static thread_local Trace::Event t_event;
+
+static inline uint64_t now_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clock_ns(CLOCK_MONOTONIC);
+#endif
+}
+
+static inline pid_t current_tid(void)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 30)
+    return gettid();
+#else
+    return getpid();
+#endif
+}
+
+/* Only uses async-signal-safe functions, since it's called by dump(). Must
+ * only be called while holding g_writing.
+ */
+static int get_fd(void)
+{
+    struct stat st;
+    int fd = g_fd;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_dev == g_dev &&
+        st.st_ino == g_ino)
+        return fd;
+
+    fd = open(g_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+              0666);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        return -1;
+
+    g_dev = st.st_dev;
+    g_ino = st.st_ino;
+    g_fd = fd;
+    return fd;
+}
+
+/* Write the events of the given ring from "from" up to "to" in chunks. */
+static void write_events(int fd, const Ring &ring, uint64_t from, uint64_t to)
+{
+    alignas(Trace::Event) char buf[sizeof(Trace::ChunkHeader)
+                                   + BATCH_SIZE * sizeof(Trace::Event)];
+    Trace::ChunkHeader *header = reinterpret_cast<Trace::ChunkHeader*>(buf);
+    Trace::Event *events = reinterpret_cast<Trace::Event*>(header + 1);
+
+    while (from < to) {
+        uint64_t count = std::min<uint64_t>(to - from, BATCH_SIZE);
+        for (uint64_t i = 0; i < count; ++i)
+            events[i] = ring.events[(from + i) % RING_SIZE];
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        /* The owner might be writing the event at "head" right now, which
+         * overwrites the one RING_SIZE events before.
+         */
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        uint64_t valid = head + 1 > RING_SIZE ? head + 1 - RING_SIZE : 0;
+        uint64_t skip = valid > from ? std::min(valid - from, count) : 0;
+
+        if (skip < count) {
+            memcpy(header->magic, Trace::MAGIC, sizeof Trace::MAGIC);
+            header->version = Trace::FORMAT_VERSION;
+            header->wrapper_count = WRAPPER_COUNT;
+            header->pid = getpid();
+            header->count = static_cast<uint32_t>(count - skip);
+            header->base_ticks = g_base_ticks;
+            header->base_ns = g_base_ns;
+            header->ticks = now_ticks();
+            header->ns = clock_ns(CLOCK_REALTIME);
+
+            if (skip > 0)
+                memmove(events, events + skip,
+                        (count - skip) * sizeof(Trace::Event));
+
+            size_t len = sizeof(Trace::ChunkHeader)
+                       + (count - skip) * sizeof(Trace::Event);
+            if (write(fd, buf, len) == -1)
+                return;
+        }
+
+        from += count;
+    }
+}
+
+/* Mark the events up to "to" as written in continuous mode and return the
+ * first one that hasn't been written before.
+ */
+static uint64_t claim_events(Ring &ring, uint64_t to)
+{
+    uint64_t from = ring.written.load();
+    do {
+        if (from >= to)
+            return to;
+    } while (!ring.written.compare_exchange_weak(from, to));
+    return from;
+}
+
+void Trace::dump(void)
+{
+    if (!Trace::enabled.load() || g_pid != getpid() ||
+        g_writing.exchange(true))
+        return;
+
+    int old_errno = errno;
+    int fd = get_fd();
+
+    for (Ring *ring = g_rings.first(); fd != -1 && ring != nullptr;
+         ring = ring->next) {
+        uint64_t to = ring->head.load(std::memory_order_acquire);
+        uint64_t from = to > RING_SIZE ? to - RING_SIZE : 0;
+        if (g_continuous)
+            from = std::max(from, claim_events(*ring, to));
+        write_events(fd, *ring, from, to);
+    }
+
+    g_writing.store(false);
+    errno = old_errno;
+}
+
+/* The signal is raised again with the default action after dumping. */
+static void dump_on_crash(int signum)
+{
+    signal(signum, SIG_DFL);
+    Trace::dump();
+    raise(signum);
+}
+
+/*
+ * Dump the events if the program crashes, but only for signals the program
+ * doesn't handle by itself, since it might rely on its own handler.
+ */
+static void install_crash_handlers(void)
+{
+    for (int signum : {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV}) {
+        struct sigaction old;
+        if (sigaction(signum, nullptr, &old) == -1 ||
+            (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL)
+            continue;
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = dump_on_crash;
+        sigemptyset(&sa.sa_mask);
+        sigaction(signum, &sa, nullptr);
+    }
+}
+
+void Trace::enable(const char *path, bool continuous)
+{
+    g_path = path;
+    g_continuous = continuous;
+    g_base_ticks = now_ticks();
+    g_base_ns = clock_ns(CLOCK_REALTIME);
+    g_pid = getpid();
+    install_crash_handlers();
+    Trace::enabled.store(true);
+}
+
+bool Trace::begin(WrapperId wid)
+{
+    if (t_tracing)
+        return false;
+
+    if (t_owner.item == nullptr) {
+        t_owner.item = g_rings.acquire();
+        t_tid = current_tid();
+    }
+
+    t_tracing = true;
+    t_have_args = false;
+    t_result_errno = 0;
+    t_event = Event();
+    t_event.wrapper = static_cast<uint16_t>(wid);
+    t_event.tid = t_tid;
+
+    /* Reset errno, so that we know whether the call has set it. */
+    t_saved_errno = errno;
+    errno = 0;
+
+    t_event.ticks = now_ticks();
+    return true;
+}
+
+void Trace::set_args(const int64_t *values, const bool *pointers, size_t count,
+                     const sockaddr *address)
+{
+    if (!t_tracing || t_have_args)
+        return;
+
+    if (address != nullptr) {
+        if (address->sa_family == AF_INET)
+            t_event.address_len = sizeof(sockaddr_in);
+        else if (address->sa_family == AF_INET6)
+            t_event.address_len = sizeof(sockaddr_in6);
+        memcpy(t_event.address, address, t_event.address_len);
+    }
+
+    count = std::min(count, MAX_ARGS);
+    for (size_t i = 0; i < count; ++i) {
+        t_event.args[i] = values[i];
+        if (pointers[i])
+            t_event.pointers |= static_cast<uint8_t>(1 << i);
+    }
+    t_event.argc = static_cast<uint8_t>(count);
+    t_have_args = true;
+}
+
+void Trace::set_result(int64_t value)
+{
+    if (t_tracing) {
+        t_event.result = value;
+        t_result_errno = errno;
+    }
+}
+
+void Trace::end(void)
+{
+    t_event.duration = now_ticks() - t_event.ticks;
+
+    /* If errno has been set after the last real call, the wrapper has
+     * failed by itself, eg. because of a reject rule.
+     */
+    if (errno == 0) {
+        errno = t_saved_errno;
+    } else {
+        t_event.error = errno;
+        if (errno != t_result_errno)
+            t_event.result = -1;
+    }
+
+    Ring &ring = *t_owner.item;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    ring.events[head % RING_SIZE] = t_event;
+    ring.head.store(++head, std::memory_order_release);
+
+    /* If another thread is writing right now, the events are written along
+     * with the next batch instead.
+     */
+    if (g_continuous && head % BATCH_SIZE == 0 && g_pid == getpid() &&
+        !g_writing.exchange(true)) {
+        int old_errno = errno;
+        int fd = get_fd();
+        if (fd != -1)
+            write_events(fd, ring, claim_events(ring, head), head);
+        g_writing.store(false);
+        errno = old_errno;
+    }
+
+    t_tracing = false;
+}
+
+void Trace::reset(void)
+{
+    g_pid = getpid();
+    t_tid = current_tid();
+    g_writing.store(false);
+    for (Ring *ring = g_rings.first(); ring != nullptr; ring = ring->next) {
+        ring->head.store(0);
+        ring->written.store(0);
+        if (ring != t_owner.item)
+            ring->owned.store(false);
+    }
+}
+
+bool Trace::read(const char *path, std::vector<Record> &records,
+                 std::string *error)
+{
+    FILE *fp = fopen(path, "rbe");
+    if (fp == nullptr) {
+        *error = std::string("Unable to open '") + path + "': "
+               + strerror(errno);
+        return false;
+    }
+
+    ChunkHeader header;
+    size_t len;
+    while ((len = fread(&header, 1, sizeof header, fp)) > 0) {
+        if (len < sizeof header ||
+            memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 ||
+            header.version != FORMAT_VERSION ||
+            header.wrapper_count != WRAPPER_COUNT) {
+            *error = std::string("Trace in '") + path + "' is invalid or"
+                     " has an incompatible format.";
+            fclose(fp);
+            return false;
+        }
+
+        /* Ticks are converted into nanoseconds based on how many of them
+         * have passed since tracing has been enabled.
+         */
+        double rate = 1.0;
+        if (header.ticks > header.base_ticks && header.ns > header.base_ns)
+            rate = static_cast<double>(header.ns - header.base_ns)
+                 / static_cast<double>(header.ticks - header.base_ticks);
+
+        for (uint32_t i = 0; i < header.count; ++i) {
+            Record record;
+            if (fread(&record.event, sizeof record.event, 1, fp) != 1) {
+                *error = std::string("Trace in '") + path + "' is truncated.";
+                fclose(fp);
+                return false;
+            }
+            if (record.event.wrapper >= WRAPPER_COUNT ||
+                record.event.address_len > sizeof record.event.address)
+                continue;
+
+            double offset = static_cast<double>(record.event.ticks)
+                          - static_cast<double>(header.base_ticks);
+            record.when = header.base_ns + static_cast<uint64_t>(
+                static_cast<int64_t>(offset * rate)
+            );
+            record.duration = static_cast<uint64_t>(
+                static_cast<double>(record.event.duration) * rate
+            );
+            record.pid = header.pid;
+            records.push_back(record);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+void Trace::sort(std::vector<Record> &records)
+{
+    auto key = [](const Record &record) {
+        return std::make_tuple(record.pid, record.event.tid,
+                               record.event.ticks, record.event.wrapper);
+    };
+
+    std::stable_sort(records.begin(), records.end(),
+                     [&](const Record &a, const Record &b) {
+        return std::make_pair(a.when, key(a)) < std::make_pair(b.when, key(b));
+    });
+
+    auto last = std::unique(records.begin(), records.end(),
+                            [&](const Record &a, const Record &b) {
+        return key(a) == key(b);
+    });
+    records.erase(last, records.end());
+}
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_TRACE_HH
+#define IP2UNIX_TRACE_HH
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "wrappers.hh"
+
+/*
+ * A flight recorder for intercepted calls, which keeps the most recent calls
+ * of every thread as fixed-size binary events in a per-thread ring buffer
+ * without any formatting or locking. The rings are written to a file on
+ * exit, on fatal errors and when the report signal is received, or
+ * continuously in batches, and are decoded via "ip2unix trace-decode".
+ *
+ * The file consists of chunks, each of which is a ChunkHeader followed by
+ * the given number of events. Every chunk is written via a single write(),
+ * so chunks of different processes appending to the same file don't
+ * interleave.
+ */
+namespace Trace {
+    inline constexpr char MAGIC[8] = {'I', 'P', '2', 'U', 'T', 'R', 'C', 'E'};
+    /* Bump this whenever the layout of ChunkHeader or Event changes. */
+    inline constexpr uint32_t FORMAT_VERSION = 2;
+
+    /* The arguments beyond this limit are not recorded. */
+    inline constexpr size_t MAX_ARGS = 7;
+
+    struct ChunkHeader {
+        char magic[sizeof MAGIC];
+        uint32_t version;
+        uint32_t wrapper_count;
+        int32_t pid;
+        uint32_t count;
+        /* Two readings of the tick counter along with the wall-clock time in
+         * nanoseconds since the epoch, the first one taken when tracing was
+         * enabled and the second one when writing the chunk, which are used
+         * to convert ticks into wall-clock time.
+         */
+        uint64_t base_ticks;
+        uint64_t base_ns;
+        uint64_t ticks;
+        uint64_t ns;
+    };
+
+    struct Event {
+        /* The tick counter on entry, which is the TSC on x86. */
+        uint64_t ticks;
+        uint64_t duration;
+        /* The result of the last call to the C library or kernel, or -1 if
+         * the wrapper has set errno by itself afterwards.
+         */
+        int64_t result;
+        int64_t args[MAX_ARGS];
+        int32_t tid;
+        /* The value of errno if it was set by the call, otherwise zero. */
+        int32_t error;
+        uint16_t wrapper;
+        uint8_t argc;
+        /* A bit for every argument that is a pointer. */
+        uint8_t pointers;
+        /* A copy of the IPv4 or IPv6 address passed to the wrapper, eg. for
+         * connect() or sendmsg(), so that the call can be replayed.
+         */
+        uint32_t address_len;
+        char address[32];
+    };
+
+    static_assert(sizeof(Event) == 128, "Trace events must have a fixed size");
+
+    /* An event read back from a trace file. */
+    struct Record {
+        /* Nanoseconds since the epoch. */
+        uint64_t when;
+        uint64_t duration;
+        pid_t pid;
+        Event event;
+    };
+
+    extern std::atomic<bool> enabled;
+
+    /* Start recording, writing chunks to the given file either continuously
+     * or only when dump() is called.
+     */
+    void enable(const char *path, bool continuous);
+
+    /* Start and finish the event of a wrapper, see Metrics::Scope. Only the
+     * outermost wrapper of a thread is recorded, in which case begin()
+     * returns true.
+     */
+    bool begin(WrapperId);
+    void end(void);
+
+    void set_args(const int64_t*, const bool*, size_t, const sockaddr*);
+    void set_result(int64_t);
+
+    /* Write the events that haven't been written yet. This is safe to call
+     * from a signal handler.
+     */
+    void dump(void);
+
+    /* Forget the events of the parent in a child process after fork(). */
+    void reset(void);
+
+    /* Append the events of a trace file to the given records, or return false
+     * along with an error message if the file is invalid.
+     */
+    bool read(const char*, std::vector<Record>&, std::string*);
+
+    /* Sort records chronologically and remove duplicates, since every dump
+     * contains all of the events that are still in the ring buffers.
+     */
+    void sort(std::vector<Record>&);
+
+    template <typename T>
+    inline int64_t to_arg(const T &val)
+    {
+        if constexpr (std::is_pointer_v<T>)
+            return static_cast<int64_t>(reinterpret_cast<uintptr_t>(val));
+        else if constexpr (std::is_same_v<T, int64_t>)
+            return val;
+        else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>)
+            return static_cast<int64_t>(val);
+        else
+            return 0;
+    }
+
+    /* Only addresses passed into a wrapper are recorded. */
+    inline const sockaddr *address_of(const sockaddr *addr)
+    {
+        return addr;
+    }
+
+    inline const sockaddr *address_of(const msghdr *msg)
+    {
+        return msg == nullptr ? nullptr
+                              : static_cast<const sockaddr*>(msg->msg_name);
+    }
+
+    template <typename T>
+    inline const sockaddr *address_of(const T&)
+    {
+        return nullptr;
+    }
+
+    template <typename ... Args>
+    inline void args(const Args &...vals)
+    {
+        if (!enabled.load(std::memory_order_relaxed))
+            return;
+
+        const int64_t values[] = {to_arg(vals) ...};
+        const bool pointers[] = {std::is_pointer_v<Args> ...};
+        const sockaddr *address = nullptr;
+        ((address = address == nullptr ? address_of(vals) : address), ...);
+        set_args(values, pointers, sizeof...(Args), address);
+    }
+
+    template <typename T>
+    inline T result(T val)
+    {
+        if (enabled.load(std::memory_order_relaxed))
+            set_result(to_arg(val));
+        return val;
+    }
+}
+
+#endif
@@ -2,8 +2,23 @@
 #ifndef IP2UNIX_TYPES_HH
 #define IP2UNIX_TYPES_HH
 
+#include <sys/socket.h>
+
 enum class SocketType {
     TCP, UDP, INVALID
 };
 
+/* Get the socket type from the type argument of socket(). */
+static inline SocketType get_sotype(const int type)
+{
+    switch (type & (SOCK_STREAM | SOCK_DGRAM)) {
+        case SOCK_STREAM:
+            return SocketType::TCP;
+        case SOCK_DGRAM:
+            return SocketType::UDP;
+        default:
+            return SocketType::INVALID;
+    }
+}
+
 #endif
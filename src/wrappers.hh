@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+#ifndef IP2UNIX_WRAPPERS_HH
+#define IP2UNIX_WRAPPERS_HH
+
+#include <cstddef>
+#include <iterator>
+
+/*
+ * All of the functions intercepted by the preload library, so that data can
+ * be kept per wrapper in arrays indexed by WrapperId. Wrappers that are only
+ * compiled in with certain build options are listed nonetheless.
+ */
+#define IP2UNIX_WRAPPERS(WRAPPER) \
+    WRAPPER(__io_uring_get_cqe) \
+    WRAPPER(accept) \
+    WRAPPER(accept4) \
+    WRAPPER(bind) \
+    WRAPPER(close) \
+    WRAPPER(connect) \
+    WRAPPER(dup) \
+    WRAPPER(dup2) \
+    WRAPPER(dup3) \
+    WRAPPER(epoll_ctl) \
+    WRAPPER(execl) \
+    WRAPPER(execle) \
+    WRAPPER(execlp) \
+    WRAPPER(execv) \
+    WRAPPER(execve) \
+    WRAPPER(execvp) \
+    WRAPPER(execvpe) \
+    WRAPPER(getaddrinfo) \
+    WRAPPER(gethostbyname) \
+    WRAPPER(gethostbyname2) \
+    WRAPPER(getpeername) \
+    WRAPPER(getsockname) \
+    WRAPPER(io_uring_peek_batch_cqe) \
+    WRAPPER(io_uring_queue_init) \
+    WRAPPER(io_uring_queue_init_params) \
+    WRAPPER(io_uring_submit) \
+    WRAPPER(io_uring_submit_and_wait) \
+    WRAPPER(io_uring_submit_and_wait_timeout) \
+    WRAPPER(io_uring_wait_cqes) \
+    WRAPPER(ioctl) \
+    WRAPPER(listen) \
+    WRAPPER(pclose) \
+    WRAPPER(popen) \
+    WRAPPER(posix_spawn) \
+    WRAPPER(posix_spawnp) \
+    WRAPPER(recvfrom) \
+    WRAPPER(recvmsg) \
+    WRAPPER(sendmsg) \
+    WRAPPER(sendto) \
+    WRAPPER(setsockopt) \
+    WRAPPER(socket) \
+    WRAPPER(syscall) \
+    WRAPPER(system)
+
+#define IP2UNIX_WRAPPER_ID(name) name,
+enum class WrapperId { IP2UNIX_WRAPPERS(IP2UNIX_WRAPPER_ID) };
+#undef IP2UNIX_WRAPPER_ID
+
+#define IP2UNIX_WRAPPER_NAME(name) #name,
+inline constexpr const char *WRAPPER_NAMES[] = {
+    IP2UNIX_WRAPPERS(IP2UNIX_WRAPPER_NAME)
+};
+#undef IP2UNIX_WRAPPER_NAME
+
+inline constexpr size_t WRAPPER_COUNT = std::size(WRAPPER_NAMES);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Measure the time it takes from spawning a trivial program until its main()
+ * function is reached, both with and without the preload library, which
+ * shows the startup cost every process run via ip2unix has to pay.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define ITERATIONS 500
+
+extern char **environ;
+
+static long long now_ns(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static double measure(char *self, const std::vector<std::string> &extra_env)
+{
+    std::vector<std::string> envstrs(extra_env);
+    for (char **env = environ; *env != nullptr; ++env) {
+        if (strncmp(*env, "LD_PRELOAD=", 11) != 0)
+            envstrs.push_back(*env);
+    }
+
+    std::vector<char*> envp;
+    for (std::string &env : envstrs)
+        envp.push_back(env.data());
+    envp.push_back(nullptr);
+
+    char child_arg[] = "child";
+    char *argv[] = {self, child_arg, nullptr};
+    long long total = 0;
+
+    for (int i = 0; i < ITERATIONS; ++i) {
+        int fds[2];
+        if (pipe(fds) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+        pid_t pid;
+        long long start = now_ns();
+        if (posix_spawn(&pid, self, &actions, nullptr, argv,
+                        envp.data()) != 0) {
+            perror("posix_spawn");
+            exit(EXIT_FAILURE);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+
+        long long reached;
+        if (read(fds[0], &reached, sizeof reached) != sizeof reached) {
+            fputs("Unable to read timestamp from child.\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        close(fds[0]);
+        waitpid(pid, nullptr, 0);
+
+        total += reached - start;
+    }
+
+    return static_cast<double>(total) / ITERATIONS / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "child") == 0) {
+        long long reached = now_ns();
+        return write(STDOUT_FILENO, &reached, sizeof reached) ==
+               sizeof reached ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s LIBIP2UNIX\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    double plain = measure(argv[0], {});
+    double preload = measure(argv[0], {
+        std::string("LD_PRELOAD=") + argv[1],
+        "__IP2UNIX_RULES=",
+    });
+
+    printf("%-14s %10.1f us\n", "plain", plain);
+    printf("%-14s %10.1f us\n", "preloaded", preload);
+    printf("%-14s %+10.1f us\n", "overhead", preload - plain);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+/*
+ * Measure the cost of forwarding calls on sockets that are not handled by
+ * ip2unix, that is the overhead of the wrappers in the preload library and
+ * the backend used for the real:: calls.
+ *
+ * This program is linked against the preload library, so calling eg.
+ * getsockname() ends up in the wrapper while the baseline is measured by
+ * calling the function of the C library directly.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ITERATIONS 200000
+
+static void *libc = nullptr;
+
+template <typename T>
+static T *libc_fun(const char *name)
+{
+    void *sym = dlsym(libc, name);
+    if (sym == nullptr) {
+        fprintf(stderr, "Unable to find %s in libc: %s\n", name, dlerror());
+        exit(EXIT_FAILURE);
+    }
+    return reinterpret_cast<T*>(sym);
+}
+
+static double measure(const std::function<void(void)> &fun)
+{
+    for (int i = 0; i < ITERATIONS / 10; ++i) fun();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) fun();
+    auto end = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double, std::nano> elapsed = end - start;
+    return elapsed.count() / ITERATIONS;
+}
+
+static void bench(const char *name, const std::function<void(void)> &wrapped,
+                  const std::function<void(void)> &direct)
+{
+    double t_wrapped = measure(wrapped);
+    double t_direct = measure(direct);
+    printf("%-14s %10.1f ns %10.1f ns %+10.1f ns\n", name, t_wrapped,
+           t_direct, t_wrapped - t_direct);
+}
+
+int main(void)
+{
+    int fds[2];
+    char buf[1];
+    sockaddr_un addr;
+    socklen_t addrlen;
+    int optval = 1;
+
+    /* Make sure that the preload library finds (empty) rules. */
+    setenv("__IP2UNIX_RULES", "", 1);
+
+    if ((libc = dlopen("libc.so.6", RTLD_LAZY)) == nullptr) {
+        fprintf(stderr, "Unable to open libc: %s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+
+    int epfd = epoll_create1(0);
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fds[0];
+
+    auto c_socket = libc_fun<decltype(socket)>("socket");
+    auto c_close = libc_fun<decltype(close)>("close");
+    auto c_dup = libc_fun<decltype(dup)>("dup");
+    auto c_dup2 = libc_fun<decltype(dup2)>("dup2");
+    auto c_getsockname = libc_fun<decltype(getsockname)>("getsockname");
+    auto c_getpeername = libc_fun<decltype(getpeername)>("getpeername");
+    auto c_setsockopt = libc_fun<decltype(setsockopt)>("setsockopt");
+    auto c_ioctl = libc_fun<int(int, unsigned long, void*)>("ioctl");
+    auto c_epoll_ctl = libc_fun<decltype(epoll_ctl)>("epoll_ctl");
+    auto c_recvfrom = libc_fun<decltype(recvfrom)>("recvfrom");
+    auto c_recvmsg = libc_fun<decltype(recvmsg)>("recvmsg");
+    auto c_sendto = libc_fun<decltype(sendto)>("sendto");
+
+    sockaddr *saddr = reinterpret_cast<sockaddr*>(&addr);
+
+    msghdr msg = {};
+    iovec iov = {buf, sizeof buf};
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof addr;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    printf("%-14s %13s %13s %13s\n", "call", "wrapped", "libc",
+           "overhead");
+
+    bench("socket+close", [&]() {
+        close(socket(AF_UNIX, SOCK_DGRAM, 0));
+    }, [&]() {
+        c_close(c_socket(AF_UNIX, SOCK_DGRAM, 0));
+    });
+
+    bench("dup+close", [&]() {
+        close(dup(fds[0]));
+    }, [&]() {
+        c_close(c_dup(fds[0]));
+    });
+
+    bench("dup2", [&]() {
+        dup2(fds[0], fds[0]);
+    }, [&]() {
+        c_dup2(fds[0], fds[0]);
+    });
+
+    bench("getsockname", [&]() {
+        addrlen = sizeof addr;
+        getsockname(fds[0], saddr, &addrlen);
+    }, [&]() {
+        addrlen = sizeof addr;
+        c_getsockname(fds[0], saddr, &addrlen);
+    });
+
+    bench("getpeername", [&]() {
+        addrlen = sizeof addr;
+        getpeername(fds[0], saddr, &addrlen);
+    }, [&]() {
+        addrlen = sizeof addr;
+        c_getpeername(fds[0], saddr, &addrlen);
+    });
+
+    bench("setsockopt", [&]() {
+        setsockopt(fds[0], SOL_SOCKET, SO_PASSCRED, &optval, sizeof optval);
+    }, [&]() {
+        c_setsockopt(fds[0], SOL_SOCKET, SO_PASSCRED, &optval,
+                     sizeof optval);
+    });
+
+    bench("ioctl", [&]() {
+        ioctl(fds[0], FIONREAD, &optval);
+    }, [&]() {
+        c_ioctl(fds[0], FIONREAD, &optval);
+    });
+
+    bench("epoll_ctl", [&]() {
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &event);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fds[0], &event);
+    }, [&]() {
+        c_epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &event);
+        c_epoll_ctl(epfd, EPOLL_CTL_DEL, fds[0], &event);
+    });
+
+    bench("recvfrom", [&]() {
+        addrlen = sizeof addr;
+        recvfrom(fds[0], buf, sizeof buf, MSG_DONTWAIT, saddr, &addrlen);
+    }, [&]() {
+        addrlen = sizeof addr;
+        c_recvfrom(fds[0], buf, sizeof buf, MSG_DONTWAIT, saddr, &addrlen);
+    });
+
+    bench("recvmsg", [&]() {
+        recvmsg(fds[0], &msg, MSG_DONTWAIT);
+    }, [&]() {
+        c_recvmsg(fds[0], &msg, MSG_DONTWAIT);
+    });
+
+    bench("sendto+recv", [&]() {
+        sendto(fds[1], buf, sizeof buf, 0, nullptr, 0);
+        addrlen = sizeof addr;
+        recvfrom(fds[0], buf, sizeof buf, 0, saddr, &addrlen);
+    }, [&]() {
+        c_sendto(fds[1], buf, sizeof buf, 0, nullptr, 0);
+        addrlen = sizeof addr;
+        c_recvfrom(fds[0], buf, sizeof buf, 0, saddr, &addrlen);
+    });
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,541 @@
+/*
+ * Replay the calls recorded via "ip2unix --trace=FILE --trace-continuous"
+ * against the socket handling and rules of ip2unix, to measure changes of the
+ * interception layer with the call patterns of real programs:
+ *
+ *   bench_replay [-n ITERATIONS] RULEFILE TRACE...
+ *
+ * The calls of all recorded processes and threads are replayed in their
+ * original order in a single thread via the embedding interface. Instead of
+ * the kernel, the calls ip2unix makes are handled by the stand-ins below,
+ * which keep a table of fake sockets and always succeed for known sockets,
+ * so no real sockets are created and no files are touched.
+ *
+ * Since only the first address passed to a call is recorded but not the data
+ * other pointers point to, socket options are replayed as zeroes and calls
+ * without a recorded address like getaddrinfo() are skipped.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ip2unix.h"
+#include "trace.hh"
+
+/* Only available if ip2unix has been built with systemd support. */
+#pragma weak ip2unix_listen
+
+/* File descriptors handed out by the stand-ins start here, while calls on
+ * descriptors that are not sockets are replayed with UNKNOWN_FD.
+ */
+#define FIRST_FD 1000
+#define UNKNOWN_FD 999
+
+#define MAX_BUFSIZE 65536
+
+struct FakeSocket {
+    int domain;
+    int type;
+};
+
+static std::map<int, FakeSocket> g_sockets;
+
+static int new_fd(const FakeSocket &sock, int fd = FIRST_FD)
+{
+    while (g_sockets.count(fd) > 0)
+        ++fd;
+    g_sockets[fd] = sock;
+    return fd;
+}
+
+static int check_fd(int fd)
+{
+    if (g_sockets.count(fd) > 0)
+        return 0;
+    errno = fd == UNKNOWN_FD ? ENOTSOCK : EBADF;
+    return -1;
+}
+
+/* Like check_fd() but for calls that work on any file descriptor. */
+static int check_file(int fd)
+{
+    return fd == UNKNOWN_FD ? 0 : check_fd(fd);
+}
+
+/* The address of the peer or the socket itself, which is an unnamed socket
+ * for Unix domain sockets and the loopback address otherwise.
+ */
+static void fake_address(int fd, sockaddr *addr, socklen_t *addrlen)
+{
+    if (addr == nullptr || addrlen == nullptr)
+        return;
+
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof ss);
+    socklen_t len = sizeof(sa_family_t);
+    ss.ss_family = static_cast<sa_family_t>(g_sockets[fd].domain);
+
+    if (ss.ss_family == AF_INET) {
+        sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&ss);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        in->sin_port = htons(40000);
+        len = sizeof(sockaddr_in);
+    } else if (ss.ss_family == AF_INET6) {
+        sockaddr_in6 *in6 = reinterpret_cast<sockaddr_in6*>(&ss);
+        in6->sin6_addr = in6addr_loopback;
+        in6->sin6_port = htons(40000);
+        len = sizeof(sockaddr_in6);
+    }
+
+    memcpy(addr, &ss, std::min(len, *addrlen));
+    *addrlen = len;
+}
+
+/*
+ * The stand-ins for the functions of the C library called by ip2unix, which
+ * take precedence over the ones of the C library since this program is
+ * linked against the embedding library statically.
+ */
+extern "C" int socket(int domain, int type, int) __THROW
+{
+    return new_fd({domain, type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)});
+}
+
+extern "C" int bind(int fd, const sockaddr*, socklen_t) __THROW
+{
+    return check_fd(fd);
+}
+
+extern "C" int connect(int fd, const sockaddr*, socklen_t)
+{
+    return check_fd(fd);
+}
+
+extern "C" int listen(int fd, int) __THROW
+{
+    return check_fd(fd);
+}
+
+extern "C" int accept4(int fd, sockaddr *addr, socklen_t *addrlen, int)
+{
+    if (check_fd(fd) == -1)
+        return -1;
+    int newfd = new_fd(g_sockets[fd]);
+    fake_address(newfd, addr, addrlen);
+    return newfd;
+}
+
+extern "C" int accept(int fd, sockaddr *addr, socklen_t *addrlen)
+{
+    return accept4(fd, addr, addrlen, 0);
+}
+
+extern "C" int close(int fd)
+{
+    if (check_file(fd) == -1)
+        return -1;
+    g_sockets.erase(fd);
+    return 0;
+}
+
+extern "C" int dup(int fd) __THROW
+{
+    if (fd == UNKNOWN_FD)
+        return fd;
+    return check_fd(fd) == -1 ? -1 : new_fd(g_sockets[fd]);
+}
+
+extern "C" int dup3(int oldfd, int newfd, int) __THROW
+{
+    if (check_file(oldfd) == -1)
+        return -1;
+    if (oldfd == UNKNOWN_FD)
+        g_sockets.erase(newfd);
+    else
+        g_sockets[newfd] = g_sockets[oldfd];
+    return newfd;
+}
+
+extern "C" int dup2(int oldfd, int newfd) __THROW
+{
+    return dup3(oldfd, newfd, 0);
+}
+
+extern "C" int getsockname(int fd, sockaddr *addr, socklen_t *addrlen) __THROW
+{
+    if (check_fd(fd) == -1)
+        return -1;
+    fake_address(fd, addr, addrlen);
+    return 0;
+}
+
+extern "C" int getpeername(int fd, sockaddr *addr, socklen_t *addrlen) __THROW
+{
+    return getsockname(fd, addr, addrlen);
+}
+
+extern "C" int setsockopt(int fd, int, int, const void*, socklen_t) __THROW
+{
+    return check_fd(fd);
+}
+
+extern "C" int getsockopt(int fd, int, int, void *val, socklen_t *len) __THROW
+{
+    if (check_fd(fd) == -1)
+        return -1;
+    memset(val, 0, *len);
+    return 0;
+}
+
+extern "C" int fcntl(int fd, int, ...)
+{
+    return check_file(fd);
+}
+
+extern "C" int ioctl(int fd, unsigned long, ...) __THROW
+{
+    return check_file(fd);
+}
+
+extern "C" int epoll_ctl(int, int, int fd, epoll_event*) __THROW
+{
+    return check_file(fd);
+}
+
+extern "C" ssize_t recvfrom(int fd, void *buf, size_t len, int,
+                            sockaddr *addr, socklen_t *addrlen)
+{
+    if (check_fd(fd) == -1)
+        return -1;
+    memset(buf, 0, len);
+    fake_address(fd, addr, addrlen);
+    return static_cast<ssize_t>(len);
+}
+
+extern "C" ssize_t recvmsg(int fd, msghdr *msg, int)
+{
+    if (check_fd(fd) == -1)
+        return -1;
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; ++i)
+        len += msg->msg_iov[i].iov_len;
+    fake_address(fd, static_cast<sockaddr*>(msg->msg_name),
+                 &msg->msg_namelen);
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+    return static_cast<ssize_t>(len);
+}
+
+extern "C" ssize_t sendto(int fd, const void*, size_t len, int,
+                          const sockaddr*, socklen_t)
+{
+    return check_fd(fd) == -1 ? -1 : static_cast<ssize_t>(len);
+}
+
+extern "C" ssize_t sendmsg(int fd, const msghdr *msg, int)
+{
+    if (check_fd(fd) == -1)
+        return -1;
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; ++i)
+        len += msg->msg_iov[i].iov_len;
+    return static_cast<ssize_t>(len);
+}
+
+extern "C" int unlink(const char*) __THROW
+{
+    return 0;
+}
+
+/* Statistics of the replayed calls of a single wrapper. */
+struct Totals {
+    uint64_t calls = 0;
+    uint64_t differing = 0;
+    double recorded_ns = 0;
+    double replayed_ns = 0;
+};
+
+class Replay
+{
+    public:
+        Replay() : fds(), buf(MAX_BUFSIZE), totals(), skipped(0) {}
+
+        void run(const std::vector<Trace::Record>&);
+        void print(FILE*) const;
+
+    private:
+        /* The descriptors of the replay by process ID and the recorded
+         * descriptor.
+         */
+        std::map<std::pair<pid_t, int64_t>, int> fds;
+        std::vector<char> buf;
+        Totals totals[WRAPPER_COUNT];
+        uint64_t skipped;
+
+        int fd_arg(const Trace::Record&, size_t);
+        void map_fd(const Trace::Record&, int64_t);
+        std::optional<long> replay(const Trace::Record&);
+};
+
+int Replay::fd_arg(const Trace::Record &record, size_t arg)
+{
+    auto found = this->fds.find({record.pid, record.event.args[arg]});
+    return found == this->fds.end() ? UNKNOWN_FD : found->second;
+}
+
+/* Map the descriptor returned by the recorded call to the one of the
+ * replayed call.
+ */
+void Replay::map_fd(const Trace::Record &record, int64_t result)
+{
+    if (record.event.result < 0 || result < 0)
+        return;
+    else if (result == UNKNOWN_FD)
+        this->fds.erase({record.pid, record.event.result});
+    else
+        this->fds[{record.pid, record.event.result}] = static_cast<int>(result);
+}
+
+std::optional<long> Replay::replay(const Trace::Record &record)
+{
+    const Trace::Event &event = record.event;
+    const int64_t *args = event.args;
+    const sockaddr *addr = event.address_len == 0 ? nullptr
+                         : reinterpret_cast<const sockaddr*>(event.address);
+    socklen_t addrlen = event.address_len;
+
+    sockaddr_storage ss;
+    socklen_t sslen = sizeof ss;
+    sockaddr *out = reinterpret_cast<sockaddr*>(&ss);
+    size_t len = std::min(static_cast<size_t>(args[2]), buf.size());
+    long result;
+
+    switch (static_cast<WrapperId>(event.wrapper)) {
+        case WrapperId::socket:
+            result = ip2unix_socket(static_cast<int>(args[0]),
+                                    static_cast<int>(args[1]),
+                                    static_cast<int>(args[2]));
+            this->map_fd(record, result);
+            return result;
+        case WrapperId::bind:
+            if (addr == nullptr)
+                return std::nullopt;
+            return ip2unix_bind(this->fd_arg(record, 0), addr, addrlen);
+        case WrapperId::connect:
+            if (addr == nullptr)
+                return std::nullopt;
+            return ip2unix_connect(this->fd_arg(record, 0), addr, addrlen);
+        case WrapperId::listen:
+            if (ip2unix_listen == nullptr)
+                return std::nullopt;
+            return ip2unix_listen(this->fd_arg(record, 0),
+                                  static_cast<int>(args[1]));
+        case WrapperId::accept:
+        case WrapperId::accept4:
+            result = ip2unix_accept4(this->fd_arg(record, 0),
+                                     args[1] == 0 ? nullptr : out,
+                                     args[1] == 0 ? nullptr : &sslen,
+                                     event.argc > 3
+                                     ? static_cast<int>(args[3]) : 0);
+            this->map_fd(record, result);
+            return result;
+        case WrapperId::getpeername:
+            return ip2unix_getpeername(this->fd_arg(record, 0), out, &sslen);
+        case WrapperId::getsockname:
+            return ip2unix_getsockname(this->fd_arg(record, 0), out, &sslen);
+        case WrapperId::setsockopt:
+            len = std::min(static_cast<size_t>(args[4]), buf.size());
+            std::fill(buf.begin(), buf.end(), 0);
+            return ip2unix_setsockopt(this->fd_arg(record, 0),
+                                      static_cast<int>(args[1]),
+                                      static_cast<int>(args[2]),
+                                      buf.data(),
+                                      static_cast<socklen_t>(len));
+        case WrapperId::recvfrom:
+            return ip2unix_recvfrom(this->fd_arg(record, 0), buf.data(), len,
+                                    static_cast<int>(args[3]),
+                                    args[4] == 0 ? nullptr : out,
+                                    args[4] == 0 ? nullptr : &sslen);
+        case WrapperId::sendto:
+            return ip2unix_sendto(this->fd_arg(record, 0), buf.data(), len,
+                                  static_cast<int>(args[3]), addr,
+                                  addr == nullptr ? 0 : addrlen);
+        case WrapperId::recvmsg:
+        case WrapperId::sendmsg: {
+            iovec iov = {buf.data(), 64};
+            msghdr msg;
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if (event.wrapper == static_cast<uint16_t>(WrapperId::recvmsg)) {
+                msg.msg_name = out;
+                msg.msg_namelen = sslen;
+                return ip2unix_recvmsg(this->fd_arg(record, 0), &msg,
+                                       static_cast<int>(args[2]));
+            }
+            msg.msg_name = const_cast<sockaddr*>(addr);
+            msg.msg_namelen = addr == nullptr ? 0 : addrlen;
+            return ip2unix_sendmsg(this->fd_arg(record, 0), &msg,
+                                   static_cast<int>(args[2]));
+        }
+        case WrapperId::dup:
+            result = ip2unix_dup(this->fd_arg(record, 0));
+            this->map_fd(record, result);
+            return result;
+        case WrapperId::dup2:
+        case WrapperId::dup3: {
+            int oldfd = this->fd_arg(record, 0);
+            int newfd = this->fd_arg(record, 1);
+            if (oldfd != UNKNOWN_FD && newfd == UNKNOWN_FD)
+                newfd = new_fd({AF_UNSPEC, 0});
+            result = ip2unix_dup3(oldfd, newfd,
+                                  event.argc > 2
+                                  ? static_cast<int>(args[2]) : 0);
+            this->map_fd(record, result);
+            return result;
+        }
+        case WrapperId::close:
+            result = ip2unix_close(this->fd_arg(record, 0));
+            this->fds.erase({record.pid, args[0]});
+            return result;
+        /* Calls that either don't involve any sockets or whose arguments
+         * can't be reconstructed from the recording.
+         */
+        case WrapperId::__io_uring_get_cqe:
+        case WrapperId::epoll_ctl:
+        case WrapperId::execl:
+        case WrapperId::execle:
+        case WrapperId::execlp:
+        case WrapperId::execv:
+        case WrapperId::execve:
+        case WrapperId::execvp:
+        case WrapperId::execvpe:
+        case WrapperId::getaddrinfo:
+        case WrapperId::gethostbyname:
+        case WrapperId::gethostbyname2:
+        case WrapperId::io_uring_peek_batch_cqe:
+        case WrapperId::io_uring_queue_init:
+        case WrapperId::io_uring_queue_init_params:
+        case WrapperId::io_uring_submit:
+        case WrapperId::io_uring_submit_and_wait:
+        case WrapperId::io_uring_submit_and_wait_timeout:
+        case WrapperId::io_uring_wait_cqes:
+        case WrapperId::ioctl:
+        case WrapperId::pclose:
+        case WrapperId::popen:
+        case WrapperId::posix_spawn:
+        case WrapperId::posix_spawnp:
+        case WrapperId::syscall:
+        case WrapperId::system:
+            break;
+    }
+
+    return std::nullopt;
+}
+
+void Replay::run(const std::vector<Trace::Record> &records)
+{
+    for (const Trace::Record &record : records) {
+        auto start = std::chrono::steady_clock::now();
+        std::optional<long> result = this->replay(record);
+        auto end = std::chrono::steady_clock::now();
+
+        if (!result) {
+            ++this->skipped;
+            continue;
+        }
+
+        Totals &wrapper = this->totals[record.event.wrapper];
+        std::chrono::duration<double, std::nano> elapsed = end - start;
+        ++wrapper.calls;
+        wrapper.recorded_ns += static_cast<double>(record.duration);
+        wrapper.replayed_ns += elapsed.count();
+        if ((*result == -1) != (record.event.result == -1))
+            ++wrapper.differing;
+    }
+
+    /* Start the next iteration from scratch. */
+    for (const auto &mapping : this->fds)
+        ip2unix_close(mapping.second);
+    this->fds.clear();
+    g_sockets.clear();
+}
+
+void Replay::print(FILE *fp) const
+{
+    fprintf(fp, "%-16s %10s %14s %14s %10s\n", "WRAPPER", "CALLS",
+            "RECORDED (ns)", "REPLAYED (ns)", "DIFFERING");
+    for (size_t i = 0; i < WRAPPER_COUNT; ++i) {
+        const Totals &wrapper = this->totals[i];
+        if (wrapper.calls == 0)
+            continue;
+        double calls = static_cast<double>(wrapper.calls);
+        fprintf(fp, "%-16s %10lu %14.1f %14.1f %10lu\n", WRAPPER_NAMES[i],
+                wrapper.calls, wrapper.recorded_ns / calls,
+                wrapper.replayed_ns / calls, wrapper.differing);
+    }
+    fprintf(fp, "%lu calls skipped\n", this->skipped);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        if (c != 'n' || (iterations = atoi(optarg)) <= 0) {
+            fprintf(stderr, "Usage: %s [-n ITERATIONS] RULEFILE TRACE...\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-n ITERATIONS] RULEFILE TRACE...\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::ifstream rulefile(argv[optind]);
+    std::stringstream rules;
+    rules << rulefile.rdbuf();
+    if (!rulefile || ip2unix_load_rules(rules.str().data(),
+                                        rules.str().size()) == -1) {
+        fprintf(stderr, "Unable to load rules from '%s'.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Trace::Record> records;
+    for (int i = optind + 1; i < argc; ++i) {
+        std::string error;
+        if (!Trace::read(argv[i], records, &error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    Trace::sort(records);
+
+    Replay replay;
+    for (int i = 0; i < iterations; ++i)
+        replay.run(records);
+    replay.print(stdout);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+/*
+ * Measure how long it takes to split and parse rule files of various sizes,
+ * which is done by the ip2unix command before running the program.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "rules.hh"
+
+static long long now_ns(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string make_rule_file(size_t count)
+{
+    std::string data = "# Generated rule file\n";
+
+    for (size_t i = 0; i < count; ++i) {
+        data += i % 2 ? "in" : "out";
+        data += ",tcp,addr=127.0." + std::to_string(i / 256 % 256) + "."
+              + std::to_string(i % 256) + ",port="
+              + std::to_string(1000 + i % 60000)
+              + ",path=/run/ip2unix/service-" + std::to_string(i)
+              + ".sock\n";
+    }
+
+    return data;
+}
+
+static void measure(const char *name, size_t count)
+{
+    std::string data = make_rule_file(count);
+
+    long long start = now_ns();
+    std::vector<std::string_view> rule_args;
+    split_rule_args(data, rule_args);
+    double split_ms = static_cast<double>(now_ns() - start) / 1000000.0;
+
+    start = now_ns();
+    std::optional<std::vector<Rule>> rules = parse_rule_args(rule_args);
+    double parse_ms = static_cast<double>(now_ns() - start) / 1000000.0;
+
+    if (!rules || rules->size() != count) {
+        fprintf(stderr, "Unable to parse %s.\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-12s split %10.2f ms  parse %10.2f ms  (%zu bytes)\n",
+           name, split_ms, parse_ms, data.size());
+}
+
+int main(void)
+{
+    measure("10k rules", 10000);
+    measure("100k rules", 100000);
+    measure("1M rules", 1000000);
+    return EXIT_SUCCESS;
+}
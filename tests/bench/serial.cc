@@ -0,0 +1,81 @@
+/*
+ * Measure how long it takes to encode and decode the rules and the systemd
+ * file descriptor maps, which happens on startup of every program run via
+ * ip2unix.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "serial.hh"
+
+#define ITERATIONS 2000
+
+static long long now_ns(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static std::vector<Rule> make_rules(size_t count)
+{
+    std::vector<Rule> rules;
+
+    for (size_t i = 0; i < count; ++i) {
+        Rule rule;
+        rule.direction = i % 2 ? RuleDir::INCOMING : RuleDir::OUTGOING;
+        rule.type = SocketType::TCP;
+        rule.address = "127.0.0." + std::to_string(i % 256);
+        rule.port = static_cast<uint16_t>(1000 + i);
+        rule.socket_path = "/run/ip2unix/service-" + std::to_string(i)
+                         + ".sock";
+        rules.push_back(rule);
+    }
+
+    return rules;
+}
+
+template <typename T>
+static void measure(const char *name, const T &value)
+{
+    std::string encoded;
+    long long start = now_ns();
+    for (int i = 0; i < ITERATIONS; ++i)
+        encoded = serialise(value);
+    double encode_us = static_cast<double>(now_ns() - start)
+                     / ITERATIONS / 1000.0;
+
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        T decoded;
+        MaybeError err = deserialise(encoded, &decoded);
+        if (err) {
+            fprintf(stderr, "Unable to decode %s: %s\n", name, err->c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    double decode_us = static_cast<double>(now_ns() - start)
+                     / ITERATIONS / 1000.0;
+
+    printf("%-16s encode %10.2f us  decode %10.2f us  (%zu bytes)\n",
+           name, encode_us, decode_us, encoded.size());
+}
+
+int main(void)
+{
+    measure("1 rule", make_rules(1));
+    measure("10 rules", make_rules(10));
+    measure("100 rules", make_rules(100));
+
+    std::unordered_map<size_t, std::pair<int, bool>> fdmap;
+    std::deque<std::pair<int, bool>> fds;
+    for (int i = 0; i < 32; ++i) {
+        fdmap[static_cast<size_t>(i)] = std::make_pair(i + 3, i % 2 == 0);
+        fds.push_back(std::make_pair(i + 35, i % 2 != 0));
+    }
+
+    measure("systemd fdmap", fdmap);
+    measure("systemd fds", fds);
+    return EXIT_SUCCESS;
+}
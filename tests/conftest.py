@@ -4,6 +4,8 @@ IP2UNIX = None
 LIBIP2UNIX = None
 SYSTEMD_SUPPORT = False
 SYSTEMD_SA_PATH = None
+USDT_PROBES = False
+LOG_LEVEL = 'trace'
 
 
 def pytest_addoption(parser):
@@ -13,10 +15,25 @@ def pytest_addoption(parser):
                      help='The path to the ip2unix library')
     parser.addoption('--systemd-support', action='store_true',
                      help='Whether systemd support is compiled in')
+    parser.addoption('--usdt-probes', action='store_true',
+                     help='Whether USDT probes are compiled in')
+    parser.addoption('--max-log-level', action='store', default='trace',
+                     help='The most verbose log level compiled in')
     parser.addoption('--systemd-sa-path', action='store',
                      help='The path to the \'systemd-socket-activate\' helper')
     parser.addoption('--helper-accept-no-peer-addr', action='store',
                      help='The path to the \'accept-no-peer-addr\' helper')
+    parser.addoption('--helper-embed', action='store',
+                     help='The path to the \'embed\' helper')
+    parser.addoption('--helper-io-uring', action='store',
+                     help='The path to the \'io-uring\' helper')
+    parser.addoption('--helper-liburing', action='store',
+                     help='The path to the \'liburing\' helper')
+    parser.addoption('--bench-replay', action='store',
+                     help='The path to the \'bench_replay\' program')
+    parser.addoption('--helper-specialized', action='store',
+                     help='The path to the preload library with built-in'
+                          ' rules')
 
 
 @pytest.fixture
@@ -24,12 +41,50 @@ def helper_accept_no_peer_addr(request):
     return request.config.option.helper_accept_no_peer_addr
 
 
+@pytest.fixture
+def helper_embed(request):
+    return request.config.option.helper_embed
+
+
+@pytest.fixture
+def helper_specialized(request):
+    return request.config.option.helper_specialized
+
+
+@pytest.fixture
+def bench_replay(request):
+    path = request.config.option.bench_replay
+    if path is None:
+        pytest.skip('replay is not supported with raw syscalls')
+    return path
+
+
+@pytest.fixture
+def helper_io_uring(request):
+    path = request.config.option.helper_io_uring
+    if path is None:
+        pytest.skip('no support for io_uring compiled in')
+    return path
+
+
+@pytest.fixture
+def helper_liburing(request):
+    path = request.config.option.helper_liburing
+    if path is None:
+        pytest.skip('liburing is not available')
+    return path
+
+
 def pytest_configure(config):
     global IP2UNIX
     global LIBIP2UNIX
     global SYSTEMD_SUPPORT
     global SYSTEMD_SA_PATH
+    global USDT_PROBES
+    global LOG_LEVEL
     IP2UNIX = config.option.ip2unix_path
     LIBIP2UNIX = config.option.libip2unix_path
     SYSTEMD_SUPPORT = config.option.systemd_support
     SYSTEMD_SA_PATH = config.option.systemd_sa_path
+    USDT_PROBES = config.option.usdt_probes
+    LOG_LEVEL = config.option.max_log_level
@@ -4,11 +4,15 @@ import subprocess
 from contextlib import contextmanager
 
 import pytest
-from conftest import IP2UNIX, LIBIP2UNIX, SYSTEMD_SUPPORT, SYSTEMD_SA_PATH
+from conftest import IP2UNIX, LIBIP2UNIX, SYSTEMD_SUPPORT, SYSTEMD_SA_PATH, \
+                     USDT_PROBES, LOG_LEVEL
 
 __all__ = ['IP2UNIX', 'LIBIP2UNIX', 'SYSTEMD_SUPPORT', 'SYSTEMD_SA_PATH',
            'ip2unix', 'systemd_only', 'non_systemd_only',
-           'systemd_sa_helper_only']
+           'systemd_sa_helper_only', 'usdt_only', 'log_level_only',
+           'LOG_LEVEL']
+
+LOG_LEVELS = ['fatal', 'error', 'warning', 'info', 'debug', 'trace']
 
 
 @contextmanager
@@ -30,3 +34,13 @@ non_systemd_only = pytest.mark.skipif(
 systemd_sa_helper_only = pytest.mark.skipif(
     SYSTEMD_SA_PATH is None, reason="no 'systemd-socket-activate' helper"
 )
+usdt_only = pytest.mark.skipif(
+    not USDT_PROBES, reason='no USDT probes compiled in'
+)
+
+
+def log_level_only(level):
+    return pytest.mark.skipif(
+        LOG_LEVELS.index(level) > LOG_LEVELS.index(LOG_LEVEL),
+        reason='no {} messages compiled in'.format(level)
+    )
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "ip2unix.h"
+
+/* A program which uses the embedding interface instead of being run via the
+ * preload library, so it needs to pass its rules explicitly.
+ */
+
+#define CHECK(what, res) \
+    if ((res) == -1) { \
+        perror(what); \
+        return EXIT_FAILURE; \
+    }
+
+static int run_client(sockaddr_in *addr)
+{
+    int fd = ip2unix_socket(AF_INET, SOCK_STREAM, 0);
+    CHECK("socket", fd);
+
+    CHECK("connect", ip2unix_connect(fd, reinterpret_cast<sockaddr*>(addr),
+                                     sizeof *addr));
+
+    char buf[4] = "foo";
+    CHECK("sendto", ip2unix_sendto(fd, buf, 3, 0, nullptr, 0));
+    CHECK("recvfrom", ip2unix_recvfrom(fd, buf, 3, 0, nullptr, nullptr));
+    fwrite(buf, 1, 3, stdout);
+    fputc('\n', stdout);
+
+    CHECK("close", ip2unix_close(fd));
+    return EXIT_SUCCESS;
+}
+
+static int run_server(sockaddr_in *addr)
+{
+    int fd = ip2unix_socket(AF_INET, SOCK_STREAM, 0);
+    CHECK("socket", fd);
+
+    CHECK("bind", ip2unix_bind(fd, reinterpret_cast<sockaddr*>(addr),
+                               sizeof *addr));
+    CHECK("listen", listen(fd, 10));
+
+    sockaddr_storage peer;
+    socklen_t peerlen = sizeof peer;
+    memset(&peer, 0, sizeof peer);
+
+    int accfd = ip2unix_accept(fd, reinterpret_cast<sockaddr*>(&peer),
+                               &peerlen);
+    CHECK("accept", accfd);
+
+    char host[INET6_ADDRSTRLEN] = "";
+    if (peer.ss_family == AF_INET) {
+        sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&peer);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof host);
+    }
+    printf("%d %s\n", peer.ss_family, host);
+    fflush(stdout);
+
+    char buf[4] = "";
+    CHECK("recvfrom", ip2unix_recvfrom(accfd, buf, 3, 0, nullptr, nullptr));
+    if (buf[0] == 'f') buf[0] = 'b';
+    if (buf[1] == 'o') buf[1] = 'a';
+    if (buf[2] == 'o') buf[2] = 'r';
+    CHECK("sendto", ip2unix_sendto(accfd, buf, 3, 0, nullptr, 0));
+
+    CHECK("close", ip2unix_close(accfd));
+    CHECK("close", ip2unix_close(fd));
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s RULES {client|server} PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    CHECK("load rules", ip2unix_load_rules(argv[1], strlen(argv[1])));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(atoi(argv[3])));
+
+    if (strcmp(argv[2], "client") == 0)
+        return run_client(&addr);
+    else
+        return run_server(&addr);
+}
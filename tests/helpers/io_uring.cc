@@ -0,0 +1,306 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* A very minimal io_uring implementation using syscall() directly, so we
+ * don't need to depend on liburing.
+ */
+struct Uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+};
+
+static bool uring_setup(Uring *ring)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    ring->fd = static_cast<int>(syscall(SYS_io_uring_setup, 8, &p));
+    if (ring->fd == -1) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+    char *sq = static_cast<char*>(mmap(nullptr, sqsize,
+                                       PROT_READ | PROT_WRITE, MAP_SHARED,
+                                       ring->fd, IORING_OFF_SQ_RING));
+    char *cq = static_cast<char*>(mmap(nullptr, cqsize,
+                                       PROT_READ | PROT_WRITE, MAP_SHARED,
+                                       ring->fd, IORING_OFF_CQ_RING));
+    void *sqes = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd,
+                      IORING_OFF_SQES);
+
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    ring->sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    ring->cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+/* Whether to reap completions without entering the kernel, like eg.
+ * io_uring_peek_cqe() of liburing does.
+ */
+static bool peek = false;
+
+static void uring_push(Uring *ring, const io_uring_sqe &entry)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    memcpy(&ring->sqes[idx], &entry, sizeof entry);
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_submit(Uring *ring, unsigned count)
+{
+    unsigned wait = peek ? 0 : 1;
+    unsigned flags = peek ? 0 : IORING_ENTER_GETEVENTS;
+    if (syscall(SYS_io_uring_enter, ring->fd, count, wait, flags,
+                nullptr, 0) == -1) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Wait for the next completion and return its result. */
+static int uring_reap(Uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (peek)
+            sched_yield();
+        else
+            syscall(SYS_io_uring_enter, ring->fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+
+    int res = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+/* Submit a single entry and wait for its completion. */
+static int uring_run(Uring *ring, const io_uring_sqe &entry)
+{
+    uring_push(ring, entry);
+    uring_submit(ring, 1);
+    return uring_reap(ring);
+}
+
+static io_uring_sqe make_sqe(uint8_t opcode, int fd)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    return sqe;
+}
+
+static int uring_msg(Uring *ring, uint8_t opcode, int fd, char *buf)
+{
+    iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = 3;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    io_uring_sqe sqe = make_sqe(opcode, fd);
+    sqe.addr = reinterpret_cast<uint64_t>(&msg);
+    return uring_run(ring, sqe);
+}
+
+#define CHECK(what, res) \
+    if ((res) < 0) { \
+        fprintf(stderr, what ": %s\n", strerror(-(res))); \
+        return EXIT_FAILURE; \
+    }
+
+static int run_client(Uring *ring, sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    io_uring_sqe sqe = make_sqe(IORING_OP_CONNECT, fd);
+    sqe.addr = reinterpret_cast<uint64_t>(addr);
+    sqe.off = sizeof(sockaddr_in);
+    CHECK("connect", uring_run(ring, sqe));
+
+    char buf[4] = "foo";
+    CHECK("sendmsg", uring_msg(ring, IORING_OP_SENDMSG, fd, buf));
+    CHECK("recvmsg", uring_msg(ring, IORING_OP_RECVMSG, fd, buf));
+    fwrite(buf, 1, 3, stdout);
+    fputc('\n', stdout);
+    return EXIT_SUCCESS;
+}
+
+static int run_server(Uring *ring, sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(addr), sizeof *addr) == -1) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+
+    if (listen(fd, 10) == -1) {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_storage peer;
+    socklen_t peerlen = sizeof peer;
+    memset(&peer, 0, sizeof peer);
+
+    io_uring_sqe sqe = make_sqe(IORING_OP_ACCEPT, fd);
+    sqe.addr = reinterpret_cast<uint64_t>(&peer);
+    sqe.addr2 = reinterpret_cast<uint64_t>(&peerlen);
+    int accfd = uring_run(ring, sqe);
+    CHECK("accept", accfd);
+
+    char host[INET6_ADDRSTRLEN] = "";
+    if (peer.ss_family == AF_INET) {
+        sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&peer);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof host);
+    }
+    printf("%d %s\n", peer.ss_family, host);
+
+    sockaddr_storage gpn;
+    socklen_t gpnlen = sizeof gpn;
+    if (getpeername(accfd, reinterpret_cast<sockaddr*>(&gpn), &gpnlen) == -1) {
+        perror("getpeername");
+        return EXIT_FAILURE;
+    }
+    printf("%d\n", gpn.ss_family);
+    fflush(stdout);
+
+    char buf[4] = "";
+    CHECK("recvmsg", uring_msg(ring, IORING_OP_RECVMSG, accfd, buf));
+    if (buf[0] == 'f') buf[0] = 'b';
+    if (buf[1] == 'o') buf[1] = 'a';
+    if (buf[2] == 'o') buf[2] = 'r';
+    CHECK("sendmsg", uring_msg(ring, IORING_OP_SENDMSG, accfd, buf));
+
+    CHECK("close", uring_run(ring, make_sqe(IORING_OP_CLOSE, accfd)));
+    CHECK("close", uring_run(ring, make_sqe(IORING_OP_CLOSE, fd)));
+    return EXIT_SUCCESS;
+}
+
+/* Accept two connections at once, whose entries have the same user_data, and
+ * reap their completions without entering the kernel.
+ */
+static int run_peek_server(Uring *ring, sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(addr), sizeof *addr) == -1) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+
+    if (listen(fd, 10) == -1) {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+
+    uring_push(ring, make_sqe(IORING_OP_ACCEPT, fd));
+    uring_push(ring, make_sqe(IORING_OP_ACCEPT, fd));
+    uring_submit(ring, 2);
+
+    int accfds[2];
+    for (int &accfd : accfds) {
+        accfd = uring_reap(ring);
+        CHECK("accept", accfd);
+    }
+
+    for (int accfd : accfds) {
+        sockaddr_storage gpn;
+        socklen_t gpnlen = sizeof gpn;
+        if (getpeername(accfd, reinterpret_cast<sockaddr*>(&gpn),
+                        &gpnlen) == -1) {
+            perror("getpeername");
+            return EXIT_FAILURE;
+        }
+        printf("%d\n", gpn.ss_family);
+    }
+    fflush(stdout);
+
+    for (int accfd : accfds) {
+        char buf[4] = "bar";
+        CHECK("sendmsg", uring_msg(ring, IORING_OP_SENDMSG, accfd, buf));
+        CHECK("close", uring_run(ring, make_sqe(IORING_OP_CLOSE, accfd)));
+    }
+
+    CHECK("close", uring_run(ring, make_sqe(IORING_OP_CLOSE, fd)));
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    Uring ring;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s {client|server|peek-client|peek-server}"
+                " PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *mode = argv[1];
+    if (strncmp(mode, "peek-", 5) == 0) {
+        peek = true;
+        mode += 5;
+    }
+
+    if (!uring_setup(&ring))
+        return 77;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(atoi(argv[2])));
+
+    if (strcmp(mode, "client") == 0)
+        return run_client(&ring, &addr);
+    else if (peek)
+        return run_peek_server(&ring, &addr);
+    else
+        return run_server(&ring, &addr);
+}
@@ -0,0 +1,142 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <liburing.h>
+#include <sys/socket.h>
+
+/* The same as the io_uring helper, but using the shared library of liburing,
+ * which issues the system calls on its own since version 2.2.
+ */
+
+#define CHECK(what, res) \
+    if ((res) < 0) { \
+        fprintf(stderr, what ": %s\n", strerror(-(res))); \
+        return EXIT_FAILURE; \
+    }
+
+/* Submit the prepared entry and wait for its completion. */
+static int uring_run(io_uring *ring)
+{
+    int ret = io_uring_submit_and_wait(ring, 1);
+    if (ret < 0)
+        return ret;
+
+    io_uring_cqe *cqe;
+    if ((ret = io_uring_wait_cqe(ring, &cqe)) < 0)
+        return ret;
+
+    ret = cqe->res;
+    io_uring_cqe_seen(ring, cqe);
+    return ret;
+}
+
+static int uring_msg(io_uring *ring, bool send, int fd, char *buf)
+{
+    iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = 3;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (send)
+        io_uring_prep_sendmsg(sqe, fd, &msg, 0);
+    else
+        io_uring_prep_recvmsg(sqe, fd, &msg, 0);
+    return uring_run(ring);
+}
+
+static int run_client(io_uring *ring, sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    io_uring_prep_connect(sqe, fd, reinterpret_cast<sockaddr*>(addr),
+                          sizeof *addr);
+    CHECK("connect", uring_run(ring));
+
+    char buf[4] = "foo";
+    CHECK("sendmsg", uring_msg(ring, true, fd, buf));
+    CHECK("recvmsg", uring_msg(ring, false, fd, buf));
+    fwrite(buf, 1, 3, stdout);
+    fputc('\n', stdout);
+    return EXIT_SUCCESS;
+}
+
+static int run_server(io_uring *ring, sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(addr), sizeof *addr) == -1) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+
+    if (listen(fd, 10) == -1) {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_storage peer;
+    socklen_t peerlen = sizeof peer;
+    memset(&peer, 0, sizeof peer);
+
+    io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    io_uring_prep_accept(sqe, fd, reinterpret_cast<sockaddr*>(&peer),
+                         &peerlen, 0);
+    int accfd = uring_run(ring);
+    CHECK("accept", accfd);
+
+    char host[INET6_ADDRSTRLEN] = "";
+    if (peer.ss_family == AF_INET) {
+        sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&peer);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof host);
+    }
+    printf("%d %s\n", peer.ss_family, host);
+    fflush(stdout);
+
+    char buf[4] = "";
+    CHECK("recvmsg", uring_msg(ring, false, accfd, buf));
+    if (buf[0] == 'f') buf[0] = 'b';
+    if (buf[1] == 'o') buf[1] = 'a';
+    if (buf[2] == 'o') buf[2] = 'r';
+    CHECK("sendmsg", uring_msg(ring, true, accfd, buf));
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    io_uring ring;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s {client|server} PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (io_uring_queue_init(8, &ring, 0) < 0)
+        return 77;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(atoi(argv[2])));
+
+    if (strcmp(argv[1], "client") == 0)
+        return run_client(&ring, &addr);
+    else
+        return run_server(&ring, &addr);
+}
@@ -0,0 +1,24 @@
+import subprocess
+import sys
+
+from helper import IP2UNIX, LIBIP2UNIX, log_level_only
+
+
+@log_level_only('info')
+def test_early_init():
+    cmd = [IP2UNIX, '-vvv', '-E', '-r', 'out,port=1234,path=/foo',
+           '-r', 'in,port=4321,reject', sys.executable, '-c', 'pass']
+    stderr = subprocess.check_output(cmd, stderr=subprocess.STDOUT)
+    assert b'Initialised 2 rule(s) early.' in stderr
+
+
+def test_early_init_fail_before_main():
+    cmd = [sys.executable, '-c', 'print("main")']
+    env = {'LD_PRELOAD': LIBIP2UNIX, '__IP2UNIX_EARLY_INIT': '1'}
+
+    with subprocess.Popen(cmd, env=env, stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE) as proc:
+        stdout, stderr = proc.communicate()
+        assert stdout == b''
+        assert stderr.startswith(b'ip2unix FATAL:')
+        assert proc.poll() != 0
@@ -0,0 +1,51 @@
+import socket
+import subprocess
+import time
+
+
+def test_embed_connect(tmpdir, helper_embed):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = '# comment\n\nout,port=1234,path=' + sockfile + '\n'
+    cmd = [helper_embed, rules, 'client', '1234']
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as server:
+        server.bind(sockfile)
+        server.listen(10)
+        with subprocess.Popen(cmd, stdout=subprocess.PIPE) as client:
+            conn, _ = server.accept()
+            with conn:
+                assert conn.recv(3) == b'foo'
+                conn.sendall(b'bar')
+            stdout = client.communicate(timeout=5)[0]
+            assert client.returncode == 0
+            assert stdout == b'bar\n'
+
+
+def test_embed_accept(tmpdir, helper_embed):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = 'in,port=1234,path=' + sockfile
+    cmd = [helper_embed, rules, 'server', '1234']
+
+    with subprocess.Popen(cmd, stdout=subprocess.PIPE) as server:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as client:
+            while True:
+                try:
+                    client.connect(sockfile)
+                except FileNotFoundError:
+                    pass
+                else:
+                    break
+                time.sleep(0.1)
+            client.sendall(b'foo')
+            assert client.recv(3) == b'bar'
+        stdout = server.communicate(timeout=5)[0]
+        assert server.returncode == 0
+        inet = str(int(socket.AF_INET)).encode()
+        assert stdout == inet + b' 127.0.0.1\n'
+
+
+def test_embed_invalid_rules(helper_embed):
+    cmd = [helper_embed, 'in,port=1234,reject\nfoo=bar', 'client', '1234']
+    result = subprocess.run(cmd, stderr=subprocess.PIPE)
+    assert result.returncode != 0
+    assert b'In rule #2: foo=bar' in result.stderr
@@ -0,0 +1,96 @@
+import os
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+CHILD_CODE = '''
+import os
+print(os.environ.get('LD_PRELOAD', ''), '__IP2UNIX_RULES' in os.environ)
+'''
+
+PARENT_CODE = '''
+import ctypes, os, shlex, subprocess, sys
+assert '__IP2UNIX_RULES' in os.environ
+cmd = [sys.executable, '-c', {child!r}]
+sys.stdout.flush()
+subprocess.check_call(cmd)
+pid = os.posix_spawn(sys.executable, cmd, os.environ)
+os.waitpid(pid, 0)
+assert os.system(shlex.join(cmd)) == 0
+libc = ctypes.CDLL(None)
+libc.popen.restype = ctypes.c_void_p
+libc.pclose.argtypes = [ctypes.c_void_p]
+assert libc.pclose(libc.popen(shlex.join(cmd).encode(), b'w')) == 0
+pid = os.posix_spawnp('env', ['env'], os.environ)
+os.waitpid(pid, 0)
+'''
+
+
+def run_filtered(*patterns):
+    cmd = [IP2UNIX, '-r', 'out,port=1234,path=/foo']
+    for pattern in patterns:
+        cmd += ['--exec-filter', pattern]
+    cmd += [sys.executable, '-c', PARENT_CODE.format(child=CHILD_CODE)]
+    env = dict(os.environ)
+    env.pop('LD_PRELOAD', None)
+    return subprocess.check_output(cmd, env=env).decode().splitlines()
+
+
+def test_no_filter():
+    output = subprocess.check_output([
+        IP2UNIX, '-r', 'out,port=1234,path=/foo', sys.executable, '-c',
+        PARENT_CODE.format(child=CHILD_CODE)
+    ]).decode().splitlines()
+    assert all(line.endswith('True') for line in output[:4])
+    assert any(line.startswith('__IP2UNIX_RULES=') for line in output[4:])
+
+
+def test_filter_no_match():
+    output = run_filtered('/nonexistent/**')
+    assert output[:4] == [' False'] * 4
+    assert not any(line.startswith('__IP2UNIX_') for line in output[4:])
+    assert not any('libip2unix' in line for line in output[4:])
+
+
+def test_filter_match():
+    python = os.path.abspath(sys.executable)
+    output = run_filtered('/nonexistent', python)
+    assert 'libip2unix' in output[0] and output[0].endswith('True')
+    assert 'libip2unix' in output[1] and output[1].endswith('True')
+    assert output[2:4] == [' False'] * 2
+    assert not any(line.startswith('__IP2UNIX_') for line in output[4:])
+
+
+def test_filter_shell():
+    python = os.path.abspath(sys.executable)
+    output = run_filtered('sh', python)
+    assert all('libip2unix' in line and line.endswith('True')
+               for line in output[:4])
+
+
+def test_filter_path_search():
+    output = run_filtered('**/env')
+    assert output[:4] == [' False'] * 4
+    assert any(line.startswith('__IP2UNIX_RULES=') for line in output[4:])
+
+
+POPEN_CODE = '''
+import ctypes, os
+libc = ctypes.CDLL(None)
+libc.popen.restype = ctypes.c_void_p
+libc.pclose.argtypes = [ctypes.c_void_p]
+libc.fgets.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_void_p]
+fp = libc.popen(b'echo "$__IP2UNIX_RULES" foo; exit 3', b'r')
+buf = ctypes.create_string_buffer(64)
+libc.fgets(buf, 64, fp)
+print(buf.value.decode().strip(), os.WEXITSTATUS(libc.pclose(fp)))
+'''
+
+
+def test_filter_popen_read():
+    cmd = [IP2UNIX, '-r', 'out,port=1234,path=/foo',
+           '--exec-filter', '/nonexistent', sys.executable, '-c', POPEN_CODE]
+    env = dict(os.environ)
+    env.pop('LD_PRELOAD', None)
+    assert subprocess.check_output(cmd, env=env) == b'foo 3\n'
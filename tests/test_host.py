@@ -0,0 +1,75 @@
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+TESTPROG = '''
+import os
+import socket
+import sys
+
+assert socket.gethostbyname('API.internal.').startswith('198.1')
+assert socket.gethostbyname('localhost') == '127.0.0.1'
+
+with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as server:
+    server.bind(('127.0.0.1', 1234))
+    server.listen(10)
+
+    if os.fork() == 0:
+        with socket.create_connection(('api.internal', 80)) as client:
+            client.sendall(b'hello')
+        raise SystemExit
+
+    conn, _ = server.accept()
+    with conn:
+        sys.stdout.buffer.write(conn.recv(1024))
+    os.wait()
+'''
+
+REJECT_PROG = '''
+import errno
+import socket
+sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+addr = socket.getaddrinfo('api.internal', 'http', socket.AF_INET,
+                          socket.SOCK_STREAM, 0, socket.AI_CANONNAME)[0]
+print(addr[3])
+print(errno.errorcode[sock.connect_ex(addr[4])])
+'''
+
+
+def test_host_rule(tmpdir):
+    sockfile = str(tmpdir.join('api.sock'))
+    cmd = [IP2UNIX, '-r', 'in,addr=127.0.0.1,port=1234,path=' + sockfile,
+           '-r', 'out,host=api.internal,port=80,path=' + sockfile,
+           sys.executable, '-c', TESTPROG]
+    assert subprocess.check_output(cmd) == b'hello'
+
+
+def test_host_reject():
+    cmd = [IP2UNIX, '-r', 'host=api.internal,reject=EPERM',
+           sys.executable, '-c', REJECT_PROG]
+    output = subprocess.check_output(cmd)
+    assert output.splitlines() == [b'api.internal', b'EPERM']
+
+
+def test_host_ipv6():
+    code = REJECT_PROG.replace('AF_INET', 'AF_INET6')
+    cmd = [IP2UNIX, '-r', 'host=api.internal,reject=EPERM',
+           sys.executable, '-c', code]
+    output = subprocess.check_output(cmd)
+    assert output.splitlines() == [b'api.internal', b'EPERM']
+
+
+def test_host_with_address():
+    for rule in ['host=api.internal,addr=1.2.3.4,reject',
+                 'addr=1.2.3.4,host=api.internal,reject']:
+        cmd = [IP2UNIX, '-c', '-r', rule]
+        result = subprocess.run(cmd, stderr=subprocess.PIPE)
+        assert result.returncode != 0
+        assert b"Can't use both an address and a host name" in result.stderr
+
+
+def test_host_print():
+    cmd = [IP2UNIX, '-cp', '-r', 'host=Api.Internal.,reject']
+    output = subprocess.check_output(cmd)
+    assert b'Host: api.internal\n' in output
@@ -0,0 +1,151 @@
+import socket
+import subprocess
+import time
+
+import pytest
+
+from helper import IP2UNIX
+
+
+def run_helper(cmd, *args, **kwargs):
+    proc = subprocess.Popen(cmd, *args, **kwargs)
+    time.sleep(0.1)
+    if proc.poll() == 77:
+        pytest.skip('io_uring is not available')
+    return proc
+
+
+def test_io_uring_connect(tmpdir, helper_io_uring):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = ['-r', 'out,port=1234,path=' + sockfile]
+    cmd = [IP2UNIX] + rules + [helper_io_uring, 'client', '1234']
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as server:
+        server.bind(sockfile)
+        server.listen(10)
+        with run_helper(cmd, stdout=subprocess.PIPE) as client:
+            conn, _ = server.accept()
+            with conn:
+                assert conn.recv(3) == b'foo'
+                conn.sendall(b'bar')
+            stdout = client.communicate(timeout=5)[0]
+            assert client.returncode == 0
+            assert stdout == b'bar\n'
+
+
+def test_io_uring_accept(tmpdir, helper_io_uring):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = ['-r', 'in,port=1234,path=' + sockfile]
+    cmd = [IP2UNIX] + rules + [helper_io_uring, 'server', '1234']
+
+    with run_helper(cmd, stdout=subprocess.PIPE) as server:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as client:
+            while True:
+                try:
+                    client.connect(sockfile)
+                except FileNotFoundError:
+                    pass
+                else:
+                    break
+                time.sleep(0.1)
+            client.sendall(b'foo')
+            assert client.recv(3) == b'bar'
+        stdout = server.communicate(timeout=5)[0]
+        assert server.returncode == 0
+        inet = str(int(socket.AF_INET)).encode()
+        assert stdout == inet + b' 127.0.0.1\n' + inet + b'\n'
+
+
+def test_io_uring_peek_connect(tmpdir, helper_io_uring):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = ['-r', 'out,port=1234,path=' + sockfile]
+    cmd = [IP2UNIX] + rules + [helper_io_uring, 'peek-client', '1234']
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as server:
+        server.bind(sockfile)
+        server.listen(10)
+        with run_helper(cmd, stdout=subprocess.PIPE) as client:
+            conn, _ = server.accept()
+            with conn:
+                assert conn.recv(3) == b'foo'
+                conn.sendall(b'bar')
+            stdout = client.communicate(timeout=5)[0]
+            assert client.returncode == 0
+            assert stdout == b'bar\n'
+
+
+def test_io_uring_peek_reject(helper_io_uring):
+    rules = ['-r', 'out,port=1234,reject=EHOSTUNREACH']
+    cmd = [IP2UNIX] + rules + [helper_io_uring, 'peek-client', '1234']
+
+    with run_helper(cmd, stderr=subprocess.PIPE) as client:
+        stderr = client.communicate(timeout=5)[1]
+        assert client.returncode != 0
+        assert stderr == b'connect: No route to host\n'
+
+
+def test_io_uring_peek_accept(tmpdir, helper_io_uring):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = ['-r', 'in,port=1234,path=' + sockfile]
+    cmd = [IP2UNIX] + rules + [helper_io_uring, 'peek-server', '1234']
+
+    with run_helper(cmd, stdout=subprocess.PIPE) as server:
+        clients = [socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                   for _ in range(2)]
+        for client in clients:
+            while True:
+                try:
+                    client.connect(sockfile)
+                except FileNotFoundError:
+                    pass
+                else:
+                    break
+                time.sleep(0.1)
+        for client in clients:
+            with client:
+                assert client.recv(3) == b'bar'
+        stdout = server.communicate(timeout=5)[0]
+        assert server.returncode == 0
+        inet = str(int(socket.AF_INET)).encode()
+        assert stdout == inet + b'\n' + inet + b'\n'
+
+
+def test_liburing_connect(tmpdir, helper_liburing):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = ['-r', 'out,port=1234,path=' + sockfile]
+    cmd = [IP2UNIX] + rules + [helper_liburing, 'client', '1234']
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as server:
+        server.bind(sockfile)
+        server.listen(10)
+        with run_helper(cmd, stdout=subprocess.PIPE) as client:
+            conn, _ = server.accept()
+            with conn:
+                assert conn.recv(3) == b'foo'
+                conn.sendall(b'bar')
+            stdout = client.communicate(timeout=5)[0]
+            assert client.returncode == 0
+            assert stdout == b'bar\n'
+
+
+def test_liburing_accept(tmpdir, helper_liburing):
+    sockfile = str(tmpdir.join('server.sock'))
+    rules = ['-r', 'in,port=1234,path=' + sockfile]
+    cmd = [IP2UNIX] + rules + [helper_liburing, 'server', '1234']
+
+    with run_helper(cmd, stdout=subprocess.PIPE) as server:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as client:
+            while True:
+                try:
+                    client.connect(sockfile)
+                except FileNotFoundError:
+                    pass
+                else:
+                    break
+                time.sleep(0.1)
+            client.sendall(b'foo')
+            assert client.recv(3) == b'bar'
+        stdout = server.communicate(timeout=5)[0]
+        assert server.returncode == 0
+        inet = str(int(socket.AF_INET)).encode()
+        assert stdout == inet + b' 127.0.0.1\n'
@@ -0,0 +1,68 @@
+import socket
+import subprocess
+import sys
+
+import pytest
+
+from helper import IP2UNIX
+
+CONNECT_CODE = '''
+import errno, socket, sys
+server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+server.bind(sys.argv[1])
+server.listen(1)
+sock = socket.socket(socket.AF_INET6, socket.SOCK_STREAM)
+err = sock.connect_ex(('::ffff:127.0.0.1', 1234))
+if err == 0:
+    print(sock.getpeername()[:2])
+else:
+    print(errno.errorcode.get(err, err))
+'''
+
+ipv6_only = pytest.mark.skipif(not socket.has_ipv6,
+                               reason='no IPv6 support available')
+
+
+def connect_mapped(tmpdir, *args, addr='127.0.0.1'):
+    sockpath = str(tmpdir.join('server.sock'))
+    cmd = [IP2UNIX, *args, '-r', f'out,addr={addr},port=1234,'
+                                 f'path={sockpath}',
+           sys.executable, '-c', CONNECT_CODE, sockpath]
+    return subprocess.check_output(cmd).decode().strip()
+
+
+@ipv6_only
+def test_ipv4_mapped(tmpdir):
+    assert connect_mapped(tmpdir) == "('::ffff:127.0.0.1', 1234)"
+
+
+@ipv6_only
+def test_ipv4_mapped_rule(tmpdir):
+    assert connect_mapped(tmpdir, addr='::ffff:127.0.0.1') == \
+        "('::ffff:127.0.0.1', 1234)"
+
+
+def test_ipv4_mapped_rule_print():
+    cmd = [IP2UNIX, '-cp', '-r', 'addr=::FFFF:7f00:1,reject']
+    output = subprocess.check_output(cmd)
+    assert b'Address: 127.0.0.1\n' in output
+
+
+@ipv6_only
+def test_no_unmap_ipv4(tmpdir):
+    assert connect_mapped(tmpdir, '--no-unmap-ipv4') != \
+        "('::ffff:127.0.0.1', 1234)"
+
+
+@ipv6_only
+def test_no_unmap_ipv4_mapped_rule(tmpdir):
+    assert connect_mapped(tmpdir, '--no-unmap-ipv4',
+                          addr='::ffff:127.0.0.1') == \
+        "('::ffff:127.0.0.1', 1234)"
+
+
+def test_no_unmap_ipv4_mapped_rule_print():
+    cmd = [IP2UNIX, '-cp', '-r', 'addr=::ffff:127.0.0.1,reject',
+           '--no-unmap-ipv4']
+    output = subprocess.check_output(cmd)
+    assert b'Address: ::ffff:127.0.0.1\n' in output
@@ -0,0 +1,103 @@
+import re
+import subprocess
+import sys
+
+from helper import IP2UNIX, log_level_only
+
+FILTER_CODE = '''
+import socket
+selected = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+selected.connect_ex(('127.0.0.1', 1234))
+other = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+other.connect_ex(('127.0.0.1', 9))
+print(selected.fileno(), other.fileno())
+other.close()
+selected.close()
+'''
+
+REUSE_CODE = '''
+import socket
+first = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+first.connect_ex(('127.0.0.1', 4321))
+fd = first.fileno()
+first.close()
+second = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+second.connect_ex(('127.0.0.1', 9))
+print(fd, second.fileno())
+second.close()
+'''
+
+RELOAD_CODE = '''
+import os, signal, socket, sys
+socket.socket(socket.AF_INET, socket.SOCK_STREAM).close()
+with open(sys.argv[1], 'w') as fp:
+    fp.write('verbosity=trace\\nwrapper=close\\n')
+os.kill(os.getpid(), signal.SIGUSR2)
+socket.socket(socket.AF_INET, socket.SOCK_STREAM).close()
+'''
+
+TRACE_RE = re.compile(r'ip2unix\[\d+\] \S+ TRACE: (\w+)\((\d+)')
+
+
+def run_controlled(tmpdir, control, code, *args):
+    control_file = tmpdir.join('control')
+    control_file.write(control)
+    sockpath = str(tmpdir.join('foo.sock'))
+    cmd = [IP2UNIX, '--log-control', str(control_file), *args,
+           '-r', f'tcp,port=1234,path={sockpath}',
+           sys.executable, '-c', code, str(control_file)]
+    result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, check=True)
+    return result.stdout.decode(), result.stderr.decode()
+
+
+def traced(stderr):
+    return [(match.group(1), int(match.group(2)))
+            for match in map(TRACE_RE.match, stderr.splitlines())
+            if match is not None]
+
+
+@log_level_only('trace')
+def test_filter_by_port(tmpdir):
+    control = '# only the socket of the rule\nverbosity=trace\nport=1234\n'
+    stdout, stderr = run_controlled(tmpdir, control, FILTER_CODE)
+    selected, other = map(int, stdout.split())
+    calls = traced(stderr)
+    assert ('close', selected) in calls
+    assert all(fd != other for _, fd in calls)
+    assert 'Socket fd {} unregistered.'.format(selected) in stderr
+    assert 'Socket fd {} unregistered.'.format(other) not in stderr
+
+
+@log_level_only('trace')
+def test_filter_by_port_reused_fd(tmpdir):
+    control = '# not matched by any rule\nverbosity=trace\nport=4321\n'
+    stdout, stderr = run_controlled(tmpdir, control, REUSE_CODE)
+    first, second = map(int, stdout.split())
+    assert first == second
+    assert "Socket {} doesn't match any rule".format(first) in stderr
+    assert traced(stderr) == []
+
+
+@log_level_only('trace')
+def test_filter_by_wrapper(tmpdir):
+    control = 'verbosity=5\nwrapper=connect\n'
+    stdout, stderr = run_controlled(tmpdir, control, FILTER_CODE)
+    selected, other = map(int, stdout.split())
+    assert sorted(traced(stderr)) == sorted([('connect', selected),
+                                             ('connect', other)])
+
+
+@log_level_only('trace')
+def test_reload_on_signal(tmpdir):
+    _, stderr = run_controlled(tmpdir, 'verbosity=error\n', RELOAD_CODE,
+                               '--report-signal', 'USR2')
+    assert [name for name, _ in traced(stderr)] == ['close']
+
+
+@log_level_only('error')
+def test_invalid_control_file(tmpdir):
+    _, stderr = run_controlled(tmpdir, 'verbosity=trace\nfoo=bar\n',
+                               FILTER_CODE, '-v')
+    assert "control:2: unknown key in 'foo'" in stderr
+    assert ' TRACE: ' not in stderr
@@ -0,0 +1,65 @@
+import re
+import subprocess
+import sys
+
+import pytest
+
+from helper import IP2UNIX, LOG_LEVEL, log_level_only
+
+THREADS_CODE = '''
+import socket, threading
+def create():
+    for _ in range(100):
+        socket.socket(socket.AF_INET, socket.SOCK_STREAM).close()
+threads = [threading.Thread(target=create) for _ in range(4)]
+for thread in threads:
+    thread.start()
+for thread in threads:
+    thread.join()
+'''
+
+LINE_RE = re.compile(r'ip2unix\[\d+\] (\S+:\d+):\S* [A-Z]+: (.*)')
+SUPPRESSED_RE = re.compile(r'Suppressed (\d+) more message\(s\) logged at'
+                           r' (\S+:\d+)\.')
+DROPPED_RE = re.compile(r'ip2unix WARNING: Dropped (\d+) log messages\.')
+
+
+@log_level_only('info')
+def test_log_from_threads():
+    cmd = [IP2UNIX, '-vvvv', '-r', 'tcp,port=1234,path=/foo',
+           sys.executable, '-c', THREADS_CODE]
+    output = subprocess.check_output(cmd, stderr=subprocess.STDOUT)
+
+    sites = set()
+    summaries = {}
+    registered = dropped = 0
+    for line in output.decode().splitlines():
+        match = DROPPED_RE.fullmatch(line)
+        if match is not None:
+            dropped += int(match.group(1))
+            continue
+        match = LINE_RE.fullmatch(line)
+        assert match is not None, line
+        if match.group(2).startswith('Registered socket with fd'):
+            sites.add(match.group(1))
+            registered += 1
+        summary = SUPPRESSED_RE.fullmatch(match.group(2))
+        if summary is not None:
+            assert summary.group(2) == match.group(1)
+            site = summary.group(2)
+            summaries[site] = summaries.get(site, 0) + int(summary.group(1))
+
+    assert len(sites) == 1
+    suppressed = summaries.get(sites.pop(), 0)
+    assert registered + suppressed + dropped >= 400
+    assert registered + suppressed <= 400
+    assert registered < 100
+
+
+@pytest.mark.skipif(LOG_LEVEL == 'trace', reason='all messages compiled in')
+def test_log_level_elided():
+    cmd = [IP2UNIX, '-vvvvv', '-r', 'tcp,port=1234,path=/foo',
+           sys.executable, '-c', THREADS_CODE]
+    output = subprocess.check_output(cmd, stderr=subprocess.STDOUT)
+    assert b' TRACE: ' not in output
+    assert b'socket(' not in output
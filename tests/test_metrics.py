@@ -0,0 +1,83 @@
+import subprocess
+import sys
+
+import pytest
+
+from helper import IP2UNIX
+
+METRICS_CODE = '''
+import socket
+for _ in range(3):
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+        assert sock.connect_ex(('127.0.0.1', 1234)) != 0
+with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+    sock.connect_ex(('127.0.0.1', 9))
+'''
+
+
+def test_report_metrics(tmpdir):
+    report = tmpdir.join('metrics.txt')
+    cmd = [IP2UNIX, '--report-metrics', str(report),
+           '-r', 'tcp,port=1234,reject', '-r', 'tcp,port=9,ignore',
+           sys.executable, '-c', METRICS_CODE]
+    subprocess.check_call(cmd)
+
+    lines = report.read().splitlines()
+    assert lines[0].startswith('# Metrics of ip2unix in process')
+    fields = {line.split('\t')[0]: line.split('\t')[1:]
+              for line in lines if not line.startswith(('#', 'counter',
+                                                        'rule'))}
+    assert fields['connect'][0] == '4'
+    calls, mean, p50, p90, p99, maxval = map(int, fields['connect'])
+    assert p50 <= p90 <= p99 <= maxval
+
+    assert 'counter\trejects\t3' in lines
+    assert 'counter\tconversions\t0' in lines
+    assert 'rule\t1\t3' in lines
+    assert 'rule\t2\t1' in lines
+
+
+def test_perf_counters(tmpdir):
+    report = tmpdir.join('metrics.txt')
+    cmd = [IP2UNIX, '--report-metrics', str(report), '--perf-counters',
+           '-r', 'tcp,port=1234,reject', sys.executable, '-c', METRICS_CODE]
+    subprocess.check_call(cmd)
+
+    lines = report.read().splitlines()
+    if '# No performance counters could be opened.' in lines:
+        pytest.skip('no performance counters available')
+
+    perf = {tuple(line.split('\t')[1:3]): line.split('\t')[3:]
+            for line in lines if line.startswith('perf\t')}
+    calls, mean = map(int, perf['connect', 'instructions'])
+    assert calls == 4
+    assert mean > 0
+
+
+def test_perf_counters_closed_by_app(tmpdir):
+    report = tmpdir.join('metrics.txt')
+    code = 'import os\n' \
+           'for fd in range(3, 64):\n' \
+           '    try:\n' \
+           '        os.close(fd)\n' \
+           '    except OSError:\n' \
+           '        pass\n' \
+           'pipes = [os.pipe() for _ in range(10)]\n' + METRICS_CODE
+    cmd = [IP2UNIX, '--report-metrics', str(report), '--perf-counters',
+           '-r', 'tcp,port=1234,reject', sys.executable, '-c', code]
+    subprocess.check_call(cmd, timeout=30)
+
+    lines = report.read().splitlines()
+    if '# No performance counters could be opened.' in lines:
+        pytest.skip('no performance counters available')
+
+    perf = {tuple(line.split('\t')[1:3]): line.split('\t')[3:]
+            for line in lines if line.startswith('perf\t')}
+    assert perf['connect', 'instructions'][0] == '4'
+
+
+def test_perf_counters_without_report():
+    cmd = [IP2UNIX, '--perf-counters', '-r', 'path=/foo', 'true']
+    result = subprocess.run(cmd, stderr=subprocess.PIPE)
+    assert result.returncode != 0
+    assert b'--perf-counters option needs a metrics report' in result.stderr
@@ -0,0 +1,94 @@
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+RULES = [
+    'tcp,port=80,path=/run/a',
+    'tcp,port=81,path=/run/a',
+    'tcp,port=82-90,path=/run/a',
+    'out,tcp,port=85,path=/run/b',
+    'in,addr=127.0.0.1,reject',
+    'in,addr=127.0.0.1,port=22,path=/run/ssh',
+    'udp,port=53,path=/run/dns',
+    'port=53,path=/run/dns',
+    'out,port=1000-2000,ignore',
+    'out,port=2001-3000,ignore',
+    'out,tcp,port=1500-2500,ignore',
+]
+
+CONNECT_CODE = '''
+import socket, sys
+for _ in range(5):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect_ex(('127.0.0.1', int(sys.argv[1])))
+    sock.close()
+'''
+
+
+def optimize(rulefile, *args):
+    cmd = [IP2UNIX, '--optimize' + ''.join(args), '-f', str(rulefile)]
+    result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, check=True)
+    return result.stdout.decode().splitlines(), result.stderr.decode()
+
+
+def test_optimize(tmpdir):
+    rulefile = tmpdir.join('rules')
+    rulefile.write('\n'.join(RULES) + '\n')
+    rules, log = optimize(rulefile)
+    assert rules == [
+        'tcp,port=80-90,path=/run/a',
+        'in,addr=127.0.0.1,reject',
+        'port=53,path=/run/dns',
+        'out,port=1000-3000,ignore',
+    ]
+    assert 'Rule #4 is shadowed by rule #3, removing it.' in log
+    assert 'Rule #11 is shadowed by rules #9, #10, removing it.' in log
+    assert 'Rule #7 is redundant to rule #8, removing it.' in log
+
+    # The optimised rules should be valid and not be optimised any further.
+    rulefile.write('\n'.join(rules) + '\n')
+    assert optimize(rulefile)[0] == rules
+
+
+def test_reorder_by_hits(tmpdir):
+    rulefile = tmpdir.join('rules')
+    rulefile.write('out,port=1000,path=/nonexistent\n'
+                   'in,port=1000,reject\n'
+                   'out,port=2000,reject\n')
+    hitfile = tmpdir.join('hits')
+
+    for port in ['2000', '1000']:
+        cmd = [IP2UNIX, '--record-hits', str(hitfile), '-f', str(rulefile),
+               sys.executable, '-c', CONNECT_CODE, port]
+        subprocess.check_call(cmd)
+    assert hitfile.read() == '# 3\n3 5\n# 3\n1 5\n'
+
+    hitfile.write('# 3\n3 10\n')
+    rules, log = optimize(rulefile, '=', str(hitfile))
+    assert rules == [
+        'out,port=2000,reject',
+        'out,port=1000,path=/nonexistent',
+        'in,port=1000,reject',
+    ]
+
+
+def test_hits_of_unmasked_sockets(tmpdir):
+    # None of the rules causes a TCP socket to be handled, but the hits of the
+    # ignore rule still need to be recorded.
+    hitfile = tmpdir.join('hits')
+    cmd = [IP2UNIX, '--record-hits', str(hitfile),
+           '-r', 'out,port=1000,ignore', '-r', 'udp,port=53,path=/run/dns',
+           sys.executable, '-c', CONNECT_CODE, '1000']
+    subprocess.check_call(cmd)
+    assert hitfile.read() == '# 2\n1 5\n'
+
+
+def test_hits_mismatch(tmpdir):
+    hitfile = tmpdir.join('hits')
+    hitfile.write('# 2\n1 10\n')
+    cmd = [IP2UNIX, '--optimize=' + str(hitfile), '-r', 'port=1,reject']
+    result = subprocess.run(cmd, stderr=subprocess.PIPE)
+    assert result.returncode != 0
+    assert b'recorded for 2 rule(s), but 1 rule(s)' in result.stderr
@@ -0,0 +1,46 @@
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+RECORD_CODE = '''
+import socket
+with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as server:
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('127.0.0.1', 1234))
+    server.listen(10)
+    for _ in range(20):
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client:
+            client.connect(('127.0.0.1', 1234))
+            conn, _ = server.accept()
+            with conn:
+                client.sendall(b'foo')
+                assert conn.recv(3) == b'foo'
+    for _ in range(10):
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+            assert sock.connect_ex(('127.0.0.1', 4321)) != 0
+'''
+
+
+def test_replay(tmpdir, bench_replay):
+    trace = str(tmpdir.join('calls.trace'))
+    rules = 'tcp,port=1234,path={}\ntcp,port=4321,reject\n'.format(
+        tmpdir.join('server.sock')
+    )
+    rulefile = tmpdir.join('rules')
+    rulefile.write(rules)
+
+    cmd = [IP2UNIX, '--trace', trace, '--trace-continuous',
+           '-f', str(rulefile), sys.executable, '-c', RECORD_CODE]
+    subprocess.check_call(cmd)
+
+    output = subprocess.check_output([bench_replay, '-n', '3',
+                                      str(rulefile), trace])
+    lines = output.decode().splitlines()
+    assert lines[0].split()[0] == 'WRAPPER'
+    totals = {line.split()[0]: line.split()[1:] for line in lines[1:-1]}
+    accepts = totals.get('accept4', totals.get('accept'))
+    assert accepts == [str(3 * 20), accepts[1], accepts[2], '0']
+    assert totals['connect'][0] == str(3 * 30)
+    assert totals['connect'][-1] == '0'
+    assert totals['bind'][0] == '3'
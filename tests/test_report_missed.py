@@ -0,0 +1,59 @@
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+MISS_CODE = '''
+import os, signal, socket, sys
+for _ in range(3):
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+        sock.connect_ex(('127.0.0.1', 9))
+with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+    sock.sendto(b'foo', ('127.0.0.1', 53))
+with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+    sock.connect_ex(('127.0.0.1', 80))
+if len(sys.argv) > 1:
+    os.kill(os.getpid(), signal.SIGUSR2)
+    socket.socket(socket.AF_INET, socket.SOCK_STREAM).close()
+    with open(sys.argv[1], 'r') as fp:
+        print(fp.read(), end='')
+'''
+
+
+def run_reported(tmpdir, *args):
+    report = tmpdir.join('missed.txt')
+    sockpath = str(tmpdir.join('foo.sock'))
+    cmd = [IP2UNIX, '--report-missed', str(report), *args,
+           '-r', 'udp,port=53,ignore', '-r', f'tcp,port=80,path={sockpath}',
+           sys.executable, '-c', MISS_CODE]
+    if args:
+        cmd.append(str(report))
+    output = subprocess.check_output(cmd).decode()
+    return output, report.read().splitlines()
+
+
+def entries(lines):
+    return [line.split('\t')[:3] for line in lines
+            if not line.startswith('#')]
+
+
+def test_report_missed(tmpdir):
+    _, lines = run_reported(tmpdir)
+    assert lines[0].startswith('# Missed by ip2unix in process')
+    assert sorted(entries(lines)) == [
+        ['out,tcp,addr=127.0.0.1,port=9', 'unmatched', '3'],
+        ['out,udp,addr=127.0.0.1,port=53', 'ignored', '1'],
+    ]
+
+
+def test_report_signal(tmpdir):
+    output, lines = run_reported(tmpdir, '--report-signal', 'USR2')
+    assert sorted(entries(output.splitlines())) == sorted(entries(lines)[:2])
+    assert len(entries(lines)) == 4
+
+
+def test_invalid_signal():
+    cmd = [IP2UNIX, '--report-signal', 'FOO', '-r', 'path=/foo', 'true']
+    result = subprocess.run(cmd, stderr=subprocess.PIPE)
+    assert result.returncode != 0
+    assert b"Invalid signal 'FOO'" in result.stderr
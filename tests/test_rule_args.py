@@ -1,6 +1,9 @@
 import os
 import unittest
 import subprocess
+import sys
+
+from tempfile import NamedTemporaryFile
 
 import helper
 
@@ -67,3 +70,56 @@ class RulesTest(unittest.TestCase):
         for val, expect in fixtures.items():
             stdout, stderr = self.check_rules(val)
             self.assertIn(expect, stdout)
+
+    def test_error_position(self):
+        stdout, stderr = self.check_rules("tcp,path=/foo",
+                                          "in,port=12-x,path=/b", bad=True)
+        self.assertEqual(stderr, "In rule #2: in,port=12-x,path=/b\n"
+                                 "                       ^ invalid end port"
+                                 " in range\n")
+
+    def test_large_rule_file(self):
+        rules = ['in,port={},path=/run/foo-{}'.format(i % 60000, i)
+                 for i in range(20000)]
+        bad_rules = list(rules)
+        bad_rules[15000] = 'in,port=123,xxx,path=/run/bad'
+        bad_rules[17000] = 'out,foo'
+
+        with NamedTemporaryFile('w') as rulefile:
+            rulefile.write('\n'.join(bad_rules) + '\n')
+            rulefile.flush()
+            cmd = [helper.IP2UNIX, '-c', '-f', rulefile.name]
+            result = subprocess.run(cmd, stderr=subprocess.PIPE)
+            self.assertNotEqual(result.returncode, 0)
+            self.assertEqual(result.stderr.decode(),
+                             "In rule #15001: " + bad_rules[15000] + "\n"
+                             + " " * 28 + "^^^ unknown flag\n")
+
+        # The serialised rules exceed the size limit of a single environment
+        # variable, so this only works when passing them differently.
+        with NamedTemporaryFile('w') as rulefile:
+            rulefile.write('\n'.join(rules) + '\n')
+            rulefile.flush()
+            cmd = [helper.IP2UNIX, '-f', rulefile.name, 'true']
+            subprocess.check_call(cmd)
+
+    def test_large_rules_closed_fds(self):
+        rules = ['out,tcp,port=1234,reject=EHOSTUNREACH']
+        rules += ['in,port={},path=/run/foo-{}'.format(i % 60000, i)
+                  for i in range(20000)]
+        code = ("import errno, socket, subprocess, sys\n"
+                "child = ('import errno, socket\\n'\n"
+                "         'sock = socket.socket()\\n'\n"
+                "         'err = sock.connect_ex((\"127.0.0.1\", 1234))\\n'\n"
+                "         'print(errno.errorcode.get(err, err))')\n"
+                "subprocess.run([sys.executable, '-c', child], check=True)\n")
+
+        with NamedTemporaryFile('w') as rulefile:
+            rulefile.write('\n'.join(rules) + '\n')
+            rulefile.flush()
+            cmd = [helper.IP2UNIX, '-f', rulefile.name,
+                   sys.executable, '-c', code]
+            result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE, check=True)
+            self.assertEqual(result.stdout, b'EHOSTUNREACH\n')
+            self.assertEqual(result.stderr, b'')
@@ -0,0 +1,93 @@
+import os
+import subprocess
+import sys
+
+from tempfile import TemporaryDirectory
+
+from helper import IP2UNIX
+
+CONNECT_CODE = '''
+import errno, os, socket, sys
+os.closerange(3, 1024)
+for port in (1234, 1235):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    err = sock.connect_ex(('127.0.0.1', port))
+    print(port, errno.errorcode.get(err, err))
+    sock.close()
+print('__IP2UNIX_RULE_IMAGE' in os.environ)
+'''
+
+SPAWN_CODE = '''
+import subprocess, sys
+subprocess.run([sys.executable, '-c', sys.argv[1]], check=True)
+'''
+
+
+def compile_image(tmpdir, *rules):
+    image = os.path.join(tmpdir, 'rules.img')
+    cmd = [IP2UNIX, '--compile', image]
+    for rule in rules:
+        cmd += ['-r', rule]
+    subprocess.check_call(cmd)
+    return image
+
+
+def test_compile_and_run():
+    with TemporaryDirectory() as tmpdir:
+        image = compile_image(tmpdir, 'tcp,port=1234,reject=EHOSTUNREACH',
+                              'tcp,port=1235,reject=EADDRNOTAVAIL')
+        with open(image, 'rb') as fp:
+            assert fp.read(8) == b'IP2URIMG'
+
+        cmd = [IP2UNIX, '-f', image, sys.executable, '-c', CONNECT_CODE]
+        output = subprocess.check_output(cmd)
+        assert output.splitlines() == [b'1234 EHOSTUNREACH',
+                                       b'1235 EADDRNOTAVAIL', b'True']
+
+
+def test_image_closed_by_parent():
+    with TemporaryDirectory() as tmpdir:
+        image = compile_image(tmpdir, 'tcp,port=1234,reject=EHOSTUNREACH',
+                              'tcp,port=1235,reject=EADDRNOTAVAIL')
+        cmd = [IP2UNIX, '-f', image, sys.executable, '-c', SPAWN_CODE,
+               CONNECT_CODE]
+        output = subprocess.check_output(cmd)
+        assert output.splitlines() == [b'1234 EHOSTUNREACH',
+                                       b'1235 EADDRNOTAVAIL', b'True']
+
+
+def test_print_image():
+    with TemporaryDirectory() as tmpdir:
+        rules = ['in,tcp,addr=127.0.0.1,port=80,path=/foo', 'out,udp,reject']
+        image = compile_image(tmpdir, *rules)
+
+        plain = subprocess.check_output([IP2UNIX, '-cp'] + sum(
+            [['-r', rule] for rule in rules], []
+        ))
+        compiled = subprocess.check_output([IP2UNIX, '-cp', '-f', image])
+        assert plain == compiled
+
+
+def test_image_with_other_rules():
+    with TemporaryDirectory() as tmpdir:
+        image = compile_image(tmpdir, 'path=/foo')
+        cmd = [IP2UNIX, '-c', '-f', image, '-r', 'path=/bar']
+        result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT)
+        assert result.returncode != 0
+        assert b'compiled rule image with other rules' in result.stdout
+
+
+def test_invalid_image():
+    with TemporaryDirectory() as tmpdir:
+        image = compile_image(tmpdir, 'path=/foo')
+        with open(image, 'rb') as fp:
+            data = fp.read()
+        with open(image, 'wb') as fp:
+            fp.write(data[:-1])
+
+        cmd = [IP2UNIX, '-c', '-f', image]
+        result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT)
+        assert result.returncode != 0
+        assert b'Rule image is truncated.' in result.stdout
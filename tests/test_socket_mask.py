@@ -0,0 +1,46 @@
+import re
+import socket
+import subprocess
+import sys
+
+from helper import IP2UNIX, log_level_only
+
+SOCKET_CODE = '''
+import socket
+socket.socket(socket.AF_INET, socket.SOCK_STREAM).close()
+socket.socket(socket.AF_INET, socket.SOCK_DGRAM).close()
+socket.socket(socket.AF_INET6, socket.SOCK_STREAM).close()
+'''
+
+
+def registered_sockets(*rules):
+    cmd = [IP2UNIX, '-vvvv']
+    for rule in rules:
+        cmd += ['-r', rule]
+    cmd += [sys.executable, '-c', SOCKET_CODE]
+    output = subprocess.check_output(cmd, stderr=subprocess.STDOUT)
+    registered = []
+    for match in re.finditer(rb'Registered socket with fd \d+, domain (\d+),'
+                             rb' type (\d+)', output):
+        registered.append((int(match.group(1)), int(match.group(2)) & 0xf))
+    return registered
+
+
+@log_level_only('info')
+def test_only_matching_sockets_registered():
+    assert registered_sockets('tcp,addr=127.0.0.1,path=/foo') == [
+        (socket.AF_INET, socket.SOCK_STREAM),
+        (socket.AF_INET6, socket.SOCK_STREAM),
+    ]
+
+
+@log_level_only('info')
+def test_ignore_rules_not_counted():
+    assert registered_sockets('udp,ignore', 'out,addr=::1,reject') == [
+        (socket.AF_INET6, socket.SOCK_STREAM),
+    ]
+
+
+@log_level_only('info')
+def test_all_sockets_registered():
+    assert len(registered_sockets('port=80,path=/foo')) == 3
@@ -0,0 +1,48 @@
+import os
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+CONNECT_CODE = '''
+import errno, socket, sys
+for host, port in [('127.0.0.1', 1234), ('127.0.0.2', 1235),
+                   ('127.0.0.1', 1235), ('127.0.0.1', 1245),
+                   ('127.0.0.1', 1300)]:
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    err = sock.connect_ex((host, port))
+    print(port, errno.errorcode.get(err, err))
+    sock.close()
+with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+    print(sock.sendto(b'foo', ('127.0.0.1', 1234)))
+'''
+
+
+def test_specialized_library(helper_specialized):
+    env = dict(os.environ)
+    env.pop('__IP2UNIX_RULES', None)
+    env['LD_PRELOAD'] = helper_specialized
+    cmd = [sys.executable, '-c', CONNECT_CODE]
+    output = subprocess.check_output(cmd, env=env)
+    assert output.splitlines() == [
+        b'1234 EHOSTUNREACH',
+        b'1235 EADDRNOTAVAIL',
+        b'1235 ECONNABORTED',
+        b'1245 ENETUNREACH',
+        b'1300 ECONNREFUSED',
+        b'3',
+    ]
+
+
+def test_emit(tmpdir):
+    output = str(tmpdir.join('rules.cc'))
+    cmd = [IP2UNIX, '--emit', output, '-r', 'tcp,port=80,path=/foo',
+           '-r', 'addr=::1,port=1000-2000,reject']
+    subprocess.check_call(cmd)
+    with open(output, 'r') as fp:
+        source = fp.read()
+    assert 'constexpr bool USES_UDP = true;' in source
+    assert 'constexpr bool USES_BLACKHOLE = false;' in source
+    assert 'case 80:' in source
+    assert '*port >= 1000 && *port <= 2000' in source
+    assert '#include "preload.cc"' in source
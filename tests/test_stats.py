@@ -0,0 +1,75 @@
+import os
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+STATS_CODE = '''
+import os, socket, subprocess, sys, time
+for _ in range(2):
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+        sock.connect_ex(('127.0.0.1', 1234))
+server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+server.bind(('127.0.0.1', 4321))
+time.sleep(0.2)
+socket.socket(socket.AF_INET, socket.SOCK_STREAM).close()
+print(os.getpid())
+for args in ([], ['--prometheus']):
+    subprocess.check_call([sys.argv[1], 'stat', *args, str(os.getpid())])
+'''
+
+
+def run_stats(tmpdir):
+    sockpath = str(tmpdir.join('server.sock'))
+    cmd = [IP2UNIX, '--stats', '-r', 'tcp,port=1234,reject',
+           '-r', f'in,tcp,port=4321,path={sockpath}',
+           sys.executable, '-c', STATS_CODE, IP2UNIX]
+    env = dict(os.environ, XDG_RUNTIME_DIR=str(tmpdir))
+    output = subprocess.check_output(cmd, env=env).decode().splitlines()
+    return int(output[0]), sockpath, output[1:]
+
+
+def test_stat(tmpdir):
+    pid, sockpath, output = run_stats(tmpdir)
+    assert output[0].startswith(f'Process {pid}, updated ')
+
+    sockets = [line.split() for line in output if sockpath in line]
+    assert sockets == [[sockets[0][0], 'tcp', 'converted', sockpath,
+                        '127.0.0.1:4321']]
+
+    assert ['rejects', '2'] in [line.split() for line in output]
+    assert ['connect', '2'] == [line.split() for line in output
+                                if line.startswith('connect ')][0][:2]
+
+
+def test_stat_prometheus(tmpdir):
+    pid, _, output = run_stats(tmpdir)
+    assert f'ip2unix_events_total{{pid="{pid}",event="rejects"}} 2' in output
+    assert f'ip2unix_rule_hits_total{{pid="{pid}",rule="1"}} 2' in output
+    assert f'ip2unix_rule_hits_total{{pid="{pid}",rule="2"}} 1' in output
+
+
+def test_stat_removed_on_exit(tmpdir):
+    run_stats(tmpdir)
+    assert tmpdir.join('ip2unix').listdir() == []
+
+
+def test_stat_not_running():
+    result = subprocess.run([IP2UNIX, 'stat', '999999999'],
+                            stderr=subprocess.PIPE)
+    assert result.returncode != 0
+
+
+def test_stat_insecure_dir(tmpdir):
+    tmpdir.join('ip2unix').mkdir().chmod(0o777)
+    cmd = [IP2UNIX, '--stats', '-r', 'tcp,port=1234,reject',
+           sys.executable, '-c', 'import os; print(os.getpid())']
+    env = dict(os.environ, XDG_RUNTIME_DIR=str(tmpdir))
+    pid = subprocess.check_output(cmd, env=env).decode().strip()
+    assert tmpdir.join('ip2unix').listdir() == []
+
+    assert pid.isdigit()
+    result = subprocess.run([IP2UNIX, 'stat', str(os.getpid())], env=env,
+                            stderr=subprocess.PIPE)
+    assert result.returncode != 0
+    assert b'Unable to use' in result.stderr
@@ -0,0 +1,61 @@
+import subprocess
+import sys
+
+from helper import IP2UNIX
+
+TRACE_CODE = '''
+import os, signal, socket, sys, threading
+def connect():
+    for _ in range(50):
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+            assert sock.connect_ex(('127.0.0.1', 1234)) != 0
+threads = [threading.Thread(target=connect) for _ in range(3)]
+for thread in threads:
+    thread.start()
+for thread in threads:
+    thread.join()
+if len(sys.argv) > 1:
+    os.kill(os.getpid(), signal.SIGUSR1)
+    os._exit(0)
+'''
+
+
+def run_trace(tmpdir, *args):
+    trace = str(tmpdir.join('calls.trace'))
+    cmd = [IP2UNIX, '--trace', trace, *args, '-r', 'tcp,port=1234,reject',
+           sys.executable, '-c', TRACE_CODE]
+    if '--report-signal' in args:
+        cmd.append('exit')
+    subprocess.check_call(cmd)
+    output = subprocess.check_output([IP2UNIX, 'trace-decode', trace])
+    return [line.split(' ', 3) for line in output.decode().splitlines()]
+
+
+def check_connects(calls):
+    connects = [call for call in calls if call[3].startswith('connect(')]
+    assert len(connects) == 150
+    assert len(set(call[2] for call in connects)) == 3
+    for call in connects:
+        assert ') = -1 EACCES ' in call[3]
+    assert [call[0] for call in calls] == sorted(call[0] for call in calls)
+
+
+def test_trace_on_exit(tmpdir):
+    check_connects(run_trace(tmpdir))
+
+
+def test_trace_continuous(tmpdir):
+    check_connects(run_trace(tmpdir, '--trace-continuous'))
+
+
+def test_trace_on_signal(tmpdir):
+    check_connects(run_trace(tmpdir, '--report-signal', 'USR1'))
+
+
+def test_trace_decode_invalid(tmpdir):
+    invalid = tmpdir.join('invalid.trace')
+    invalid.write('not a trace')
+    result = subprocess.run([IP2UNIX, 'trace-decode', str(invalid)],
+                            stderr=subprocess.PIPE)
+    assert result.returncode != 0
+    assert b'incompatible format' in result.stderr
@@ -0,0 +1,31 @@
+import re
+import shutil
+import subprocess
+
+import pytest
+
+from helper import LIBIP2UNIX, usdt_only
+
+# The number of arguments of every probe, which must stay the same so that
+# existing tracing scripts keep working.
+PROBES = {
+    'wrapper_entry': 2,
+    'wrapper_return': 4,
+    'rule_match': 4,
+    'sockopt_replay': 3,
+    'socket_convert': 3,
+    'accept_peer': 3,
+    'udp_peer': 3,
+}
+
+
+@usdt_only
+@pytest.mark.skipif(shutil.which('readelf') is None,
+                    reason="no 'readelf' program found")
+def test_probe_notes():
+    notes = subprocess.check_output(['readelf', '-n', LIBIP2UNIX]).decode()
+    found = re.findall(r'Provider: ip2unix\s+Name: (\w+)\s+'
+                       r'Location:[^\n]*\n\s+Arguments: ([^\n]*)', notes)
+    assert {name for name, _ in found} == set(PROBES)
+    for name, args in found:
+        assert len(args.split()) == PROBES[name], name
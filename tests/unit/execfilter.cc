@@ -0,0 +1,73 @@
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "execfilter.hh"
+
+#define LIB "/nix/store/xxx-ip2unix/lib/libip2unix.so"
+
+static void check_env(const ExecFilter &filter,
+                      std::vector<const char*> input,
+                      const std::vector<std::string> &expected)
+{
+    input.push_back(nullptr);
+    char *const *envp = const_cast<char *const*>(input.data());
+
+    size_t vars, bytes;
+    ExecFilter::env_size(envp, &vars, &bytes);
+    std::vector<char*> stripped(vars);
+    std::string buf(bytes, '\0');
+    filter.strip_env(envp, stripped.data(), buf.data());
+
+    std::vector<std::string> result;
+    for (char **var = stripped.data(); *var != nullptr; ++var)
+        result.push_back(*var);
+
+    if (result != expected) {
+        std::string msg = "Unexpected environment:";
+        for (const std::string &var : result)
+            msg += " " + var;
+        throw std::runtime_error(msg);
+    }
+}
+
+int main(void)
+{
+    ExecFilter filter({"/usr/bin/python*", "/opt/**/server", "git"}, LIB);
+
+    if (!filter.matches("/usr/bin/python3"))
+        throw std::runtime_error("/usr/bin/python3 should have matched.");
+    if (!filter.matches("/opt/foo/bar/server"))
+        throw std::runtime_error("/opt/foo/bar/server should have matched.");
+    if (filter.matches("/usr/bin/curl"))
+        throw std::runtime_error("/usr/bin/curl should not have matched.");
+    if (!filter.matches("/usr/local/bin/git"))
+        throw std::runtime_error("/usr/local/bin/git should have matched.");
+    if (filter.matches("/usr/lib/python3"))
+        throw std::runtime_error("/usr/lib/python3 should not have matched.");
+
+    if (ExecFilter::find_program("/usr//bin/./foo", false) != "/usr/bin/foo")
+        throw std::runtime_error("Absolute path wasn't normalised.");
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof cwd) == nullptr)
+        throw std::runtime_error("Unable to get current directory.");
+    std::string expected = std::string(cwd) + "/foo";
+    if (ExecFilter::find_program("./foo", false) != expected)
+        throw std::runtime_error("Relative path wasn't made absolute.");
+
+    check_env(filter, {"FOO=bar", "__IP2UNIX_RULES=xxx",
+                       "LD_PRELOAD=" LIB, "__IP2UNIX_VERBOSITY=2"},
+              {"FOO=bar"});
+
+    check_env(filter, {"LD_PRELOAD=/lib/a.so:" LIB " /lib/b.so", "A=B"},
+              {"LD_PRELOAD=/lib/a.so:/lib/b.so", "A=B"});
+
+    check_env(filter, {"LD_PRELOAD=/lib/a.so  " LIB, "LD_PRELOAD=" LIB ":c.so"},
+              {"LD_PRELOAD=/lib/a.so", "LD_PRELOAD=c.so"});
+
+    check_env(filter, {"LD_PRELOAD=/lib/libip2unix.so", "IP2UNIX=1"},
+              {"LD_PRELOAD=/lib/libip2unix.so", "IP2UNIX=1"});
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <ruleimage.hh>
+
+/* All the combinations of values we want to check */
+
+static std::vector<std::optional<RuleDir>> ruledirs = {
+    std::nullopt,
+    RuleDir::INCOMING,
+    RuleDir::OUTGOING
+};
+
+static std::vector<std::optional<SocketType>> sotypes = {
+    std::nullopt,
+    SocketType::TCP,
+    SocketType::UDP
+};
+
+static std::vector<std::optional<std::string>> addresses = {
+    std::nullopt,
+    "127.0.0.1",
+    "::1",
+    "fe80::1234"
+};
+
+static std::vector<std::optional<std::string>> strings = {
+    std::nullopt,
+    "",
+    "/run/foo.sock",
+    std::string("aaa\0bbb", 7),
+    "/run/foo.sock"
+};
+
+static std::vector<std::optional<uint16_t>> ports = {
+    std::nullopt, 0, 19, 65535
+};
+
+static std::vector<std::optional<int>> ints = {
+    std::nullopt, 12, -19
+};
+
+static std::vector<bool> bools = { true, false };
+
+#define CHOOSE(values) \
+    values[seed % values.size()]; seed /= values.size()
+
+#define ASSERT_RULEVAL(field) \
+    if (newrule.field != rule.field) \
+        throw std::runtime_error("Mismatch in value for " #field \
+                                 " after decoding rule image.");
+
+#define ASSERT_TRUE(what, cond) \
+    if (!(cond)) \
+        throw std::runtime_error(what);
+
+static std::string compile(const std::vector<Rule> &rules)
+{
+    std::string image;
+    MaybeError err = RuleImage::compile(rules, &image);
+    if (err)
+        throw std::runtime_error(*err);
+    return image;
+}
+
+/*
+ * Iterate through all combinations of the vectors given by CHOOSE(), see
+ * test_rule() in serial.cc for details.
+ */
+static unsigned long test_rule(unsigned long seed)
+{
+    Rule rule;
+    rule.direction = CHOOSE(ruledirs);
+    rule.type = CHOOSE(sotypes);
+    rule.address = CHOOSE(addresses);
+    if (rule.address)
+        rule.host = "host-" + rule.address.value();
+    rule.port = CHOOSE(ports);
+    rule.port_end = CHOOSE(ports);
+#ifdef SYSTEMD_SUPPORT
+    rule.socket_activation = CHOOSE(bools);
+    rule.fd_name = CHOOSE(strings);
+#endif
+    rule.socket_path = CHOOSE(strings);
+    rule.reject = CHOOSE(bools);
+    rule.reject_errno = CHOOSE(ints);
+    rule.blackhole = CHOOSE(bools);
+    rule.ignore = CHOOSE(bools);
+
+    std::string data = compile({rule, rule});
+    RuleImage::Image image(data.data(), data.size());
+
+    MaybeError err;
+    if ((err = image.validate()))
+        throw std::runtime_error(*err);
+
+    ASSERT_TRUE("Wrong number of rules in image.", image.size() == 2);
+
+    Rule newrule = image.get(1);
+
+    ASSERT_RULEVAL(direction);
+    ASSERT_RULEVAL(type);
+    ASSERT_RULEVAL(address);
+    ASSERT_RULEVAL(host);
+    ASSERT_RULEVAL(port);
+    ASSERT_RULEVAL(port_end);
+#ifdef SYSTEMD_SUPPORT
+    ASSERT_RULEVAL(socket_activation);
+    ASSERT_RULEVAL(fd_name);
+#endif
+    ASSERT_RULEVAL(socket_path);
+    ASSERT_RULEVAL(reject);
+    ASSERT_RULEVAL(reject_errno);
+    ASSERT_RULEVAL(blackhole);
+    ASSERT_RULEVAL(ignore);
+    return seed;
+}
+
+static void test_matches(void)
+{
+    Rule rule1;
+    rule1.direction = RuleDir::INCOMING;
+    rule1.type = SocketType::TCP;
+    rule1.address = "127.0.0.1";
+    rule1.port = 1000;
+    rule1.port_end = 2000;
+
+    Rule rule2;
+    rule2.address = "::1";
+    rule2.port = 80;
+
+    std::string data = compile({rule1, rule2});
+    RuleImage::Image image(data.data(), data.size());
+    if (MaybeError err = image.validate())
+        throw std::runtime_error(*err);
+
+    SockAddr v4 = SockAddr::create("127.0.0.1", 1500).value();
+    SockAddr v4other = SockAddr::create("127.0.0.2", 1500).value();
+    SockAddr v4outside = SockAddr::create("127.0.0.1", 2001).value();
+    SockAddr v6 = SockAddr::create("::1", 80, AF_INET6).value();
+
+    ASSERT_TRUE("Rule #1 should match within port range.",
+                image.matches(0, v4, SocketType::TCP, RuleDir::INCOMING));
+    ASSERT_TRUE("Rule #1 shouldn't match a different address.",
+                !image.matches(0, v4other, SocketType::TCP,
+                               RuleDir::INCOMING));
+    ASSERT_TRUE("Rule #1 shouldn't match outside of port range.",
+                !image.matches(0, v4outside, SocketType::TCP,
+                               RuleDir::INCOMING));
+    ASSERT_TRUE("Rule #1 shouldn't match a different type.",
+                !image.matches(0, v4, SocketType::UDP, RuleDir::INCOMING));
+    ASSERT_TRUE("Rule #1 shouldn't match a different direction.",
+                !image.matches(0, v4, SocketType::TCP, RuleDir::OUTGOING));
+    ASSERT_TRUE("Rule #1 shouldn't match an IPv6 address.",
+                !image.matches(0, v6, SocketType::TCP, RuleDir::INCOMING));
+    ASSERT_TRUE("Rule #2 should match an IPv6 address.",
+                image.matches(1, v6, SocketType::UDP, RuleDir::OUTGOING));
+    ASSERT_TRUE("Rule #2 shouldn't match an IPv4 address.",
+                !image.matches(1, v4, SocketType::UDP, RuleDir::OUTGOING));
+}
+
+static void test_socket_mask(void)
+{
+    Rule rule1;
+    rule1.type = SocketType::TCP;
+    rule1.address = "127.0.0.1";
+    rule1.socket_path = "/foo";
+
+    Rule rule2;
+    rule2.ignore = true;
+
+    Rule rule3;
+    rule3.direction = RuleDir::OUTGOING;
+    rule3.address = "::1";
+    rule3.reject = true;
+
+    std::string data = compile({rule1, rule2, rule3});
+    SocketMask::Mask mask =
+        RuleImage::Image(data.data(), data.size()).socket_mask();
+
+    ASSERT_TRUE("Socket mask should be the same as for the rules.",
+                mask == SocketMask::for_rules({rule1, rule2, rule3}));
+    ASSERT_TRUE("IPv4 TCP sockets should be able to match.",
+                SocketMask::may_match(mask, AF_INET, SocketType::TCP));
+    ASSERT_TRUE("IPv4 UDP sockets shouldn't be able to match.",
+                !SocketMask::may_match(mask, AF_INET, SocketType::UDP));
+    ASSERT_TRUE("Outgoing IPv6 UDP sockets should be able to match.",
+                SocketMask::may_match(mask, AF_INET6, SocketType::UDP,
+                                      RuleDir::OUTGOING));
+    ASSERT_TRUE("Incoming IPv6 UDP sockets shouldn't be able to match.",
+                !SocketMask::may_match(mask, AF_INET6, SocketType::UDP,
+                                       RuleDir::INCOMING));
+    ASSERT_TRUE("IPv6 TCP sockets should be able to match IPv4 rules.",
+                SocketMask::may_match(mask, AF_INET6, SocketType::TCP,
+                                      RuleDir::INCOMING));
+}
+
+static void test_invalid(void)
+{
+    Rule rule;
+    rule.address = "not-an-address";
+
+    std::string data;
+    ASSERT_TRUE("Compiling an invalid address should fail.",
+                RuleImage::compile({rule}, &data));
+
+    rule.address = std::nullopt;
+    rule.socket_path = "/foo";
+    data = compile({rule});
+
+    std::string truncated = data.substr(0, data.size() - 1);
+    ASSERT_TRUE("Truncated image should be invalid.",
+                RuleImage::Image(truncated.data(),
+                                 truncated.size()).validate());
+
+    std::string badmagic = data;
+    badmagic[0] = 'X';
+    ASSERT_TRUE("Image with invalid magic should be invalid.",
+                RuleImage::Image(badmagic.data(),
+                                 badmagic.size()).validate());
+
+    std::string badversion = data;
+    RuleImage::Header header;
+    memcpy(&header, badversion.data(), sizeof header);
+    header.version++;
+    memcpy(badversion.data(), &header, sizeof header);
+    ASSERT_TRUE("Image with wrong version should be invalid.",
+                RuleImage::Image(badversion.data(),
+                                 badversion.size()).validate());
+}
+
+int main(void)
+{
+    /* Note that this begins at 1, because the last iteration picks the first
+     * elements of all vectors. If we'd use 0 here we would pick it twice.
+     */
+    for (unsigned long i = 1; test_rule(i) <= 0; ++i);
+
+    test_matches();
+    test_socket_mask();
+    test_invalid();
+    return 0;
+}
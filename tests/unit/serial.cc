@@ -1,3 +1,7 @@
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
 #include <serial.hh>
 
 /* All the combinations of values we want to check */
@@ -123,6 +127,7 @@ static unsigned long test_rule(unsigned long seed)
     rule.direction = CHOOSE(ruledirs);
     rule.type = CHOOSE(sotypes);
     rule.address = CHOOSE(strings);
+    rule.host = rule.address;
     rule.port = CHOOSE(ports);
     rule.port_end = CHOOSE(ports);
 #ifdef SYSTEMD_SUPPORT
@@ -144,6 +149,7 @@ static unsigned long test_rule(unsigned long seed)
     ASSERT_RULEVAL(direction);
     ASSERT_RULEVAL(type);
     ASSERT_RULEVAL(address);
+    ASSERT_RULEVAL(host);
     ASSERT_RULEVAL(port);
     ASSERT_RULEVAL(port_end);
 #ifdef SYSTEMD_SUPPORT
@@ -186,6 +192,62 @@ static void test_pairs(void)
     }
 }
 
+/*
+ * Every prefix of a valid encoding must either decode to something or produce
+ * an error, but never read past the end of the input.
+ */
+static void test_truncated(void)
+{
+    Rule rule;
+    rule.direction = RuleDir::INCOMING;
+    rule.address = "1.2.3.4";
+    rule.port = 1234;
+    rule.socket_path = std::string("/foo\\@\0bar", 10);
+    rule.reject_errno = -12;
+
+    std::string full = serialise(std::vector<Rule>{rule, rule});
+
+    for (size_t len = 0; len < full.size(); ++len) {
+        /* Copy into a buffer without a trailing NUL byte, so that tools like
+         * AddressSanitizer notice if we read beyond the view.
+         */
+        std::unique_ptr<char[]> buf(new char[len + 1]);
+        std::copy(full.begin(), full.begin() + static_cast<long>(len),
+                  buf.get());
+
+        std::vector<Rule> out;
+        MaybeError err = deserialise(std::string_view(buf.get(), len), &out);
+        if (!err && out.size() > 1)
+            throw std::runtime_error("Truncated input at length "
+                                     + std::to_string(len)
+                                     + " decoded to both rules.");
+    }
+}
+
+static void test_invalid(void)
+{
+    uint16_t port;
+    ASSERT_EQUAL(std::string("Invalid integer value."),
+                 deserialise("65536&", &port).value_or(""));
+    ASSERT_EQUAL(std::string("Invalid integer value."),
+                 deserialise("x&", &port).value_or(""));
+    ASSERT_EQUAL(std::string("Invalid character 'x' after integer."),
+                 deserialise("12x", &port).value_or(""));
+    ASSERT_EQUAL(std::string("Unexpected end of input after integer."),
+                 deserialise("12", &port).value_or(""));
+
+    std::string str;
+    ASSERT_EQUAL(std::string("Unexpected end of input in string."),
+                 deserialise("abc", &str).value_or(""));
+    ASSERT_EQUAL(std::string("Unexpected end of input after escape"
+                             " character."),
+                 deserialise("abc\\", &str).value_or(""));
+
+    bool val;
+    ASSERT_EQUAL(std::string("Invalid character 'x' for boolean."),
+                 deserialise("x", &val).value_or(""));
+}
+
 int main(void)
 {
     /* Note that this begins at 1, because the last iteration picks the first
@@ -194,5 +256,7 @@ int main(void)
     for (unsigned long i = 1; test_rule(i) <= 0; ++i);
 
     test_pairs();
+    test_truncated();
+    test_invalid();
     return 0;
 }